@@ -16,10 +16,40 @@
  *
  * VCAN is simple, synchronous and not thread safe. It does not simulate
  * transmission errors, collisions, arbitration, etc. just pure data transfer.
- * Callbacks should be fast.
+ * Callbacks should be fast. For transmitting from multiple threads, use the
+ * #vcan_bus_mt_t from vcan_mt.h instead. The optional modules vcan_arb.h
+ * and vcan_fault.h add the arbitration and injected transmission errors.
  *
  * ... but you are free to alter it to your specific needs!
  *
+ * **Compile-time configuration**
+ *
+ * The following macros, defined before including this header or on the
+ * command line, must be the same in every translation unit using VCAN:
+ *
+ * - `VCAN_HEADER_ONLY`: single-header mode. This header includes
+ *   `src/vcan.c` and all functions are `static inline`, so the compiler can
+ *   inline vcan_tx() and the fan-out loop into the callers without LTO.
+ *   Nothing else is compiled or linked for the core. Each translation unit
+ *   gets its own copy of the functions, all working on the same structures.
+ *   C only.
+ * - `VCAN_MAX_CONNECTED_NODES`: capacity of the embedded node table.
+ * - `VCAN_TX_BY_REF`: vcan_tx() and vcan_tx_direct() pass the caller's
+ *   message to the nodes as vcan_tx_ref() does, without copying it into
+ *   #vcan_bus_t.received_msg.
+ * - `VCAN_NO_SRC_EXCLUSION`: the transmitting node is not excluded from the
+ *   delivery, removing the comparison from the fan-out loop; the node list
+ *   must not contain the transmitters or they must ignore their own
+ *   messages.
+ * - `VCAN_STATS`: statistics counters, see vcan_get_stats().
+ * - `VCAN_NO_SIMD`: the fan-out compares the filter summaries of the nodes
+ *   one at a time, without SIMD instructions, see vcan_set_filter().
+ * - `VCAN_PROBES`: tracepoints at the start of each transmission, at each
+ *   delivery to a node and at the end of the transmission: USDT probes
+ *   `vcan:tx_entry`, `vcan:dispatch` and `vcan:tx_exit` where
+ *   `<sys/sdt.h>` is available, for perf and bpftrace, and the hooks set
+ *   with vcan_set_probes(). Without it nothing is compiled in.
+ *
  * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
  * <https://matjaz.it>. All rights reserved.
  * @license BSD 3-clause license.
@@ -28,6 +58,21 @@
 #ifndef VCAN_H
 #define VCAN_H
 
+/* Included outside of the extern "C" block: C++ templates have C++ linkage. */
+#ifdef __cplusplus
+#include <atomic>
+/** Atomic type usable from both C and C++. */
+#define VCAN_ATOMIC(type) std::atomic<type>
+/** Alignment specifier usable from both C and C++. */
+#define VCAN_ALIGNAS(alignment) alignas(alignment)
+#else
+#include <stdatomic.h>
+/** Atomic type usable from both C and C++. */
+#define VCAN_ATOMIC(type) _Atomic type
+/** Alignment specifier usable from both C and C++. */
+#define VCAN_ALIGNAS(alignment) _Alignas(alignment)
+#endif
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -38,13 +83,36 @@ extern "C"
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 
 /** Max payload size of a CAN message in bytes. */
 #define VCAN_DATA_MAX_LEN 64
+#ifndef VCAN_MAX_CONNECTED_NODES
 /** MAx amount of virtual nodes connected to the virtual bus. */
 #define VCAN_MAX_CONNECTED_NODES 16
+#endif
+
+#ifdef VCAN_HEADER_ONLY
+/** Linkage of the library functions: internal in the header-only build. */
+#define VCAN_API static inline
+#else
+/** Linkage of the library functions: external in the library build. */
+#define VCAN_API
+#endif
+
+#ifndef VCAN_CACHE_LINE_SIZE
+/** Alignment used to keep data of different threads on separate cache lines. */
+#define VCAN_CACHE_LINE_SIZE 64
+#endif
+
+/*
+ * Define VCAN_STATS, e.g. with `-DVCAN_STATS`, to compile in the statistics
+ * counters of buses and nodes, read with vcan_get_stats() and
+ * vcan_get_node_stats(). It changes the layout of the structs, so every
+ * source file using VCAN must be compiled with the same setting.
+ */
 
 /** VCAN error codes. */
 typedef enum
@@ -62,7 +130,7 @@ typedef enum
 
     /**
      * Max amount of connected nodes reached.
-     * Consider increasing #VCAN_MAX_CONNECTED_NODES.
+     * Consider increasing #VCAN_MAX_CONNECTED_NODES or using vcan_init_ex().
      */
             VCAN_TOO_MANY_CONNECTED = 5,
 
@@ -70,12 +138,59 @@ typedef enum
             VCAN_NODE_NOT_FOUND = 6,
     /** The node is already connected to the bus. */
             VCAN_ALREADY_CONNECTED = 7,
+    /** The filter array or exact-ID array is NULL with a non-zero length. */
+            VCAN_NULL_FILTER = 8,
+    /** The exact-ID array of a filter, a routing table, a signal table or a
+     * fault injection table is not sorted in ascending order. */
+            VCAN_UNSORTED_FILTER = 9,
+    /** The queue has no free slot, the message was not enqueued. */
+            VCAN_QUEUE_FULL = 10,
+    /** A thread or synchronisation primitive could not be created. */
+            VCAN_THREAD_FAILED = 11,
+    /** The storage or queue argument is NULL. */
+            VCAN_NULL_STORAGE = 12,
+    /** The capacity is zero or not a power of 2. */
+            VCAN_INVALID_CAPACITY = 13,
+    /** The payload does not fit into the compact frame, or the snapshot
+     * into the buffer. */
+            VCAN_TOO_LONG = 14,
+    /** A packed frame is truncated or has an invalid length. */
+            VCAN_INVALID_PACKED = 15,
+    /** A file could not be opened, read, written or mapped. */
+            VCAN_IO_FAILED = 16,
+    /** A signal description is malformed or does not fit into a message. */
+            VCAN_INVALID_SIGNAL = 17,
+    /** The receive queue was full: the newest message was dropped for the
+     * node, see #VCAN_RX_DROP_NEWEST. */
+            VCAN_DROPPED_NEWEST = 18,
+    /** The receive queue was full: its oldest message was dropped to make
+     * room for the newest one, see #VCAN_RX_DROP_OLDEST. */
+            VCAN_DROPPED_OLDEST = 19,
+    /** The receive queue stayed full for the whole blocking timeout: the
+     * newest message was dropped for the node, see #VCAN_RX_BLOCK. */
+            VCAN_TX_TIMEOUT = 20,
+    /** The receive queue was full: the message went into its overflow
+     * arena, nothing was lost, see #VCAN_RX_SPILL. */
+            VCAN_SPILLED = 21,
+    /** The overflow policy or its overflow arena is invalid. */
+            VCAN_INVALID_POLICY = 22,
+    /** The snapshot is truncated, corrupted, taken by a build with another
+     * configuration or does not fit the state to restore it into. */
+            VCAN_INVALID_SNAPSHOT = 23,
+    /** The transmitting node is in bus-off state and cannot transmit, see
+     * vcan_fault.h. */
+            VCAN_BUS_OFF = 24,
+    /** The transmission was destroyed by an error frame, see vcan_fault.h.
+     */
+            VCAN_ERROR_FRAME = 25,
+    /** A fault injection rule is invalid, see vcan_fault.h. */
+            VCAN_INVALID_FAULT = 26,
 } vcan_err_t;
 
 /** Message to transmit or receive. */
 typedef struct
 {
-    /** The CAN ID - unused by VCAN. */
+    /** The CAN ID - used by VCAN only for the acceptance filters. */
     uint32_t id;
 
     /** Used bytes in the \p data field. */
@@ -85,6 +200,339 @@ typedef struct
     uint8_t data[VCAN_DATA_MAX_LEN];
 } vcan_msg_t;
 
+/**
+ * Copies the header and only the used part of the payload, clamped to
+ * #VCAN_DATA_MAX_LEN, instead of the whole message struct.
+ *
+ * Payload bytes past \p src->len in \p dst are left untouched.
+ *
+ * @param dst not NULL
+ * @param src not NULL
+ */
+static inline void vcan_copy_msg(vcan_msg_t* const dst,
+                                 const vcan_msg_t* const src)
+{
+    const size_t len = src->len < VCAN_DATA_MAX_LEN
+                       ? src->len : VCAN_DATA_MAX_LEN;
+    memcpy(dst, src, offsetof(vcan_msg_t, data) + len);
+}
+
+/** Max payload length of a classic CAN frame, in bytes. */
+#define VCAN_CLASSIC_DATA_MAX_LEN 8
+
+/**
+ * Compact classic CAN frame, 16 bytes instead of the 72 of #vcan_msg_t.
+ *
+ * Used to store mostly-classic traffic densely, e.g. in ring buffers.
+ */
+typedef struct
+{
+    /** The CAN ID. */
+    uint32_t id;
+
+    /** Used bytes in the \p data field, at most
+     * #VCAN_CLASSIC_DATA_MAX_LEN. */
+    uint8_t len;
+
+    /** Payload. */
+    uint8_t data[VCAN_CLASSIC_DATA_MAX_LEN];
+} vcan_frame8_t;
+
+/** Length of the header of a packed frame: the CAN ID as 4 little-endian
+ * bytes followed by 1 byte of payload length. */
+#define VCAN_PACKED_HEADER_LEN 5U
+
+/** Size in bytes of a packed frame with \p len bytes of payload. */
+#define VCAN_PACKED_SIZE(len) (VCAN_PACKED_HEADER_LEN + (size_t) (len))
+
+/**
+ * Acceptance filter in the style of the CAN controllers' ones.
+ *
+ * A message is accepted when `(msg->id & mask) == (id & mask)`.
+ */
+typedef struct
+{
+    /** Acceptance code: the expected values of the bits set in \p mask. */
+    uint32_t id;
+
+    /** Bits of the CAN ID to compare. 0 accepts everything. */
+    uint32_t mask;
+} vcan_filter_t;
+
+/**
+ * Acceptance filtering state of a node, set with vcan_set_filter().
+ *
+ * All zeros, as with a zero-initialised node, accepts every message.
+ */
+typedef struct
+{
+    /** Filters in id/mask form. */
+    const vcan_filter_t* filters;
+
+    /** Amount of filters in \p filters. */
+    size_t filters_len;
+
+    /** Accepted exact CAN IDs, sorted in ascending order. */
+    const uint32_t* ids;
+
+    /** Amount of IDs in \p ids. */
+    size_t ids_len;
+
+    /**
+     * Precomputed acceptance code and mask matching a superset of what the
+     * filters and IDs accept, used to reject messages in O(1) before
+     * scanning the filters.
+     */
+    vcan_filter_t summary;
+} vcan_acceptance_t;
+
+/**
+ * Metadata of a delivered message, see vcan_rx_queue_set_meta() and
+ * #vcan_node_t.rx_meta.
+ */
+typedef struct
+{
+    /** Position of the message among the transmissions of the bus, counting
+     * from 1, without gaps. */
+    uint64_t seq;
+
+    /**
+     * Bus clock when the message was transmitted, i.e. vcan_tx() called or,
+     * for the messages queued by vcan_mt.h or a gateway first, the time they
+     * were queued at. 0 unless #VCAN_BUS_TIMESTAMPS is set and the bus has a
+     * clock.
+     */
+    uint64_t tx_time;
+
+    /** Bus clock when the message was handed over to the node: callback
+     * called or message queued. 0 as \p tx_time. */
+    uint64_t rx_time;
+} vcan_meta_t;
+
+struct vcan_pool;
+
+/**
+ * Reference-counted message from the frame pool of a bus, see
+ * vcan_set_pool().
+ *
+ * A frame is shared read-only by all its holders: the transmitter and the
+ * receive queues of the nodes in shared mode, see
+ * vcan_rx_queue_init_shared(). It returns into the pool when the last one
+ * calls vcan_frame_release().
+ */
+typedef struct vcan_frame
+{
+    /** The message, not to be modified while shared. */
+    vcan_msg_t msg;
+
+    /** Amount of holders. */
+    VCAN_ATOMIC(uint32_t) refs;
+
+    /** Position of the next free frame plus 1, while free. For internal use
+     * only. */
+    VCAN_ATOMIC(uint32_t) next_free;
+
+    /** The pool the frame belongs to. */
+    struct vcan_pool* pool;
+} vcan_frame_t;
+
+/**
+ * Fixed-block pool of frames of a bus, in caller-provided storage.
+ *
+ * Frames are allocated by the transmitting thread and released by any
+ * thread through a lock-free free list. Set it with vcan_set_pool(), do not
+ * access its fields directly.
+ */
+typedef struct vcan_pool
+{
+    /** Storage of \p capacity frames. NULL when the bus has no pool. */
+    vcan_frame_t* frames;
+
+    /** Amount of frames in \p frames. */
+    size_t capacity;
+
+    /** Top of the free list: position plus 1 in the lower 32 bits, 0 when
+     * empty, and a counter against ABA in the upper 32 bits. */
+    VCAN_ATOMIC(uint64_t) free_head;
+
+    /** Frames currently allocated. */
+    VCAN_ATOMIC(size_t) in_use;
+
+    /** Max of \p in_use ever reached. */
+    VCAN_ATOMIC(size_t) high_water;
+
+    /** Allocations failed because all frames were in use. */
+    VCAN_ATOMIC(uint64_t) exhausted;
+} vcan_pool_t;
+
+/** Counters of the frame pool of a bus, as read by vcan_get_pool_stats(). */
+typedef struct
+{
+    /** Frames in the pool. */
+    size_t capacity;
+
+    /** Frames currently allocated. */
+    size_t in_use;
+
+    /** Max amount of frames ever allocated at the same time. */
+    size_t high_water;
+
+    /** Allocations failed because all frames were in use. */
+    uint64_t exhausted;
+} vcan_pool_stats_t;
+
+/**
+ * What the bus does with a message for a node whose receive queue is full,
+ * set with vcan_rx_queue_set_policy(). Each overflow is counted in
+ * vcan_rx_overflows() and reported by vcan_rx_last_overflow().
+ */
+typedef enum
+{
+    /** Drop the newest message, the default. Reported as
+     * #VCAN_DROPPED_NEWEST. */
+    VCAN_RX_DROP_NEWEST = 0,
+
+    /** Drop the oldest queued message to enqueue the newest one, so the
+     * consumer always finds the latest traffic. Reported as
+     * #VCAN_DROPPED_OLDEST. The messages the consumer is dequeuing at the
+     * same time cannot be dropped: then the newest one is, as with
+     * #VCAN_RX_DROP_NEWEST. */
+    VCAN_RX_DROP_OLDEST = 1,
+
+    /** Make the transmitter wait for the consumer to free a slot, up to a
+     * timeout, before dropping the newest message. Reported as
+     * #VCAN_TX_TIMEOUT on expiry. */
+    VCAN_RX_BLOCK = 2,
+
+    /** Enqueue into a second, usually larger, caller-provided queue, the
+     * overflow arena, until the consumer drained it. The message is dropped
+     * only when the arena is full too. Reported as #VCAN_SPILLED, or as
+     * #VCAN_DROPPED_NEWEST when dropped. */
+    VCAN_RX_SPILL = 3,
+} vcan_rx_policy_t;
+
+/**
+ * Bounded single-producer single-consumer queue of received messages.
+ *
+ * The producer is whoever transmits on the bus the node is connected to,
+ * the consumer is the node calling vcan_rx_poll(), possibly on another
+ * thread. Producer and consumer indices live on separate cache lines.
+ *
+ * Initialise it with vcan_rx_queue_init(), do not access its fields directly.
+ */
+typedef struct vcan_rx_queue
+{
+    /** Storage of \p capacity messages, unless \p frames is used. */
+    vcan_msg_t* msgs;
+
+    /** Storage of \p capacity shared frames in shared mode, see
+     * vcan_rx_queue_init_shared(). NULL otherwise. */
+    vcan_frame_t** frames;
+
+    /** Amount of messages fitting into \p msgs, a power of 2. */
+    size_t capacity;
+
+    /** What to do when full, see vcan_rx_queue_set_policy(). */
+    vcan_rx_policy_t policy;
+
+    /** Bus clock ticks a #VCAN_RX_BLOCK transmitter waits for a slot. */
+    uint64_t timeout;
+
+    /** Overflow arena of #VCAN_RX_SPILL, NULL otherwise. */
+    struct vcan_rx_queue* spill;
+
+    /** Readiness notification set with vcan_rx_queue_set_notify(). Can be
+     * NULL. */
+    void (* notify)(void* ctx);
+
+    /** Context passed to \p notify. */
+    void* notify_ctx;
+
+    /** Next position to enqueue at, written by the producer. */
+    VCAN_ALIGNAS(VCAN_CACHE_LINE_SIZE) VCAN_ATOMIC(size_t) tail;
+
+    /** Producer's last known value of \p head. */
+    size_t head_cache;
+
+    /** Set by the consumer once drained, cleared by the producer calling
+     * \p notify: one notification per batch. */
+    VCAN_ATOMIC(bool) armed;
+
+    /** Messages dropped because the queue was full or, in shared mode, the
+     * frame pool was exhausted. */
+    VCAN_ATOMIC(uint64_t) overflows;
+
+    /** #vcan_err_t reporting the last overflow, #VCAN_OK before the first. */
+    VCAN_ATOMIC(uint32_t) last_overflow;
+
+    /** Next position to dequeue from, written by the consumer, or also by
+     * the producer with #VCAN_RX_DROP_OLDEST. The producer reuses the
+     * positions before it. */
+    VCAN_ALIGNAS(VCAN_CACHE_LINE_SIZE) VCAN_ATOMIC(size_t) head;
+
+    /**
+     * With #VCAN_RX_DROP_OLDEST, next position not taken yet by the consumer
+     * or the producer: the consumer takes the ones it dequeues before
+     * reading them, the producer the oldest one to drop, only while equal to
+     * \p head, that is while the consumer reads nothing.
+     */
+    VCAN_ATOMIC(size_t) claim;
+
+    /** Consumer's last known value of \p tail. */
+    size_t tail_cache;
+
+    /** Storage of \p capacity metadata entries set with
+     * vcan_rx_queue_set_meta(). Can be NULL. */
+    vcan_meta_t* metas;
+} vcan_rx_queue_t;
+
+/** Counters of a bus, as read by vcan_get_stats(). */
+typedef struct
+{
+    /** Transmitted messages, including the ones no node accepted. */
+    uint64_t tx_frames;
+
+    /** Transmitted payload bytes. */
+    uint64_t tx_bytes;
+
+    /** Messages dropped for some node by a full queue. */
+    uint64_t dropped;
+} vcan_bus_stats_t;
+
+/** Counters of a node, as read by vcan_get_node_stats(). */
+typedef struct
+{
+    /** Received messages: delivered to a callback or queued. */
+    uint64_t rx_frames;
+
+    /** Received payload bytes. */
+    uint64_t rx_bytes;
+
+    /** Cumulative time spent in the node's callbacks, in the units of the
+     * bus clock set with vcan_set_clock(). 0 without a clock. */
+    uint64_t callback_time;
+} vcan_node_stats_t;
+
+#ifdef VCAN_STATS
+/** Live bus counters, updated by the transmitting thread. For internal use
+ * only. */
+typedef struct
+{
+    VCAN_ATOMIC(uint64_t) tx_frames;
+    VCAN_ATOMIC(uint64_t) tx_bytes;
+    VCAN_ATOMIC(uint64_t) dropped;
+} vcan_bus_counters_t;
+
+/** Live node counters, updated by the transmitting thread. For internal use
+ * only. */
+typedef struct
+{
+    VCAN_ATOMIC(uint64_t) rx_frames;
+    VCAN_ATOMIC(uint64_t) rx_bytes;
+    VCAN_ATOMIC(uint64_t) callback_time;
+} vcan_node_counters_t;
+#endif
+
 /**
  * Virtual node.
  *
@@ -112,6 +560,75 @@ struct vcan_node
 
     /** Identifier of the node. Can be set to anything, VCAN does not use it. */
     uint32_t id;
+
+    /**
+     * Optional callback called once per vcan_tx_burst() with the whole array
+     * of transmitted messages. Can be NULL.
+     *
+     * When NULL, vcan_tx_burst() calls \p callback_on_rx once per message
+     * instead.
+     *
+     * @param node the address of this node.
+     * @param msgs the transmitted messages, valid only during the callback.
+     * @param count amount of messages in \p msgs, at least 1.
+     */
+    void (* callback_on_rx_burst)(struct vcan_node* node,
+                                  const vcan_msg_t* msgs,
+                                  size_t count);
+
+    /**
+     * Acceptance filters, matched by the bus before calling the callbacks.
+     * Set it with vcan_set_filter(). Zero-initialised, it accepts everything.
+     */
+    vcan_acceptance_t acceptance;
+
+    /**
+     * Optional receive queue, initialised with vcan_rx_queue_init().
+     * Can be NULL.
+     *
+     * When not NULL, the node is in queued mode: the bus copies each accepted
+     * message into the queue instead of calling the callbacks, and the node
+     * drains it at its own pace with vcan_rx_poll(). When the queue is full,
+     * the message is dropped for this node and counted in
+     * vcan_rx_overflows().
+     */
+    vcan_rx_queue_t* rx_queue;
+
+    /**
+     * Handle of the node, managed by vcan_connect() and vcan_disconnect():
+     * the bus in whose node table the node occupies \p slot.
+     * NULL when not connected.
+     *
+     * It makes finding the node in the table O(1). A node connected to
+     * multiple buses at once has a handle only for one of them; the others
+     * fall back to a linear scan.
+     */
+    struct vcan_bus* bus;
+
+    /** Handle of the node: its index in the node table of \p bus. */
+    size_t slot;
+
+    /**
+     * Worker of a parallel delivery the node is bound to, plus 1, keeping
+     * its state on one core: see vcan_par.h. 0 lets any worker deliver to
+     * it, which is the default.
+     */
+    uint32_t affinity;
+
+    /** Amount of buses the node is connected to. */
+    size_t connections;
+
+    /**
+     * Metadata of the message passed to the callback, set just before
+     * calling it. For a burst, the one of its first message: the other
+     * ones follow with consecutive sequence numbers.
+     */
+    vcan_meta_t rx_meta;
+
+#ifdef VCAN_STATS
+    /** Reception counters, read them with vcan_get_node_stats(). */
+    vcan_node_counters_t stats;
+#endif
 };
 
 /**
@@ -122,32 +639,282 @@ struct vcan_node
  */
 typedef struct vcan_node vcan_node_t;
 
+/**
+ * Keep the node table in connection order on disconnection, at O(N) cost,
+ * instead of the O(1) default which moves the last node into the freed slot.
+ * Flag of #vcan_bus_t.flags.
+ */
+#define VCAN_BUS_ORDERED (1U << 0U)
+
+/**
+ * Timestamp each transmission and each delivery with the bus clock, see
+ * #vcan_meta_t and vcan_set_clock(). Flag of #vcan_bus_t.flags.
+ *
+ * The sequence numbers are counted anyway; the timestamps cost two clock
+ * readings per message and node more.
+ */
+#define VCAN_BUS_TIMESTAMPS (1U << 1U)
+
+/**
+ * Transmit hook of a bus, see vcan_set_tx_hook().
+ *
+ * @param ctx the context set along with the hook
+ * @param msg the message to transmit, valid only during the call
+ * @param src_node the transmitting node, can be NULL
+ * @return the result to return to the transmitter
+ */
+typedef vcan_err_t (* vcan_tx_hook_t)(void* ctx,
+                                      const vcan_msg_t* msg,
+                                      const vcan_node_t* src_node);
+
+/**
+ * Fan-out hook of a bus, see vcan_set_fanout().
+ *
+ * @param ctx the context set along with the hook
+ * @param bus the bus delivering the message
+ * @param nodes the node table of the bus
+ * @param count amount of connected nodes in \p nodes
+ * @param msg the message to deliver, valid only during the call
+ * @param src_node the transmitting node to skip, can be NULL
+ */
+typedef void (* vcan_fanout_hook_t)(void* ctx,
+                                    struct vcan_bus* bus,
+                                    vcan_node_t* const* nodes,
+                                    size_t count,
+                                    const vcan_msg_t* msg,
+                                    const vcan_node_t* src_node);
+
+/**
+ * Hooks called at the tracepoints of a bus when compiled with `VCAN_PROBES`,
+ * see vcan_set_probes(). Each one can be NULL.
+ */
+typedef struct
+{
+    /** Start of the delivery of \p count messages, 1 unless a burst. */
+    void (* tx_entry)(void* ctx,
+                      const struct vcan_bus* bus,
+                      const vcan_msg_t* msgs,
+                      size_t count);
+
+    /** The message is handed over to the node: queued or callback called
+     * right after this hook. For a burst callback, the first message. */
+    void (* dispatch)(void* ctx,
+                      const struct vcan_bus* bus,
+                      const vcan_node_t* node,
+                      const vcan_msg_t* msg);
+
+    /** End of the delivery started by the matching \p tx_entry. */
+    void (* tx_exit)(void* ctx,
+                     const struct vcan_bus* bus,
+                     const vcan_msg_t* msgs,
+                     size_t count);
+
+    /** Passed to the hooks. */
+    void* ctx;
+} vcan_probes_t;
+
+/**
+ * Significant bits of the values in a #vcan_hist_t: the buckets are at most
+ * 1/8 of their value wide.
+ */
+#define VCAN_HIST_SUB_BITS 3U
+
+/** Buckets of a #vcan_hist_t, covering all 64-bit values. */
+#define VCAN_HIST_BUCKETS \
+    ((64U - VCAN_HIST_SUB_BITS + 1U) << VCAN_HIST_SUB_BITS)
+
+/**
+ * Latency histogram with logarithmic buckets of linear sub-buckets, as
+ * HdrHistogram: exact up to 15, then with a relative error below 12.5%.
+ *
+ * Written by one thread at a time, read from any thread. Initialise it with
+ * vcan_hist_init(), do not access its fields directly.
+ */
+typedef struct
+{
+    /** Values recorded into each bucket. */
+    VCAN_ATOMIC(uint64_t) counts[VCAN_HIST_BUCKETS];
+
+    /** Values recorded. */
+    VCAN_ATOMIC(uint64_t) total;
+
+    /** Largest value recorded. */
+    VCAN_ATOMIC(uint64_t) max;
+} vcan_hist_t;
+
+/**
+ * Transmission issued from within a callback, waiting in the deferred-TX
+ * FIFO of the bus, see vcan_set_deferred().
+ */
+typedef struct
+{
+    /** Copy of the transmitted message. */
+    vcan_msg_t msg;
+
+    /** The transmitting node, can be NULL. */
+    const vcan_node_t* src_node;
+
+    /** Bus clock at the transmission, see #vcan_meta_t.tx_time. */
+    uint64_t tx_time;
+} vcan_deferred_t;
+
 /**
  * Virtual bus.
  *
  * Contains a list of nodes connected to it.
  */
-typedef struct
+typedef struct vcan_bus
 {
     /** The message just transmitted over the bus. */
     vcan_msg_t received_msg;
 
-    /** Nodes to deliver new messages to. */
+    /** Nodes to deliver new messages to, unless \p table is used. */
     vcan_node_t* nodes[VCAN_MAX_CONNECTED_NODES];
 
     /** Amount of nodes. */
     size_t connected;
+
+    /**
+     * Caller-provided node table set by vcan_init_ex(), used instead of
+     * \p nodes. NULL after vcan_init().
+     */
+    vcan_node_t** table;
+
+    /** Amount of nodes fitting into \p table. */
+    size_t capacity;
+
+    /**
+     * Summary code of the filters of each node of \p nodes, in a separate
+     * array from \p masks so the fan-out compares several nodes per
+     * instruction. 0 for nodes accepting everything.
+     */
+    uint32_t codes[VCAN_MAX_CONNECTED_NODES];
+
+    /** Summary mask of the filters of each node of \p nodes. */
+    uint32_t masks[VCAN_MAX_CONNECTED_NODES];
+
+    /** Caller-provided summary codes for \p table set with
+     * vcan_set_match_table(). Can be NULL. */
+    uint32_t* table_codes;
+
+    /** Caller-provided summary masks for \p table. Can be NULL. */
+    uint32_t* table_masks;
+
+    /** Bus options, such as #VCAN_BUS_ORDERED. 0 after initialisation. */
+    uint32_t flags;
+
+    /** Timestamp source set with vcan_set_clock(). Can be NULL. */
+    uint64_t (* clock_now)(void* ctx);
+
+    /** Context passed to \p clock_now. */
+    void* clock_ctx;
+
+    /** Transmit hook set with vcan_set_tx_hook(). Can be NULL. */
+    vcan_tx_hook_t tx_hook;
+
+    /** Context passed to \p tx_hook. */
+    void* tx_hook_ctx;
+
+    /** Fan-out hook set with vcan_set_fanout(). Can be NULL. */
+    vcan_fanout_hook_t fanout_hook;
+
+    /** Context passed to \p fanout_hook. */
+    void* fanout_ctx;
+
+    /** Caller-provided deferred-TX FIFO set with vcan_set_deferred(). Can
+     * be NULL. */
+    vcan_deferred_t* deferred;
+
+    /** Max amount of messages in \p deferred. */
+    size_t deferred_capacity;
+
+    /** Position of the oldest message in \p deferred. */
+    size_t deferred_head;
+
+    /** Amount of messages in \p deferred. */
+    size_t deferred_len;
+
+    /** True while the nodes are being notified of a transmission. */
+    bool delivering;
+
+    /** Frame pool set with vcan_set_pool(). */
+    vcan_pool_t pool;
+
+    /** Frame holding the message being delivered, shared by the receive
+     * queues in shared mode. Can be NULL. */
+    vcan_frame_t* frame;
+
+    /** Sequence number of the last transmission. */
+    uint64_t seq;
+
+    /** Metadata of the message being delivered, without \p rx_time. */
+    vcan_meta_t meta;
+
+    /** Hooks of the tracepoints set with vcan_set_probes(). Can be NULL. */
+    const vcan_probes_t* probes;
+
+    /** Histogram of the fan-out durations set with vcan_set_histogram().
+     * Can be NULL. */
+    vcan_hist_t* hist;
+
+#ifdef VCAN_STATS
+    /** Transmission counters, read them with vcan_get_stats(). */
+    vcan_bus_counters_t stats;
+#endif
 } vcan_bus_t;
 
 /**
- * Initialises the bus.
+ * Initialises the bus, with room for #VCAN_MAX_CONNECTED_NODES nodes.
+ *
+ * @param bus not NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_init(vcan_bus_t* bus);
+
+/**
+ * Initialises the bus with a caller-provided node table of any size,
+ * instead of the embedded one of #VCAN_MAX_CONNECTED_NODES nodes.
+ *
+ * Useful for large buses without recompiling with a different
+ * #VCAN_MAX_CONNECTED_NODES. The table may be statically allocated or come
+ * from any allocator; it must stay valid as long as the bus is used.
+ *
+ * @param bus not NULL
+ * @param nodes not NULL, array of \p capacity node pointers
+ * @param capacity max amount of connected nodes, not 0
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_STORAGE on \p nodes being NULL
+ * - #VCAN_INVALID_CAPACITY on \p capacity being 0
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_init_ex(vcan_bus_t* bus,
+                                 vcan_node_t** nodes,
+                                 size_t capacity);
+
+/**
+ * Gives a bus initialised with vcan_init_ex() the storage for the summary
+ * code/mask of the filters of each node of its node table.
+ *
+ * Without it, the fan-out of such a bus checks the filters node by node,
+ * while the bus with the embedded node table always has one: for that one
+ * this function has no effect. See vcan_set_filter().
  *
  * @param bus not NULL
+ * @param codes not NULL, array of as many codes as node table capacity,
+ *        valid as long as the bus is used
+ * @param masks not NULL, array of as many masks as node table capacity,
+ *        valid as long as the bus is used
  * @return
  * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_STORAGE on \p codes or \p masks being NULL
  * - #VCAN_OK otherwise
  */
-vcan_err_t vcan_init(vcan_bus_t* bus);
+VCAN_API vcan_err_t vcan_set_match_table(vcan_bus_t* bus,
+                                         uint32_t* codes,
+                                         uint32_t* masks);
 
 /**
  * Attaches a new node to the bus, enabling it to receive any transmitted
@@ -157,24 +924,34 @@ vcan_err_t vcan_init(vcan_bus_t* bus);
  * \p node->received_msg and its callback will be called, passing
  * the node itself as its only argument.
  *
+ * The node's index in the node table is stored in the node as a handle
+ * (\p node->bus and \p node->slot), making the duplicate detection O(1).
+ *
  * @param bus not NULL
- * @param node not NULL, with callback not NULL
+ * @param node not NULL, with callback not NULL unless it has a receive queue
  * @return
  * - #VCAN_NULL_BUS on \p bus being NULL
  * - #VCAN_NULL_NODE on \p node being NULL
- * - #VCAN_NULL_CALLBACK on \p node->callback_on_rx being NULL
+ * - #VCAN_NULL_CALLBACK on \p node->callback_on_rx and \p node->rx_queue
+ *   being both NULL
  * - #VCAN_TOO_MANY_CONNECTED when there number of already connected nodes
- *   to the bus the maximum. Increase #VCAN_MAX_CONNECTED_NODES if required.
+ *   to the bus the maximum. Increase #VCAN_MAX_CONNECTED_NODES or use
+ *   vcan_init_ex() if required.
  * - #VCAN_ALREADY_CONNECTED when the node is already connected to the bus,
  *   there is nothing to be done.
  * - #VCAN_OK otherwise
  */
-vcan_err_t vcan_connect(vcan_bus_t* bus, vcan_node_t* node);
+VCAN_API vcan_err_t vcan_connect(vcan_bus_t* bus, vcan_node_t* node);
 
 /**
  * Detaches a node from the bus, disabling it from receiving any further
  * messages.
  *
+ * Takes O(1) thanks to the node's handle: the last node of the table is
+ * moved into the freed slot, so the delivery order of the remaining nodes
+ * may change. Set #VCAN_BUS_ORDERED in \p bus->flags to keep the
+ * connection order instead, at O(N) cost.
+ *
  * @param bus not NULL
  * @param node not NULL
  * @return
@@ -184,11 +961,12 @@ vcan_err_t vcan_connect(vcan_bus_t* bus, vcan_node_t* node);
  *   is nothing to do
  * - #VCAN_OK otherwise
  */
-vcan_err_t vcan_disconnect(vcan_bus_t* bus, const vcan_node_t* node);
+VCAN_API vcan_err_t vcan_disconnect(vcan_bus_t* bus, const vcan_node_t* node);
 
 /**
  * Sends a copy of the message to every connected node and calls every nodes's
- * callback to notify them.
+ * callback to notify them. Nodes whose acceptance filters (see
+ * vcan_set_filter()) reject the message ID are skipped.
  *
  * If you include a transmitting node, that one is excluded from the reception.
  *
@@ -196,22 +974,923 @@ vcan_err_t vcan_disconnect(vcan_bus_t* bus, const vcan_node_t* node);
  * enough. Before transmitting the next message, the user should take care
  * that each virtual node has finished processing the message (e.g. copying to
  * another location), so the next transmit does not overwrite the
- * unprocessed message in the nodes.
+ * unprocessed message in the nodes. Callbacks transmitting on the same bus
+ * should enable the deferred-TX mode with vcan_set_deferred().
+ *
+ * Only the header and the first \p msg->len bytes of the payload are copied
+ * into \p bus->received_msg, so short classic CAN frames do not pay for the
+ * full #VCAN_DATA_MAX_LEN bytes. Payload bytes past \p len in
+ * \p bus->received_msg are unspecified. A \p len larger than
+ * #VCAN_DATA_MAX_LEN is copied as #VCAN_DATA_MAX_LEN bytes.
+ *
+ * @param bus not NULL
+ * @param msg not NULL
+ * @param src_node can be NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_MSG on \p msg being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_tx(vcan_bus_t* bus,
+                            const vcan_msg_t* msg,
+                            const vcan_node_t* src_node);
+
+/**
+ * Zero-copy variant of vcan_tx(): passes the caller's message directly to
+ * every node's callback, without copying it into \p bus->received_msg.
+ *
+ * If you include a transmitting node, that one is excluded from the reception.
+ *
+ * Lifetime: the \p msg pointer received by the callbacks is valid only
+ * during the callback itself, as it points to the caller's memory, which
+ * may be reused or freed as soon as this function returns. Nodes that need
+ * the message afterwards must copy it. The message must not be modified
+ * by the caller while this function runs. \p bus->received_msg is
+ * left untouched.
+ *
+ * @param bus not NULL
+ * @param msg not NULL
+ * @param src_node can be NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_MSG on \p msg being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_tx_ref(vcan_bus_t* bus,
+                                const vcan_msg_t* msg,
+                                const vcan_node_t* src_node);
+
+/**
+ * Variant of vcan_tx_ref() for a message transmitted earlier and queued
+ * meanwhile, keeping its original transmission time in the metadata of the
+ * deliveries, see #vcan_meta_t.tx_time.
+ *
+ * @param bus not NULL
+ * @param msg not NULL
+ * @param src_node can be NULL
+ * @param tx_time bus clock when the message was transmitted, as obtained
+ *        from vcan_timestamp()
+ * @return as vcan_tx_ref()
+ */
+VCAN_API vcan_err_t vcan_tx_stamped(vcan_bus_t* bus,
+                                    const vcan_msg_t* msg,
+                                    const vcan_node_t* src_node,
+                                    uint64_t tx_time);
+
+/**
+ * Transmits an array of messages at once, validating the arguments only once.
+ *
+ * Every connected node except \p src_node obtains the whole array: nodes with
+ * a \p callback_on_rx_burst get a single call with all messages, the others
+ * get one \p callback_on_rx call per message, in order. The messages are
+ * delivered node by node, so a node receives all of them before the next
+ * node receives the first one. Messages rejected by the node's acceptance
+ * filters are skipped: a burst callback obtains each contiguous run of
+ * accepted messages with one call.
+ *
+ * Like vcan_tx_ref(), the callbacks obtain pointers into \p msgs, which are
+ * valid only during the callback. Only the last message is copied into
+ * \p bus->received_msg.
+ *
+ * @param bus not NULL
+ * @param msgs not NULL unless \p count is 0
+ * @param count amount of messages in \p msgs. Nothing is transmitted when 0.
+ * @param src_node can be NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_MSG on \p msgs being NULL with a non-zero \p count
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_tx_burst(vcan_bus_t* bus,
+                                  const vcan_msg_t* msgs,
+                                  size_t count,
+                                  const vcan_node_t* src_node);
+
+/**
+ * Sets the acceptance filters of the node, so it receives only the messages
+ * matching at least one of the id/mask \p filters or one of the exact
+ * \p ids.
+ *
+ * The matching happens in the bus before any callback is called, so
+ * rejected messages cost the node nothing. A precomputed code/mask summary
+ * of all filters rejects most unwanted messages with a single comparison;
+ * the exact IDs are then looked up with a binary search. The bus keeps the
+ * summaries of its nodes side by side and compares them with SIMD
+ * instructions where available (AVX2, SSE2 or NEON), 4 to 8 nodes at a time,
+ * so only the nodes passing the summary are visited at all, see
+ * vcan_set_match_table() for the buses with a caller-provided node table.
+ * A node connected to several buses is visited anyway on the buses other
+ * than the one of its handle (\p node->bus), whose summary is updated here.
+ *
+ * The arrays are not copied: they must stay valid and unmodified while the
+ * node is connected. Passing no filters and no IDs makes the node accept
+ * every message again. Filters can be changed also while the node is
+ * connected, but not from a different thread than the transmitting one.
+ *
+ * @param node not NULL
+ * @param filters id/mask filters, can be NULL if \p filters_len is 0
+ * @param filters_len amount of \p filters
+ * @param ids exact CAN IDs, sorted in strictly ascending order, can be NULL if
+ *        \p ids_len is 0
+ * @param ids_len amount of \p ids
+ * @return
+ * - #VCAN_NULL_NODE on \p node being NULL
+ * - #VCAN_NULL_FILTER on \p filters or \p ids being NULL with non-zero length
+ * - #VCAN_NODE_NOT_FOUND when the handle of \p node is stale: its bus
+ *   (initialised again) no longer has the node in the slot of the handle.
+ *   The handle is cleared and the filters are not changed.
+ * - #VCAN_UNSORTED_FILTER on \p ids not being strictly ascending
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_set_filter(vcan_node_t* node,
+                                    const vcan_filter_t* filters,
+                                    size_t filters_len,
+                                    const uint32_t* ids,
+                                    size_t ids_len);
+
+/**
+ * Initialises a receive queue to assign to a node's \p rx_queue.
+ *
+ * @param queue not NULL
+ * @param storage not NULL, array of \p capacity messages, owned by the queue
+ *        until it is not used anymore
+ * @param capacity non-zero power of 2
+ * @return
+ * - #VCAN_NULL_STORAGE on \p queue or \p storage being NULL
+ * - #VCAN_INVALID_CAPACITY on \p capacity being 0 or not a power of 2
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_rx_queue_init(vcan_rx_queue_t* queue,
+                                       vcan_msg_t* storage,
+                                       size_t capacity);
+
+/**
+ * Gives the receive queue storage for the metadata of each queued message,
+ * to be read with vcan_rx_poll_meta().
+ *
+ * Must be set while the queue is empty and not in use, e.g. right after
+ * its initialisation.
+ *
+ * @param queue not NULL, initialised
+ * @param metas not NULL, array of as many entries as the queue capacity,
+ *        owned by the queue until it is not used anymore
+ * @return
+ * - #VCAN_NULL_STORAGE on \p queue or \p metas being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_rx_queue_set_meta(vcan_rx_queue_t* queue,
+                                           vcan_meta_t* metas);
+
+/**
+ * Sets what the bus does with the messages for the node when its receive
+ * queue is full, see #vcan_rx_policy_t.
+ *
+ * Must be set while the queue is empty and not in use, e.g. right after
+ * its initialisation. With #VCAN_RX_DROP_OLDEST the producer and the
+ * consumer both advance the head of the queue and the consumer discards and
+ * dequeues again whatever the producer dropped while it was copying it.
+ *
+ * With #VCAN_RX_BLOCK the transmitter spins, so all other nodes wait too:
+ * the timeout is measured with the bus clock set with vcan_set_clock(), which
+ * must advance on its own, like a monotonic clock. Without a clock the
+ * transmitter does not wait at all.
+ *
+ * With #VCAN_RX_SPILL the polling functions dequeue from the overflow arena
+ * once the queue is empty, so the reception order is kept.
+ *
+ * @param queue not NULL, initialised
+ * @param policy one of #vcan_rx_policy_t
+ * @param timeout max wait of #VCAN_RX_BLOCK in bus clock ticks, ignored
+ *        otherwise
+ * @param spill overflow arena of #VCAN_RX_SPILL: an initialised, empty and
+ *        unused queue in the same mode as \p queue (copying or shared),
+ *        owned by \p queue until it is not used anymore. Ignored otherwise,
+ *        can be NULL
+ * @return
+ * - #VCAN_NULL_STORAGE on \p queue being NULL, or \p spill being NULL with
+ *   #VCAN_RX_SPILL
+ * - #VCAN_INVALID_POLICY on an unknown \p policy, or \p spill being
+ *   \p queue itself or in the other mode
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_rx_queue_set_policy(vcan_rx_queue_t* queue,
+                                             vcan_rx_policy_t policy,
+                                             uint64_t timeout,
+                                             vcan_rx_queue_t* spill);
+
+/**
+ * Sets the function the producer calls when a message lands in the empty
+ * receive queue, e.g. to wake up the event loop of the consumer thread, see
+ * vcan_notify.h.
+ *
+ * The notifications are coalesced: after one, the next comes only once the
+ * consumer drained the queue with vcan_rx_drain(), however many messages
+ * arrive meanwhile. The function is called by the transmitting thread,
+ * while delivering, so it should be short and must not transmit.
+ *
+ * Must be set while the queue is not in use. The queue starts armed: the
+ * first message notifies.
+ *
+ * @param queue not NULL, initialised
+ * @param notify called with \p ctx, NULL to stop notifying
+ * @param ctx passed to \p notify, can be NULL
+ * @return
+ * - #VCAN_NULL_STORAGE on \p queue being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_rx_queue_set_notify(vcan_rx_queue_t* queue,
+                                             void (* notify)(void* ctx),
+                                             void* ctx);
+
+/**
+ * Dequeues received messages from the node's receive queue until it is
+ * empty, calling \p on_rx on each, then re-arms the notification of the
+ * queue, see vcan_rx_queue_set_notify().
+ *
+ * Must be called by the single consumer thread of the node, typically when
+ * notified. Messages arriving while draining are drained too, so a message
+ * is never left in the queue without a pending notification; at worst a
+ * notification finds the queue already empty. The messages are copied in
+ * batches to the stack, \p on_rx can transmit.
+ *
+ * @param node the node, with a receive queue
+ * @param on_rx not NULL, called with \p node and each message in reception
+ *        order
+ * @return the amount of messages drained, 0 when the queue was empty or any
+ * argument is invalid
+ */
+VCAN_API size_t vcan_rx_drain(vcan_node_t* node,
+                              void (* on_rx)(vcan_node_t* node,
+                                             const vcan_msg_t* msg));
+
+/**
+ * Dequeues up to \p max received messages from the node's receive queue.
+ *
+ * Must be called by a single consumer thread per node. The messages are
+ * copied into \p msgs in reception order; payload bytes past each
+ * message's \p len are unspecified.
+ *
+ * @param node the node, with a receive queue
+ * @param msgs not NULL, room for \p max messages
+ * @param max max amount of messages to dequeue
+ * @return the amount of messages written into \p msgs, 0 when the queue is
+ * empty or any argument is invalid
+ */
+VCAN_API size_t vcan_rx_poll(vcan_node_t* node, vcan_msg_t* msgs, size_t max);
+
+/**
+ * Variant of vcan_rx_poll() also dequeuing the metadata of the messages.
+ *
+ * @param node the node, with a receive queue
+ * @param msgs not NULL, room for \p max messages
+ * @param metas not NULL, room for \p max entries, zeroed for a queue without
+ *        metadata storage
+ * @param max max amount of messages to dequeue
+ * @return the amount of messages written into \p msgs, 0 when the queue is
+ * empty or any argument is invalid
+ */
+VCAN_API size_t vcan_rx_poll_meta(vcan_node_t* node,
+                                  vcan_msg_t* msgs,
+                                  vcan_meta_t* metas,
+                                  size_t max);
+
+/**
+ * Initialises a receive queue in shared mode to assign to a node's
+ * \p rx_queue: it holds references to the frames of the frame pool of the
+ * bus instead of copies of the messages.
+ *
+ * Each transmission then copies the message at most once into a frame, see
+ * vcan_set_pool(), and each queue only takes a reference to it. A message
+ * arriving while the pool is exhausted is dropped for the node and counted
+ * in vcan_rx_overflows(). The queue is drained with vcan_rx_poll_shared()
+ * or, copying, with vcan_rx_poll() and the other polling functions.
+ *
+ * @param queue not NULL
+ * @param storage not NULL, array of \p capacity frame handles, owned by the
+ *        queue until it is not used anymore
+ * @param capacity non-zero power of 2
+ * @return
+ * - #VCAN_NULL_STORAGE on \p queue or \p storage being NULL
+ * - #VCAN_INVALID_CAPACITY on \p capacity being 0 or not a power of 2
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_rx_queue_init_shared(vcan_rx_queue_t* queue,
+                                              vcan_frame_t** storage,
+                                              size_t capacity);
+
+/**
+ * Dequeues up to \p max frames from the node's receive queue in shared
+ * mode, without copying them.
+ *
+ * Must be called by a single consumer thread per node. The caller holds
+ * a reference to each frame and must vcan_frame_release() it once done.
+ *
+ * @param node the node, with a receive queue in shared mode
+ * @param frames not NULL, room for \p max frame handles
+ * @param max max amount of frames to dequeue
+ * @return the amount of frames written into \p frames, 0 when the queue is
+ * empty, not in shared mode or any argument is invalid
+ */
+VCAN_API size_t vcan_rx_poll_shared(vcan_node_t* node,
+                                    vcan_frame_t** frames,
+                                    size_t max);
+
+/**
+ * Amount of messages the node could not receive because its receive queue
+ * was full. Can be read from any thread.
+ *
+ * @param node the node, with a receive queue
+ * @return the counter, 0 when \p node or its receive queue are NULL
+ */
+VCAN_API uint64_t vcan_rx_overflows(const vcan_node_t* node);
+
+/**
+ * How the overflow policy of the node's receive queue handled the last
+ * message not fitting into it. Can be read from any thread.
+ *
+ * @param node the node, with a receive queue
+ * @return #VCAN_DROPPED_NEWEST, #VCAN_DROPPED_OLDEST, #VCAN_TX_TIMEOUT or
+ * #VCAN_SPILLED, #VCAN_OK before the first overflow or when \p node or its
+ * receive queue are NULL
+ */
+VCAN_API vcan_err_t vcan_rx_last_overflow(const vcan_node_t* node);
+
+/**
+ * Fill level of the fullest receive queue of the nodes connected to the
+ * bus, for the transmitters to throttle themselves before messages are
+ * dropped.
+ *
+ * The overflow arena of a #VCAN_RX_SPILL queue counts as part of it. Costs
+ * two relaxed atomic loads per node with a receive queue; must be called
+ * from the transmitting thread, like vcan_tx().
+ *
+ * @param bus the bus
+ * @return 0 (all empty, no queues or \p bus NULL) to 100 (one queue full)
+ * percent
+ */
+VCAN_API uint32_t vcan_bus_pressure(const vcan_bus_t* bus);
+
+/**
+ * Converts a message into a compact classic frame.
+ *
+ * @param frame not NULL
+ * @param msg not NULL
+ * @return
+ * - #VCAN_NULL_MSG on \p frame or \p msg being NULL
+ * - #VCAN_TOO_LONG on the payload being longer than
+ *   #VCAN_CLASSIC_DATA_MAX_LEN, \p frame is untouched
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_frame8_from_msg(vcan_frame8_t* frame,
+                                         const vcan_msg_t* msg);
+
+/**
+ * Converts a compact classic frame into a message.
+ *
+ * Payload bytes past \p frame->len in \p msg are left untouched.
+ *
+ * @param msg not NULL
+ * @param frame not NULL
+ * @return
+ * - #VCAN_NULL_MSG on \p msg or \p frame being NULL
+ * - #VCAN_TOO_LONG on \p frame->len being longer than
+ *   #VCAN_CLASSIC_DATA_MAX_LEN, \p msg is untouched
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_frame8_to_msg(vcan_msg_t* msg,
+                                       const vcan_frame8_t* frame);
+
+/**
+ * Like vcan_tx() but transmits a compact classic frame.
+ *
+ * The frame is expanded directly into \p bus->received_msg.
+ *
+ * @param bus not NULL
+ * @param frame not NULL
+ * @param src_node can be NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_MSG on \p frame being NULL
+ * - #VCAN_TOO_LONG on \p frame->len being longer than
+ *   #VCAN_CLASSIC_DATA_MAX_LEN, nothing is transmitted
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_tx_frame8(vcan_bus_t* bus,
+                                   const vcan_frame8_t* frame,
+                                   const vcan_node_t* src_node);
+
+/**
+ * Payload length of the CAN FD frame carrying \p len bytes: \p len itself
+ * up to #VCAN_CLASSIC_DATA_MAX_LEN, the next valid CAN FD length above it
+ * (12, 16, 20, 24, 32, 48 or 64), the rest of the frame being padding.
+ *
+ * @param len payload bytes
+ * @return the frame payload length, or 0 on \p len being above
+ * #VCAN_DATA_MAX_LEN
+ */
+VCAN_API uint32_t vcan_fd_len(uint32_t len);
+
+/**
+ * Serialises the message into a packed frame: a header of
+ * #VCAN_PACKED_HEADER_LEN bytes followed by only the used payload bytes.
+ *
+ * Packed frames can be concatenated back to back into a byte buffer, so a
+ * classic 8-byte frame takes 13 bytes.
+ *
+ * @param buf not NULL, destination
+ * @param buf_len available bytes in \p buf
+ * @param msg not NULL, with \p len not above #VCAN_DATA_MAX_LEN
+ * @return the amount of bytes written, that is
+ * `VCAN_PACKED_SIZE(msg->len)`, or 0 on NULL arguments, an invalid length or
+ * \p buf being too short
+ */
+VCAN_API size_t vcan_pack(uint8_t* buf, size_t buf_len, const vcan_msg_t* msg);
+
+/**
+ * Deserialises one packed frame from the start of the buffer.
+ *
+ * @param msg not NULL, destination
+ * @param buf not NULL, packed frame
+ * @param buf_len available bytes in \p buf
+ * @return the amount of bytes read, or 0 on NULL arguments, an invalid
+ * length or a truncated frame
+ */
+VCAN_API size_t vcan_unpack(vcan_msg_t* msg,
+                            const uint8_t* buf,
+                            size_t buf_len);
+
+/**
+ * Transmits every packed frame of a buffer, in order, like calling vcan_tx()
+ * on each of them.
+ *
+ * Each frame is unpacked directly into \p bus->received_msg.
+ *
+ * @param bus not NULL
+ * @param buf not NULL unless \p buf_len is 0, back-to-back packed frames
+ * @param buf_len bytes in \p buf
+ * @param src_node can be NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_MSG on \p buf being NULL with a non-zero \p buf_len
+ * - #VCAN_INVALID_PACKED on a truncated or invalid frame: the frames before
+ *   it have already been transmitted
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_tx_packed(vcan_bus_t* bus,
+                                   const uint8_t* buf,
+                                   size_t buf_len,
+                                   const vcan_node_t* src_node);
+
+/**
+ * Like vcan_rx_poll() but dequeues into compact classic frames.
+ *
+ * Stops before the first message longer than #VCAN_CLASSIC_DATA_MAX_LEN,
+ * which stays queued and can be obtained with vcan_rx_poll().
+ *
+ * @param node can be NULL
+ * @param frames not NULL, destination of at least \p max frames
+ * @param max max amount of frames to dequeue
+ * @return the amount of dequeued frames
+ */
+VCAN_API size_t vcan_rx_poll_frame8(vcan_node_t* node,
+                                    vcan_frame8_t* frames,
+                                    size_t max);
+
+/**
+ * Like vcan_rx_poll() but dequeues as many messages as fit into the buffer,
+ * as back-to-back packed frames. See vcan_pack().
+ *
+ * @param node can be NULL
+ * @param buf not NULL, destination
+ * @param buf_len available bytes in \p buf
+ * @return the amount of bytes written
+ */
+VCAN_API size_t vcan_rx_poll_packed(vcan_node_t* node,
+                                    uint8_t* buf,
+                                    size_t buf_len);
+
+/**
+ * Sets the timestamp source of the bus, such as a monotonic clock in
+ * nanoseconds or a CPU cycle counter.
+ *
+ * With `VCAN_STATS` it measures the time spent in the callbacks of each node,
+ * with #VCAN_BUS_TIMESTAMPS it timestamps the messages, see #vcan_meta_t.
+ *
+ * @param bus not NULL
+ * @param now returns the current time in any unit, can be NULL to clear it
+ * @param ctx passed to \p now, can be NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_set_clock(vcan_bus_t* bus, uint64_t (* now)(void* ctx),
+                                   void* ctx);
+
+/**
+ * Reads the bus clock for a timestamp of the metadata, see
+ * #VCAN_BUS_TIMESTAMPS.
+ *
+ * Called from any thread transmitting on the bus, such as the ones of
+ * vcan_mt_tx(), so the clock must be thread-safe in that case.
+ *
+ * @param bus can be NULL
+ * @return the bus clock, 0 on \p bus being NULL, without a clock or without
+ * #VCAN_BUS_TIMESTAMPS
+ */
+VCAN_API uint64_t vcan_timestamp(const vcan_bus_t* bus);
+
+/**
+ * Sets the hooks called at the tracepoints of the bus.
+ *
+ * They are called only when VCAN is compiled with `VCAN_PROBES`, on the
+ * thread delivering the messages, or on the workers for \p dispatch with
+ * vcan_par.h. Without `VCAN_PROBES` the tracepoints cost nothing.
+ *
+ * @param bus not NULL
+ * @param probes hooks valid while set, NULL to clear them
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_set_probes(vcan_bus_t* bus,
+                                    const vcan_probes_t* probes);
+
+/**
+ * Empties the histogram.
+ *
+ * @param hist not NULL
+ * @return
+ * - #VCAN_NULL_STORAGE on \p hist being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_hist_init(vcan_hist_t* hist);
+
+/**
+ * Sets the histogram recording the duration of each fan-out of the bus,
+ * from the start of the delivery to the return of the last callback, in
+ * units of the bus clock, see vcan_set_clock(). A burst counts as one
+ * fan-out.
+ *
+ * It costs two clock readings per transmission; nothing is recorded
+ * without a clock.
+ *
+ * @param bus not NULL
+ * @param hist initialised, valid while set, NULL to stop recording. Must
+ *        not be shared with buses transmitting on other threads.
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_set_histogram(vcan_bus_t* bus, vcan_hist_t* hist);
+
+/**
+ * Records one value, e.g. a latency computed from #vcan_meta_t.
+ *
+ * @param hist not NULL, initialised
+ * @param value the value
+ */
+VCAN_API void vcan_hist_record(vcan_hist_t* hist, uint64_t value);
+
+/**
+ * Estimates a quantile of the recorded values.
+ *
+ * @param hist not NULL, initialised
+ * @param quantile between 0 and 1, e.g. 0.99 for the 99th percentile
+ * @return the upper bound of the bucket holding the quantile, never more
+ * than the largest value recorded, 0 without values
+ */
+VCAN_API uint64_t vcan_hist_quantile(const vcan_hist_t* hist,
+                                     double quantile);
+
+/**
+ * Dumps the histogram as text: a first line with the amount of values, the
+ * largest one and the 50th, 99th and 99.9th percentiles, then one line per
+ * non-empty bucket with its lowest value, highest value and amount of
+ * values.
+ *
+ * @param hist not NULL, initialised
+ * @param buf not NULL, destination, always NUL-terminated
+ * @param buf_len available bytes in \p buf, not 0
+ * @return the amount of characters written, excluding the NUL terminator;
+ * the lines not fitting are left out
+ */
+VCAN_API size_t vcan_hist_dump(const vcan_hist_t* hist,
+                               char* buf,
+                               size_t buf_len);
+
+/**
+ * Reads the counters of the bus.
+ *
+ * The counters exist only when VCAN is compiled with `VCAN_STATS` defined,
+ * otherwise they all read as 0. They are updated with relaxed atomics, so
+ * they can be read from any thread while the bus transmits: each counter is
+ * exact, but they are not a snapshot of the same instant.
+ *
+ * @param bus not NULL
+ * @param stats not NULL, destination
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_STORAGE on \p stats being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_get_stats(const vcan_bus_t* bus,
+                                   vcan_bus_stats_t* stats);
+
+/**
+ * Reads the counters of the node, accumulated across all buses it has been
+ * connected to. Like vcan_get_stats().
+ *
+ * @param node not NULL
+ * @param stats not NULL, destination
+ * @return
+ * - #VCAN_NULL_NODE on \p node being NULL
+ * - #VCAN_NULL_STORAGE on \p stats being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_get_node_stats(const vcan_node_t* node,
+                                        vcan_node_stats_t* stats);
+
+/**
+ * Sets the transmit hook of the bus, which takes over the messages
+ * transmitted with vcan_tx(), vcan_tx_ref(), vcan_tx_burst(),
+ * vcan_tx_frame8() and vcan_tx_packed() instead of delivering them.
+ *
+ * It is the extension point of the components altering when or how the
+ * messages reach the nodes, such as an arbitration simulation queueing
+ * them. The hook must copy the messages it keeps and delivers them later
+ * with vcan_tx_direct(). Transmissions from bursts stop at the first hook
+ * call not returning #VCAN_OK, whose result is returned.
+ *
+ * @param bus not NULL
+ * @param hook can be NULL for the direct delivery
+ * @param ctx passed to \p hook, can be NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_set_tx_hook(vcan_bus_t* bus,
+                                     vcan_tx_hook_t hook,
+                                     void* ctx);
+
+/**
+ * Like vcan_tx() but bypasses the transmit hook, delivering the message to
+ * the nodes immediately. Meant for the implementations of the hooks.
  *
  * @param bus not NULL
  * @param msg not NULL
  * @param src_node can be NULL
+ * @return the same as vcan_tx()
+ */
+VCAN_API vcan_err_t vcan_tx_direct(vcan_bus_t* bus,
+                                   const vcan_msg_t* msg,
+                                   const vcan_node_t* src_node);
+
+/**
+ * Enables the deferred-TX mode of the bus, for callbacks that transmit on
+ * the bus they receive from, e.g. request/response nodes.
+ *
+ * Without it, such a transmission is delivered recursively from within
+ * the callback: it overwrites \p bus->received_msg while the remaining
+ * nodes are still to be notified of the previous message and the stack
+ * grows with each response of a chain. In deferred-TX mode, messages
+ * transmitted on the bus while its nodes are being notified are copied
+ * into the FIFO instead and delivered in transmission order once the
+ * current fan-out has finished, iteratively and without allocations.
+ *
+ * The transmitting functions then return before the message reaches the
+ * nodes. A full FIFO makes them return #VCAN_QUEUE_FULL, enqueueing
+ * nothing: a burst is enqueued entirely or not at all. Messages taken over
+ * by a transmit hook are not deferred, the hook already decides when they
+ * are delivered.
+ *
+ * Must not be called from within a callback of the bus.
+ *
+ * @param bus not NULL
+ * @param fifo storage of \p capacity messages, valid while set. NULL
+ *        disables the deferred-TX mode.
+ * @param capacity max amount of deferred messages, not 0 unless \p fifo is
+ *        NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_INVALID_CAPACITY on \p capacity being 0 with a non-NULL \p fifo
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_set_deferred(vcan_bus_t* bus,
+                                      vcan_deferred_t* fifo,
+                                      size_t capacity);
+
+/**
+ * Sets the fan-out hook of the bus, which delivers each transmitted message
+ * to the connected nodes instead of the serial loop over the node table.
+ *
+ * It is the extension point of the components delivering in a different
+ * way, such as in parallel on multiple threads. The hook must deliver the
+ * message with vcan_tx_to() to every node of the node table it obtains
+ * except \p src_node before returning. The transmission counters and the
+ * deferred-TX mode are handled by the bus around the hook.
+ *
+ * With a hook, vcan_tx_burst() delivers the burst one message at a time,
+ * without calling the burst callbacks.
+ *
+ * @param bus not NULL
+ * @param hook can be NULL for the serial delivery
+ * @param ctx passed to \p hook, can be NULL
  * @return
  * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_set_fanout(vcan_bus_t* bus,
+                                    vcan_fanout_hook_t hook,
+                                    void* ctx);
+
+/**
+ * Delivers the message to one node as the bus does: only if its acceptance
+ * filters accept the CAN ID, into its receive queue or to its callback.
+ * Meant for the implementations of the fan-out hooks.
+ *
+ * Can be called from multiple threads at once for different nodes.
+ *
+ * @param bus not NULL, the bus the node is connected to
+ * @param node not NULL
+ * @param msg not NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_NODE on \p node being NULL
  * - #VCAN_NULL_MSG on \p msg being NULL
+ * - #VCAN_OK otherwise, also when the filters reject the message
+ */
+VCAN_API vcan_err_t vcan_tx_to(vcan_bus_t* bus,
+                               vcan_node_t* node,
+                               const vcan_msg_t* msg);
+
+/**
+ * Gives the bus a pool of frames, e.g. right after its initialisation.
+ *
+ * With a pool, each transmission copies the message once into a frame,
+ * unless it is transmitted from a frame with vcan_tx_shared(), and the
+ * receive queues in shared mode hold references to it instead of copies.
+ * The callbacks receive the message from the frame as well. When the pool
+ * is exhausted, the callbacks still receive the message while the shared
+ * queues drop it, counting an overflow.
+ *
+ * Must not be called while frames of the previous pool are in use.
+ *
+ * @param bus not NULL
+ * @param frames not NULL, storage of \p capacity frames, valid while set
+ * @param capacity amount of frames, between 1 and `UINT32_MAX - 1`
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_STORAGE on \p frames being NULL
+ * - #VCAN_INVALID_CAPACITY on \p capacity out of range
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_set_pool(vcan_bus_t* bus,
+                                  vcan_frame_t* frames,
+                                  size_t capacity);
+
+/**
+ * Allocates a frame from the pool of the bus, with one reference held by
+ * the caller.
+ *
+ * Must be called from the thread transmitting on the bus.
+ *
+ * @param bus not NULL, with a pool
+ * @return the frame, NULL when the pool is exhausted or missing
+ */
+VCAN_API vcan_frame_t* vcan_frame_alloc(vcan_bus_t* bus);
+
+/**
+ * Adds a reference to the frame. Can be called from any thread holding a
+ * reference already.
+ *
+ * @param frame can be NULL, doing nothing
+ */
+VCAN_API void vcan_frame_retain(vcan_frame_t* frame);
+
+/**
+ * Drops a reference to the frame, returning it into its pool with the last
+ * one. Can be called from any thread.
+ *
+ * @param frame can be NULL, doing nothing
+ */
+VCAN_API void vcan_frame_release(vcan_frame_t* frame);
+
+/**
+ * Transmits a frame from the pool of the bus without copying its message.
+ *
+ * Like vcan_tx_ref(), the callbacks obtain a pointer to the message of the
+ * frame; the receive queues in shared mode take a reference to the frame.
+ * The caller keeps its own reference and releases it when it wants.
+ *
+ * @param bus not NULL
+ * @param frame not NULL, allocated from the pool of \p bus
+ * @param src_node the transmitting node, can be NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_MSG on \p frame being NULL
+ * - the result of the transmit hook, if any, see vcan_set_tx_hook()
+ * - #VCAN_QUEUE_FULL on a full FIFO in deferred-TX mode
  * - #VCAN_OK otherwise
  */
-vcan_err_t vcan_tx(vcan_bus_t* bus,
-                   const vcan_msg_t* msg,
-                   const vcan_node_t* src_node);
+VCAN_API vcan_err_t vcan_tx_shared(vcan_bus_t* bus,
+                                   vcan_frame_t* frame,
+                                   const vcan_node_t* src_node);
+
+/**
+ * Reads the counters of the frame pool of the bus, including its high-water
+ * mark. Can be called from any thread.
+ *
+ * @param bus not NULL
+ * @param stats not NULL, filled with the counters, all 0 without a pool
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_STORAGE on \p stats being NULL
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_get_pool_stats(const vcan_bus_t* bus,
+                                        vcan_pool_stats_t* stats);
+
+/** First 4 bytes of a bus snapshot, `"VCS1"` on little-endian hosts. */
+#define VCAN_SNAPSHOT_MAGIC 0x31534356UL
+
+/**
+ * Serialises the state of the bus into a flat buffer, to be restored with
+ * vcan_restore() instead of reaching the same state again.
+ *
+ * The snapshot holds the connected nodes by their \p id, in delivery order,
+ * the bus flags and sequence number, the statistics counters and, for each
+ * node, its metadata, its statistics and the content of its receive queue
+ * with the overflow arena and the metadata. It holds no pointers: it can be
+ * copied, written to a file and mapped back at any address, by a process
+ * running the same build on a host with the same endianness.
+ *
+ * Callbacks, filters, hooks, clock, pools and the storage of the queues are
+ * not part of it, they are set up by the caller as usual. The bus must be
+ * quiescent: no transmission in progress and no consumer polling a queue.
+ *
+ * @param bus not NULL
+ * @param buf destination, can be NULL to only obtain the size
+ * @param buf_len available bytes in \p buf
+ * @param len not NULL, set to the size of the snapshot, also when it does
+ *        not fit
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_STORAGE on \p len being NULL
+ * - #VCAN_INVALID_SNAPSHOT when called during a transmission
+ * - #VCAN_TOO_LONG on the snapshot not fitting into \p buf_len bytes
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_snapshot(const vcan_bus_t* bus,
+                                  void* buf,
+                                  size_t buf_len,
+                                  size_t* len);
+
+/**
+ * Brings the bus back to the state serialised by vcan_snapshot().
+ *
+ * The nodes currently connected are disconnected and the ones of the
+ * snapshot connected in their order, re-bound by their \p id among
+ * \p nodes. Their receive queues are emptied and refilled: they must have
+ * enough capacity and, for the ones in shared mode, the bus a frame pool.
+ *
+ * The snapshot is fully checked before touching anything, so on
+ * #VCAN_INVALID_SNAPSHOT, #VCAN_NODE_NOT_FOUND, #VCAN_TOO_MANY_CONNECTED
+ * and #VCAN_INVALID_CAPACITY the bus is left as it was. Only an exhausted
+ * frame pool or a failing vcan_connect() can leave it half restored.
+ *
+ * @param bus not NULL, initialised, quiescent
+ * @param buf not NULL, snapshot
+ * @param buf_len bytes of the snapshot
+ * @param nodes candidates to connect, with distinct IDs, can be NULL if
+ *        \p nodes_len is 0
+ * @param nodes_len amount of \p nodes
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_STORAGE on \p buf being NULL
+ * - #VCAN_INVALID_SNAPSHOT on the snapshot being invalid, having a queued
+ *   node without a receive queue or two nodes re-bound to the same one of
+ *   \p nodes
+ * - #VCAN_NODE_NOT_FOUND on a node of the snapshot missing in \p nodes
+ * - #VCAN_TOO_MANY_CONNECTED on the node table being too small
+ * - #VCAN_INVALID_CAPACITY on a receive queue being too small or, for a
+ *   queue in shared mode with messages, the bus having no frame pool
+ * - #VCAN_QUEUE_FULL on the frame pool being exhausted while refilling a
+ *   queue in shared mode
+ * - the result of vcan_connect() on failing to connect a node
+ * - #VCAN_OK otherwise
+ */
+VCAN_API vcan_err_t vcan_restore(vcan_bus_t* bus,
+                                 const void* buf,
+                                 size_t buf_len,
+                                 vcan_node_t* const* nodes,
+                                 size_t nodes_len);
 
 #ifdef __cplusplus
 }
 #endif
 
+#ifdef VCAN_HEADER_ONLY
+#include "../src/vcan.c"
+#endif
+
 #endif  /* VCAN_H */
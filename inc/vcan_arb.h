@@ -0,0 +1,229 @@
+/**
+ * @file
+ *
+ * VCAN arbitration simulation.
+ *
+ * A #vcan_arb_t installs itself as transmit hook of a bus: vcan_tx() and
+ * the other transmission functions then only submit the messages to a
+ * priority queue instead of delivering them. A virtual clock, moved forward
+ * with vcan_arb_advance(), drains the queue like a real CAN bus: whenever
+ * the bus is idle, the pending message with the lowest ID wins the
+ * arbitration and occupies the bus for its wire time, computed from its
+ * length and the bitrates, and is delivered to the nodes when its
+ * transmission completes. Messages with the same ID are sent in submission
+ * order.
+ *
+ * No bit-level simulation takes place. The wire time assumes the worst-case
+ * bit stuffing. Messages with IDs above 0x7FF are considered extended
+ * frames, messages longer than 8 bytes CAN FD frames; the ID values are
+ * compared as they are, without distinguishing the frame formats.
+ *
+ * The queue is a binary heap in caller-provided storage, so submitting and
+ * arbitrating are O(log N) for N pending messages.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_ARB_H
+#define VCAN_ARB_H
+
+#include "vcan.h"
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Heap key of a pending message. For internal use only. */
+typedef struct
+{
+    /** CAN ID: the lower, the higher the priority. */
+    uint32_t id;
+
+    /** Index of the pending message in the pool of frames. */
+    uint32_t frame;
+
+    /** Submission order, among messages with the same ID. */
+    uint64_t seq;
+} vcan_arb_key_t;
+
+/** Pending message. For internal use only. */
+typedef struct
+{
+    /** The submitted message. */
+    vcan_msg_t msg;
+
+    /** The transmitting node to exclude from the reception. */
+    const vcan_node_t* src_node;
+
+    /** Next free frame of the pool, when this one is free. */
+    uint32_t next_free;
+} vcan_arb_frame_t;
+
+/**
+ * Storage for one pending message, provided by the caller as an array to
+ * vcan_arb_init(). Do not access its fields directly.
+ */
+typedef struct
+{
+    /** Heap key at this position. */
+    vcan_arb_key_t key;
+
+    /** Frame of the pool at this position. */
+    vcan_arb_frame_t frame;
+} vcan_arb_slot_t;
+
+/**
+ * Arbitration simulation of one bus.
+ *
+ * Initialise it with vcan_arb_init(), do not access its fields directly.
+ */
+typedef struct
+{
+    /** Bus whose transmissions are arbitrated. */
+    vcan_bus_t* bus;
+
+    /** Caller-provided storage of the heap and of the pool of frames. */
+    vcan_arb_slot_t* slots;
+
+    /** Max amount of pending messages. */
+    uint32_t capacity;
+
+    /** Amount of keys in the heap, excluding the message on the wire. */
+    uint32_t len;
+
+    /** First free frame of the pool, \p capacity when none. */
+    uint32_t free_head;
+
+    /** Frame being transmitted when \p in_flight. */
+    uint32_t wire_frame;
+
+    /** True while a message occupies the bus. */
+    bool in_flight;
+
+    /** Bitrate of the arbitration phase and of classic frames, in bit/s. */
+    uint32_t nominal_bitrate;
+
+    /** Bitrate of the data phase of CAN FD frames, in bit/s. */
+    uint32_t data_bitrate;
+
+    /** Submission counter, source of #vcan_arb_key_t.seq. */
+    uint64_t next_seq;
+
+    /** The virtual clock, in nanoseconds. */
+    uint64_t now;
+
+    /** End of the transmission of the message on the wire. */
+    uint64_t busy_until;
+
+    /** Total time the bus has been occupied, in nanoseconds. */
+    uint64_t busy_time;
+} vcan_arb_t;
+
+/**
+ * Time a message occupies the bus, in nanoseconds, including the
+ * interframe space and assuming the worst-case bit stuffing.
+ *
+ * Up to 8 bytes the message is a classic CAN frame at the nominal bitrate.
+ * Above, it is a CAN FD frame with the payload padded to the next valid
+ * length, whose data phase runs at the data bitrate.
+ *
+ * @param nominal_bitrate bitrate of the arbitration phase in bit/s, not 0
+ * @param data_bitrate bitrate of the data phase in bit/s, 0 to use the
+ *        nominal one (no bitrate switching)
+ * @param msg not NULL
+ * @return the wire time, 0 on invalid arguments
+ */
+uint64_t vcan_arb_wire_time(uint32_t nominal_bitrate,
+                            uint32_t data_bitrate,
+                            const vcan_msg_t* msg);
+
+/**
+ * Initialises the arbitration and installs it as transmit hook of the bus,
+ * with the virtual clock at 0.
+ *
+ * @param arb not NULL
+ * @param bus not NULL, initialised
+ * @param slots not NULL, array of \p capacity slots, valid while in use
+ * @param capacity max amount of pending messages, not 0. Further
+ *        transmissions fail with #VCAN_QUEUE_FULL.
+ * @param nominal_bitrate bitrate of the arbitration phase in bit/s, not 0
+ * @param data_bitrate bitrate of the CAN FD data phase in bit/s, 0 to use
+ *        the nominal one
+ * @return
+ * - #VCAN_NULL_STORAGE on \p arb or \p slots being NULL
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_INVALID_CAPACITY on \p capacity or \p nominal_bitrate being 0, or
+ *   \p capacity exceeding UINT32_MAX
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_arb_init(vcan_arb_t* arb,
+                         vcan_bus_t* bus,
+                         vcan_arb_slot_t* slots,
+                         size_t capacity,
+                         uint32_t nominal_bitrate,
+                         uint32_t data_bitrate);
+
+/**
+ * Removes the arbitration from the bus, which delivers immediately again.
+ * The pending messages are discarded.
+ *
+ * @param arb not NULL, initialised
+ * @return
+ * - #VCAN_NULL_STORAGE on \p arb being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_arb_deinit(vcan_arb_t* arb);
+
+/**
+ * Moves the virtual clock forward by \p dt, delivering every message whose
+ * transmission completes until then.
+ *
+ * While delivering a message, the clock reads the end of its transmission.
+ * Messages submitted by the callbacks take part in the next arbitration,
+ * which starts as soon as the delivered message leaves the bus.
+ *
+ * @param arb not NULL, initialised
+ * @param dt time to advance by in nanoseconds, 0 only starts the
+ *        transmission of the pending messages
+ * @return
+ * - #VCAN_NULL_STORAGE on \p arb being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_arb_advance(vcan_arb_t* arb, uint64_t dt);
+
+/**
+ * The virtual clock of the arbitration passed as \p ctx, with the signature
+ * of a bus clock, see vcan_set_clock().
+ *
+ * @param ctx not NULL, the arbitration
+ * @return the current virtual time in nanoseconds
+ */
+uint64_t vcan_arb_clock(void* ctx);
+
+/**
+ * Amount of messages submitted and not yet delivered, including the one on
+ * the wire.
+ *
+ * @param arb not NULL
+ * @return the pending messages
+ */
+size_t vcan_arb_pending(const vcan_arb_t* arb);
+
+/**
+ * Total time the bus has been occupied by transmissions, in nanoseconds:
+ * divided by the elapsed virtual time, it gives the bus load.
+ *
+ * @param arb not NULL
+ * @return the busy time
+ */
+uint64_t vcan_arb_busy_time(const vcan_arb_t* arb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* VCAN_ARB_H */
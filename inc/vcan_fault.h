@@ -0,0 +1,283 @@
+/**
+ * @file
+ *
+ * VCAN fault injection.
+ *
+ * A #vcan_fault_t installs itself as transmit hook of a bus and injects
+ * deterministic transmission errors into the traffic according to a table
+ * of rules: dropped frames, bit flips in the payload, delayed delivery,
+ * error frames and bus-off of specific nodes. Each rule applies to one CAN
+ * ID or to all of them, to the whole frame or to its reception by one
+ * node, and triggers with a probability drawn from a seeded pseudo-random
+ * generator: the same seed and the same traffic give the same faults.
+ *
+ * Frame-level rules (#vcan_fault_rule_t.node being NULL) act on the
+ * transmission: #VCAN_FAULT_DROP delivers it to nobody,
+ * #VCAN_FAULT_BIT_FLIP corrupts the payload delivered to everybody,
+ * #VCAN_FAULT_DELAY holds it back and #VCAN_FAULT_ERROR_FRAME replaces it
+ * with an error frame. Node-level rules act on the delivery to their node:
+ * #VCAN_FAULT_DROP and #VCAN_FAULT_BIT_FLIP only for that node,
+ * #VCAN_FAULT_BUS_OFF disconnecting it logically from the bus. A node-level
+ * rule installs the fault injection as fan-out hook of the bus as well.
+ *
+ * The rules are compiled by vcan_fault_init() into a summary bitmap of the
+ * CAN IDs they apply to: a message without rules costs the hook call and
+ * one bit test before being delivered as usual, so the fault injection can
+ * stay installed. Without it, being the transmit hook NULL, nothing is
+ * evaluated at all.
+ *
+ * The delays and the bus-off periods are measured with the bus clock set
+ * with vcan_set_clock(), which reads 0 without one.
+ *
+ * The transmit and fan-out hooks are taken, so the fault injection cannot
+ * be combined with vcan_arb.h or vcan_par.h on the same bus.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_FAULT_H
+#define VCAN_FAULT_H
+
+#include "vcan.h"
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** #vcan_fault_rule_t.id of the rules applying to every CAN ID. */
+#define VCAN_FAULT_ANY_ID UINT32_MAX
+
+/** #vcan_fault_rule_t.ppm of the rules always triggering. */
+#define VCAN_FAULT_ALWAYS 1000000U
+
+/**
+ * CAN ID of the error frames delivered to the nodes in place of the
+ * transmissions destroyed by #VCAN_FAULT_ERROR_FRAME, with no payload. The
+ * same bit as the `CAN_ERR_FLAG` of SocketCAN, above the 29 bits of the
+ * extended IDs.
+ */
+#define VCAN_FAULT_ERROR_ID 0x20000000U
+
+/** Bits of the summary bitmap of the CAN IDs with rules. */
+#define VCAN_FAULT_SUMMARY_BITS 256U
+
+/** Kind of fault injected by a #vcan_fault_rule_t. */
+typedef enum
+{
+    /** The message is not delivered: to nobody or to the node of the
+     * rule. */
+            VCAN_FAULT_DROP = 0,
+    /** #vcan_fault_rule_t.bits random bits of the payload are inverted:
+     * in the message delivered to everybody or only to the node of the
+     * rule. Messages without payload are not affected. */
+            VCAN_FAULT_BIT_FLIP = 1,
+    /** The message is delivered #vcan_fault_rule_t.duration bus clock
+     * units later, see vcan_fault_release(). Frame-level only. */
+            VCAN_FAULT_DELAY = 2,
+    /** The message is destroyed by an error frame: the nodes receive a
+     * message with the #VCAN_FAULT_ERROR_ID instead and the transmission
+     * returns #VCAN_ERROR_FRAME. Frame-level only. */
+            VCAN_FAULT_ERROR_FRAME = 3,
+    /** The node of the rule goes bus-off, for #vcan_fault_rule_t.duration
+     * bus clock units or until vcan_fault_recover() when 0: it receives
+     * nothing and its transmissions fail with #VCAN_BUS_OFF. Node-level
+     * only, triggered by the messages delivered to the node. */
+            VCAN_FAULT_BUS_OFF = 4,
+} vcan_fault_kind_t;
+
+/**
+ * Fault injection rule, provided by the caller as a table sorted by
+ * \p id to vcan_fault_init().
+ *
+ * The rules with the same ID are evaluated in table order, followed by the
+ * ones of #VCAN_FAULT_ANY_ID, which sort last. The evaluation stops at the
+ * first triggered rule not letting the message through, e.g. a drop.
+ */
+typedef struct
+{
+    /** CAN ID the rule applies to, or #VCAN_FAULT_ANY_ID. */
+    uint32_t id;
+
+    /** What happens when the rule triggers. */
+    vcan_fault_kind_t kind;
+
+    /** Node whose reception the rule applies to, NULL for the whole
+     * frame. */
+    const vcan_node_t* node;
+
+    /** Probability of triggering for each message, in parts per million up
+     * to #VCAN_FAULT_ALWAYS. */
+    uint32_t ppm;
+
+    /** Bits inverted by #VCAN_FAULT_BIT_FLIP, 0 counts as 1. */
+    uint32_t bits;
+
+    /** Bus clock units of #VCAN_FAULT_DELAY and #VCAN_FAULT_BUS_OFF. */
+    uint64_t duration;
+
+    /** Times the rule triggered. Set to 0 by vcan_fault_init(). */
+    uint64_t hits;
+
+    /** Bus clock at which the bus-off ends, when \p off and \p duration is
+     * not 0. For internal use only. */
+    uint64_t off_until;
+
+    /** True while the node of a #VCAN_FAULT_BUS_OFF rule is bus-off. For
+     * internal use only. */
+    bool off;
+} vcan_fault_rule_t;
+
+/**
+ * Storage for one delayed message, provided by the caller as an array to
+ * vcan_fault_init(). Do not access its fields directly.
+ */
+typedef struct
+{
+    /** The delayed message. */
+    vcan_msg_t msg;
+
+    /** The transmitting node. */
+    const vcan_node_t* src_node;
+
+    /** Bus clock at which the message is delivered. */
+    uint64_t due;
+} vcan_fault_delayed_t;
+
+/**
+ * Fault injection into one bus.
+ *
+ * Initialise it with vcan_fault_init(), do not access its fields directly.
+ */
+typedef struct
+{
+    /** Bus the faults are injected into. */
+    vcan_bus_t* bus;
+
+    /** Caller-provided rules, sorted by ID. */
+    vcan_fault_rule_t* rules;
+
+    /** Amount of rules. */
+    size_t rules_len;
+
+    /** Position of the first rule of #VCAN_FAULT_ANY_ID. */
+    size_t any_first;
+
+    /**
+     * CAN IDs with frame-level rules, by their lowest 8 bits, all of them
+     * with frame-level rules for any ID. A clear bit skips the evaluation.
+     */
+    uint64_t frame_ids[VCAN_FAULT_SUMMARY_BITS / 64U];
+
+    /** CAN IDs with node-level rules, as \p frame_ids. */
+    uint64_t node_ids[VCAN_FAULT_SUMMARY_BITS / 64U];
+
+    /** Amount of bus-off rules in force. */
+    size_t offs;
+
+    /** Caller-provided storage of the delayed messages, in the order they
+     * were delayed. Can be NULL. */
+    vcan_fault_delayed_t* delayed;
+
+    /** Max amount of delayed messages. */
+    size_t delayed_capacity;
+
+    /** Amount of delayed messages. */
+    size_t delayed_len;
+
+    /** True while the due delayed messages are delivered. */
+    bool releasing;
+
+    /** State of the pseudo-random generator. */
+    uint64_t random;
+} vcan_fault_t;
+
+/**
+ * Initialises the fault injection and installs it as transmit hook of the
+ * bus and, with node-level rules, as fan-out hook.
+ *
+ * @param fault not NULL
+ * @param bus not NULL, initialised
+ * @param rules not NULL, array of \p rules_len rules sorted by ID, valid
+ *        while in use
+ * @param rules_len amount of rules
+ * @param delayed storage of \p delayed_capacity delayed messages, valid
+ *        while in use. Can be NULL without #VCAN_FAULT_DELAY rules.
+ * @param delayed_capacity max amount of delayed messages. Further delayed
+ *        transmissions fail with #VCAN_QUEUE_FULL.
+ * @param seed of the pseudo-random generator
+ * @return
+ * - #VCAN_NULL_STORAGE on \p fault or \p rules being NULL, or on
+ *   \p delayed being NULL with #VCAN_FAULT_DELAY rules
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_INVALID_CAPACITY on \p delayed_capacity being 0 with
+ *   #VCAN_FAULT_DELAY rules
+ * - #VCAN_UNSORTED_FILTER on the rules not being sorted by ID
+ * - #VCAN_INVALID_FAULT on a rule with an invalid kind, a probability above
+ *   #VCAN_FAULT_ALWAYS, a node for a frame-level only kind or none for
+ *   #VCAN_FAULT_BUS_OFF
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_fault_init(vcan_fault_t* fault,
+                           vcan_bus_t* bus,
+                           vcan_fault_rule_t* rules,
+                           size_t rules_len,
+                           vcan_fault_delayed_t* delayed,
+                           size_t delayed_capacity,
+                           uint64_t seed);
+
+/**
+ * Removes the fault injection from the bus, which delivers every message
+ * again. The delayed messages are discarded, the bus-off nodes recovered.
+ *
+ * @param fault not NULL, initialised
+ * @return
+ * - #VCAN_NULL_STORAGE on \p fault being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_fault_deinit(vcan_fault_t* fault);
+
+/**
+ * Delivers the delayed messages due by the current bus clock, in order of
+ * due time, and ends the bus-off periods that are over.
+ *
+ * Each transmission on the bus does it first anyway; call it when no
+ * transmission happens, e.g. after advancing the clock.
+ *
+ * @param fault not NULL, initialised
+ * @return
+ * - #VCAN_NULL_STORAGE on \p fault being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_fault_release(vcan_fault_t* fault);
+
+/**
+ * Ends the bus-off state of the node, whatever its duration.
+ *
+ * @param fault not NULL, initialised
+ * @param node not NULL
+ * @return
+ * - #VCAN_NULL_STORAGE on \p fault being NULL
+ * - #VCAN_NULL_NODE on \p node being NULL
+ * - #VCAN_OK otherwise, also when not bus-off
+ */
+vcan_err_t vcan_fault_recover(vcan_fault_t* fault, const vcan_node_t* node);
+
+/**
+ * Whether the node is bus-off.
+ *
+ * @param fault can be NULL
+ * @param node can be NULL
+ * @return false on \p fault or \p node being NULL
+ */
+bool vcan_fault_is_bus_off(const vcan_fault_t* fault,
+                           const vcan_node_t* node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* VCAN_FAULT_H */
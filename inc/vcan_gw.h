@@ -0,0 +1,193 @@
+/**
+ * @file
+ *
+ * VCAN gateway between multiple buses.
+ *
+ * A #vcan_gw_t connects one port node to each of its buses and forwards the
+ * messages received by the ports according to a routing table, sorted by
+ * source bus and CAN ID, where each route lists the destination buses and
+ * optionally a new CAN ID for the forwarded copy.
+ *
+ * Forwarded messages are copied once into a FIFO owned by the gateway and
+ * transmitted from there by reference: a message routed while the gateway
+ * is already forwarding, e.g. because it came back through another
+ * gateway, is only enqueued, so the gateways never call each other
+ * recursively. Each enqueued message carries the amount of gateway hops
+ * that caused it; exceeding #VCAN_GW_MAX_HOPS drops it, breaking routing
+ * loops.
+ *
+ * All buses of a gateway must be transmitted on from the same thread.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_GW_H
+#define VCAN_GW_H
+
+#include "vcan.h"
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Max amount of buses of one gateway: one bit of a destination mask each. */
+#define VCAN_GW_MAX_BUSES 32U
+
+#ifndef VCAN_GW_MAX_HOPS
+/** Max amount of forwardings a message can cause before being dropped. */
+#define VCAN_GW_MAX_HOPS 8U
+#endif
+
+/** #vcan_gw_route_t.new_id keeping the CAN ID of the forwarded message. */
+#define VCAN_GW_SAME_ID UINT32_MAX
+
+/** Route of the messages with one CAN ID received on one bus. */
+typedef struct
+{
+    /** Index of the bus the message is received on. */
+    uint32_t src_bus;
+
+    /** CAN ID of the received message. */
+    uint32_t id;
+
+    /** Bit i set forwards the message to the bus with index i. The source
+     * bus is always excluded. */
+    uint32_t dst_mask;
+
+    /** CAN ID of the forwarded copy, #VCAN_GW_SAME_ID to keep it. */
+    uint32_t new_id;
+} vcan_gw_route_t;
+
+/** Message waiting in the gateway FIFO. For internal use only. */
+typedef struct
+{
+    /** The forwarded copy. */
+    vcan_msg_t msg;
+
+    /** Buses to forward it to. */
+    uint32_t dst_mask;
+
+    /** Forwardings that led to this message, including this one. */
+    uint32_t hops;
+
+    /** Transmission time on the first bus, see #vcan_meta_t.tx_time. */
+    uint64_t tx_time;
+} vcan_gw_pending_t;
+
+struct vcan_gw;
+
+/** Node of the gateway on one bus. For internal use only. */
+typedef struct
+{
+    /** Connected to the bus. */
+    vcan_node_t node;
+
+    /** The gateway it belongs to. */
+    struct vcan_gw* gw;
+
+    /** Index of the bus. */
+    uint32_t bus_index;
+} vcan_gw_port_t;
+
+/**
+ * Gateway between multiple buses.
+ *
+ * Initialise it with vcan_gw_init(), do not access its fields directly.
+ */
+typedef struct vcan_gw
+{
+    /** One node per bus. */
+    vcan_gw_port_t ports[VCAN_GW_MAX_BUSES];
+
+    /** The connected buses. */
+    vcan_bus_t** buses;
+
+    /** Amount of \p buses. */
+    uint32_t bus_count;
+
+    /** Routing table, sorted by source bus and CAN ID. */
+    const vcan_gw_route_t* routes;
+
+    /** Amount of \p routes. */
+    size_t routes_len;
+
+    /** Caller-provided ring of messages waiting to be forwarded. */
+    vcan_gw_pending_t* fifo;
+
+    /** Max amount of messages in \p fifo. */
+    size_t capacity;
+
+    /** Position of the oldest message in \p fifo. */
+    size_t head;
+
+    /** Amount of messages in \p fifo. */
+    size_t len;
+
+    /** Hops of the message being forwarded, 0 when forwarding nothing. */
+    uint32_t hops;
+
+    /** True while the FIFO is being emptied. */
+    bool draining;
+
+    /** Messages dropped for a full FIFO or too many hops. */
+    uint64_t dropped;
+} vcan_gw_t;
+
+/**
+ * Initialises the gateway and connects its ports to every bus.
+ *
+ * @param gw not NULL
+ * @param buses not NULL, array of \p bus_count initialised buses, valid
+ *        while the gateway is in use
+ * @param bus_count between 1 and #VCAN_GW_MAX_BUSES
+ * @param routes routing table, sorted by \p src_bus and then by \p id, both
+ *        strictly ascending, valid while the gateway is in use. Can be NULL
+ *        if \p routes_len is 0.
+ * @param routes_len amount of \p routes
+ * @param fifo not NULL, storage of \p capacity messages
+ * @param capacity max amount of messages waiting to be forwarded, not 0
+ * @return
+ * - #VCAN_NULL_STORAGE on \p gw, \p buses or \p fifo being NULL
+ * - #VCAN_NULL_BUS on any bus being NULL
+ * - #VCAN_NULL_FILTER on \p routes being NULL with non-zero length
+ * - #VCAN_INVALID_CAPACITY on \p bus_count or \p capacity being out of range
+ * - #VCAN_UNSORTED_FILTER on \p routes not being sorted
+ * - the errors of vcan_connect(), after which no port stays connected
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_gw_init(vcan_gw_t* gw,
+                        vcan_bus_t** buses,
+                        size_t bus_count,
+                        const vcan_gw_route_t* routes,
+                        size_t routes_len,
+                        vcan_gw_pending_t* fifo,
+                        size_t capacity);
+
+/**
+ * Disconnects the ports of the gateway from all buses.
+ *
+ * @param gw not NULL, initialised
+ * @return
+ * - #VCAN_NULL_STORAGE on \p gw being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_gw_deinit(vcan_gw_t* gw);
+
+/**
+ * Amount of messages the gateway did not forward because the FIFO was full
+ * or because of exceeding #VCAN_GW_MAX_HOPS.
+ *
+ * @param gw not NULL
+ * @return the dropped messages
+ */
+uint64_t vcan_gw_dropped(const vcan_gw_t* gw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* VCAN_GW_H */
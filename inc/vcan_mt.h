@@ -0,0 +1,319 @@
+/**
+ * @file
+ *
+ * VCAN multi-threaded bus.
+ *
+ * A #vcan_bus_mt_t wraps a regular #vcan_bus_t, which is touched only by a
+ * dedicated dispatcher thread. Any thread may transmit with vcan_mt_tx():
+ * the message is copied into a lock-free bounded multi-producer queue and
+ * the dispatcher delivers the queued messages to the nodes' callbacks one at a
+ * time, in the single global order in which they were enqueued.
+ *
+ * Connections and disconnections travel through the same queue, so they are
+ * ordered with the messages, never block the transmitters and give the
+ * same results as vcan_connect() and vcan_disconnect().
+ *
+ * All callbacks run on the dispatcher thread. They may call vcan_mt_tx(),
+ * vcan_mt_connect() and vcan_mt_disconnect() themselves.
+ *
+ * Instead of starting the dispatcher thread, an event loop can deliver the
+ * queued messages on its own thread with vcan_mt_dispatch(), whenever the
+ * notification set with vcan_mt_set_notify() tells it that some are queued.
+ *
+ * Requires POSIX threads and C11 atomics.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_MT_H
+#define VCAN_MT_H
+
+#include "vcan.h"
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#ifndef VCAN_MT_QUEUE_LEN
+/** Capacity of the transmission queue of the multi-threaded bus, in messages.
+ * Must be a power of 2. */
+#define VCAN_MT_QUEUE_LEN 256
+#endif
+
+#if (VCAN_MT_QUEUE_LEN & (VCAN_MT_QUEUE_LEN - 1)) != 0
+#error "VCAN_MT_QUEUE_LEN must be a power of 2"
+#endif
+
+/** Slot of the transmission queue. For internal use only. */
+typedef struct
+{
+    /** Position of the slot in the queue, tells if it's free or full. */
+    VCAN_ATOMIC(size_t) seq;
+
+    /** Kind of entry: message, connection or disconnection. */
+    uint32_t kind;
+
+    /** The transmitting node to exclude from the reception. */
+    const vcan_node_t* src_node;
+
+    /** Node to connect or disconnect. */
+    vcan_node_t* node;
+
+    /** Completion of the connection or disconnection. */
+    struct vcan_mt_request* request;
+
+    /** The enqueued message. */
+    vcan_msg_t msg;
+
+    /** Bus clock when the message was enqueued, see #vcan_meta_t.tx_time. */
+    uint64_t tx_time;
+} vcan_mt_slot_t;
+
+/**
+ * Virtual bus safe to transmit on from multiple threads.
+ *
+ * Initialise it with vcan_mt_init(), do not access its fields directly.
+ */
+typedef struct
+{
+    /** Bus the dispatcher delivers the messages on. */
+    vcan_bus_t bus;
+
+    /** Ring of queued messages. */
+    vcan_mt_slot_t slots[VCAN_MT_QUEUE_LEN];
+
+    /** Next position to enqueue at, shared by the transmitters. */
+    VCAN_ALIGNAS(VCAN_CACHE_LINE_SIZE) VCAN_ATOMIC(size_t) tail;
+
+    /** Next position to dequeue from, owned by the dispatcher. */
+    VCAN_ALIGNAS(VCAN_CACHE_LINE_SIZE) size_t head;
+
+    /** Amount of entries already processed by the dispatcher. */
+    VCAN_ATOMIC(size_t) processed;
+
+    /** True while the dispatcher waits for new entries. */
+    VCAN_ATOMIC(bool) sleeping;
+
+    /** True while the dispatcher should keep running. */
+    VCAN_ATOMIC(bool) running;
+
+    /** True from vcan_mt_start() until the dispatcher has been joined. */
+    VCAN_ATOMIC(bool) started;
+
+    /** Amount of threads waiting in vcan_mt_flush(). */
+    VCAN_ATOMIC(size_t) flushers;
+
+    /** Set by vcan_mt_dispatch() once drained, cleared by the transmitter
+     * calling \p notify: one notification per batch. */
+    VCAN_ATOMIC(bool) armed;
+
+    /** Readiness notification set with vcan_mt_set_notify(). Can be NULL. */
+    void (* notify)(void* ctx);
+
+    /** Context passed to \p notify. */
+    void* notify_ctx;
+
+    /** The dispatcher thread. */
+    pthread_t dispatcher;
+
+    /** Protects the sleeping and completion handshakes. */
+    pthread_mutex_t lock;
+
+    /** Signalled to wake the dispatcher up. */
+    pthread_cond_t wakeup;
+
+    /** Signalled when the dispatcher completes some entries. */
+    pthread_cond_t completed;
+} vcan_bus_mt_t;
+
+/**
+ * Initialises the multi-threaded bus, without starting the dispatcher.
+ *
+ * Nodes connected before vcan_mt_start() are connected immediately.
+ *
+ * @param bus not NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_THREAD_FAILED on the synchronisation primitives failing to
+ *   initialise
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_mt_init(vcan_bus_mt_t* bus);
+
+/**
+ * Like vcan_mt_init() but with a caller-provided node table, as with
+ * vcan_init_ex().
+ *
+ * @param bus not NULL
+ * @param nodes not NULL, array of \p capacity node pointers
+ * @param capacity max amount of connected nodes, not 0
+ * @return the same as vcan_mt_init() and vcan_init_ex()
+ */
+vcan_err_t vcan_mt_init_ex(vcan_bus_mt_t* bus,
+                           vcan_node_t** nodes,
+                           size_t capacity);
+
+/**
+ * Starts the dispatcher thread delivering the queued messages.
+ *
+ * @param bus not NULL, initialised, not started
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_THREAD_FAILED on the thread failing to start
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_mt_start(vcan_bus_mt_t* bus);
+
+/**
+ * Delivers all queued messages and stops the dispatcher thread.
+ *
+ * Must not be called from a callback. The bus can be started again.
+ *
+ * @param bus not NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_OK otherwise, also when it was not running
+ */
+vcan_err_t vcan_mt_stop(vcan_bus_mt_t* bus);
+
+/**
+ * Stops the dispatcher if running and releases the synchronisation
+ * primitives. The bus must be initialised again before reuse.
+ *
+ * @param bus not NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_mt_deinit(vcan_bus_mt_t* bus);
+
+/**
+ * Thread-safe counterpart of vcan_connect().
+ *
+ * While the dispatcher runs, the connection is enqueued like a message, so
+ * it applies to all messages enqueued after it, and the call waits for the
+ * dispatcher to process it. Transmitters are never blocked. When called
+ * from a callback or while the dispatcher is stopped, it applies immediately.
+ *
+ * @param bus not NULL
+ * @param node not NULL, with callback not NULL
+ * @return the same as vcan_connect(), plus #VCAN_QUEUE_FULL when
+ * vcan_mt_stop() is stopping the dispatcher at the same time: nothing is
+ * done then
+ */
+vcan_err_t vcan_mt_connect(vcan_bus_mt_t* bus, vcan_node_t* node);
+
+/**
+ * Thread-safe counterpart of vcan_disconnect().
+ *
+ * Like vcan_mt_connect(), the disconnection is ordered with the messages:
+ * the ones enqueued before it are still delivered to the node. Once it
+ * returns, the node does not receive any further message.
+ *
+ * @param bus not NULL
+ * @param node not NULL
+ * @return the same as vcan_disconnect(), plus #VCAN_QUEUE_FULL like
+ * vcan_mt_connect()
+ */
+vcan_err_t vcan_mt_disconnect(vcan_bus_mt_t* bus, vcan_node_t* node);
+
+/**
+ * Thread-safe, lock-free counterpart of vcan_tx().
+ *
+ * Copies the message into the queue and returns immediately: the callbacks
+ * are called later by the dispatcher thread. Messages are delivered in the
+ * order they are enqueued across all threads.
+ *
+ * With #VCAN_BUS_TIMESTAMPS set on \p bus->bus, the transmission time in the
+ * metadata of the deliveries is the time of the enqueuing, read from the bus
+ * clock on the calling thread.
+ *
+ * @param bus not NULL
+ * @param msg not NULL
+ * @param src_node can be NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_MSG on \p msg being NULL
+ * - #VCAN_QUEUE_FULL when the queue has no free slot, the message is not
+ *   transmitted and counted as dropped in vcan_get_stats()
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_mt_tx(vcan_bus_mt_t* bus,
+                      const vcan_msg_t* msg,
+                      const vcan_node_t* src_node);
+
+/**
+ * Waits until every message enqueued before this call has been delivered.
+ *
+ * Must not be called from a callback. Returns immediately when the dispatcher
+ * is not running.
+ *
+ * @param bus not NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_mt_flush(vcan_bus_mt_t* bus);
+
+/**
+ * Sets the function a transmitter calls when it enqueues into the empty
+ * queue, to wake up the event loop calling vcan_mt_dispatch(), e.g. through
+ * vcan_notify.h.
+ *
+ * The notifications are coalesced: after one, the next comes only once
+ * vcan_mt_dispatch() drained the queue, however many messages are enqueued
+ * meanwhile. The function is called by the transmitting threads, so it must
+ * be thread-safe and short.
+ *
+ * Must be set before transmitting. The bus starts armed: the first message
+ * notifies.
+ *
+ * @param bus not NULL, initialised
+ * @param notify called with \p ctx, NULL to stop notifying
+ * @param ctx passed to \p notify, can be NULL
+ * @return
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_mt_set_notify(vcan_bus_mt_t* bus,
+                              void (* notify)(void* ctx),
+                              void* ctx);
+
+/**
+ * Delivers all queued messages on the calling thread, until the queue is
+ * empty, then re-arms the notification, see vcan_mt_set_notify().
+ *
+ * Replaces the dispatcher thread: the bus must not be started. A single
+ * thread, typically an event loop, must dispatch and it is the one to
+ * connect and disconnect the nodes, which apply immediately as while the
+ * dispatcher is stopped. Messages enqueued while dispatching are dispatched
+ * too, so a message is never left queued without a pending notification.
+ *
+ * @param bus not NULL, not started
+ * @return the amount of messages delivered, 0 when nothing was queued,
+ * \p bus is NULL or started
+ */
+size_t vcan_mt_dispatch(vcan_bus_mt_t* bus);
+
+/**
+ * Tells a callback whether the dispatcher has more entries already queued
+ * behind the message being delivered.
+ *
+ * Lets a node batch its output, e.g. into one system call, and flush it
+ * only when this returns false. Must be called from a callback only.
+ *
+ * @param bus not NULL
+ * @return true if the dispatcher will deliver another entry right after
+ *         the current one
+ */
+bool vcan_mt_has_next(const vcan_bus_mt_t* bus);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* VCAN_MT_H */
@@ -0,0 +1,274 @@
+/**
+ * @file
+ *
+ * VCAN bus spanning processes and hosts.
+ *
+ * A #vcan_net_t links a multi-threaded bus to the same logical bus in other
+ * processes, through one of two transports:
+ *
+ * - a POSIX shared-memory ring, for processes on the same host, opened with
+ *   vcan_net_shm_open();
+ * - UDP multicast, for processes on different hosts, opened with
+ *   vcan_net_udp_open().
+ *
+ * The link connects a proxy node to the local bus: it stands for all the
+ * nodes of the other processes. The messages it receives are coalesced into
+ * datagrams while the dispatcher has more messages queued (see
+ * vcan_mt_has_next()) and published to the transport. A receiver thread
+ * transmits the messages of the other processes on the local bus with
+ * vcan_mt_tx(), excluding the proxy node, so nothing is echoed back. The
+ * ECU models connected to the bus are not aware of the transport.
+ *
+ * Each datagram starts with a #VCAN_NET_HEADER_LEN-byte header: the magic
+ * `"VCN1"`, the 4-byte identifier of the sending link, its 4-byte sequence
+ * number and the 2-byte amount of frames, all little-endian. The frames
+ * follow as packed frames, see vcan_pack(). The receivers count the gaps in
+ * the sequence numbers of each sender as lost datagrams.
+ *
+ * Requires POSIX threads, shared memory and sockets.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_NET_H
+#define VCAN_NET_H
+
+#include "vcan.h"
+#include "vcan_mt.h"
+#include <stdbool.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#ifndef VCAN_NET_DATAGRAM_LEN
+/** Max size of a datagram in bytes, fitting into an Ethernet frame. */
+#define VCAN_NET_DATAGRAM_LEN 1400U
+#endif
+
+#ifndef VCAN_NET_SHM_SLOTS
+/** Datagrams the shared-memory ring holds before overwriting the oldest. */
+#define VCAN_NET_SHM_SLOTS 1024U
+#endif
+
+#ifndef VCAN_NET_MAX_PEERS
+/** Max amount of other links whose sequence numbers are tracked. */
+#define VCAN_NET_MAX_PEERS 16U
+#endif
+
+/** Size of the header of each datagram. */
+#define VCAN_NET_HEADER_LEN 14U
+
+/** Slot of the shared-memory ring. For internal use only. */
+typedef struct
+{
+    /** Position of the datagram in the ring plus 1, 0 when never written,
+     * UINT64_MAX while being written. */
+    VCAN_ATOMIC(uint_least64_t) seq;
+
+    /** Bytes in \p data. */
+    uint32_t len;
+
+    /** The datagram. */
+    uint8_t data[VCAN_NET_DATAGRAM_LEN];
+} vcan_net_shm_slot_t;
+
+/** The shared-memory ring, all zeros when created. For internal use only. */
+typedef struct
+{
+    /** Amount of datagrams ever published, claimed by the writers. */
+    VCAN_ATOMIC(uint_least64_t) tail;
+
+    /** The datagrams, the oldest ones being overwritten. */
+    vcan_net_shm_slot_t slots[VCAN_NET_SHM_SLOTS];
+} vcan_net_shm_ring_t;
+
+/** Sequence number tracking of another link. For internal use only. */
+typedef struct
+{
+    /** Identifier of the link. */
+    uint32_t sender;
+
+    /** Sequence number expected next. */
+    uint32_t next_seq;
+} vcan_net_peer_t;
+
+/** Counters of a link, see vcan_net_get_stats(). */
+typedef struct
+{
+    /** Datagrams published by the link. */
+    uint64_t tx_datagrams;
+
+    /** Datagrams of other links received. */
+    uint64_t rx_datagrams;
+
+    /** Datagrams of other links missing from the sequence numbers. */
+    uint64_t lost;
+
+    /** Messages not sent to the transport or not transmitted on the full
+     * local bus. */
+    uint64_t dropped;
+} vcan_net_stats_t;
+
+/**
+ * Link of a multi-threaded bus to the other processes on the same logical
+ * bus.
+ *
+ * Initialise it with vcan_net_shm_open() or vcan_net_udp_open(), do not
+ * access its fields directly.
+ */
+typedef struct
+{
+    /** Proxy of the remote nodes, connected to \p bus. */
+    vcan_node_t node;
+
+    /** The local bus. */
+    vcan_bus_mt_t* bus;
+
+    /** True for the shared-memory transport, false for UDP. */
+    bool shm;
+
+    /** Identifier of this link in the datagrams. */
+    uint32_t sender;
+
+    /** Sequence number of the next datagram, touched by the dispatcher. */
+    uint32_t next_seq;
+
+    /** Datagram being coalesced, touched by the dispatcher only. */
+    uint8_t datagram[VCAN_NET_DATAGRAM_LEN];
+
+    /** Bytes used in \p datagram, including the header. */
+    size_t datagram_len;
+
+    /** Frames in \p datagram. */
+    uint16_t datagram_frames;
+
+    /** The mapped ring of the shared-memory transport. */
+    vcan_net_shm_ring_t* ring;
+
+    /** Position of the next datagram to read from \p ring. */
+    uint64_t cursor;
+
+    /** Socket of the UDP transport. */
+    int fd;
+
+    /** Multicast group of the UDP transport, in network byte order. */
+    uint32_t group;
+
+    /** UDP port, in network byte order. */
+    uint16_t port;
+
+    /** Pipe waking up the receiver thread of the UDP transport. */
+    int stop_pipe[2];
+
+    /** Other links seen so far, touched by the receiver only. */
+    vcan_net_peer_t peers[VCAN_NET_MAX_PEERS];
+
+    /** Amount of \p peers. */
+    size_t peer_count;
+
+    /** Counter of vcan_net_stats_t.tx_datagrams. */
+    VCAN_ATOMIC(uint_least64_t) tx_datagrams;
+
+    /** Counter of vcan_net_stats_t.rx_datagrams. */
+    VCAN_ATOMIC(uint_least64_t) rx_datagrams;
+
+    /** Counter of vcan_net_stats_t.lost. */
+    VCAN_ATOMIC(uint_least64_t) lost;
+
+    /** Counter of vcan_net_stats_t.dropped. */
+    VCAN_ATOMIC(uint_least64_t) dropped;
+
+    /** True while the receiver should keep running. */
+    VCAN_ATOMIC(bool) running;
+
+    /** The receiver thread. */
+    pthread_t receiver;
+} vcan_net_t;
+
+/**
+ * Links the bus to the shared-memory ring of the logical bus, creating the
+ * ring if no other process did.
+ *
+ * Only the datagrams published after opening are received. The ring outlives
+ * the processes: remove it with `shm_unlink()` once the logical bus is no
+ * longer needed. A receiver falling more than #VCAN_NET_SHM_SLOTS datagrams
+ * behind skips the overwritten ones, counting them as lost.
+ *
+ * @param net not NULL
+ * @param bus not NULL, initialised, valid until closed
+ * @param name not NULL, name of the POSIX shared-memory object, starting
+ *        with a slash, e.g. `"/vcan-powertrain"`
+ * @return
+ * - #VCAN_NULL_NODE on \p net being NULL
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_STORAGE on \p name being NULL
+ * - #VCAN_IO_FAILED on the shared memory failing to open or map
+ * - #VCAN_THREAD_FAILED on the receiver failing to start
+ * - the errors of vcan_mt_connect()
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_net_shm_open(vcan_net_t* net,
+                             vcan_bus_mt_t* bus,
+                             const char* name);
+
+/**
+ * Links the bus to the UDP multicast group of the logical bus.
+ *
+ * Datagrams are looped back to the host, so processes on the same host can
+ * share the group. UDP may lose or reorder datagrams: the ones arriving
+ * after a newer one of the same sender are discarded.
+ *
+ * @param net not NULL
+ * @param bus not NULL, initialised, valid until closed
+ * @param group not NULL, IPv4 multicast address, e.g. `"239.0.0.1"`
+ * @param port UDP port of the logical bus, not 0
+ * @return
+ * - #VCAN_NULL_NODE on \p net being NULL
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_STORAGE on \p group being NULL
+ * - #VCAN_INVALID_CAPACITY on \p port being 0
+ * - #VCAN_IO_FAILED on an invalid \p group or the socket failing
+ * - #VCAN_THREAD_FAILED on the receiver failing to start
+ * - the errors of vcan_mt_connect()
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_net_udp_open(vcan_net_t* net,
+                             vcan_bus_mt_t* bus,
+                             const char* group,
+                             uint16_t port);
+
+/**
+ * Stops the receiver thread, disconnects the proxy node, publishes the
+ * datagram still being coalesced and closes the transport.
+ *
+ * Must not be called from a callback.
+ *
+ * @param net not NULL, opened
+ * @return
+ * - #VCAN_NULL_NODE on \p net being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_net_close(vcan_net_t* net);
+
+/**
+ * Reads the counters of the link.
+ *
+ * @param net not NULL, opened
+ * @param stats not NULL, filled with the counters
+ * @return
+ * - #VCAN_NULL_NODE on \p net being NULL
+ * - #VCAN_NULL_STORAGE on \p stats being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_net_get_stats(const vcan_net_t* net, vcan_net_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* VCAN_NET_H */
@@ -0,0 +1,110 @@
+/**
+ * @file
+ *
+ * VCAN readiness notifications for event loops.
+ *
+ * A #vcan_notify_t is a file descriptor becoming readable when notified, to
+ * be watched with `poll()`, `select()` or `epoll`: an eventfd on Linux, the
+ * read end of a non-blocking pipe elsewhere. vcan_notify_signal() is meant
+ * as notification function of a receive queue, see
+ * vcan_rx_queue_set_notify(), or of a multi-threaded bus run by the event
+ * loop, see vcan_mt_set_notify():
+ *
+ * ```c
+ * vcan_notify_init(&notify);
+ * vcan_rx_queue_set_notify(&queue, vcan_notify_signal, &notify);
+ * // Add vcan_notify_fd(&notify) to the epoll set. When readable:
+ * vcan_notify_clear(&notify);
+ * vcan_rx_drain(&node, on_rx);
+ * ```
+ *
+ * As the bus coalesces the notifications, the descriptor is written once
+ * per batch of messages, not once per message.
+ *
+ * Requires POSIX.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_NOTIFY_H
+#define VCAN_NOTIFY_H
+
+#include "vcan.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Pollable notification.
+ *
+ * Initialise it with vcan_notify_init(), do not access its fields directly.
+ */
+typedef struct
+{
+    /** Descriptor to poll for reading. */
+    int read_fd;
+
+    /** Descriptor written by vcan_notify_signal(), the same as \p read_fd
+     * for an eventfd. */
+    int write_fd;
+} vcan_notify_t;
+
+/**
+ * Opens the descriptors of the notification, non-blocking and closed on
+ * `exec()`.
+ *
+ * @param notify not NULL
+ * @return
+ * - #VCAN_NULL_STORAGE on \p notify being NULL
+ * - #VCAN_IO_FAILED on the eventfd or pipe failing to open
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_notify_init(vcan_notify_t* notify);
+
+/**
+ * Closes the descriptors of the notification.
+ *
+ * @param notify not NULL, initialised
+ * @return
+ * - #VCAN_NULL_STORAGE on \p notify being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_notify_deinit(vcan_notify_t* notify);
+
+/**
+ * The descriptor to poll for reading, becoming readable once notified.
+ *
+ * @param notify not NULL, initialised
+ * @return the descriptor, -1 on \p notify being NULL
+ */
+int vcan_notify_fd(const vcan_notify_t* notify);
+
+/**
+ * Makes the descriptor readable, from any thread. Notifying again before
+ * vcan_notify_clear() has no further effect.
+ *
+ * Has the signature of the notification functions of the receive queues and
+ * the multi-threaded bus.
+ *
+ * @param notify the #vcan_notify_t, not NULL
+ */
+void vcan_notify_signal(void* notify);
+
+/**
+ * Consumes the pending notifications without blocking, so the descriptor is
+ * not readable until notified again. Call it before draining.
+ *
+ * @param notify not NULL, initialised
+ * @return true if it was notified
+ */
+bool vcan_notify_clear(vcan_notify_t* notify);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* VCAN_NOTIFY_H */
@@ -0,0 +1,158 @@
+/**
+ * @file
+ *
+ * VCAN parallel delivery of each message to the nodes of a bus.
+ *
+ * A #vcan_par_t installs itself as fan-out hook of a bus (see
+ * vcan_set_fanout()) and splits the delivery of every transmitted message
+ * across a pool of worker threads, joining them before the transmission
+ * returns. The transmitting thread takes part as worker 0.
+ *
+ * The node table is split into one contiguous share per worker. Each worker
+ * delivers its share from the front; once done, it steals the nodes not
+ * started yet from the back of the shares of the others, so slow callbacks
+ * do not leave workers idle. Nodes with a non-zero #vcan_node_t.affinity
+ * are delivered only by that worker, never stolen, keeping their state hot
+ * in the cache of one core; together with the CPU pinning of the workers,
+ * each node stays on one core.
+ *
+ * The callbacks run concurrently for different nodes, so they must not
+ * share unsynchronised state nor transmit on the bus they receive from.
+ *
+ * Requires POSIX threads and C11 atomics. CPU pinning is available on
+ * Linux only.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_PAR_H
+#define VCAN_PAR_H
+
+#include "vcan.h"
+#include <stdbool.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Max amount of workers of a pool, including the transmitting thread. */
+#define VCAN_PAR_MAX_WORKERS 64U
+
+struct vcan_par;
+
+/** Worker of the pool. For internal use only. */
+typedef struct
+{
+    /**
+     * Share of the order being delivered: the next position from the
+     * front in the lower 32 bits, the end in the upper 32 bits.
+     */
+    VCAN_ALIGNAS(VCAN_CACHE_LINE_SIZE) VCAN_ATOMIC(uint_least64_t) range;
+
+    /** Positions of the share below it are bound to this worker. */
+    uint32_t bound_end;
+
+    /** The pool it belongs to. */
+    struct vcan_par* pool;
+
+    /** Index of the worker. */
+    uint32_t index;
+
+    /** The thread, unused for worker 0. */
+    pthread_t thread;
+} vcan_par_worker_t;
+
+/**
+ * Pool of workers delivering the messages of a bus in parallel.
+ *
+ * Initialise it with vcan_par_init(), do not access its fields directly.
+ */
+typedef struct vcan_par
+{
+    /** The workers, the first one being the transmitting thread. */
+    vcan_par_worker_t workers[VCAN_PAR_MAX_WORKERS];
+
+    /** Amount of \p workers. */
+    uint32_t worker_count;
+
+    /** The bus whose fan-out is parallelised. */
+    vcan_bus_t* bus;
+
+    /** Caller-provided nodes to deliver to, in order of the shares. */
+    vcan_node_t** order;
+
+    /** Max amount of nodes in \p order. */
+    size_t capacity;
+
+    /** Message being delivered. */
+    const vcan_msg_t* msg;
+
+    /** Incremented at each delivery, waking up the workers. */
+    VCAN_ALIGNAS(VCAN_CACHE_LINE_SIZE) VCAN_ATOMIC(size_t) generation;
+
+    /** Workers still delivering the current message. */
+    VCAN_ALIGNAS(VCAN_CACHE_LINE_SIZE) VCAN_ATOMIC(uint_least32_t) pending;
+
+    /** Amount of workers sleeping on \p wakeup. */
+    VCAN_ATOMIC(uint_least32_t) sleepers;
+
+    /** True while the workers should keep running. */
+    VCAN_ATOMIC(bool) running;
+
+    /** Protects the sleeping handshake. */
+    pthread_mutex_t lock;
+
+    /** Signalled when a delivery starts. */
+    pthread_cond_t wakeup;
+} vcan_par_t;
+
+/**
+ * Starts the workers and installs the pool as fan-out hook of the bus.
+ *
+ * @param pool not NULL
+ * @param bus not NULL, initialised, valid while the pool is in use
+ * @param order not NULL, storage of \p capacity node pointers, valid while
+ *        the pool is in use
+ * @param capacity max amount of nodes delivered in parallel, at least the
+ *        amount of connected nodes: with more, the delivery is serial
+ * @param worker_count amount of workers between 1 and
+ *        #VCAN_PAR_MAX_WORKERS, including the transmitting thread
+ * @param cpus CPU index of each worker thread except the first one
+ *        (`worker_count - 1` entries), NULL to leave them unpinned
+ * @return
+ * - #VCAN_NULL_STORAGE on \p pool or \p order being NULL
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_INVALID_CAPACITY on \p capacity being 0 or \p worker_count out of
+ *   range
+ * - #VCAN_THREAD_FAILED on any worker failing to start or to be pinned
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_par_init(vcan_par_t* pool,
+                         vcan_bus_t* bus,
+                         vcan_node_t** order,
+                         size_t capacity,
+                         uint32_t worker_count,
+                         const int* cpus);
+
+/**
+ * Restores the serial delivery of the bus and stops the workers.
+ *
+ * Must not be called during a transmission on the bus.
+ *
+ * @param pool not NULL, initialised
+ * @return
+ * - #VCAN_NULL_STORAGE on \p pool being NULL
+ * - the errors of vcan_set_fanout()
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_par_deinit(vcan_par_t* pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* VCAN_PAR_H */
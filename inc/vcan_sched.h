@@ -0,0 +1,250 @@
+/**
+ * @file
+ *
+ * VCAN simulated-time scheduler of periodic and one-shot transmissions.
+ *
+ * A #vcan_sched_t keeps the scheduled messages of a bus in a min-heap
+ * ordered by due time, over a caller-provided array, and owns a virtual
+ * clock. vcan_advance_time() moves the clock forward and transmits only the
+ * messages that became due, in time order, so the cost does not depend on
+ * the amount of scheduled messages that are not due.
+ *
+ * Messages due at the same time and sent by the same node are transmitted
+ * together with one vcan_tx_burst(). Scheduling them one after the other
+ * keeps them adjacent.
+ *
+ * The scheduler does not allocate and does not use threads: it is safe to
+ * use from the thread transmitting on the bus only.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_SCHED_H
+#define VCAN_SCHED_H
+
+#include "vcan.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#ifndef VCAN_SCHED_BATCH_LEN
+/** Max amount of messages the scheduler passes to one vcan_tx_burst(). */
+#define VCAN_SCHED_BATCH_LEN 32U
+#endif
+
+/**
+ * A scheduled transmission.
+ *
+ * Set \p msg and \p src_node before scheduling it with vcan_sched_add(), do
+ * not access the other fields directly. The payload of \p msg can be updated
+ * at any time from the transmitting thread, e.g. from a bus callback, and
+ * the next transmission sends the new content.
+ */
+typedef struct
+{
+    /** The message to transmit. */
+    vcan_msg_t msg;
+
+    /** The transmitting node to exclude from the reception, can be NULL. */
+    const vcan_node_t* src_node;
+
+    /** Interval between the transmissions, 0 for a one-shot one. */
+    uint64_t period;
+
+    /** Virtual time of the next transmission. */
+    uint64_t due;
+
+    /** Insertion order, keeping entries with the same \p due in FIFO order. */
+    uint64_t seq;
+
+    /** Position in the heap, SIZE_MAX when not scheduled. */
+    size_t heap_index;
+} vcan_sched_entry_t;
+
+/**
+ * Scheduler of the transmissions on one bus.
+ *
+ * Initialise it with vcan_sched_init(), do not access its fields directly.
+ */
+typedef struct
+{
+    /** Bus to transmit on. */
+    vcan_bus_t* bus;
+
+    /** Min-heap of the scheduled entries, caller-provided. */
+    vcan_sched_entry_t** heap;
+
+    /** Max amount of entries fitting into \p heap. */
+    size_t capacity;
+
+    /** Amount of scheduled entries. */
+    size_t len;
+
+    /** The virtual clock. */
+    uint64_t now;
+
+    /** Insertion counter, source of #vcan_sched_entry_t.seq. */
+    uint64_t next_seq;
+} vcan_sched_t;
+
+/**
+ * Initialises the scheduler, with the virtual clock at 0.
+ *
+ * @param sched not NULL
+ * @param bus not NULL, initialised
+ * @param heap not NULL, array of \p capacity entry pointers, valid while the
+ *        scheduler is used
+ * @param capacity max amount of scheduled entries, not 0
+ * @return
+ * - #VCAN_NULL_STORAGE on \p sched or \p heap being NULL
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_INVALID_CAPACITY on \p capacity being 0
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_sched_init(vcan_sched_t* sched,
+                           vcan_bus_t* bus,
+                           vcan_sched_entry_t** heap,
+                           size_t capacity);
+
+/**
+ * Schedules the entry for a transmission after \p delay and then every
+ * \p period, in O(log N).
+ *
+ * An entry which is already scheduled is rescheduled. Can be called from
+ * the bus callbacks during vcan_advance_time(): an entry becoming due within
+ * the time being advanced is transmitted in the same call.
+ *
+ * @param sched not NULL, initialised
+ * @param entry not NULL, with \p msg set, valid while scheduled
+ * @param delay time from now of the first transmission, 0 for the next call
+ *        of vcan_advance_time()
+ * @param period interval between the transmissions, 0 for only one
+ * @return
+ * - #VCAN_NULL_STORAGE on \p sched being NULL
+ * - #VCAN_NULL_MSG on \p entry being NULL
+ * - #VCAN_QUEUE_FULL on the heap being full, the entry is not scheduled
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_sched_add(vcan_sched_t* sched,
+                          vcan_sched_entry_t* entry,
+                          uint64_t delay,
+                          uint64_t period);
+
+/**
+ * Removes the entry from the schedule in O(log N). Does nothing if it is not
+ * scheduled. Can be called from the bus callbacks.
+ *
+ * @param sched not NULL, initialised
+ * @param entry not NULL
+ * @return
+ * - #VCAN_NULL_STORAGE on \p sched being NULL
+ * - #VCAN_NULL_MSG on \p entry being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_sched_cancel(vcan_sched_t* sched, vcan_sched_entry_t* entry);
+
+/**
+ * Moves the virtual clock forward by \p dt, transmitting every message due
+ * until then in time order.
+ *
+ * While transmitting a message, the clock reads its due time, so the
+ * callbacks observe the simulated time of the transmission. Periodic
+ * entries are rescheduled at their due time plus their period, without
+ * accumulating any drift.
+ *
+ * A failed transmission, e.g. rejected by the transmit hook, does not stop
+ * the clock: the rest of its batch is lost, like after vcan_tx_burst(), and
+ * the following batches are transmitted anyway. Periodic entries stay
+ * scheduled.
+ *
+ * @param sched not NULL, initialised
+ * @param dt time to advance by, 0 only transmits what is due now
+ * @return
+ * - #VCAN_NULL_STORAGE on \p sched being NULL
+ * - the error of the first failed transmission, see vcan_tx_burst()
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_advance_time(vcan_sched_t* sched, uint64_t dt);
+
+/**
+ * The virtual clock of the scheduler passed as \p ctx, with the signature of
+ * a bus clock: `vcan_set_clock(bus, vcan_sched_clock, &sched)` timestamps
+ * the bus with the simulated time.
+ *
+ * @param ctx not NULL, the scheduler
+ * @return the current virtual time
+ */
+uint64_t vcan_sched_clock(void* ctx);
+
+/** First 4 bytes of a scheduler snapshot, `"VSS1"` on little-endian hosts. */
+#define VCAN_SCHED_SNAPSHOT_MAGIC 0x31535356UL
+
+/**
+ * Serialises the virtual clock and the scheduled entries into a flat buffer,
+ * like vcan_snapshot() does for the bus, to be restored with
+ * vcan_sched_restore().
+ *
+ * The entries are recorded by their position in \p entries, the table of
+ * all the entries the application schedules, together with their message,
+ * period, due time and transmitting node, by its \p id. The snapshot holds
+ * no pointers.
+ *
+ * @param sched not NULL, initialised, not advancing the time
+ * @param entries table of the entries, containing all scheduled ones, can be
+ *        NULL if \p entries_len is 0
+ * @param entries_len amount of \p entries
+ * @param buf destination, can be NULL to only obtain the size
+ * @param buf_len available bytes in \p buf
+ * @param len not NULL, set to the size of the snapshot, also when it does
+ *        not fit
+ * @return
+ * - #VCAN_NULL_STORAGE on \p sched or \p len being NULL
+ * - #VCAN_INVALID_SNAPSHOT on a scheduled entry missing in \p entries
+ * - #VCAN_TOO_LONG on the snapshot not fitting into \p buf_len bytes
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_sched_snapshot(const vcan_sched_t* sched,
+                               const vcan_sched_entry_t* entries,
+                               size_t entries_len,
+                               void* buf,
+                               size_t buf_len,
+                               size_t* len);
+
+/**
+ * Brings the scheduler back to the state serialised by
+ * vcan_sched_snapshot(): the clock is set and the entries scheduled at the
+ * time are rescheduled, in the same order, replacing the current ones.
+ *
+ * The transmitting nodes are re-bound by their \p id among the nodes
+ * connected to the bus of the scheduler, so restore the bus first. On any
+ * error the scheduler is left as it was.
+ *
+ * @param sched not NULL, initialised, not advancing the time
+ * @param entries table of the entries, in the same order as for the
+ *        snapshot, can be NULL if \p entries_len is 0
+ * @param entries_len amount of \p entries
+ * @param buf not NULL, snapshot
+ * @param buf_len bytes of the snapshot
+ * @return
+ * - #VCAN_NULL_STORAGE on \p sched or \p buf being NULL
+ * - #VCAN_INVALID_SNAPSHOT on the snapshot being invalid, referring to an
+ *   entry past \p entries_len or to the same entry twice
+ * - #VCAN_INVALID_CAPACITY on the heap of \p sched being too small
+ * - #VCAN_NODE_NOT_FOUND on a transmitting node not connected to the bus
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_sched_restore(vcan_sched_t* sched,
+                              vcan_sched_entry_t* entries,
+                              size_t entries_len,
+                              const void* buf,
+                              size_t buf_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* VCAN_SCHED_H */
@@ -0,0 +1,254 @@
+/**
+ * @file
+ *
+ * VCAN signal decoding shared by the nodes.
+ *
+ * A #vcan_sig_db_t compiles a DBC-like description of the signals of each
+ * CAN ID into one extraction table per ID: the bytes each signal spans and
+ * the shift of its least significant bit, so decoding a signal is a short
+ * loop over its bytes instead of a loop over its bits.
+ *
+ * The nodes interested in the signals share one database. The first one
+ * calling vcan_sig_decode() for a received message decodes all its signals
+ * into the cache of the CAN ID; the other ones find the payload unchanged
+ * and read the cached physical values without decoding again. The values
+ * of a signal can also be accessed by name with vcan_sig_find().
+ *
+ * The description is either a constant table, e.g. generated from a DBC file
+ * at build time with #VCAN_SIG, or parsed at run time from the text of a DBC
+ * file with vcan_sig_parse_dbc().
+ *
+ * A database must be used by one thread at a time: do not share it between
+ * nodes delivered in parallel, see vcan_par.h.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_SIG_H
+#define VCAN_SIG_H
+
+#include "vcan.h"
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Flag of #vcan_sig_t.flags: little-endian (Intel, `@1` in DBC) byte order,
+ * otherwise big-endian (Motorola, `@0`). */
+#define VCAN_SIG_LITTLE_ENDIAN (1U << 0U)
+
+/** Flag of #vcan_sig_t.flags: two's complement signed value (`-` in DBC). */
+#define VCAN_SIG_SIGNED (1U << 1U)
+
+/**
+ * Initialiser of a #vcan_sig_t with a string literal as name.
+ *
+ * Example:
+ * @code
+ * static const vcan_sig_t signals[] = {
+ *     VCAN_SIG("EngineSpeed", 0x100, 0, 16, VCAN_SIG_LITTLE_ENDIAN, 0.25, 0),
+ *     VCAN_SIG("CoolantTemp", 0x100, 16, 8, VCAN_SIG_LITTLE_ENDIAN, 1, -40),
+ * };
+ * @endcode
+ */
+#define VCAN_SIG(name_literal, id, start, len, sig_flags, scale, shift) \
+    { .name = (name_literal), .name_len = sizeof(name_literal) - 1U, \
+      .msg_id = (id), .start_bit = (start), .length = (len), \
+      .flags = (sig_flags), .factor = (scale), .offset = (shift) }
+
+/** Description of a signal, as in a DBC file. */
+typedef struct
+{
+    /** Name of the signal, not necessarily NUL-terminated. Can be NULL. */
+    const char* name;
+
+    /** Characters in \p name. */
+    size_t name_len;
+
+    /** CAN ID of the message carrying the signal. */
+    uint32_t msg_id;
+
+    /** DBC start bit: position of the least significant bit for
+     * little-endian signals, of the most significant bit for big-endian
+     * ones, counting from bit 0 of byte 0. */
+    uint32_t start_bit;
+
+    /** Size of the signal in bits, between 1 and 64. */
+    uint32_t length;
+
+    /** Combination of #VCAN_SIG_LITTLE_ENDIAN and #VCAN_SIG_SIGNED. */
+    uint32_t flags;
+
+    /** Physical value = raw value * \p factor + \p offset. */
+    double factor;
+
+    /** Physical value = raw value * \p factor + \p offset. */
+    double offset;
+} vcan_sig_t;
+
+/** Extraction table entry of a signal. For internal use only. */
+typedef struct
+{
+    /** Byte holding the least significant bit. */
+    uint8_t lsb_byte;
+
+    /** Bytes spanned by the signal. */
+    uint8_t byte_count;
+
+    /** Position of the least significant bit within \p lsb_byte. */
+    uint8_t shift;
+
+    /** Payload length needed for the signal to be present. */
+    uint8_t min_len;
+
+    /** Raw value bits: low \p length bits set. */
+    uint64_t mask;
+} vcan_sig_layout_t;
+
+/** Cached signals of a single CAN ID. */
+typedef struct
+{
+    /** The CAN ID. */
+    uint32_t id;
+
+    /** Index of the first signal of this ID in the description. */
+    size_t first;
+
+    /** Amount of signals of this ID. */
+    size_t count;
+
+    /**
+     * Physical values of the signals, in the order of the description. NaN
+     * for a signal not fitting into the payload of the last message.
+     */
+    double* values;
+
+    /** True once decoded. */
+    bool valid;
+
+    /** Length of the last decoded payload. */
+    uint8_t len;
+
+    /** The last decoded payload. */
+    uint8_t data[VCAN_DATA_MAX_LEN];
+} vcan_sig_msg_t;
+
+/**
+ * Compiled description of the signals and their decoded values.
+ *
+ * Initialise it with vcan_sig_init(), do not access its fields directly.
+ */
+typedef struct
+{
+    /** The description, grouped by ascending CAN ID. */
+    const vcan_sig_t* signals;
+
+    /** Amount of \p signals. */
+    size_t signal_count;
+
+    /** Extraction table entry of each signal. */
+    vcan_sig_layout_t* layouts;
+
+    /** Physical value of each signal. */
+    double* values;
+
+    /** One entry per CAN ID, ascending. */
+    vcan_sig_msg_t* msgs;
+
+    /** Amount of \p msgs. */
+    size_t msg_count;
+
+    /** Amount of messages decoded, not found in the cache. */
+    uint64_t decodes;
+} vcan_sig_db_t;
+
+/**
+ * Compiles the description into the extraction tables.
+ *
+ * @param db not NULL
+ * @param signals description of \p signal_count signals, sorted by
+ *        non-descending \p msg_id, valid while the database is in use. Can be
+ *        NULL if \p signal_count is 0.
+ * @param signal_count amount of \p signals
+ * @param layouts not NULL, storage of \p signal_count extraction entries
+ * @param values not NULL, storage of \p signal_count physical values
+ * @param msgs not NULL, storage of \p msg_capacity CAN IDs
+ * @param msg_capacity max amount of distinct CAN IDs in \p signals
+ * @return
+ * - #VCAN_NULL_STORAGE on \p db, \p layouts, \p values or \p msgs being
+ *   NULL
+ * - #VCAN_NULL_FILTER on \p signals being NULL with non-zero count
+ * - #VCAN_UNSORTED_FILTER on \p signals not being sorted by CAN ID
+ * - #VCAN_INVALID_SIGNAL on a signal of no bits, more than 64 bits or not
+ *   fitting into #VCAN_DATA_MAX_LEN bytes
+ * - #VCAN_INVALID_CAPACITY on more CAN IDs than \p msg_capacity
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_sig_init(vcan_sig_db_t* db,
+                         const vcan_sig_t* signals,
+                         size_t signal_count,
+                         vcan_sig_layout_t* layouts,
+                         double* values,
+                         vcan_sig_msg_t* msgs,
+                         size_t msg_capacity);
+
+/**
+ * Decodes the signals of the message, unless the cache of its CAN ID already
+ * holds the same payload.
+ *
+ * Meant to be called from the callbacks of the nodes sharing the database,
+ * so the received message is decoded once for all.
+ *
+ * @param db not NULL, initialised
+ * @param msg not NULL
+ * @return the cached signals of the CAN ID of \p msg, NULL if it has no
+ *         signals
+ */
+const vcan_sig_msg_t* vcan_sig_decode(vcan_sig_db_t* db, const vcan_msg_t* msg);
+
+/**
+ * Finds the cached physical value of the first signal with the name.
+ *
+ * The value is updated in place by each vcan_sig_decode() of its CAN ID, so
+ * the pointer can be looked up once when setting up the node.
+ *
+ * @param db not NULL, initialised
+ * @param name not NULL, NUL-terminated
+ * @return the cached value, NaN until decoded, NULL if no signal has the name
+ */
+const double* vcan_sig_find(const vcan_sig_db_t* db, const char* name);
+
+/**
+ * Parses the messages and signals of the text of a DBC file.
+ *
+ * Only the `BO_` and `SG_` lines are interpreted; the other ones are
+ * skipped. Multiplexed signals (`m<value>`) are skipped, as they are
+ * decoded differently depending on the multiplexor value, while the
+ * multiplexor itself (`M`) is kept. The signals are stored sorted by CAN ID,
+ * ready for vcan_sig_init(). The names point into \p text.
+ *
+ * @param text not NULL, NUL-terminated, valid while the signals are in use
+ * @param signals not NULL, storage of \p capacity signals
+ * @param capacity max amount of signals
+ * @param count not NULL, set to the amount of signals parsed
+ * @return
+ * - #VCAN_NULL_STORAGE on any argument being NULL
+ * - #VCAN_INVALID_SIGNAL on a malformed `BO_` or `SG_` line, or a signal
+ *   before any `BO_` line
+ * - #VCAN_INVALID_CAPACITY on more signals than \p capacity
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_sig_parse_dbc(const char* text,
+                              vcan_sig_t* signals,
+                              size_t capacity,
+                              size_t* count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* VCAN_SIG_H */
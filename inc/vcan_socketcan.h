@@ -0,0 +1,146 @@
+/**
+ * @file
+ *
+ * VCAN bridge to a Linux SocketCAN interface.
+ *
+ * A #vcan_socketcan_t connects a multi-threaded bus to a SocketCAN
+ * interface, real or virtual (`vcan` kernel module), so the tools of the
+ * system, such as `candump`, see the simulated traffic and can inject into
+ * it.
+ *
+ * The bridge node, connected to the bus, sends the messages it receives to
+ * the interface. They are collected in a batch while the dispatcher has
+ * more messages queued (see vcan_mt_has_next()) and sent with a single
+ * `sendmmsg()`. A receiver thread reads the frames of the interface in
+ * batches with `recvmmsg()` and transmits them on the bus with vcan_mt_tx(),
+ * excluding the bridge node, so nothing is echoed back.
+ *
+ * Messages longer than 8 bytes are CAN FD frames, padded to the next valid
+ * CAN FD length, and CAN IDs above 0x7FF are extended IDs. Remote and error
+ * frames of the interface are ignored.
+ *
+ * Linux only. Requires POSIX threads.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_SOCKETCAN_H
+#define VCAN_SOCKETCAN_H
+
+#include "vcan.h"
+#include "vcan_mt.h"
+#include <stdbool.h>
+#include <pthread.h>
+#include <linux/can.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#ifndef VCAN_SOCKETCAN_BATCH_LEN
+/** Max amount of frames sent or received with one system call. */
+#define VCAN_SOCKETCAN_BATCH_LEN 32U
+#endif
+
+/**
+ * Bridge between a multi-threaded bus and a SocketCAN interface.
+ *
+ * Initialise it with vcan_socketcan_open(), do not access its fields
+ * directly.
+ */
+typedef struct
+{
+    /** Node connected to \p bus, sending to the interface. */
+    vcan_node_t node;
+
+    /** The bridged bus. */
+    vcan_bus_mt_t* bus;
+
+    /** The raw CAN socket bound to the interface. */
+    int fd;
+
+    /** Pipe waking up the receiver thread to stop it. */
+    int stop_pipe[2];
+
+    /** True if the interface accepts CAN FD frames. */
+    bool fd_frames;
+
+    /** Frames waiting to be sent, touched by the dispatcher only. Classic
+     * frames use only the first #CAN_MTU bytes. */
+    struct canfd_frame tx_frames[VCAN_SOCKETCAN_BATCH_LEN];
+
+    /** Amount of frames in \p tx_frames. */
+    size_t tx_len;
+
+    /** Messages not sent to the interface: too long for it or refused. */
+    VCAN_ATOMIC(uint_least64_t) tx_dropped;
+
+    /** Frames of the interface not transmitted on the full bus. */
+    VCAN_ATOMIC(uint_least64_t) rx_dropped;
+
+    /** The receiver thread. */
+    pthread_t receiver;
+} vcan_socketcan_t;
+
+/**
+ * Opens the interface, connects the bridge node to the bus and starts the
+ * receiver thread.
+ *
+ * CAN FD is enabled when the interface supports it, otherwise only the
+ * messages of up to 8 bytes are bridged.
+ *
+ * @param bridge not NULL
+ * @param bus not NULL, initialised, valid until closed
+ * @param ifname not NULL, name of the interface, e.g. `"vcan0"`
+ * @return
+ * - #VCAN_NULL_NODE on \p bridge being NULL
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - #VCAN_NULL_STORAGE on \p ifname being NULL
+ * - #VCAN_IO_FAILED on the interface not existing or the socket failing
+ * - #VCAN_THREAD_FAILED on the receiver failing to start
+ * - the errors of vcan_mt_connect()
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_socketcan_open(vcan_socketcan_t* bridge,
+                               vcan_bus_mt_t* bus,
+                               const char* ifname);
+
+/**
+ * Stops the receiver thread, disconnects the bridge node, sends the frames
+ * still batched and closes the socket.
+ *
+ * Must not be called from a callback.
+ *
+ * @param bridge not NULL, opened
+ * @return
+ * - #VCAN_NULL_NODE on \p bridge being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_socketcan_close(vcan_socketcan_t* bridge);
+
+/**
+ * Amount of messages of the bus not sent to the interface, because they
+ * are too long for it or the socket refused them.
+ *
+ * @param bridge not NULL, opened
+ * @return the dropped messages
+ */
+uint64_t vcan_socketcan_tx_dropped(const vcan_socketcan_t* bridge);
+
+/**
+ * Amount of frames of the interface not transmitted on the bus, because its
+ * queue was full.
+ *
+ * @param bridge not NULL, opened
+ * @return the dropped frames
+ */
+uint64_t vcan_socketcan_rx_dropped(const vcan_socketcan_t* bridge);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* VCAN_SOCKETCAN_H */
@@ -0,0 +1,224 @@
+/**
+ * @file
+ *
+ * VCAN static topology: transmission functions generated at compile time
+ * for a fixed set of nodes and CAN IDs.
+ *
+ * When the nodes of a bus and the IDs each of them receives are known at
+ * build time, VCAN_STATIC_TX() generates a specialised transmission function
+ * from an X-macro list of routes: a `switch` on the CAN ID, which the
+ * compiler turns into a jump table or a binary search, with a direct call
+ * of the callback of each receiving node in each case. There is no node
+ * table to walk, no filter to match and, as the callbacks are named, no
+ * indirect call.
+ *
+ * ```c
+ * vcan_node_t engine = {.id = 1};
+ * vcan_node_t brakes = {.id = 2};
+ *
+ * #define BODY_ROUTES(ROUTE, TO) \
+ *     ROUTE(0x100, TO(engine, engine_rx) TO(brakes, brakes_rx)) \
+ *     ROUTE(0x200, TO(brakes, brakes_rx))
+ *
+ * VCAN_STATIC_TX(body_tx, BODY_ROUTES)
+ *
+ * body_tx(&msg, &engine);  // brakes_rx(&brakes, &msg) if msg.id is 0x100
+ * ```
+ *
+ * Each `ROUTE(id, deliveries)` lists the deliveries of the messages with
+ * that CAN ID, in order, each `TO(node, callback)` a node object and its
+ * callback. Messages with IDs not listed are delivered to nobody. Listing
+ * an ID twice does not compile.
+ *
+ * The generated function works like vcan_tx_ref(): the callbacks obtain the
+ * caller's message and the transmitting node is excluded, unless
+ * `VCAN_NO_SRC_EXCLUSION` is defined. It does not use a #vcan_bus_t at all,
+ * so there are no hooks, receive queues, metadata or statistics: these
+ * require the regular bus, which the static functions can be mixed with.
+ *
+ * In C++, the vcan::static_bus template does the same with the routes as
+ * template arguments, see its documentation.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_STATIC_H
+#define VCAN_STATIC_H
+
+#include "vcan.h"
+
+#ifdef VCAN_NO_SRC_EXCLUSION
+/** Delivery to one node of a static route. For internal use only. */
+#define VCAN_STATIC_TO(node, callback) \
+    callback(&(node), msg);
+#else
+/** Delivery to one node of a static route. For internal use only. */
+#define VCAN_STATIC_TO(node, callback) \
+    if (&(node) != src_node) \
+    { \
+        callback(&(node), msg); \
+    }
+#endif
+
+/** Case of the switch of a static route. For internal use only. */
+#define VCAN_STATIC_ROUTE(id, deliveries) \
+    case (id): \
+        deliveries \
+        break;
+
+/**
+ * Defines the function \p name, transmitting a message to the nodes of the
+ * static routes listed by \p routes, see the file documentation.
+ *
+ * The function is `static inline`, with the signature
+ * `vcan_err_t name(const vcan_msg_t* msg, const vcan_node_t* src_node)`,
+ * returning #VCAN_NULL_MSG on \p msg being NULL and #VCAN_OK otherwise.
+ *
+ * @param name of the generated function
+ * @param routes X-macro taking the `ROUTE` and `TO` macros and expanding to
+ *        the `ROUTE(id, TO(node, callback) ...)` list
+ */
+#define VCAN_STATIC_TX(name, routes) \
+    static inline vcan_err_t name(const vcan_msg_t* const msg, \
+                                  const vcan_node_t* const src_node) \
+    { \
+        vcan_err_t err = VCAN_NULL_MSG; \
+        (void) src_node; \
+        if (msg != NULL) \
+        { \
+            switch (msg->id) \
+            { \
+                routes(VCAN_STATIC_ROUTE, VCAN_STATIC_TO) \
+                default: \
+                    break; \
+            } \
+            err = VCAN_OK; \
+        } \
+        return err; \
+    }
+
+#ifdef __cplusplus
+
+/** C++ wrappers of VCAN. */
+namespace vcan
+{
+
+/**
+ * Delivery to a node with its callback, both known at compile time, for
+ * vcan::route.
+ *
+ * @tparam Node node object with static storage duration
+ * @tparam Callback called directly with the node and the message
+ */
+template<vcan_node_t& Node,
+         void (* Callback)(vcan_node_t* node, const vcan_msg_t* msg)>
+struct to
+{
+    /** Calls the callback, unless the node is the transmitter. */
+    static inline void deliver(const vcan_msg_t* const msg,
+                               const vcan_node_t* const src_node)
+    {
+#ifdef VCAN_NO_SRC_EXCLUSION
+        (void) src_node;
+        Callback(&Node, msg);
+#else
+        if (&Node != src_node)
+        {
+            Callback(&Node, msg);
+        }
+#endif
+    }
+};
+
+/**
+ * Static route of vcan::static_bus: the messages with CAN ID \p Id are
+ * delivered through each of \p Tos, in order.
+ *
+ * @tparam Id CAN ID
+ * @tparam Tos vcan::to deliveries
+ */
+template<uint32_t Id, typename... Tos>
+struct route
+{
+    /** The CAN ID of the route. */
+    static constexpr uint32_t id = Id;
+
+    /** Delivers the message through all deliveries of the route. */
+    static inline void deliver(const vcan_msg_t* const msg,
+                               const vcan_node_t* const src_node)
+    {
+        const int expand[] = {0, (Tos::deliver(msg, src_node), 0)...};
+        (void) expand;
+    }
+};
+
+/**
+ * Bus with a static topology, the C++ counterpart of VCAN_STATIC_TX():
+ *
+ * ```cpp
+ * using body_bus = vcan::static_bus<
+ *         vcan::route<0x100, vcan::to<engine, engine_rx>,
+ *                            vcan::to<brakes, brakes_rx>>,
+ *         vcan::route<0x200, vcan::to<brakes, brakes_rx>>>;
+ *
+ * body_bus::tx(&msg, &engine);
+ * ```
+ *
+ * The routes are compared one after the other, which the compiler unrolls
+ * and, with constant IDs, usually turns into a jump table as well. Only the
+ * first route with the ID of the message delivers it, the IDs should be
+ * distinct.
+ *
+ * @tparam Routes vcan::route list
+ */
+template<typename... Routes>
+struct static_bus
+{
+    /**
+     * Transmits the message to the nodes of the route of its CAN ID.
+     *
+     * @param msg the message, passed as is to the callbacks
+     * @param src_node the transmitting node, excluded from the delivery,
+     *        can be NULL
+     * @return #VCAN_NULL_MSG on \p msg being NULL, #VCAN_OK otherwise
+     */
+    static inline vcan_err_t tx(const vcan_msg_t* const msg,
+                                const vcan_node_t* const src_node = nullptr)
+    {
+        vcan_err_t err = VCAN_NULL_MSG;
+        if (msg != nullptr)
+        {
+            bool delivered = false;
+            const int expand[] = {
+                    0, (delivered = delivered
+                                    || static_bus::deliver_if<Routes>(
+                                            msg, src_node), 0)...
+            };
+            (void) expand;
+            err = VCAN_OK;
+        }
+        return err;
+    }
+
+private:
+    /** Delivers through the route if the message has its ID. */
+    template<typename Route>
+    static inline bool deliver_if(const vcan_msg_t* const msg,
+                                  const vcan_node_t* const src_node)
+    {
+        const bool matches = msg->id == Route::id;
+        if (matches)
+        {
+            Route::deliver(msg, src_node);
+        }
+        return matches;
+    }
+};
+
+}  /* namespace vcan */
+
+#endif  /* __cplusplus */
+
+#endif  /* VCAN_STATIC_H */
@@ -0,0 +1,243 @@
+/**
+ * @file
+ *
+ * VCAN trace recording and replay.
+ *
+ * A #vcan_trace_recorder_t embeds a node which, once connected to a bus,
+ * appends every received message with its timestamp into one half of a
+ * caller-provided arena. When the half is full, a flusher thread writes it
+ * to the file while the other half keeps recording, so the transmitting
+ * thread never performs a system call for a single message.
+ *
+ * A #vcan_trace_replay_t maps a recorded file into memory and streams its
+ * messages into vcan_tx_burst(), at full speed or respecting the recorded
+ * timing.
+ *
+ * The file starts with the 8-byte magic #VCAN_TRACE_MAGIC, followed by
+ * back-to-back records: an 8-byte little-endian timestamp in nanoseconds
+ * followed by the message as a packed frame, see vcan_pack().
+ *
+ * Requires POSIX threads, files and memory mapping.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#ifndef VCAN_TRACE_H
+#define VCAN_TRACE_H
+
+#include "vcan.h"
+#include <stdbool.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** First bytes of every trace file, identifying the format and version. */
+#define VCAN_TRACE_MAGIC "VCANTRC1"
+
+/** Length of #VCAN_TRACE_MAGIC in the file, without terminator. */
+#define VCAN_TRACE_MAGIC_LEN 8U
+
+/** Length of the timestamp preceding each packed frame. */
+#define VCAN_TRACE_TIMESTAMP_LEN 8U
+
+/** Size in bytes of the largest record. */
+#define VCAN_TRACE_RECORD_MAX_LEN \
+    (VCAN_TRACE_TIMESTAMP_LEN + VCAN_PACKED_SIZE(VCAN_DATA_MAX_LEN))
+
+#ifndef VCAN_TRACE_BATCH_LEN
+/** Max amount of messages the replay passes to one vcan_tx_burst(). */
+#define VCAN_TRACE_BATCH_LEN 32U
+#endif
+
+/** Replay the messages as fast as possible, ignoring the timestamps. */
+#define VCAN_TRACE_FULL_SPEED 0U
+
+/** Replay the messages with the recorded intervals between them. */
+#define VCAN_TRACE_REAL_TIME 1U
+
+/**
+ * Recorder of the messages received by its node into a trace file.
+ *
+ * Initialise it with vcan_trace_recorder_open(), connect its \p node to the
+ * buses to record, do not access the other fields directly.
+ */
+typedef struct
+{
+    /** Node to connect to the buses to record. */
+    vcan_node_t node;
+
+    /** The two halves of the arena: one records, the other one is flushed. */
+    uint8_t* buffers[2];
+
+    /** Size of each half of the arena. */
+    size_t buffer_len;
+
+    /** Index of the half being recorded into. */
+    size_t active;
+
+    /** Used bytes of the half being recorded into. */
+    size_t used;
+
+    /** Bytes of the half waiting for the flusher, 0 when none. */
+    size_t pending_len;
+
+    /** Timestamp source, in nanoseconds. NULL for the monotonic clock. */
+    uint64_t (* now)(void* ctx);
+
+    /** Context passed to \p now. */
+    void* now_ctx;
+
+    /** Descriptor of the trace file. */
+    int fd;
+
+    /** True while the flusher should keep running. */
+    bool running;
+
+    /** True after any write to the file failed. */
+    bool io_failed;
+
+    /** The flusher thread. */
+    pthread_t flusher;
+
+    /** Protects the handover of the buffers. */
+    pthread_mutex_t lock;
+
+    /** Signalled when a buffer is waiting to be flushed. */
+    pthread_cond_t filled;
+
+    /** Signalled when the flusher has written a buffer. */
+    pthread_cond_t flushed;
+} vcan_trace_recorder_t;
+
+/**
+ * Creates the trace file and starts the recorder's flusher thread.
+ *
+ * The records are written to the file only when half of the arena is full
+ * or on vcan_trace_recorder_close(). When the flusher is still writing the
+ * previous half, the recording waits for it rather than losing messages.
+ *
+ * @param recorder not NULL
+ * @param path not NULL, file to create or truncate
+ * @param arena not NULL, storage of the two buffers, valid until closed
+ * @param arena_len bytes in \p arena, at least twice
+ *        #VCAN_TRACE_RECORD_MAX_LEN. Larger arenas mean fewer, larger writes.
+ * @param now timestamp source in nanoseconds, can be NULL for the monotonic
+ *        clock
+ * @param now_ctx passed to \p now, can be NULL
+ * @return
+ * - #VCAN_NULL_NODE on \p recorder being NULL
+ * - #VCAN_NULL_STORAGE on \p path or \p arena being NULL
+ * - #VCAN_INVALID_CAPACITY on \p arena_len being too small
+ * - #VCAN_IO_FAILED on the file not being writable
+ * - #VCAN_THREAD_FAILED on the flusher failing to start
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_trace_recorder_open(vcan_trace_recorder_t* recorder,
+                                    const char* path,
+                                    uint8_t* arena,
+                                    size_t arena_len,
+                                    uint64_t (* now)(void* ctx),
+                                    void* now_ctx);
+
+/**
+ * Writes the remaining records, stops the flusher and closes the file.
+ *
+ * The node must be disconnected from all buses before.
+ *
+ * @param recorder not NULL, opened
+ * @return
+ * - #VCAN_NULL_NODE on \p recorder being NULL
+ * - #VCAN_IO_FAILED on any write having failed since opening
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_trace_recorder_close(vcan_trace_recorder_t* recorder);
+
+/**
+ * Replay of a trace file, mapped into memory.
+ *
+ * Initialise it with vcan_trace_replay_open(), do not access its fields
+ * directly.
+ */
+typedef struct
+{
+    /** The mapped file. */
+    const uint8_t* data;
+
+    /** Bytes in \p data. */
+    size_t len;
+
+    /** Position of the next record to replay. */
+    size_t offset;
+
+    /** Time the replay is aligned to in real-time mode, in nanoseconds of
+     * the monotonic clock. */
+    uint64_t start_time;
+
+    /** Timestamp of the first replayed record. */
+    uint64_t start_timestamp;
+} vcan_trace_replay_t;
+
+/**
+ * Maps the trace file into memory and checks its magic.
+ *
+ * @param replay not NULL
+ * @param path not NULL, trace file
+ * @return
+ * - #VCAN_NULL_STORAGE on \p replay or \p path being NULL
+ * - #VCAN_IO_FAILED on the file not being readable or mappable
+ * - #VCAN_INVALID_PACKED on the file not starting with #VCAN_TRACE_MAGIC
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_trace_replay_open(vcan_trace_replay_t* replay,
+                                  const char* path);
+
+/**
+ * Transmits all remaining messages of the trace on the bus, in batches of up
+ * to #VCAN_TRACE_BATCH_LEN messages through vcan_tx_burst().
+ *
+ * In #VCAN_TRACE_REAL_TIME mode, each batch contains only the messages that
+ * are due and the replay sleeps until the next one is, so the intervals
+ * between the recorded timestamps are reproduced.
+ *
+ * A failed transmission, e.g. rejected by the transmit hook, does not stop
+ * the replay: the rest of its batch is lost, like after vcan_tx_burst(), and
+ * the following batches are transmitted anyway. The first error is
+ * returned.
+ *
+ * @param replay not NULL, opened
+ * @param bus not NULL
+ * @param mode #VCAN_TRACE_FULL_SPEED or #VCAN_TRACE_REAL_TIME
+ * @param src_node node excluded from the reception, can be NULL
+ * @return
+ * - #VCAN_NULL_STORAGE on \p replay being NULL
+ * - #VCAN_NULL_BUS on \p bus being NULL
+ * - the error of the first failed transmission, see vcan_tx_burst()
+ * - #VCAN_INVALID_PACKED on a truncated or corrupted record: the messages
+ *   before it have already been transmitted
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_trace_replay(vcan_trace_replay_t* replay,
+                             vcan_bus_t* bus,
+                             uint32_t mode,
+                             const vcan_node_t* src_node);
+
+/**
+ * Unmaps the trace file.
+ *
+ * @param replay not NULL
+ * @return
+ * - #VCAN_NULL_STORAGE on \p replay being NULL
+ * - #VCAN_OK otherwise
+ */
+vcan_err_t vcan_trace_replay_close(vcan_trace_replay_t* replay);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* VCAN_TRACE_H */
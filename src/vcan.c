@@ -3,122 +3,3001 @@
  *
  * VCAN library implementation.
  *
+ * Also included by vcan.h in the header-only build, see `VCAN_HEADER_ONLY`.
+ *
  * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
  * <https://matjaz.it>. All rights reserved.
  * @license BSD 3-clause license.
  */
 
+#ifndef VCAN_C
+#define VCAN_C
+
 #include "vcan.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#if defined(VCAN_NO_SIMD)
+// Scalar filter matching only
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define VCAN_SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define VCAN_SIMD_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VCAN_SIMD_NEON
+#endif
+
+/** Nodes whose filter summaries are matched into one bitmask. */
+#define VCAN_MATCH_BLOCK 32U
+
+VCAN_API vcan_err_t vcan_init(vcan_bus_t* const bus)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        memset(bus, 0, sizeof(vcan_bus_t));
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_init_ex(vcan_bus_t* const bus,
+                                 vcan_node_t** const nodes,
+                                 const size_t capacity)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (nodes == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (capacity == 0)
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        memset(bus, 0, sizeof(vcan_bus_t));
+        bus->table = nodes;
+        bus->capacity = capacity;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+/**
+ * The transmitting node to skip during the delivery, NULL when
+ * `VCAN_NO_SRC_EXCLUSION` is defined.
+ */
+static inline const vcan_node_t* vcan_excluded(
+        const vcan_node_t* const src_node)
+{
+#ifdef VCAN_NO_SRC_EXCLUSION
+    (void) src_node;
+    return NULL;
+#else
+    return src_node;
+#endif
+}
+
+VCAN_API uint64_t vcan_timestamp(const vcan_bus_t* const bus)
+{
+    uint64_t now = 0;
+    if (bus != NULL && (bus->flags & VCAN_BUS_TIMESTAMPS)
+        && bus->clock_now != NULL)
+    {
+        now = bus->clock_now(bus->clock_ctx);
+    }
+    return now;
+}
+
+/** Fills the metadata of the message being delivered to one node. */
+static inline void vcan_stamp(const vcan_bus_t* const bus,
+                              vcan_meta_t* const meta)
+{
+    meta->seq = bus->meta.seq;
+    meta->tx_time = bus->meta.tx_time;
+    meta->rx_time = vcan_timestamp(bus);
+}
+
+/** The node table in use: the caller-provided one or the embedded one. */
+static inline vcan_node_t** vcan_nodes(vcan_bus_t* const bus)
+{
+    return bus->table != NULL ? bus->table : bus->nodes;
+}
+
+/** Filter summary codes of the node table in use, NULL if it has none. */
+static inline uint32_t* vcan_codes(vcan_bus_t* const bus)
+{
+    return bus->table != NULL ? bus->table_codes : bus->codes;
+}
+
+/** Filter summary masks of the node table in use, NULL if it has none. */
+static inline uint32_t* vcan_masks(vcan_bus_t* const bus)
+{
+    return bus->table != NULL ? bus->table_masks : bus->masks;
+}
+
+/** Max amount of nodes fitting into the node table in use. */
+static inline size_t vcan_capacity(const vcan_bus_t* const bus)
+{
+    return bus->table != NULL ? bus->capacity : VCAN_MAX_CONNECTED_NODES;
+}
+
+/** Current time of the bus clock, 0 without a clock. */
+static inline uint64_t vcan_now(const vcan_bus_t* const bus)
+{
+    return bus->clock_now != NULL ? bus->clock_now(bus->clock_ctx) : 0U;
+}
+
+#ifdef VCAN_STATS
+/** Adds to a counter with a single writer: no atomic read-modify-write. */
+static inline void vcan_stat_add(VCAN_ATOMIC(uint64_t)* const counter,
+                                 const uint64_t amount)
+{
+    atomic_store_explicit(
+            counter,
+            atomic_load_explicit(counter, memory_order_relaxed) + amount,
+            memory_order_relaxed);
+}
+
+/** Sum of the payload lengths of the messages. */
+static uint64_t vcan_stat_bytes(const vcan_msg_t* const msgs,
+                                const size_t count)
+{
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        bytes += msgs[i].len;
+    }
+    return bytes;
+}
+
+#define VCAN_STAT_TX(bus, msgs, count) do { \
+    vcan_stat_add(&(bus)->stats.tx_frames, (count)); \
+    vcan_stat_add(&(bus)->stats.tx_bytes, vcan_stat_bytes((msgs), (count))); \
+} while (0)
+#define VCAN_STAT_RX(node, msgs, count) do { \
+    vcan_stat_add(&(node)->stats.rx_frames, (count)); \
+    vcan_stat_add(&(node)->stats.rx_bytes, vcan_stat_bytes((msgs), (count))); \
+} while (0)
+/* The drops are also counted by the transmitters of the multi-threaded bus,
+ * thus a read-modify-write. */
+#define VCAN_STAT_DROP(bus) \
+    atomic_fetch_add_explicit(&(bus)->stats.dropped, 1U, memory_order_relaxed)
+#define VCAN_STAT_START(bus) vcan_now(bus)
+#define VCAN_STAT_CALLBACK(bus, node, start) \
+    vcan_stat_add(&(node)->stats.callback_time, vcan_now(bus) - (start))
+#else
+#define VCAN_STAT_TX(bus, msgs, count) ((void) 0)
+#define VCAN_STAT_RX(node, msgs, count) ((void) 0)
+#define VCAN_STAT_DROP(bus) ((void) 0)
+#define VCAN_STAT_START(bus) 0U
+#define VCAN_STAT_CALLBACK(bus, node, start) ((void) (start))
+#endif
+
+#ifdef VCAN_PROBES
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define VCAN_USDT(name, a, b, c) DTRACE_PROBE3(vcan, name, a, b, c)
+#endif
+#endif
+#ifndef VCAN_USDT
+#define VCAN_USDT(name, a, b, c) ((void) 0)
+#endif
+#define VCAN_PROBE(bus, name, a, b) do { \
+    VCAN_USDT(name, (bus), (a), (b)); \
+    if ((bus)->probes != NULL && (bus)->probes->name != NULL) \
+    { \
+        (bus)->probes->name((bus)->probes->ctx, (bus), (a), (b)); \
+    } \
+} while (0)
+#define VCAN_PROBE_TX_ENTRY(bus, msgs, count) \
+    VCAN_PROBE(bus, tx_entry, msgs, count)
+#define VCAN_PROBE_DISPATCH(bus, node, msg) VCAN_PROBE(bus, dispatch, node, msg)
+#define VCAN_PROBE_TX_EXIT(bus, msgs, count) \
+    VCAN_PROBE(bus, tx_exit, msgs, count)
+#else
+#define VCAN_PROBE_TX_ENTRY(bus, msgs, count) ((void) 0)
+#define VCAN_PROBE_DISPATCH(bus, node, msg) ((void) 0)
+#define VCAN_PROBE_TX_EXIT(bus, msgs, count) ((void) 0)
+#endif
+
+/** The histogram to record the starting fan-out into, NULL if none. */
+static inline vcan_hist_t* vcan_hist_of(const vcan_bus_t* const bus)
+{
+    return bus->clock_now != NULL ? bus->hist : NULL;
+}
+
+/** Records the duration of the fan-out started at \p start, if any. */
+static inline void vcan_hist_since(const vcan_bus_t* const bus,
+                                   vcan_hist_t* const hist,
+                                   const uint64_t start)
+{
+    if (hist != NULL)
+    {
+        const uint64_t end = vcan_now(bus);
+        vcan_hist_record(hist, end > start ? end - start : 0U);
+    }
+}
+
+/** Binary search of the CAN ID in the sorted exact-ID list. */
+static bool vcan_id_in_list(const uint32_t* const ids,
+                            const size_t ids_len,
+                            const uint32_t id)
+{
+    size_t low = 0;
+    size_t high = ids_len;
+    bool found = false;
+    while (low < high && !found)
+    {
+        const size_t mid = low + (high - low) / 2;
+        if (ids[mid] < id)
+        {
+            low = mid + 1;
+        }
+        else if (ids[mid] > id)
+        {
+            high = mid;
+        }
+        else
+        {
+            found = true;
+        }
+    }
+    return found;
+}
+
+/** True if the node's acceptance filters let the CAN ID through. */
+static bool vcan_accepts(const vcan_node_t* const node, const uint32_t id)
+{
+    const vcan_acceptance_t* const acc = &node->acceptance;
+    bool accepted;
+    if ((id & acc->summary.mask) != acc->summary.id)
+    {
+        accepted = false;
+    }
+    else if (acc->filters_len == 0 && acc->ids_len == 0)
+    {
+        accepted = true;
+    }
+    else
+    {
+        accepted = vcan_id_in_list(acc->ids, acc->ids_len, id);
+        for (size_t i = 0; i < acc->filters_len && !accepted; i++)
+        {
+            accepted = (id & acc->filters[i].mask)
+                       == (acc->filters[i].id & acc->filters[i].mask);
+        }
+    }
+    return accepted;
+}
+
+/**
+ * Matches the CAN ID against up to #VCAN_MATCH_BLOCK filter summaries.
+ *
+ * @return bit i set if the summary i lets the CAN ID through
+ */
+static uint32_t vcan_match_block(const uint32_t* const codes,
+                                 const uint32_t* const masks,
+                                 const size_t count,
+                                 const uint32_t id)
+{
+    uint32_t matches = 0;
+    size_t i = 0;
+#if defined(VCAN_SIMD_AVX2)
+    const __m256i ids = _mm256_set1_epi32((int) id);
+    for (; i + 8U <= count; i += 8U)
+    {
+        const __m256i masked = _mm256_and_si256(
+                ids, _mm256_loadu_si256((const __m256i*) &masks[i]));
+        const __m256i equal = _mm256_cmpeq_epi32(
+                masked, _mm256_loadu_si256((const __m256i*) &codes[i]));
+        matches |= (uint32_t) _mm256_movemask_ps(
+                _mm256_castsi256_ps(equal)) << i;
+    }
+#elif defined(VCAN_SIMD_SSE2)
+    const __m128i ids = _mm_set1_epi32((int) id);
+    for (; i + 4U <= count; i += 4U)
+    {
+        const __m128i masked = _mm_and_si128(
+                ids, _mm_loadu_si128((const __m128i*) &masks[i]));
+        const __m128i equal = _mm_cmpeq_epi32(
+                masked, _mm_loadu_si128((const __m128i*) &codes[i]));
+        matches |= (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(equal)) << i;
+    }
+#elif defined(VCAN_SIMD_NEON)
+    static const uint32_t lane_bits[4] = {1U, 2U, 4U, 8U};
+    const uint32x4_t ids = vdupq_n_u32(id);
+    const uint32x4_t bits = vld1q_u32(lane_bits);
+    for (; i + 4U <= count; i += 4U)
+    {
+        const uint32x4_t equal = vceqq_u32(
+                vandq_u32(ids, vld1q_u32(&masks[i])), vld1q_u32(&codes[i]));
+        matches |= vaddvq_u32(vandq_u32(equal, bits)) << i;
+    }
+#endif
+    for (; i < count; i++)
+    {
+        if ((id & masks[i]) == codes[i])
+        {
+            matches |= 1U << i;
+        }
+    }
+    return matches;
+}
+
+/** Position of the lowest set bit, which must exist. */
+static inline uint32_t vcan_lowest_bit(const uint32_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (uint32_t) __builtin_ctz(bits);
+#else
+    uint32_t position = 0;
+    while (((bits >> position) & 1U) == 0)
+    {
+        position++;
+    }
+    return position;
+#endif
+}
+
+/** Position plus 1 of the frame in its pool, as linked in the free list. */
+static inline uint32_t vcan_frame_link(const vcan_frame_t* const frame)
+{
+    return (uint32_t) (frame - frame->pool->frames) + 1U;
+}
+
+VCAN_API vcan_frame_t* vcan_frame_alloc(vcan_bus_t* const bus)
+{
+    vcan_frame_t* frame = NULL;
+    if (bus != NULL && bus->pool.frames != NULL)
+    {
+        vcan_pool_t* const pool = &bus->pool;
+        uint64_t head = atomic_load_explicit(&pool->free_head,
+                                             memory_order_acquire);
+        bool done = false;
+        while (!done)
+        {
+            const uint32_t link = (uint32_t) head;
+            if (link == 0)
+            {
+                atomic_fetch_add_explicit(&pool->exhausted, 1U,
+                                          memory_order_relaxed);
+                done = true;
+            }
+            else
+            {
+                vcan_frame_t* const top = &pool->frames[link - 1U];
+                const uint64_t next = atomic_load_explicit(
+                        &top->next_free, memory_order_relaxed);
+                // The counter changes at each pop, so a frame popped and
+                // pushed back meanwhile does not match
+                const uint64_t popped = ((head >> 32U) + 1U) << 32U | next;
+                if (atomic_compare_exchange_weak_explicit(
+                        &pool->free_head, &head, popped,
+                        memory_order_acquire, memory_order_acquire))
+                {
+                    frame = top;
+                    done = true;
+                }
+            }
+        }
+    }
+    if (frame != NULL)
+    {
+        vcan_pool_t* const pool = frame->pool;
+        atomic_store_explicit(&frame->refs, 1U, memory_order_relaxed);
+        const size_t in_use = atomic_fetch_add_explicit(
+                &pool->in_use, 1U, memory_order_relaxed) + 1U;
+        size_t high_water = atomic_load_explicit(&pool->high_water,
+                                                 memory_order_relaxed);
+        while (in_use > high_water
+               && !atomic_compare_exchange_weak_explicit(
+                       &pool->high_water, &high_water, in_use,
+                       memory_order_relaxed, memory_order_relaxed))
+        {
+            // Retry with the updated high-water mark
+        }
+    }
+    return frame;
+}
+
+VCAN_API void vcan_frame_retain(vcan_frame_t* const frame)
+{
+    if (frame != NULL)
+    {
+        atomic_fetch_add_explicit(&frame->refs, 1U, memory_order_relaxed);
+    }
+}
+
+VCAN_API void vcan_frame_release(vcan_frame_t* const frame)
+{
+    if (frame != NULL && atomic_fetch_sub_explicit(
+            &frame->refs, 1U, memory_order_acq_rel) == 1U)
+    {
+        vcan_pool_t* const pool = frame->pool;
+        const uint64_t link = vcan_frame_link(frame);
+        uint64_t head = atomic_load_explicit(&pool->free_head,
+                                             memory_order_relaxed);
+        uint64_t pushed;
+        do
+        {
+            atomic_store_explicit(&frame->next_free, (uint32_t) head,
+                                  memory_order_relaxed);
+            pushed = (head & ~(uint64_t) UINT32_MAX) | link;
+        } while (!atomic_compare_exchange_weak_explicit(
+                &pool->free_head, &head, pushed,
+                memory_order_release, memory_order_relaxed));
+        atomic_fetch_sub_explicit(&pool->in_use, 1U, memory_order_relaxed);
+    }
+}
+
+/**
+ * A reference to the frame holding the message: the one of the current
+ * delivery or, if it is for another message, a new copy. NULL when the pool
+ * is exhausted or missing.
+ */
+static vcan_frame_t* vcan_frame_for(vcan_bus_t* const bus,
+                                    const vcan_msg_t* const msg)
+{
+    vcan_frame_t* frame = bus->frame;
+    if (frame != NULL && &frame->msg == msg)
+    {
+        vcan_frame_retain(frame);
+    }
+    else
+    {
+        frame = vcan_frame_alloc(bus);
+        if (frame != NULL)
+        {
+            vcan_copy_msg(&frame->msg, msg);
+        }
+    }
+    return frame;
+}
+
+/**
+ * Whether the queue has a free slot at the tail position, called by the
+ * single producer.
+ */
+static bool vcan_rx_has_room(vcan_rx_queue_t* const queue, const size_t tail)
+{
+    bool room = true;
+    if (tail - queue->head_cache >= queue->capacity)
+    {
+        // Looks full: refresh the consumer position, which is more expensive
+        queue->head_cache = atomic_load_explicit(&queue->head,
+                                                 memory_order_acquire);
+        room = tail - queue->head_cache < queue->capacity;
+    }
+    return room;
+}
+
+/**
+ * Copies the message into the free slot at the tail position and publishes
+ * it, called by the single producer.
+ *
+ * @return false if the queue is in shared mode and the pool is exhausted
+ */
+static bool vcan_rx_put(vcan_bus_t* const bus,
+                        vcan_rx_queue_t* const queue,
+                        const size_t tail,
+                        const vcan_msg_t* const msg)
+{
+    bool put = true;
+    if (queue->frames != NULL)
+    {
+        vcan_frame_t* const frame = vcan_frame_for(bus, msg);
+        queue->frames[tail & (queue->capacity - 1)] = frame;
+        put = frame != NULL;
+    }
+    else
+    {
+        vcan_copy_msg(&queue->msgs[tail & (queue->capacity - 1)], msg);
+    }
+    if (put)
+    {
+        if (queue->metas != NULL)
+        {
+            vcan_stamp(bus, &queue->metas[tail & (queue->capacity - 1)]);
+        }
+        atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    }
+    return put;
+}
+
+/** Whether the overflow arena still holds messages, called by the producer. */
+static bool vcan_rx_spilling(vcan_rx_queue_t* const spill)
+{
+    const size_t tail = atomic_load_explicit(&spill->tail,
+                                             memory_order_relaxed);
+    if (spill->head_cache != tail)
+    {
+        spill->head_cache = atomic_load_explicit(&spill->head,
+                                                 memory_order_acquire);
+    }
+    return spill->head_cache != tail;
+}
+
+/**
+ * Applies the overflow policy to the full queue, called by the single
+ * producer.
+ *
+ * @return #VCAN_OK if a slot got free meanwhile, otherwise what the policy
+ * did: #VCAN_DROPPED_OLDEST after freeing the slot of the oldest message,
+ * #VCAN_SPILLED if the message must go into the overflow arena,
+ * #VCAN_DROPPED_NEWEST or #VCAN_TX_TIMEOUT if it must be dropped
+ */
+static vcan_err_t vcan_rx_overflow(vcan_bus_t* const bus,
+                                   vcan_rx_queue_t* const queue,
+                                   const size_t tail)
+{
+    vcan_err_t err;
+    if (queue->policy == VCAN_RX_DROP_OLDEST)
+    {
+        // Only the consumer's releases move the head, so the oldest message
+        // is not being read if nothing was taken past it
+        size_t head = queue->head_cache;
+        if (atomic_compare_exchange_strong_explicit(
+                &queue->claim, &head, head + 1,
+                memory_order_acq_rel, memory_order_relaxed))
+        {
+            if (queue->frames != NULL)
+            {
+                vcan_frame_release(
+                        queue->frames[head & (queue->capacity - 1)]);
+            }
+            // Fails only if the consumer released the next ones meanwhile
+            size_t expected = head;
+            atomic_compare_exchange_strong_explicit(
+                    &queue->head, &expected, head + 1,
+                    memory_order_release, memory_order_relaxed);
+            queue->head_cache = head + 1;
+            err = VCAN_DROPPED_OLDEST;
+        }
+        else
+        {
+            // The consumer is dequeuing: there is room once it released
+            err = vcan_rx_has_room(queue, tail) ? VCAN_OK
+                                                : VCAN_DROPPED_NEWEST;
+        }
+    }
+    else if (queue->policy == VCAN_RX_BLOCK && bus->clock_now != NULL)
+    {
+        const uint64_t start = bus->clock_now(bus->clock_ctx);
+        bool room = false;
+        do
+        {
+            room = vcan_rx_has_room(queue, tail);
+        } while (!room
+                 && bus->clock_now(bus->clock_ctx) - start < queue->timeout);
+        err = room ? VCAN_OK : VCAN_TX_TIMEOUT;
+    }
+    else if (queue->policy == VCAN_RX_BLOCK)
+    {
+        err = VCAN_TX_TIMEOUT;
+    }
+    else if (queue->policy == VCAN_RX_SPILL)
+    {
+        err = VCAN_SPILLED;
+    }
+    else
+    {
+        err = VCAN_DROPPED_NEWEST;
+    }
+    return err;
+}
+
+/**
+ * Notifies the consumer of the queue if it is armed, called by the single
+ * producer after enqueueing.
+ */
+static void vcan_rx_notify(vcan_rx_queue_t* const queue)
+{
+    // Pairs with the fence of vcan_rx_drain(): either the consumer sees the
+    // new message or we see it armed.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->armed, memory_order_relaxed)
+        && atomic_exchange_explicit(&queue->armed, false,
+                                    memory_order_relaxed))
+    {
+        queue->notify(queue->notify_ctx);
+    }
+}
+
+/**
+ * Copies the message into the receive queue, called by the single producer.
+ * A full queue is handled according to its overflow policy.
+ *
+ * @return #VCAN_OK if enqueued, otherwise the #vcan_err_t reporting the
+ * overflow: #VCAN_DROPPED_OLDEST and #VCAN_SPILLED if enqueued anyway
+ */
+static vcan_err_t vcan_rx_push(vcan_bus_t* const bus,
+                               vcan_rx_queue_t* const queue,
+                               const vcan_msg_t* const msg)
+{
+    const size_t tail = atomic_load_explicit(&queue->tail,
+                                             memory_order_relaxed);
+    vcan_err_t err = VCAN_OK;
+    if (queue->spill != NULL && vcan_rx_spilling(queue->spill))
+    {
+        // Nothing enters the queue before the arena is drained, keeping the
+        // reception order
+        err = VCAN_SPILLED;
+    }
+    else if (!vcan_rx_has_room(queue, tail))
+    {
+        err = vcan_rx_overflow(bus, queue, tail);
+    }
+    if (err == VCAN_SPILLED)
+    {
+        vcan_rx_queue_t* const spill = queue->spill;
+        const size_t spill_tail = atomic_load_explicit(&spill->tail,
+                                                       memory_order_relaxed);
+        if (!vcan_rx_has_room(spill, spill_tail)
+            || !vcan_rx_put(bus, spill, spill_tail, msg))
+        {
+            err = VCAN_DROPPED_NEWEST;
+        }
+    }
+    else if ((err == VCAN_OK || err == VCAN_DROPPED_OLDEST)
+             && !vcan_rx_put(bus, queue, tail, msg))
+    {
+        err = VCAN_DROPPED_NEWEST;
+    }
+    if ((err == VCAN_OK || err == VCAN_SPILLED || err == VCAN_DROPPED_OLDEST)
+        && queue->notify != NULL)
+    {
+        vcan_rx_notify(queue);
+    }
+    if (err != VCAN_OK)
+    {
+        // Single writer: no need for an atomic read-modify-write.
+        if (err != VCAN_SPILLED)
+        {
+            atomic_store_explicit(
+                    &queue->overflows,
+                    atomic_load_explicit(&queue->overflows,
+                                         memory_order_relaxed) + 1,
+                    memory_order_relaxed);
+        }
+        atomic_store_explicit(&queue->last_overflow, (uint32_t) err,
+                              memory_order_relaxed);
+    }
+    return err;
+}
+
+/** Hands one message over to the node, by queue or by callback. */
+static void vcan_deliver(vcan_bus_t* const bus,
+                         vcan_node_t* const node,
+                         const vcan_msg_t* const msg)
+{
+    VCAN_PROBE_DISPATCH(bus, node, msg);
+    if (node->rx_queue != NULL)
+    {
+        const vcan_err_t pushed = vcan_rx_push(bus, node->rx_queue, msg);
+        if (pushed == VCAN_OK || pushed == VCAN_SPILLED
+            || pushed == VCAN_DROPPED_OLDEST)
+        {
+            VCAN_STAT_RX(node, msg, 1U);
+        }
+        if (pushed != VCAN_OK && pushed != VCAN_SPILLED)
+        {
+            VCAN_STAT_DROP(bus);
+        }
+    }
+    else
+    {
+        vcan_stamp(bus, &node->rx_meta);
+        const uint64_t start = VCAN_STAT_START(bus);
+        node->callback_on_rx(node, msg);
+        VCAN_STAT_CALLBACK(bus, node, start);
+        VCAN_STAT_RX(node, msg, 1U);
+    }
+}
+
+/**
+ * Delivers the message to every connected node accepting it, except the
+ * source node.
+ */
+static void vcan_fanout(vcan_bus_t* const bus,
+                        const vcan_msg_t* msg,
+                        const vcan_node_t* const src_node,
+                        const uint64_t tx_time)
+{
+    // Restored at the end for the transmission the callbacks are nested in
+    const vcan_meta_t outer_meta = bus->meta;
+    bus->meta.seq = ++bus->seq;
+    bus->meta.tx_time = tx_time;
+    // The frame of a transmission the callbacks are nested in, if any
+    vcan_frame_t* const outer = bus->frame;
+    const bool shared = outer != NULL && &outer->msg == msg;
+    if (!shared)
+    {
+        // Copied once for all queues, before any worker of a hook runs,
+        // and delivered from the frame so each queue just references it
+        bus->frame = bus->pool.frames != NULL
+                     ? vcan_frame_for(bus, msg) : NULL;
+        if (bus->frame != NULL)
+        {
+            msg = &bus->frame->msg;
+        }
+    }
+    vcan_hist_t* const hist = vcan_hist_of(bus);
+    const uint64_t start = hist != NULL ? vcan_now(bus) : 0U;
+    VCAN_PROBE_TX_ENTRY(bus, msg, 1U);
+    VCAN_STAT_TX(bus, msg, 1U);
+    if (bus->fanout_hook != NULL)
+    {
+        bus->fanout_hook(bus->fanout_ctx, bus, vcan_nodes(bus),
+                         bus->connected, msg, vcan_excluded(src_node));
+    }
+    else
+    {
+        vcan_node_t** const nodes = vcan_nodes(bus);
+        const uint32_t* const codes = vcan_codes(bus);
+        const uint32_t* const masks = vcan_masks(bus);
+        const vcan_node_t* const excluded = vcan_excluded(src_node);
+        if (codes == NULL || masks == NULL)
+        {
+            for (size_t i = 0; i < bus->connected; i++)
+            {
+                vcan_node_t* const node = nodes[i];
+                if (node != excluded && vcan_accepts(node, msg->id))
+                {
+                    vcan_deliver(bus, node, msg);
+                }
+            }
+        }
+        else
+        {
+            for (size_t block = 0; block < bus->connected;
+                 block += VCAN_MATCH_BLOCK)
+            {
+                const size_t remaining = bus->connected - block;
+                uint32_t matches = vcan_match_block(
+                        &codes[block], &masks[block],
+                        remaining < VCAN_MATCH_BLOCK
+                        ? remaining : VCAN_MATCH_BLOCK, msg->id);
+                while (matches != 0)
+                {
+                    const size_t i = block + vcan_lowest_bit(matches);
+                    matches &= matches - 1U;
+                    // The callbacks may have disconnected nodes meanwhile:
+                    // the summary is only a hint, the node decides
+                    if (i < bus->connected && nodes[i] != excluded
+                        && vcan_accepts(nodes[i], msg->id))
+                    {
+                        vcan_deliver(bus, nodes[i], msg);
+                    }
+                }
+            }
+        }
+    }
+    VCAN_PROBE_TX_EXIT(bus, msg, 1U);
+    vcan_hist_since(bus, hist, start);
+    if (!shared)
+    {
+        vcan_frame_release(bus->frame);
+        bus->frame = outer;
+    }
+    bus->meta = outer_meta;
+}
+
+/** Calls the burst callback with one run of accepted messages. */
+static void vcan_burst_run(vcan_bus_t* const bus,
+                           vcan_node_t* const node,
+                           const vcan_msg_t* const msgs,
+                           const size_t count,
+                           const uint64_t seq)
+{
+    VCAN_PROBE_DISPATCH(bus, node, msgs);
+    vcan_stamp(bus, &node->rx_meta);
+    node->rx_meta.seq = seq;
+    const uint64_t start = VCAN_STAT_START(bus);
+    node->callback_on_rx_burst(node, msgs, count);
+    VCAN_STAT_CALLBACK(bus, node, start);
+    VCAN_STAT_RX(node, msgs, count);
+}
+
+/**
+ * Calls the burst callback of the node once per contiguous run of accepted
+ * messages, so a node without filters obtains the whole array at once.
+ */
+static void vcan_fanout_burst_to(vcan_bus_t* const bus,
+                                 vcan_node_t* const node,
+                                 const vcan_msg_t* const msgs,
+                                 const size_t count)
+{
+    // Sequence number of the first message of the burst
+    const uint64_t first = bus->meta.seq;
+    size_t run_start = 0;
+    for (size_t m = 0; m < count; m++)
+    {
+        if (!vcan_accepts(node, msgs[m].id))
+        {
+            if (m > run_start)
+            {
+                vcan_burst_run(bus, node, &msgs[run_start], m - run_start,
+                               first + run_start);
+            }
+            run_start = m + 1;
+        }
+    }
+    if (count > run_start)
+    {
+        vcan_burst_run(bus, node, &msgs[run_start], count - run_start,
+                       first + run_start);
+    }
+}
+
+/** True if the transmissions have to wait in the deferred-TX FIFO. */
+static inline bool vcan_deferring(const vcan_bus_t* const bus)
+{
+    return bus->deferred != NULL && bus->delivering;
+}
+
+/** Appends copies of the messages to the deferred-TX FIFO, all or none. */
+static vcan_err_t vcan_defer(vcan_bus_t* const bus,
+                             const vcan_msg_t* const msgs,
+                             const size_t count,
+                             const vcan_node_t* const src_node,
+                             const uint64_t tx_time)
+{
+    vcan_err_t err;
+    if (count > bus->deferred_capacity - bus->deferred_len)
+    {
+        err = VCAN_QUEUE_FULL;
+    }
+    else
+    {
+        for (size_t m = 0; m < count; m++)
+        {
+            vcan_deferred_t* const slot = &bus->deferred[
+                    (bus->deferred_head + bus->deferred_len)
+                    % bus->deferred_capacity];
+            vcan_copy_msg(&slot->msg, &msgs[m]);
+            slot->src_node = src_node;
+            slot->tx_time = tx_time;
+            bus->deferred_len++;
+        }
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+/**
+ * Ends the delivery of a transmission by delivering the deferred messages,
+ * including the ones deferred meanwhile, one after the other.
+ */
+static void vcan_end_delivery(vcan_bus_t* const bus)
+{
+    while (bus->deferred_len > 0)
+    {
+        const vcan_deferred_t* const next = &bus->deferred[bus->deferred_head];
+        const vcan_node_t* const src_node = next->src_node;
+        const uint64_t tx_time = next->tx_time;
+        // Moved out first, so the callbacks can already reuse the slot
+        vcan_copy_msg(&bus->received_msg, &next->msg);
+        bus->deferred_head = (bus->deferred_head + 1U) % bus->deferred_capacity;
+        bus->deferred_len--;
+        vcan_fanout(bus, &bus->received_msg, src_node, tx_time);
+    }
+    bus->delivering = false;
+}
+
+/** Delivers the message and then any transmission deferred meanwhile. */
+static void vcan_deliver_all(vcan_bus_t* const bus,
+                             const vcan_msg_t* const msg,
+                             const vcan_node_t* const src_node,
+                             const uint64_t tx_time)
+{
+    bus->delivering = true;
+    vcan_fanout(bus, msg, src_node, tx_time);
+    vcan_end_delivery(bus);
+}
+
+VCAN_API vcan_err_t vcan_tx(vcan_bus_t* const bus,
+                            const vcan_msg_t* const msg,
+                            const vcan_node_t* const src_node)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (msg == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else if (bus->tx_hook != NULL)
+    {
+        err = bus->tx_hook(bus->tx_hook_ctx, msg, src_node);
+    }
+    else if (vcan_deferring(bus))
+    {
+        err = vcan_defer(bus, msg, 1U, src_node, vcan_timestamp(bus));
+    }
+    else
+    {
+#ifdef VCAN_TX_BY_REF
+        vcan_deliver_all(bus, msg, src_node, vcan_timestamp(bus));
+#else
+        vcan_copy_msg(&bus->received_msg, msg);
+        vcan_deliver_all(bus, &bus->received_msg, src_node,
+                         vcan_timestamp(bus));
+#endif
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_tx_direct(vcan_bus_t* const bus,
+                                   const vcan_msg_t* const msg,
+                                   const vcan_node_t* const src_node)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (msg == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else if (vcan_deferring(bus))
+    {
+        err = vcan_defer(bus, msg, 1U, src_node, vcan_timestamp(bus));
+    }
+    else
+    {
+#ifdef VCAN_TX_BY_REF
+        vcan_deliver_all(bus, msg, src_node, vcan_timestamp(bus));
+#else
+        vcan_copy_msg(&bus->received_msg, msg);
+        vcan_deliver_all(bus, &bus->received_msg, src_node,
+                         vcan_timestamp(bus));
+#endif
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_tx_ref(vcan_bus_t* const bus,
+                                const vcan_msg_t* const msg,
+                                const vcan_node_t* const src_node)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (msg == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else if (bus->tx_hook != NULL)
+    {
+        err = bus->tx_hook(bus->tx_hook_ctx, msg, src_node);
+    }
+    else if (vcan_deferring(bus))
+    {
+        err = vcan_defer(bus, msg, 1U, src_node, vcan_timestamp(bus));
+    }
+    else
+    {
+        vcan_deliver_all(bus, msg, src_node, vcan_timestamp(bus));
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_tx_stamped(vcan_bus_t* const bus,
+                                    const vcan_msg_t* const msg,
+                                    const vcan_node_t* const src_node,
+                                    const uint64_t tx_time)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (msg == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else if (bus->tx_hook != NULL)
+    {
+        err = bus->tx_hook(bus->tx_hook_ctx, msg, src_node);
+    }
+    else if (vcan_deferring(bus))
+    {
+        err = vcan_defer(bus, msg, 1U, src_node, tx_time);
+    }
+    else
+    {
+        vcan_deliver_all(bus, msg, src_node, tx_time);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_tx_burst(vcan_bus_t* const bus,
+                                  const vcan_msg_t* const msgs,
+                                  const size_t count,
+                                  const vcan_node_t* const src_node)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (count == 0)
+    {
+        err = VCAN_OK;
+    }
+    else if (msgs == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else if (bus->tx_hook != NULL)
+    {
+        err = VCAN_OK;
+        for (size_t m = 0; m < count && err == VCAN_OK; m++)
+        {
+            err = bus->tx_hook(bus->tx_hook_ctx, &msgs[m], src_node);
+        }
+    }
+    else if (vcan_deferring(bus))
+    {
+        err = vcan_defer(bus, msgs, count, src_node, vcan_timestamp(bus));
+    }
+    else if (bus->fanout_hook != NULL)
+    {
+        const uint64_t tx_time = vcan_timestamp(bus);
+        bus->delivering = true;
+        for (size_t m = 0; m < count; m++)
+        {
+            vcan_fanout(bus, &msgs[m], src_node, tx_time);
+        }
+        vcan_copy_msg(&bus->received_msg, &msgs[count - 1]);
+        vcan_end_delivery(bus);
+        err = VCAN_OK;
+    }
+    else
+    {
+        vcan_node_t** const nodes = vcan_nodes(bus);
+        const vcan_node_t* const excluded = vcan_excluded(src_node);
+        const vcan_meta_t outer_meta = bus->meta;
+        const uint64_t first = bus->seq + 1U;
+        bus->seq += count;
+        bus->meta.tx_time = vcan_timestamp(bus);
+        vcan_hist_t* const hist = vcan_hist_of(bus);
+        const uint64_t start = hist != NULL ? vcan_now(bus) : 0U;
+        bus->delivering = true;
+        VCAN_PROBE_TX_ENTRY(bus, msgs, count);
+        VCAN_STAT_TX(bus, msgs, count);
+        for (size_t i = 0; i < bus->connected; i++)
+        {
+            vcan_node_t* const node = nodes[i];
+            if (node != excluded)
+            {
+                bus->meta.seq = first;
+                if (node->callback_on_rx_burst != NULL
+                    && node->rx_queue == NULL)
+                {
+                    vcan_fanout_burst_to(bus, node, msgs, count);
+                }
+                else
+                {
+                    for (size_t m = 0; m < count; m++)
+                    {
+                        if (vcan_accepts(node, msgs[m].id))
+                        {
+                            bus->meta.seq = first + m;
+                            vcan_deliver(bus, node, &msgs[m]);
+                        }
+                    }
+                }
+            }
+        }
+        VCAN_PROBE_TX_EXIT(bus, msgs, count);
+        vcan_hist_since(bus, hist, start);
+        bus->meta = outer_meta;
+        vcan_copy_msg(&bus->received_msg, &msgs[count - 1]);
+        vcan_end_delivery(bus);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+/** Index returned by vcan_index_of() for nodes not in the table. */
+#define VCAN_NOT_CONNECTED SIZE_MAX
+
+/**
+ * Finds the node in the node table, in O(1) through its handle whenever
+ * possible, with a linear scan only for nodes on multiple buses.
+ */
+static size_t vcan_index_of(vcan_bus_t* const bus,
+                            const vcan_node_t* const node)
+{
+    vcan_node_t** const nodes = vcan_nodes(bus);
+    size_t index = VCAN_NOT_CONNECTED;
+    if (node->bus == bus && node->slot < bus->connected
+        && nodes[node->slot] == node)
+    {
+        index = node->slot;
+    }
+    else if (node->connections > 1
+             || (node->connections == 1 && node->bus == NULL))
+    {
+        // Connected to some bus without a handle: might be this one
+        for (size_t i = 0; i < bus->connected; i++)
+        {
+            if (nodes[i] == node)
+            {
+                index = i;
+                break;
+            }
+        }
+    }
+    return index;
+}
+
+/**
+ * Stores the node into a slot, updating its handle if it is for this bus.
+ *
+ * The filter summary is copied only for the bus of the handle, the one
+ * vcan_set_filter() can update; the other buses visit the node anyway.
+ */
+static void vcan_place(vcan_bus_t* const bus,
+                       vcan_node_t* const node,
+                       const size_t index)
+{
+    uint32_t* const codes = vcan_codes(bus);
+    uint32_t* const masks = vcan_masks(bus);
+    vcan_nodes(bus)[index] = node;
+    if (node->bus == bus)
+    {
+        node->slot = index;
+    }
+    if (codes != NULL && masks != NULL)
+    {
+        const bool handle = node->bus == bus;
+        codes[index] = handle ? node->acceptance.summary.id : 0U;
+        masks[index] = handle ? node->acceptance.summary.mask : 0U;
+    }
+}
+
+VCAN_API vcan_err_t vcan_connect(vcan_bus_t* const bus,
+                                 vcan_node_t* const node)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (node == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else if (node->callback_on_rx == NULL && node->rx_queue == NULL)
+    {
+        err = VCAN_NULL_CALLBACK;
+    }
+    else if (bus->connected >= vcan_capacity(bus))
+    {
+        err = VCAN_TOO_MANY_CONNECTED;
+    }
+    else if (vcan_index_of(bus, node) != VCAN_NOT_CONNECTED)
+    {
+        err = VCAN_ALREADY_CONNECTED;
+    }
+    else
+    {
+        if (node->bus == NULL || node->connections == 0)
+        {
+            node->bus = bus;
+        }
+        node->connections++;
+        vcan_place(bus, node, bus->connected++);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_disconnect(vcan_bus_t* const bus,
+                                    const vcan_node_t* const node)
+{
+    vcan_err_t err;
+    size_t index;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (node == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else if ((index = vcan_index_of(bus, node)) == VCAN_NOT_CONNECTED)
+    {
+        err = VCAN_NODE_NOT_FOUND;
+    }
+    else
+    {
+        vcan_node_t** const nodes = vcan_nodes(bus);
+        // The same node, writable through the table of the bus
+        vcan_node_t* const owned = nodes[index];
+        const size_t last = bus->connected - 1;
+        if (bus->flags & VCAN_BUS_ORDERED)
+        {
+            for (size_t i = index; i < last; i++)
+            {
+                vcan_place(bus, nodes[i + 1], i);
+            }
+        }
+        else if (index != last)
+        {
+            vcan_place(bus, nodes[last], index);
+        }
+        bus->connected--;
+        if (owned->bus == bus)
+        {
+            owned->bus = NULL;
+        }
+        owned->connections--;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+/**
+ * Folds a filter into the summary code/mask: only the bits compared by every
+ * filter and having the same value in all of them are kept.
+ */
+static void vcan_summary_add(vcan_filter_t* const summary,
+                             const uint32_t id,
+                             const uint32_t mask)
+{
+    summary->mask &= mask & ~(summary->id ^ id);
+}
+
+VCAN_API vcan_err_t vcan_set_filter(vcan_node_t* const node,
+                                    const vcan_filter_t* const filters,
+                                    const size_t filters_len,
+                                    const uint32_t* const ids,
+                                    const size_t ids_len)
+{
+    vcan_err_t err;
+    if (node == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else if ((filters == NULL && filters_len > 0)
+             || (ids == NULL && ids_len > 0))
+    {
+        err = VCAN_NULL_FILTER;
+    }
+    else if (node->bus != NULL
+             && (node->slot >= node->bus->connected
+                 || vcan_nodes(node->bus)[node->slot] != node))
+    {
+        // Stale handle, e.g. the bus was initialised again meanwhile
+        node->bus = NULL;
+        err = VCAN_NODE_NOT_FOUND;
+    }
+    else
+    {
+        err = VCAN_OK;
+        for (size_t i = 1; i < ids_len; i++)
+        {
+            if (ids[i - 1] >= ids[i])
+            {
+                err = VCAN_UNSORTED_FILTER;
+                break;
+            }
+        }
+    }
+    if (err == VCAN_OK)
+    {
+        vcan_filter_t summary = {.id = 0, .mask = 0};
+        if (filters_len > 0)
+        {
+            summary.id = filters[0].id;
+            summary.mask = UINT32_MAX;
+        }
+        else if (ids_len > 0)
+        {
+            summary.id = ids[0];
+            summary.mask = UINT32_MAX;
+        }
+        for (size_t i = 0; i < filters_len; i++)
+        {
+            vcan_summary_add(&summary, filters[i].id, filters[i].mask);
+        }
+        for (size_t i = 0; i < ids_len; i++)
+        {
+            vcan_summary_add(&summary, ids[i], UINT32_MAX);
+        }
+        summary.id &= summary.mask;
+        node->acceptance.filters = filters;
+        node->acceptance.filters_len = filters_len;
+        node->acceptance.ids = ids;
+        node->acceptance.ids_len = ids_len;
+        node->acceptance.summary = summary;
+        if (node->bus != NULL)
+        {
+            vcan_place(node->bus, node, node->slot);
+        }
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_set_match_table(vcan_bus_t* const bus,
+                                         uint32_t* const codes,
+                                         uint32_t* const masks)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (codes == NULL || masks == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        if (bus->table != NULL)
+        {
+            // The embedded table has its own summaries
+            bus->table_codes = codes;
+            bus->table_masks = masks;
+        }
+        vcan_node_t** const nodes = vcan_nodes(bus);
+        for (size_t i = 0; i < bus->connected; i++)
+        {
+            vcan_place(bus, nodes[i], i);
+        }
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+/** Checks the arguments of a receive queue and empties it. */
+static vcan_err_t vcan_rx_queue_reset(vcan_rx_queue_t* const queue,
+                                      const void* const storage,
+                                      const size_t capacity)
+{
+    vcan_err_t err;
+    if (queue == NULL || storage == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        queue->msgs = NULL;
+        queue->frames = NULL;
+        queue->capacity = capacity;
+        queue->policy = VCAN_RX_DROP_NEWEST;
+        queue->timeout = 0;
+        queue->spill = NULL;
+        queue->notify = NULL;
+        queue->notify_ctx = NULL;
+        atomic_init(&queue->tail, 0);
+        queue->head_cache = 0;
+        atomic_init(&queue->armed, true);
+        atomic_init(&queue->overflows, 0);
+        atomic_init(&queue->last_overflow, VCAN_OK);
+        atomic_init(&queue->head, 0);
+        atomic_init(&queue->claim, 0);
+        queue->tail_cache = 0;
+        queue->metas = NULL;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_rx_queue_init(vcan_rx_queue_t* const queue,
+                                       vcan_msg_t* const storage,
+                                       const size_t capacity)
+{
+    const vcan_err_t err = vcan_rx_queue_reset(queue, storage, capacity);
+    if (err == VCAN_OK)
+    {
+        queue->msgs = storage;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_rx_queue_init_shared(vcan_rx_queue_t* const queue,
+                                              vcan_frame_t** const storage,
+                                              const size_t capacity)
+{
+    const vcan_err_t err = vcan_rx_queue_reset(queue, storage, capacity);
+    if (err == VCAN_OK)
+    {
+        queue->frames = storage;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_rx_queue_set_meta(vcan_rx_queue_t* const queue,
+                                           vcan_meta_t* const metas)
+{
+    vcan_err_t err;
+    if (queue == NULL || metas == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        queue->metas = metas;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_rx_queue_set_notify(vcan_rx_queue_t* const queue,
+                                             void (* const notify)(void* ctx),
+                                             void* const ctx)
+{
+    vcan_err_t err;
+    if (queue == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        queue->notify = notify;
+        queue->notify_ctx = ctx;
+        atomic_store(&queue->armed, true);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_rx_queue_set_policy(vcan_rx_queue_t* const queue,
+                                             const vcan_rx_policy_t policy,
+                                             const uint64_t timeout,
+                                             vcan_rx_queue_t* const spill)
+{
+    vcan_err_t err;
+    if (queue == NULL || (policy == VCAN_RX_SPILL && spill == NULL))
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (policy != VCAN_RX_DROP_NEWEST && policy != VCAN_RX_DROP_OLDEST
+             && policy != VCAN_RX_BLOCK && policy != VCAN_RX_SPILL)
+    {
+        err = VCAN_INVALID_POLICY;
+    }
+    else if (policy == VCAN_RX_SPILL
+             && (spill == queue
+                 || (spill->frames == NULL) != (queue->frames == NULL)))
+    {
+        err = VCAN_INVALID_POLICY;
+    }
+    else
+    {
+        queue->policy = policy;
+        queue->timeout = timeout;
+        queue->spill = policy == VCAN_RX_SPILL ? spill : NULL;
+        atomic_store(&queue->claim, atomic_load(&queue->head));
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+/**
+ * Amount of messages ready to be dequeued from the head position. The
+ * producer position is refreshed only when fewer than \p wanted are known.
+ */
+static size_t vcan_rx_ready(vcan_rx_queue_t* const queue,
+                            const size_t head,
+                            const size_t wanted)
+{
+    const size_t known = queue->tail_cache - head;
+    // With drop-oldest the producer can move the head past the known tail
+    if (known < wanted || known > queue->capacity)
+    {
+        queue->tail_cache = atomic_load_explicit(&queue->tail,
+                                                 memory_order_acquire);
+    }
+    return queue->tail_cache - head;
+}
+
+/** Position of the next message to dequeue, called by the consumer. */
+static size_t vcan_rx_front(vcan_rx_queue_t* const queue)
+{
+    return atomic_load_explicit(queue->policy == VCAN_RX_DROP_OLDEST
+                                ? &queue->claim : &queue->head,
+                                memory_order_relaxed);
+}
+
+/**
+ * The queue to dequeue from: the overflow arena once the queue itself is
+ * empty, as the arena only holds messages newer than all queued ones.
+ */
+static vcan_rx_queue_t* vcan_rx_source(vcan_rx_queue_t* const queue)
+{
+    vcan_rx_queue_t* source = queue;
+    if (queue->spill != NULL
+        && vcan_rx_ready(queue, vcan_rx_front(queue), 1U) == 0)
+    {
+        source = queue->spill;
+    }
+    return source;
+}
+
+/** The queued message at the given position. */
+static const vcan_msg_t* vcan_rx_at(const vcan_rx_queue_t* const queue,
+                                    const size_t pos)
+{
+    return queue->frames != NULL
+           ? &queue->frames[pos & (queue->capacity - 1)]->msg
+           : &queue->msgs[pos & (queue->capacity - 1)];
+}
+
+/**
+ * Takes up to \p max ready messages for reading, so the producer of a
+ * #VCAN_RX_DROP_OLDEST queue cannot drop them meanwhile.
+ *
+ * @param queue not NULL
+ * @param max max amount of messages
+ * @param count set to the amount of messages taken, at most \p max
+ * @return the position of the first one
+ */
+static size_t vcan_rx_claim(vcan_rx_queue_t* const queue,
+                            const size_t max,
+                            size_t* const count)
+{
+    size_t head = vcan_rx_front(queue);
+    bool claimed = queue->policy != VCAN_RX_DROP_OLDEST;
+    do
+    {
+        const size_t ready = vcan_rx_ready(queue, head, max);
+        *count = ready < max ? ready : max;
+        // On failure the producer dropped the oldest: retry from the next
+        claimed = claimed || atomic_compare_exchange_weak_explicit(
+                &queue->claim, &head, head + *count,
+                memory_order_acquire, memory_order_relaxed);
+    } while (!claimed);
+    return head;
+}
+
+/**
+ * Frees the first \p count of the \p claimed positions from the head for
+ * the producer, after reading them.
+ *
+ * The rest of the positions taken by vcan_rx_claim() are given back, after
+ * moving the head, so the producer cannot drop the oldest before. Without
+ * any claimed position, the producer of a #VCAN_RX_DROP_OLDEST queue may
+ * have moved both already: nothing is written.
+ */
+static void vcan_rx_take(vcan_rx_queue_t* const queue,
+                         const size_t head,
+                         const size_t claimed,
+                         const size_t count)
+{
+    if (queue->policy != VCAN_RX_DROP_OLDEST || claimed > 0)
+    {
+        atomic_store_explicit(&queue->head, head + count,
+                              memory_order_release);
+    }
+    if (queue->policy == VCAN_RX_DROP_OLDEST && count < claimed)
+    {
+        atomic_store_explicit(&queue->claim, head + count,
+                              memory_order_release);
+    }
+}
+
+/**
+ * Like vcan_rx_take(), also dropping the references held by a queue in
+ * shared mode first, as the producer reuses the slots right after.
+ */
+static void vcan_rx_consume(vcan_rx_queue_t* const queue,
+                            const size_t head,
+                            const size_t claimed,
+                            const size_t count)
+{
+    if (queue->frames != NULL)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            vcan_frame_release(
+                    queue->frames[(head + i) & (queue->capacity - 1)]);
+        }
+    }
+    vcan_rx_take(queue, head, claimed, count);
+}
+
+VCAN_API size_t vcan_rx_poll(vcan_node_t* const node,
+                             vcan_msg_t* const msgs,
+                             const size_t max)
+{
+    size_t polled = 0;
+    if (node != NULL && node->rx_queue != NULL && msgs != NULL)
+    {
+        vcan_rx_queue_t* const queue = vcan_rx_source(node->rx_queue);
+        const size_t head = vcan_rx_claim(queue, max, &polled);
+        for (size_t i = 0; i < polled; i++)
+        {
+            vcan_copy_msg(&msgs[i], vcan_rx_at(queue, head + i));
+        }
+        vcan_rx_consume(queue, head, polled, polled);
+    }
+    return polled;
+}
+
+VCAN_API size_t vcan_rx_poll_meta(vcan_node_t* const node,
+                                  vcan_msg_t* const msgs,
+                                  vcan_meta_t* const metas,
+                                  const size_t max)
+{
+    size_t polled = 0;
+    if (node != NULL && node->rx_queue != NULL && msgs != NULL
+        && metas != NULL)
+    {
+        vcan_rx_queue_t* const queue = vcan_rx_source(node->rx_queue);
+        const size_t head = vcan_rx_claim(queue, max, &polled);
+        for (size_t i = 0; i < polled; i++)
+        {
+            vcan_copy_msg(&msgs[i], vcan_rx_at(queue, head + i));
+            if (queue->metas != NULL)
+            {
+                metas[i] = queue->metas[(head + i) & (queue->capacity - 1)];
+            }
+            else
+            {
+                memset(&metas[i], 0, sizeof(vcan_meta_t));
+            }
+        }
+        vcan_rx_consume(queue, head, polled, polled);
+    }
+    return polled;
+}
+
+VCAN_API size_t vcan_rx_poll_shared(vcan_node_t* const node,
+                                    vcan_frame_t** const frames,
+                                    const size_t max)
+{
+    size_t polled = 0;
+    if (node != NULL && node->rx_queue != NULL
+        && node->rx_queue->frames != NULL && frames != NULL)
+    {
+        vcan_rx_queue_t* const queue = vcan_rx_source(node->rx_queue);
+        const size_t head = vcan_rx_claim(queue, max, &polled);
+        for (size_t i = 0; i < polled; i++)
+        {
+            // The references move to the caller
+            frames[i] = queue->frames[(head + i) & (queue->capacity - 1)];
+        }
+        vcan_rx_take(queue, head, polled, polled);
+    }
+    return polled;
+}
+
+/** Messages copied to the stack at once by vcan_rx_drain(). */
+#define VCAN_RX_DRAIN_BATCH 16U
+
+VCAN_API size_t vcan_rx_drain(vcan_node_t* const node,
+                              void (* const on_rx)(vcan_node_t* node,
+                                                   const vcan_msg_t* msg))
+{
+    size_t drained = 0;
+    if (node != NULL && node->rx_queue != NULL && on_rx != NULL)
+    {
+        vcan_rx_queue_t* const queue = node->rx_queue;
+        vcan_msg_t batch[VCAN_RX_DRAIN_BATCH];
+        size_t polled;
+        bool empty = false;
+        while (!empty)
+        {
+            while ((polled = vcan_rx_poll(node, batch, VCAN_RX_DRAIN_BATCH))
+                   > 0)
+            {
+                for (size_t i = 0; i < polled; i++)
+                {
+                    on_rx(node, &batch[i]);
+                }
+                drained += polled;
+            }
+            atomic_store_explicit(&queue->armed, true, memory_order_relaxed);
+            // Pairs with the fence of vcan_rx_notify()
+            atomic_thread_fence(memory_order_seq_cst);
+            vcan_rx_queue_t* const source = vcan_rx_source(queue);
+            empty = vcan_rx_ready(source, vcan_rx_front(source), 1U) == 0;
+        }
+    }
+    return drained;
+}
+
+VCAN_API uint64_t vcan_rx_overflows(const vcan_node_t* const node)
+{
+    uint64_t overflows = 0;
+    if (node != NULL && node->rx_queue != NULL)
+    {
+        overflows = atomic_load_explicit(&node->rx_queue->overflows,
+                                         memory_order_relaxed);
+    }
+    return overflows;
+}
+
+VCAN_API vcan_err_t vcan_rx_last_overflow(const vcan_node_t* const node)
+{
+    vcan_err_t err = VCAN_OK;
+    if (node != NULL && node->rx_queue != NULL)
+    {
+        err = (vcan_err_t) atomic_load_explicit(
+                &node->rx_queue->last_overflow, memory_order_relaxed);
+    }
+    return err;
+}
+
+/** Fill level of the queue and its overflow arena, in percent. */
+static uint32_t vcan_rx_fill(const vcan_rx_queue_t* const queue)
+{
+    size_t queued = atomic_load_explicit(&queue->tail, memory_order_relaxed)
+                    - atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t capacity = queue->capacity;
+    if (queue->spill != NULL)
+    {
+        queued += atomic_load_explicit(&queue->spill->tail,
+                                       memory_order_relaxed)
+                  - atomic_load_explicit(&queue->spill->head,
+                                         memory_order_relaxed);
+        capacity += queue->spill->capacity;
+    }
+    return (uint32_t) (queued * 100U / capacity);
+}
+
+VCAN_API uint32_t vcan_bus_pressure(const vcan_bus_t* const bus)
+{
+    uint32_t pressure = 0;
+    if (bus != NULL)
+    {
+        vcan_node_t* const* const nodes =
+                bus->table != NULL ? bus->table : bus->nodes;
+        for (size_t i = 0; i < bus->connected && pressure < 100U; i++)
+        {
+            if (nodes[i]->rx_queue != NULL)
+            {
+                const uint32_t fill = vcan_rx_fill(nodes[i]->rx_queue);
+                pressure = fill > pressure ? fill : pressure;
+            }
+        }
+    }
+    return pressure;
+}
+
+VCAN_API vcan_err_t vcan_frame8_from_msg(vcan_frame8_t* const frame,
+                                         const vcan_msg_t* const msg)
+{
+    vcan_err_t err;
+    if (frame == NULL || msg == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else if (msg->len > VCAN_CLASSIC_DATA_MAX_LEN)
+    {
+        err = VCAN_TOO_LONG;
+    }
+    else
+    {
+        frame->id = msg->id;
+        frame->len = (uint8_t) msg->len;
+        memcpy(frame->data, msg->data, msg->len);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_frame8_to_msg(vcan_msg_t* const msg,
+                                       const vcan_frame8_t* const frame)
+{
+    vcan_err_t err;
+    if (frame == NULL || msg == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else if (frame->len > VCAN_CLASSIC_DATA_MAX_LEN)
+    {
+        err = VCAN_TOO_LONG;
+    }
+    else
+    {
+        msg->id = frame->id;
+        msg->len = frame->len;
+        memcpy(msg->data, frame->data, frame->len);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_tx_frame8(vcan_bus_t* const bus,
+                                   const vcan_frame8_t* const frame,
+                                   const vcan_node_t* const src_node)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (bus->tx_hook != NULL)
+    {
+        vcan_msg_t msg;
+        err = vcan_frame8_to_msg(&msg, frame);
+        if (err == VCAN_OK)
+        {
+            err = bus->tx_hook(bus->tx_hook_ctx, &msg, src_node);
+        }
+    }
+    else if (vcan_deferring(bus))
+    {
+        vcan_msg_t msg;
+        err = vcan_frame8_to_msg(&msg, frame);
+        if (err == VCAN_OK)
+        {
+            err = vcan_defer(bus, &msg, 1U, src_node, vcan_timestamp(bus));
+        }
+    }
+    else
+    {
+        // Expanded straight into the bus, no intermediate copy
+        err = vcan_frame8_to_msg(&bus->received_msg, frame);
+        if (err == VCAN_OK)
+        {
+            vcan_deliver_all(bus, &bus->received_msg, src_node,
+                             vcan_timestamp(bus));
+        }
+    }
+    return err;
+}
+
+VCAN_API uint32_t vcan_fd_len(const uint32_t len)
+{
+    static const uint8_t fd_lens[] = {12, 16, 20, 24, 32, 48, 64};
+    uint32_t fd_len = len;
+    if (len > VCAN_DATA_MAX_LEN)
+    {
+        fd_len = 0;
+    }
+    else if (len > VCAN_CLASSIC_DATA_MAX_LEN)
+    {
+        size_t index = 0;
+        while (fd_lens[index] < len)
+        {
+            index++;
+        }
+        fd_len = fd_lens[index];
+    }
+    return fd_len;
+}
+
+VCAN_API size_t vcan_pack(uint8_t* const buf,
+                          const size_t buf_len,
+                          const vcan_msg_t* const msg)
+{
+    size_t written = 0;
+    if (buf != NULL && msg != NULL && msg->len <= VCAN_DATA_MAX_LEN
+        && buf_len >= VCAN_PACKED_SIZE(msg->len))
+    {
+        buf[0] = (uint8_t) (msg->id);
+        buf[1] = (uint8_t) (msg->id >> 8U);
+        buf[2] = (uint8_t) (msg->id >> 16U);
+        buf[3] = (uint8_t) (msg->id >> 24U);
+        buf[4] = (uint8_t) msg->len;
+        memcpy(&buf[VCAN_PACKED_HEADER_LEN], msg->data, msg->len);
+        written = VCAN_PACKED_SIZE(msg->len);
+    }
+    return written;
+}
+
+VCAN_API size_t vcan_unpack(vcan_msg_t* const msg,
+                            const uint8_t* const buf,
+                            const size_t buf_len)
+{
+    size_t read = 0;
+    if (msg != NULL && buf != NULL && buf_len >= VCAN_PACKED_HEADER_LEN
+        && buf[4] <= VCAN_DATA_MAX_LEN
+        && buf_len >= VCAN_PACKED_SIZE(buf[4]))
+    {
+        msg->id = (uint32_t) buf[0]
+                  | ((uint32_t) buf[1] << 8U)
+                  | ((uint32_t) buf[2] << 16U)
+                  | ((uint32_t) buf[3] << 24U);
+        msg->len = buf[4];
+        memcpy(msg->data, &buf[VCAN_PACKED_HEADER_LEN], msg->len);
+        read = VCAN_PACKED_SIZE(msg->len);
+    }
+    return read;
+}
+
+VCAN_API vcan_err_t vcan_tx_packed(vcan_bus_t* const bus,
+                                   const uint8_t* const buf,
+                                   const size_t buf_len,
+                                   const vcan_node_t* const src_node)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (buf == NULL && buf_len > 0)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else
+    {
+        err = VCAN_OK;
+        size_t offset = 0;
+        vcan_msg_t taken;
+        // Unpacked straight into the bus, unless it still has to be taken
+        // by a hook or deferred
+        vcan_msg_t* const msg = bus->tx_hook != NULL || vcan_deferring(bus)
+                                ? &taken : &bus->received_msg;
+        while (offset < buf_len && err == VCAN_OK)
+        {
+            const size_t read = vcan_unpack(msg, &buf[offset],
+                                            buf_len - offset);
+            if (read == 0)
+            {
+                err = VCAN_INVALID_PACKED;
+            }
+            else if (bus->tx_hook != NULL)
+            {
+                err = bus->tx_hook(bus->tx_hook_ctx, msg, src_node);
+                offset += read;
+            }
+            else if (vcan_deferring(bus))
+            {
+                err = vcan_defer(bus, msg, 1U, src_node, vcan_timestamp(bus));
+                offset += read;
+            }
+            else
+            {
+                vcan_deliver_all(bus, msg, src_node, vcan_timestamp(bus));
+                offset += read;
+            }
+        }
+    }
+    return err;
+}
+
+VCAN_API size_t vcan_rx_poll_frame8(vcan_node_t* const node,
+                                    vcan_frame8_t* const frames,
+                                    const size_t max)
+{
+    size_t polled = 0;
+    if (node != NULL && node->rx_queue != NULL && frames != NULL)
+    {
+        vcan_rx_queue_t* const queue = vcan_rx_source(node->rx_queue);
+        size_t ready;
+        const size_t head = vcan_rx_claim(queue, max, &ready);
+        while (polled < ready
+               && vcan_frame8_from_msg(&frames[polled],
+                                       vcan_rx_at(queue, head + polled))
+                  == VCAN_OK)
+        {
+            polled++;
+        }
+        vcan_rx_consume(queue, head, ready, polled);
+    }
+    return polled;
+}
+
+VCAN_API size_t vcan_rx_poll_packed(vcan_node_t* const node,
+                                    uint8_t* const buf,
+                                    const size_t buf_len)
+{
+    size_t written = 0;
+    if (node != NULL && node->rx_queue != NULL && buf != NULL)
+    {
+        vcan_rx_queue_t* const queue = vcan_rx_source(node->rx_queue);
+        size_t ready;
+        const size_t head = vcan_rx_claim(queue, SIZE_MAX, &ready);
+        size_t polled = 0;
+        size_t packed = 1;
+        while (polled < ready && packed > 0)
+        {
+            packed = vcan_pack(&buf[written], buf_len - written,
+                               vcan_rx_at(queue, head + polled));
+            if (packed > 0)
+            {
+                written += packed;
+                polled++;
+            }
+        }
+        vcan_rx_consume(queue, head, ready, polled);
+    }
+    return written;
+}
+
+VCAN_API vcan_err_t vcan_set_clock(vcan_bus_t* const bus,
+                                   uint64_t (* const now)(void* ctx),
+                                   void* const ctx)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        bus->clock_now = now;
+        bus->clock_ctx = ctx;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_get_stats(const vcan_bus_t* const bus,
+                                   vcan_bus_stats_t* const stats)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (stats == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        memset(stats, 0, sizeof(vcan_bus_stats_t));
+#ifdef VCAN_STATS
+        stats->tx_frames = atomic_load_explicit(&bus->stats.tx_frames,
+                                                memory_order_relaxed);
+        stats->tx_bytes = atomic_load_explicit(&bus->stats.tx_bytes,
+                                               memory_order_relaxed);
+        stats->dropped = atomic_load_explicit(&bus->stats.dropped,
+                                              memory_order_relaxed);
+#endif
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_get_node_stats(const vcan_node_t* const node,
+                                        vcan_node_stats_t* const stats)
+{
+    vcan_err_t err;
+    if (node == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else if (stats == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        memset(stats, 0, sizeof(vcan_node_stats_t));
+#ifdef VCAN_STATS
+        stats->rx_frames = atomic_load_explicit(&node->stats.rx_frames,
+                                                memory_order_relaxed);
+        stats->rx_bytes = atomic_load_explicit(&node->stats.rx_bytes,
+                                               memory_order_relaxed);
+        stats->callback_time = atomic_load_explicit(
+                &node->stats.callback_time, memory_order_relaxed);
+#endif
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_set_tx_hook(vcan_bus_t* const bus,
+                                     const vcan_tx_hook_t hook,
+                                     void* const ctx)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        bus->tx_hook = hook;
+        bus->tx_hook_ctx = ctx;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_set_deferred(vcan_bus_t* const bus,
+                                      vcan_deferred_t* const fifo,
+                                      const size_t capacity)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (fifo != NULL && capacity == 0)
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        bus->deferred = fifo;
+        bus->deferred_capacity = fifo != NULL ? capacity : 0U;
+        bus->deferred_head = 0;
+        bus->deferred_len = 0;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_set_fanout(vcan_bus_t* const bus,
+                                    const vcan_fanout_hook_t hook,
+                                    void* const ctx)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        bus->fanout_hook = hook;
+        bus->fanout_ctx = ctx;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_tx_to(vcan_bus_t* const bus,
+                               vcan_node_t* const node,
+                               const vcan_msg_t* const msg)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (node == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else if (msg == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else
+    {
+        if (vcan_accepts(node, msg->id))
+        {
+            vcan_deliver(bus, node, msg);
+        }
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+
+VCAN_API vcan_err_t vcan_set_pool(vcan_bus_t* const bus,
+                                  vcan_frame_t* const frames,
+                                  const size_t capacity)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (frames == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (capacity == 0 || capacity >= UINT32_MAX)
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        vcan_pool_t* const pool = &bus->pool;
+        pool->frames = frames;
+        pool->capacity = capacity;
+        for (size_t i = 0; i < capacity; i++)
+        {
+            frames[i].pool = pool;
+            atomic_init(&frames[i].refs, 0U);
+            // The last one links to none
+            atomic_init(&frames[i].next_free,
+                        i + 1U < capacity ? (uint32_t) (i + 2U) : 0U);
+        }
+        atomic_init(&pool->free_head, 1U);
+        atomic_init(&pool->in_use, 0U);
+        atomic_init(&pool->high_water, 0U);
+        atomic_init(&pool->exhausted, 0U);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_tx_shared(vcan_bus_t* const bus,
+                                   vcan_frame_t* const frame,
+                                   const vcan_node_t* const src_node)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (frame == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else if (bus->tx_hook != NULL)
+    {
+        err = bus->tx_hook(bus->tx_hook_ctx, &frame->msg, src_node);
+    }
+    else if (vcan_deferring(bus))
+    {
+        err = vcan_defer(bus, &frame->msg, 1U, src_node, vcan_timestamp(bus));
+    }
+    else
+    {
+        vcan_frame_t* const outer = bus->frame;
+        bus->frame = frame;
+        vcan_deliver_all(bus, &frame->msg, src_node, vcan_timestamp(bus));
+        bus->frame = outer;
+        err = VCAN_OK;
+    }
+    return err;
+}
 
-vcan_err_t vcan_init(vcan_bus_t* const bus)
+VCAN_API vcan_err_t vcan_get_pool_stats(const vcan_bus_t* const bus,
+                                        vcan_pool_stats_t* const stats)
 {
     vcan_err_t err;
     if (bus == NULL)
     {
         err = VCAN_NULL_BUS;
     }
+    else if (stats == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
     else
     {
-        memset(bus, 0, sizeof(vcan_bus_t));
+        const vcan_pool_t* const pool = &bus->pool;
+        memset(stats, 0, sizeof(vcan_pool_stats_t));
+        if (pool->frames != NULL)
+        {
+            stats->capacity = pool->capacity;
+            stats->in_use = atomic_load_explicit(&pool->in_use,
+                                                 memory_order_relaxed);
+            stats->high_water = atomic_load_explicit(&pool->high_water,
+                                                     memory_order_relaxed);
+            stats->exhausted = atomic_load_explicit(&pool->exhausted,
+                                                    memory_order_relaxed);
+        }
         err = VCAN_OK;
     }
     return err;
 }
 
-vcan_err_t vcan_tx(vcan_bus_t* const bus,
-                   const vcan_msg_t* const msg,
-                   const vcan_node_t* const src_node)
+VCAN_API vcan_err_t vcan_set_probes(vcan_bus_t* const bus,
+                                    const vcan_probes_t* const probes)
 {
     vcan_err_t err;
     if (bus == NULL)
     {
         err = VCAN_NULL_BUS;
     }
-    else if (msg == NULL)
+    else
     {
-        err = VCAN_NULL_MSG;
+        bus->probes = probes;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_hist_init(vcan_hist_t* const hist)
+{
+    vcan_err_t err;
+    if (hist == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
     }
     else
     {
-        memcpy(&bus->received_msg, msg, sizeof(vcan_msg_t));
-        for (size_t i = 0; i < bus->connected; i++)
+        for (size_t i = 0; i < VCAN_HIST_BUCKETS; i++)
         {
-            if (bus->nodes[i] != src_node)
-            {
-                bus->nodes[i]->callback_on_rx(bus->nodes[i], &bus->received_msg);
-            }
+            atomic_init(&hist->counts[i], 0U);
         }
+        atomic_init(&hist->total, 0U);
+        atomic_init(&hist->max, 0U);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+VCAN_API vcan_err_t vcan_set_histogram(vcan_bus_t* const bus,
+                                       vcan_hist_t* const hist)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        bus->hist = hist;
         err = VCAN_OK;
     }
     return err;
 }
 
-vcan_err_t vcan_connect(vcan_bus_t* const bus,
-                        vcan_node_t* const node)
+/** Position of the most significant set bit, which must exist. */
+static inline uint32_t vcan_highest_bit(const uint64_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63U - (uint32_t) __builtin_clzll(bits);
+#else
+    uint32_t position = 63U;
+    while (((bits >> position) & 1U) == 0)
+    {
+        position--;
+    }
+    return position;
+#endif
+}
+
+/** Bucket of the value: the value itself while exact, then its top bits. */
+static uint32_t vcan_hist_index(const uint64_t value)
+{
+    uint32_t index;
+    if (value < (2U << VCAN_HIST_SUB_BITS))
+    {
+        index = (uint32_t) value;
+    }
+    else
+    {
+        const uint32_t shift = vcan_highest_bit(value) - VCAN_HIST_SUB_BITS;
+        index = (shift << VCAN_HIST_SUB_BITS) + (uint32_t) (value >> shift);
+    }
+    return index;
+}
+
+/** Lowest value of the bucket. */
+static uint64_t vcan_hist_lowest(const uint32_t index)
+{
+    uint64_t lowest = index;
+    if (index >= (2U << VCAN_HIST_SUB_BITS))
+    {
+        const uint32_t shift = (index >> VCAN_HIST_SUB_BITS) - 1U;
+        const uint32_t sub = (index & ((1U << VCAN_HIST_SUB_BITS) - 1U))
+                             | (1U << VCAN_HIST_SUB_BITS);
+        lowest = (uint64_t) sub << shift;
+    }
+    return lowest;
+}
+
+/** Highest value of the bucket. */
+static uint64_t vcan_hist_highest(const uint32_t index)
+{
+    uint64_t highest = index;
+    if (index >= (2U << VCAN_HIST_SUB_BITS))
+    {
+        const uint32_t shift = (index >> VCAN_HIST_SUB_BITS) - 1U;
+        highest = vcan_hist_lowest(index) + ((UINT64_C(1) << shift) - 1U);
+    }
+    return highest;
+}
+
+VCAN_API void vcan_hist_record(vcan_hist_t* const hist, const uint64_t value)
+{
+    // Single writer: no need for atomic read-modify-writes.
+    VCAN_ATOMIC(uint64_t)* const count = &hist->counts[vcan_hist_index(value)];
+    atomic_store_explicit(
+            count, atomic_load_explicit(count, memory_order_relaxed) + 1U,
+            memory_order_relaxed);
+    atomic_store_explicit(
+            &hist->total,
+            atomic_load_explicit(&hist->total, memory_order_relaxed) + 1U,
+            memory_order_relaxed);
+    if (value > atomic_load_explicit(&hist->max, memory_order_relaxed))
+    {
+        atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+    }
+}
+
+VCAN_API uint64_t vcan_hist_quantile(const vcan_hist_t* const hist,
+                                     const double quantile)
+{
+    const uint64_t total = atomic_load_explicit(&hist->total,
+                                                memory_order_relaxed);
+    const uint64_t max = atomic_load_explicit(&hist->max,
+                                              memory_order_relaxed);
+    uint64_t value = 0;
+    if (total > 0)
+    {
+        // Rank of the quantile among the values, rounded up, from 1
+        const double exact = quantile * (double) total;
+        uint64_t rank = quantile > 0 ? (uint64_t) exact : 0U;
+        if ((double) rank < exact)
+        {
+            rank++;
+        }
+        rank = rank < 1U ? 1U : (rank > total ? total : rank);
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < VCAN_HIST_BUCKETS && seen < rank; i++)
+        {
+            seen += atomic_load_explicit(&hist->counts[i],
+                                         memory_order_relaxed);
+            value = vcan_hist_highest(i);
+        }
+        value = value < max ? value : max;
+    }
+    return value;
+}
+
+VCAN_API size_t vcan_hist_dump(const vcan_hist_t* const hist,
+                               char* const buf,
+                               const size_t buf_len)
+{
+    size_t written = 0;
+    int line = snprintf(
+            buf, buf_len,
+            "count %" PRIu64 " max %" PRIu64 " p50 %" PRIu64
+            " p99 %" PRIu64 " p999 %" PRIu64 "\n",
+            atomic_load_explicit(&hist->total, memory_order_relaxed),
+            atomic_load_explicit(&hist->max, memory_order_relaxed),
+            vcan_hist_quantile(hist, 0.5), vcan_hist_quantile(hist, 0.99),
+            vcan_hist_quantile(hist, 0.999));
+    for (uint32_t i = 0; i < VCAN_HIST_BUCKETS && line >= 0
+                         && (size_t) line < buf_len - written; i++)
+    {
+        written += (size_t) line;
+        const uint64_t count = atomic_load_explicit(&hist->counts[i],
+                                                    memory_order_relaxed);
+        line = 0;
+        if (count > 0)
+        {
+            line = snprintf(&buf[written], buf_len - written,
+                            "%" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                            vcan_hist_lowest(i), vcan_hist_highest(i), count);
+        }
+    }
+    if (line >= 0 && (size_t) line < buf_len - written)
+    {
+        written += (size_t) line;
+    }
+    // The line not fitting is cut off entirely
+    buf[written] = '\0';
+    return written;
+}
+
+/** Layout options of the build recorded in the snapshots. */
+#ifdef VCAN_STATS
+#define VCAN_SNAP_FEATURES 1U
+#else
+#define VCAN_SNAP_FEATURES 0U
+#endif
+
+/** Flag of a node of the snapshot: followed by its receive queue. */
+#define VCAN_SNAP_QUEUED (1U << 0U)
+
+/** Flag of a node of the snapshot: its queued messages carry metadata. */
+#define VCAN_SNAP_METAS (1U << 1U)
+
+/**
+ * Write cursor over the buffer of a snapshot. It counts the bytes even past
+ * the end of the buffer, so the size is known also when it does not fit.
+ */
+typedef struct
+{
+    uint8_t* buf;
+    size_t len;
+    size_t pos;
+} vcan_snap_writer_t;
+
+/** Read cursor over the buffer of a snapshot. */
+typedef struct
+{
+    const uint8_t* buf;
+    size_t len;
+    size_t pos;
+    /** Cleared on reading past the end of the buffer. */
+    bool valid;
+} vcan_snap_reader_t;
+
+static void vcan_snap_put(vcan_snap_writer_t* const writer,
+                          const void* const data,
+                          const size_t len)
+{
+    if (writer->buf != NULL && writer->pos <= writer->len
+        && len <= writer->len - writer->pos)
+    {
+        memcpy(&writer->buf[writer->pos], data, len);
+    }
+    writer->pos += len;
+}
+
+static void vcan_snap_put32(vcan_snap_writer_t* const writer,
+                            const uint32_t value)
+{
+    vcan_snap_put(writer, &value, sizeof(value));
+}
+
+static void vcan_snap_put64(vcan_snap_writer_t* const writer,
+                            const uint64_t value)
+{
+    vcan_snap_put(writer, &value, sizeof(value));
+}
+
+/** Reads \p len bytes, zeroes on reading past the end of the buffer. */
+static void vcan_snap_get(vcan_snap_reader_t* const reader,
+                          void* const data,
+                          const size_t len)
+{
+    if (reader->valid && len <= reader->len - reader->pos)
+    {
+        memcpy(data, &reader->buf[reader->pos], len);
+        reader->pos += len;
+    }
+    else
+    {
+        memset(data, 0, len);
+        reader->valid = false;
+    }
+}
+
+static uint32_t vcan_snap_get32(vcan_snap_reader_t* const reader)
+{
+    uint32_t value;
+    vcan_snap_get(reader, &value, sizeof(value));
+    return value;
+}
+
+static uint64_t vcan_snap_get64(vcan_snap_reader_t* const reader)
+{
+    uint64_t value;
+    vcan_snap_get(reader, &value, sizeof(value));
+    return value;
+}
+
+static void vcan_snap_put_meta(vcan_snap_writer_t* const writer,
+                               const vcan_meta_t* const meta)
+{
+    vcan_snap_put64(writer, meta->seq);
+    vcan_snap_put64(writer, meta->tx_time);
+    vcan_snap_put64(writer, meta->rx_time);
+}
+
+static void vcan_snap_get_meta(vcan_snap_reader_t* const reader,
+                               vcan_meta_t* const meta)
+{
+    meta->seq = vcan_snap_get64(reader);
+    meta->tx_time = vcan_snap_get64(reader);
+    meta->rx_time = vcan_snap_get64(reader);
+}
+
+/** Amount of messages in the receive queue, without its overflow arena. */
+static size_t vcan_rx_queued(const vcan_rx_queue_t* const queue)
+{
+    return atomic_load_explicit(&queue->tail, memory_order_acquire)
+           - atomic_load_explicit(&queue->head, memory_order_acquire);
+}
+
+/** Writes the queued messages, with their metadata if \p metas is set. */
+static void vcan_snap_queue(vcan_snap_writer_t* const writer,
+                            const vcan_rx_queue_t* const queue,
+                            const bool metas)
+{
+    const size_t head = atomic_load_explicit(&queue->head,
+                                             memory_order_acquire);
+    const size_t queued = vcan_rx_queued(queue);
+    for (size_t i = 0; i < queued; i++)
+    {
+        const vcan_msg_t* const msg = vcan_rx_at(queue, head + i);
+        const uint32_t len = msg->len < VCAN_DATA_MAX_LEN
+                             ? msg->len : VCAN_DATA_MAX_LEN;
+        vcan_snap_put32(writer, msg->id);
+        vcan_snap_put32(writer, len);
+        vcan_snap_put(writer, msg->data, len);
+        if (metas)
+        {
+            static const vcan_meta_t none = {0};
+            vcan_snap_put_meta(writer, queue->metas != NULL
+                                       ? &queue->metas[(head + i)
+                                                       & (queue->capacity
+                                                          - 1)]
+                                       : &none);
+        }
+    }
+}
+
+/** Writes the state of one connected node. */
+static void vcan_snap_node(vcan_snap_writer_t* const writer,
+                           const vcan_node_t* const node)
+{
+    const vcan_rx_queue_t* const queue = node->rx_queue;
+    vcan_snap_put32(writer, node->id);
+    vcan_snap_put32(writer,
+                    (queue != NULL ? VCAN_SNAP_QUEUED : 0U)
+                    | (queue != NULL && queue->metas != NULL
+                       ? VCAN_SNAP_METAS : 0U));
+    vcan_snap_put_meta(writer, &node->rx_meta);
+#ifdef VCAN_STATS
+    vcan_snap_put64(writer, atomic_load_explicit(&node->stats.rx_frames,
+                                                 memory_order_relaxed));
+    vcan_snap_put64(writer, atomic_load_explicit(&node->stats.rx_bytes,
+                                                 memory_order_relaxed));
+    vcan_snap_put64(writer, atomic_load_explicit(&node->stats.callback_time,
+                                                 memory_order_relaxed));
+#endif
+    if (queue != NULL)
+    {
+        const bool metas = queue->metas != NULL;
+        vcan_snap_put64(writer, atomic_load_explicit(&queue->overflows,
+                                                     memory_order_relaxed));
+        vcan_snap_put32(writer, atomic_load_explicit(&queue->last_overflow,
+                                                     memory_order_relaxed));
+        vcan_snap_put32(writer, (uint32_t) (
+                vcan_rx_queued(queue)
+                + (queue->spill != NULL ? vcan_rx_queued(queue->spill) : 0)));
+        vcan_snap_queue(writer, queue, metas);
+        if (queue->spill != NULL)
+        {
+            vcan_snap_queue(writer, queue->spill, metas);
+        }
+    }
+}
+
+VCAN_API vcan_err_t vcan_snapshot(const vcan_bus_t* const bus,
+                                  void* const buf,
+                                  const size_t buf_len,
+                                  size_t* const len)
 {
     vcan_err_t err;
     if (bus == NULL)
     {
         err = VCAN_NULL_BUS;
     }
+    else if (len == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (bus->delivering)
+    {
+        err = VCAN_INVALID_SNAPSHOT;
+    }
+    else
+    {
+        vcan_snap_writer_t writer = {.buf = buf, .len = buf_len, .pos = 0};
+        vcan_node_t* const* const nodes =
+                bus->table != NULL ? bus->table : bus->nodes;
+        vcan_snap_put32(&writer, (uint32_t) VCAN_SNAPSHOT_MAGIC);
+        vcan_snap_put32(&writer, VCAN_SNAP_FEATURES);
+        vcan_snap_put32(&writer, bus->flags);
+        vcan_snap_put32(&writer, (uint32_t) bus->connected);
+        vcan_snap_put64(&writer, bus->seq);
+#ifdef VCAN_STATS
+        vcan_snap_put64(&writer, atomic_load_explicit(&bus->stats.tx_frames,
+                                                      memory_order_relaxed));
+        vcan_snap_put64(&writer, atomic_load_explicit(&bus->stats.tx_bytes,
+                                                      memory_order_relaxed));
+        vcan_snap_put64(&writer, atomic_load_explicit(&bus->stats.dropped,
+                                                      memory_order_relaxed));
+#endif
+        for (size_t i = 0; i < bus->connected; i++)
+        {
+            vcan_snap_node(&writer, nodes[i]);
+        }
+        *len = writer.pos;
+        err = buf != NULL && writer.pos <= buf_len ? VCAN_OK : VCAN_TOO_LONG;
+    }
+    return err;
+}
+
+/** Empties the receive queue, like the consumer. */
+static void vcan_rx_discard(vcan_rx_queue_t* const queue)
+{
+    size_t queued;
+    const size_t head = vcan_rx_claim(queue, SIZE_MAX, &queued);
+    vcan_rx_consume(queue, head, queued, queued);
+}
+
+/** Empties the receive queue and its overflow arena and re-arms it. */
+static void vcan_rx_clear(vcan_rx_queue_t* const queue)
+{
+    vcan_rx_discard(queue);
+    if (queue->spill != NULL)
+    {
+        vcan_rx_discard(queue->spill);
+    }
+    atomic_store(&queue->armed, true);
+}
+
+/**
+ * Enqueues a message of the snapshot, into the overflow arena once the
+ * queue is full.
+ */
+static vcan_err_t vcan_restore_msg(vcan_bus_t* const bus,
+                                   vcan_rx_queue_t* const queue,
+                                   const vcan_msg_t* const msg,
+                                   const vcan_meta_t* const meta)
+{
+    vcan_rx_queue_t* const target = vcan_rx_queued(queue) < queue->capacity
+                                    ? queue : queue->spill;
+    const size_t tail = atomic_load_explicit(&target->tail,
+                                             memory_order_relaxed);
+    vcan_err_t err = VCAN_QUEUE_FULL;
+    if (vcan_rx_put(bus, target, tail, msg))
+    {
+        if (target->metas != NULL)
+        {
+            target->metas[tail & (target->capacity - 1)] = *meta;
+        }
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+/**
+ * Reads, and if \p apply is set restores, the state of one node, which
+ * \p restored points to afterwards, NULL if not found.
+ */
+static vcan_err_t vcan_restore_node(vcan_bus_t* const bus,
+                                    vcan_snap_reader_t* const reader,
+                                    vcan_node_t* const* const nodes,
+                                    const size_t nodes_len,
+                                    const bool apply,
+                                    vcan_node_t** const restored)
+{
+    const uint32_t id = vcan_snap_get32(reader);
+    const uint32_t kind = vcan_snap_get32(reader);
+    vcan_meta_t rx_meta;
+    vcan_snap_get_meta(reader, &rx_meta);
+#ifdef VCAN_STATS
+    uint64_t stats[3];
+    for (size_t i = 0; i < 3; i++)
+    {
+        stats[i] = vcan_snap_get64(reader);
+    }
+#endif
+    vcan_node_t* node = NULL;
+    for (size_t i = 0; i < nodes_len && node == NULL; i++)
+    {
+        node = nodes[i] != NULL && nodes[i]->id == id ? nodes[i] : NULL;
+    }
+    *restored = node;
+    vcan_rx_queue_t* const queue = node != NULL ? node->rx_queue : NULL;
+    const uint64_t overflows = (kind & VCAN_SNAP_QUEUED)
+                               ? vcan_snap_get64(reader) : 0;
+    const uint32_t last_overflow = (kind & VCAN_SNAP_QUEUED)
+                                   ? vcan_snap_get32(reader) : VCAN_OK;
+    const uint32_t queued = (kind & VCAN_SNAP_QUEUED)
+                            ? vcan_snap_get32(reader) : 0;
+    vcan_err_t err;
+    if (!reader->valid)
+    {
+        err = VCAN_INVALID_SNAPSHOT;
+    }
     else if (node == NULL)
     {
-        err = VCAN_NULL_NODE;
+        err = VCAN_NODE_NOT_FOUND;
     }
-    else if (node->callback_on_rx == NULL)
+    else if ((kind & VCAN_SNAP_QUEUED) && queue == NULL)
     {
-        err = VCAN_NULL_CALLBACK;
+        err = VCAN_INVALID_SNAPSHOT;
+    }
+    else if (queued > 0
+             && queued > queue->capacity
+                         + (queue->spill != NULL ? queue->spill->capacity : 0))
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else if (queued > 0 && queue->frames != NULL && bus->pool.frames == NULL)
+    {
+        // Shared mode without a pool could not hold any message
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        err = apply ? vcan_connect(bus, node) : VCAN_OK;
+        if (err == VCAN_OK && apply)
+        {
+            node->rx_meta = rx_meta;
+#ifdef VCAN_STATS
+            atomic_store_explicit(&node->stats.rx_frames, stats[0],
+                                  memory_order_relaxed);
+            atomic_store_explicit(&node->stats.rx_bytes, stats[1],
+                                  memory_order_relaxed);
+            atomic_store_explicit(&node->stats.callback_time, stats[2],
+                                  memory_order_relaxed);
+#endif
+            if (queue != NULL)
+            {
+                vcan_rx_clear(queue);
+                atomic_store_explicit(&queue->overflows, overflows,
+                                      memory_order_relaxed);
+                atomic_store_explicit(&queue->last_overflow, last_overflow,
+                                      memory_order_relaxed);
+            }
+        }
+        for (uint32_t i = 0; i < queued && err == VCAN_OK; i++)
+        {
+            vcan_msg_t msg;
+            vcan_meta_t meta = {0};
+            msg.id = vcan_snap_get32(reader);
+            msg.len = vcan_snap_get32(reader);
+            if (msg.len > VCAN_DATA_MAX_LEN)
+            {
+                reader->valid = false;
+            }
+            else
+            {
+                vcan_snap_get(reader, msg.data, msg.len);
+            }
+            if (kind & VCAN_SNAP_METAS)
+            {
+                vcan_snap_get_meta(reader, &meta);
+            }
+            if (!reader->valid)
+            {
+                err = VCAN_INVALID_SNAPSHOT;
+            }
+            else if (apply)
+            {
+                err = vcan_restore_msg(bus, queue, &msg, &meta);
+            }
+        }
+    }
+    return err;
+}
+
+/**
+ * Whether one of the first \p count node records of the snapshot, starting
+ * at \p first, is restored into \p node.
+ */
+static bool vcan_restore_taken(vcan_bus_t* const bus,
+                               const void* const buf,
+                               const size_t buf_len,
+                               const size_t first,
+                               const uint32_t count,
+                               vcan_node_t* const* const nodes,
+                               const size_t nodes_len,
+                               const vcan_node_t* const node)
+{
+    vcan_snap_reader_t reader = {
+            .buf = buf, .len = buf_len, .pos = first, .valid = true,
+    };
+    bool taken = false;
+    for (uint32_t i = 0; i < count && !taken; i++)
+    {
+        vcan_node_t* other;
+        vcan_restore_node(bus, &reader, nodes, nodes_len, false, &other);
+        taken = other == node;
+    }
+    return taken;
+}
+
+/**
+ * Reads the whole snapshot, restoring it into the bus only if \p apply is
+ * set, so a first pass can check it without side effects.
+ */
+static vcan_err_t vcan_restore_pass(vcan_bus_t* const bus,
+                                    const void* const buf,
+                                    const size_t buf_len,
+                                    vcan_node_t* const* const nodes,
+                                    const size_t nodes_len,
+                                    const bool apply)
+{
+    vcan_snap_reader_t reader = {
+            .buf = buf, .len = buf_len, .pos = 0, .valid = true,
+    };
+    const uint32_t magic = vcan_snap_get32(&reader);
+    const uint32_t features = vcan_snap_get32(&reader);
+    const uint32_t flags = vcan_snap_get32(&reader);
+    const uint32_t connected = vcan_snap_get32(&reader);
+    const uint64_t seq = vcan_snap_get64(&reader);
+#ifdef VCAN_STATS
+    uint64_t stats[3];
+    for (size_t i = 0; i < 3; i++)
+    {
+        stats[i] = vcan_snap_get64(&reader);
+    }
+#endif
+    vcan_err_t err;
+    if (!reader.valid || magic != VCAN_SNAPSHOT_MAGIC
+        || features != VCAN_SNAP_FEATURES)
+    {
+        err = VCAN_INVALID_SNAPSHOT;
     }
-    else if (bus->connected >= VCAN_MAX_CONNECTED_NODES)
+    else if (connected > vcan_capacity(bus))
     {
         err = VCAN_TOO_MANY_CONNECTED;
     }
     else
     {
+        if (apply)
+        {
+            while (bus->connected > 0)
+            {
+                vcan_disconnect(bus, vcan_nodes(bus)[bus->connected - 1]);
+            }
+            bus->flags = flags;
+            bus->seq = seq;
+#ifdef VCAN_STATS
+            atomic_store_explicit(&bus->stats.tx_frames, stats[0],
+                                  memory_order_relaxed);
+            atomic_store_explicit(&bus->stats.tx_bytes, stats[1],
+                                  memory_order_relaxed);
+            atomic_store_explicit(&bus->stats.dropped, stats[2],
+                                  memory_order_relaxed);
+#endif
+        }
+        const size_t first = reader.pos;
         err = VCAN_OK;
-        for (size_t i = 0; i < bus->connected; i++)
+        for (uint32_t i = 0; i < connected && err == VCAN_OK; i++)
         {
-            if (bus->nodes[i] == node)
+            vcan_node_t* node;
+            err = vcan_restore_node(bus, &reader, nodes, nodes_len, apply,
+                                    &node);
+            // Checked only in the first pass: the node records before are
+            // valid, quadratic but on the few connected nodes
+            if (err == VCAN_OK && !apply
+                && vcan_restore_taken(bus, buf, buf_len, first, i, nodes,
+                                      nodes_len, node))
             {
-                err = VCAN_ALREADY_CONNECTED;
+                err = VCAN_INVALID_SNAPSHOT;
             }
         }
-        if (err == VCAN_OK)
+        if (err == VCAN_OK && reader.pos != buf_len)
         {
-            bus->nodes[bus->connected++] = node;
+            err = VCAN_INVALID_SNAPSHOT;
         }
     }
     return err;
 }
 
-vcan_err_t vcan_disconnect(vcan_bus_t* const bus,
-                           const vcan_node_t* const node)
+VCAN_API vcan_err_t vcan_restore(vcan_bus_t* const bus,
+                                 const void* const buf,
+                                 const size_t buf_len,
+                                 vcan_node_t* const* const nodes,
+                                 const size_t nodes_len)
 {
     vcan_err_t err;
     if (bus == NULL)
     {
         err = VCAN_NULL_BUS;
     }
-    else if (node == NULL)
+    else if (buf == NULL)
     {
-        err = VCAN_NULL_NODE;
+        err = VCAN_NULL_STORAGE;
     }
     else
     {
-        err = VCAN_NODE_NOT_FOUND;
-        for (size_t i = 0; i < bus->connected; i++)
+        err = vcan_restore_pass(bus, buf, buf_len, nodes, nodes_len, false);
+        if (err == VCAN_OK)
         {
-            if (bus->nodes[i] == node)
-            {
-                const size_t nodes_to_shift = bus->connected - i - 1;
-                memmove(&bus->nodes[i],
-                        &bus->nodes[i + 1],
-                        nodes_to_shift * sizeof(vcan_node_t*));
-                bus->connected--;
-                err = VCAN_OK;
-                break;
-            }
+            err = vcan_restore_pass(bus, buf, buf_len, nodes, nodes_len,
+                                    true);
         }
     }
     return err;
 }
+
+#endif  /* VCAN_C */
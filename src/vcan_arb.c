@@ -0,0 +1,285 @@
+/**
+ * @file
+ *
+ * VCAN arbitration simulation implementation.
+ *
+ * The slots provided by the caller hold two independent arrays: the keys
+ * of the heap, ordered by priority, and the pool of pending messages, which
+ * never move. Only the 16-byte keys are swapped while sifting.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#include "vcan_arb.h"
+
+/** Highest CAN ID of a standard frame, higher ones are extended. */
+#define VCAN_ARB_STD_ID_MAX 0x7FFU
+
+/** Bits of a classic frame exposed to stuffing, without the payload:
+ * standard and extended format. */
+#define VCAN_ARB_CLASSIC_STUFFED_STD 34U
+#define VCAN_ARB_CLASSIC_STUFFED_EXT 54U
+
+/** Bits of a classic frame not exposed to stuffing, including the
+ * interframe space. */
+#define VCAN_ARB_CLASSIC_FIXED 13U
+
+/** Bits of the CAN FD arbitration phase: standard and extended format. */
+#define VCAN_ARB_FD_ARBITRATION_STD 17U
+#define VCAN_ARB_FD_ARBITRATION_EXT 36U
+
+/** Bits of the CAN FD data phase exposed to stuffing, without the payload:
+ * ESI and DLC. */
+#define VCAN_ARB_FD_DATA_HEADER 5U
+
+/** Bits after the data phase at the nominal bitrate: CRC delimiter, ACK,
+ * end of frame and interframe space. */
+#define VCAN_ARB_FD_TRAILER 13U
+
+/** Nanoseconds taken by the bits at the bitrate, rounded up. */
+static uint64_t vcan_arb_bits_ns(const uint64_t bits, const uint32_t bitrate)
+{
+    return (bits * 1000000000U + bitrate - 1U) / bitrate;
+}
+
+/** Worst-case stuff bits of a sequence of bits: one every 4 after the
+ * first 5 equal ones. */
+static uint64_t vcan_arb_stuff_bits(const uint64_t bits)
+{
+    return bits > 0 ? (bits - 1U) / 4U : 0U;
+}
+
+uint64_t vcan_arb_wire_time(const uint32_t nominal_bitrate,
+                            const uint32_t data_bitrate,
+                            const vcan_msg_t* const msg)
+{
+    uint64_t wire_time = 0;
+    if (nominal_bitrate > 0 && msg != NULL && msg->len <= VCAN_DATA_MAX_LEN)
+    {
+        const bool extended = msg->id > VCAN_ARB_STD_ID_MAX;
+        if (msg->len <= VCAN_CLASSIC_DATA_MAX_LEN)
+        {
+            const uint64_t stuffed = 8U * (uint64_t) msg->len + (extended
+                                     ? VCAN_ARB_CLASSIC_STUFFED_EXT
+                                     : VCAN_ARB_CLASSIC_STUFFED_STD);
+            wire_time = vcan_arb_bits_ns(
+                    stuffed + VCAN_ARB_CLASSIC_FIXED
+                    + vcan_arb_stuff_bits(stuffed), nominal_bitrate);
+        }
+        else
+        {
+            const uint64_t payload = 8U * (uint64_t) vcan_fd_len(msg->len);
+            const uint64_t arbitration = extended
+                                         ? VCAN_ARB_FD_ARBITRATION_EXT
+                                         : VCAN_ARB_FD_ARBITRATION_STD;
+            // Stuff count and CRC, with their fixed stuff bits
+            const uint64_t crc = payload <= 16U * 8U ? 4U + 17U + 6U
+                                                     : 4U + 21U + 7U;
+            const uint64_t data = VCAN_ARB_FD_DATA_HEADER + payload;
+            const uint32_t rate = data_bitrate > 0
+                                  ? data_bitrate : nominal_bitrate;
+            wire_time = vcan_arb_bits_ns(
+                    arbitration + vcan_arb_stuff_bits(arbitration)
+                    + VCAN_ARB_FD_TRAILER, nominal_bitrate)
+                        + vcan_arb_bits_ns(
+                    data + vcan_arb_stuff_bits(data) + crc, rate);
+        }
+    }
+    return wire_time;
+}
+
+/** True if the key \p a wins the arbitration against \p b. */
+static inline bool vcan_arb_wins(const vcan_arb_key_t* const a,
+                                 const vcan_arb_key_t* const b)
+{
+    return a->id < b->id || (a->id == b->id && a->seq < b->seq);
+}
+
+/** Moves the last key towards the root while it has priority. */
+static void vcan_arb_sift_up(vcan_arb_t* const arb)
+{
+    vcan_arb_slot_t* const slots = arb->slots;
+    uint32_t index = arb->len - 1U;
+    const vcan_arb_key_t key = slots[index].key;
+    while (index > 0 && vcan_arb_wins(&key, &slots[(index - 1U) / 2U].key))
+    {
+        slots[index].key = slots[(index - 1U) / 2U].key;
+        index = (index - 1U) / 2U;
+    }
+    slots[index].key = key;
+}
+
+/** Removes the root key, the winner of the arbitration. */
+static void vcan_arb_pop(vcan_arb_t* const arb)
+{
+    vcan_arb_slot_t* const slots = arb->slots;
+    arb->len--;
+    const vcan_arb_key_t key = slots[arb->len].key;
+    uint32_t index = 0;
+    bool placed = false;
+    while (!placed)
+    {
+        uint32_t child = 2U * index + 1U;
+        if (child + 1U < arb->len
+            && vcan_arb_wins(&slots[child + 1U].key, &slots[child].key))
+        {
+            child++;
+        }
+        if (child < arb->len && vcan_arb_wins(&slots[child].key, &key))
+        {
+            slots[index].key = slots[child].key;
+            index = child;
+        }
+        else
+        {
+            placed = true;
+        }
+    }
+    if (arb->len > 0)
+    {
+        slots[index].key = key;
+    }
+}
+
+/** Transmit hook: enqueues the message for the arbitration. */
+static vcan_err_t vcan_arb_submit(void* const ctx,
+                                  const vcan_msg_t* const msg,
+                                  const vcan_node_t* const src_node)
+{
+    vcan_arb_t* const arb = ctx;
+    vcan_err_t err;
+    if (arb->free_head >= arb->capacity)
+    {
+        err = VCAN_QUEUE_FULL;
+    }
+    else
+    {
+        const uint32_t frame = arb->free_head;
+        vcan_arb_frame_t* const pending = &arb->slots[frame].frame;
+        arb->free_head = pending->next_free;
+        vcan_copy_msg(&pending->msg, msg);
+        pending->src_node = src_node;
+        vcan_arb_key_t* const key = &arb->slots[arb->len].key;
+        key->id = msg->id;
+        key->frame = frame;
+        key->seq = arb->next_seq++;
+        arb->len++;
+        vcan_arb_sift_up(arb);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+vcan_err_t vcan_arb_init(vcan_arb_t* const arb,
+                         vcan_bus_t* const bus,
+                         vcan_arb_slot_t* const slots,
+                         const size_t capacity,
+                         const uint32_t nominal_bitrate,
+                         const uint32_t data_bitrate)
+{
+    vcan_err_t err;
+    if (arb == NULL || slots == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (capacity == 0 || capacity > UINT32_MAX || nominal_bitrate == 0)
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        memset(arb, 0, sizeof(vcan_arb_t));
+        arb->bus = bus;
+        arb->slots = slots;
+        arb->capacity = (uint32_t) capacity;
+        arb->nominal_bitrate = nominal_bitrate;
+        arb->data_bitrate = data_bitrate;
+        for (uint32_t i = 0; i < arb->capacity; i++)
+        {
+            slots[i].frame.next_free = i + 1U;
+        }
+        err = vcan_set_tx_hook(bus, vcan_arb_submit, arb);
+    }
+    return err;
+}
+
+vcan_err_t vcan_arb_deinit(vcan_arb_t* const arb)
+{
+    vcan_err_t err;
+    if (arb == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        err = vcan_set_tx_hook(arb->bus, NULL, NULL);
+        arb->len = 0;
+        arb->in_flight = false;
+    }
+    return err;
+}
+
+vcan_err_t vcan_arb_advance(vcan_arb_t* const arb, const uint64_t dt)
+{
+    vcan_err_t err;
+    if (arb == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        const uint64_t target = arb->now + dt;
+        bool progress = true;
+        while (progress)
+        {
+            if (!arb->in_flight && arb->len > 0)
+            {
+                // Idle bus: the pending message with the lowest ID wins
+                arb->wire_frame = arb->slots[0].key.frame;
+                vcan_arb_pop(arb);
+                const uint64_t wire_time = vcan_arb_wire_time(
+                        arb->nominal_bitrate, arb->data_bitrate,
+                        &arb->slots[arb->wire_frame].frame.msg);
+                arb->in_flight = true;
+                arb->busy_until = arb->now + wire_time;
+                arb->busy_time += wire_time;
+            }
+            progress = arb->in_flight && arb->busy_until <= target;
+            if (progress)
+            {
+                vcan_arb_frame_t* const frame =
+                        &arb->slots[arb->wire_frame].frame;
+                arb->now = arb->busy_until;
+                arb->in_flight = false;
+                vcan_tx_direct(arb->bus, &frame->msg, frame->src_node);
+                // Released after the delivery, which read it
+                frame->next_free = arb->free_head;
+                arb->free_head = arb->wire_frame;
+            }
+        }
+        arb->now = target;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+uint64_t vcan_arb_clock(void* const ctx)
+{
+    return ((const vcan_arb_t*) ctx)->now;
+}
+
+size_t vcan_arb_pending(const vcan_arb_t* const arb)
+{
+    return arb->len + (arb->in_flight ? 1U : 0U);
+}
+
+uint64_t vcan_arb_busy_time(const vcan_arb_t* const arb)
+{
+    return arb->busy_time;
+}
@@ -0,0 +1,579 @@
+/**
+ * @file
+ *
+ * VCAN fault injection implementation.
+ *
+ * The rules with a specific ID come first in the sorted table, found by a
+ * binary search, followed by the ones of #VCAN_FAULT_ANY_ID starting at
+ * vcan_fault_t.any_first, evaluated for every message with rules.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#include "vcan_fault.h"
+
+/** Current time of the bus clock, 0 without a clock. */
+static uint64_t vcan_fault_now(const vcan_fault_t* const fault)
+{
+    return fault->bus->clock_now != NULL
+           ? fault->bus->clock_now(fault->bus->clock_ctx) : 0U;
+}
+
+/** Next pseudo-random number: SplitMix64, any seed fits. */
+static uint64_t vcan_fault_random(vcan_fault_t* const fault)
+{
+    fault->random += 0x9E3779B97F4A7C15U;
+    uint64_t z = fault->random;
+    z = (z ^ (z >> 30U)) * 0xBF58476D1CE4E5B9U;
+    z = (z ^ (z >> 27U)) * 0x94D049BB133111EBU;
+    return z ^ (z >> 31U);
+}
+
+/** Whether the rule triggers this time, drawing only when uncertain. */
+static bool vcan_fault_triggers(vcan_fault_t* const fault,
+                                const vcan_fault_rule_t* const rule)
+{
+    bool triggers;
+    if (rule->ppm >= VCAN_FAULT_ALWAYS)
+    {
+        triggers = true;
+    }
+    else if (rule->ppm == 0)
+    {
+        triggers = false;
+    }
+    else
+    {
+        triggers = vcan_fault_random(fault) % VCAN_FAULT_ALWAYS < rule->ppm;
+    }
+    return triggers;
+}
+
+/** Marks the CAN ID in the summary bitmap. */
+static void vcan_fault_mark(uint64_t* const summary, const uint32_t id)
+{
+    const uint32_t bit = id % VCAN_FAULT_SUMMARY_BITS;
+    summary[bit / 64U] |= (uint64_t) 1U << (bit % 64U);
+}
+
+/** Whether the summary bitmap has the CAN ID: if not, it has no rules. */
+static inline bool vcan_fault_marked(const uint64_t* const summary,
+                                     const uint32_t id)
+{
+    const uint32_t bit = id % VCAN_FAULT_SUMMARY_BITS;
+    return ((summary[bit / 64U] >> (bit % 64U)) & 1U) != 0;
+}
+
+/**
+ * The position if it holds a rule of the ID or of any ID, otherwise the
+ * first rule of any ID: the two ranges are visited as one sequence.
+ */
+static size_t vcan_fault_skip(const vcan_fault_t* const fault,
+                              const size_t pos,
+                              const uint32_t id)
+{
+    return pos >= fault->any_first || fault->rules[pos].id == id
+           ? pos : fault->any_first;
+}
+
+/** First rule applying to the ID, rules_len when none. */
+static size_t vcan_fault_first(const vcan_fault_t* const fault,
+                               const uint32_t id)
+{
+    size_t low = 0;
+    size_t high = fault->any_first;
+    while (low < high)
+    {
+        const size_t mid = low + (high - low) / 2U;
+        if (fault->rules[mid].id < id)
+        {
+            low = mid + 1U;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return vcan_fault_skip(fault, low, id);
+}
+
+/** Inverts random bits of the payload. */
+static void vcan_fault_flip(vcan_fault_t* const fault,
+                            vcan_msg_t* const msg,
+                            const uint32_t bits)
+{
+    const uint32_t len = msg->len < VCAN_DATA_MAX_LEN
+                         ? msg->len : VCAN_DATA_MAX_LEN;
+    const uint32_t flips = bits > 0 ? bits : 1U;
+    for (uint32_t i = 0; i < flips && len > 0; i++)
+    {
+        const uint64_t bit = vcan_fault_random(fault) % (8U * (uint64_t) len);
+        msg->data[bit / 8U] ^= (uint8_t) (1U << (bit % 8U));
+    }
+}
+
+/** Ends the bus-off periods that are over. */
+static void vcan_fault_expire(vcan_fault_t* const fault, const uint64_t now)
+{
+    for (size_t i = 0; i < fault->rules_len && fault->offs > 0; i++)
+    {
+        vcan_fault_rule_t* const rule = &fault->rules[i];
+        if (rule->off && rule->duration > 0 && now >= rule->off_until)
+        {
+            rule->off = false;
+            fault->offs--;
+        }
+    }
+}
+
+/** Holds the message back for the duration of the rule. */
+static vcan_err_t vcan_fault_delay(vcan_fault_t* const fault,
+                                   const vcan_msg_t* const msg,
+                                   const vcan_node_t* const src_node,
+                                   const uint64_t duration)
+{
+    vcan_err_t err;
+    if (fault->delayed_len >= fault->delayed_capacity)
+    {
+        err = VCAN_QUEUE_FULL;
+    }
+    else
+    {
+        vcan_fault_delayed_t* const slot = &fault->delayed[fault->delayed_len];
+        vcan_copy_msg(&slot->msg, msg);
+        slot->src_node = src_node;
+        slot->due = vcan_fault_now(fault) + duration;
+        fault->delayed_len++;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+/**
+ * Delivers the due delayed messages one after the other, including the
+ * ones delayed meanwhile by the callbacks, earliest first.
+ */
+static void vcan_fault_release_due(vcan_fault_t* const fault)
+{
+    fault->releasing = true;
+    bool found = true;
+    while (found)
+    {
+        const uint64_t now = vcan_fault_now(fault);
+        size_t next = fault->delayed_len;
+        for (size_t i = 0; i < fault->delayed_len; i++)
+        {
+            if (fault->delayed[i].due <= now
+                && (next == fault->delayed_len
+                    || fault->delayed[i].due < fault->delayed[next].due))
+            {
+                next = i;
+            }
+        }
+        found = next < fault->delayed_len;
+        if (found)
+        {
+            // Moved out first, so the callbacks can already delay more
+            vcan_msg_t msg;
+            vcan_copy_msg(&msg, &fault->delayed[next].msg);
+            const vcan_node_t* const src_node = fault->delayed[next].src_node;
+            fault->delayed_len--;
+            memmove(&fault->delayed[next], &fault->delayed[next + 1U],
+                    (fault->delayed_len - next)
+                    * sizeof(vcan_fault_delayed_t));
+            vcan_tx_direct(fault->bus, &msg, src_node);
+        }
+    }
+    fault->releasing = false;
+}
+
+/** Delivers the due delayed messages and ends the bus-off periods over. */
+static void vcan_fault_catch_up(vcan_fault_t* const fault)
+{
+    if (fault->offs > 0)
+    {
+        vcan_fault_expire(fault, vcan_fault_now(fault));
+    }
+    if (fault->delayed_len > 0 && !fault->releasing)
+    {
+        vcan_fault_release_due(fault);
+    }
+}
+
+/** Evaluates the frame-level rules of a message having some. */
+static vcan_err_t vcan_fault_frame(vcan_fault_t* const fault,
+                                   const vcan_msg_t* const msg,
+                                   const vcan_node_t* const src_node)
+{
+    vcan_msg_t corrupted;
+    const vcan_msg_t* out = msg;
+    vcan_err_t err = VCAN_OK;
+    bool deliver = true;
+    for (size_t i = vcan_fault_first(fault, msg->id);
+         i < fault->rules_len && deliver;
+         i = vcan_fault_skip(fault, i + 1U, msg->id))
+    {
+        vcan_fault_rule_t* const rule = &fault->rules[i];
+        if (rule->node == NULL && vcan_fault_triggers(fault, rule))
+        {
+            rule->hits++;
+            switch (rule->kind)
+            {
+                case VCAN_FAULT_BIT_FLIP:
+                    if (out == msg)
+                    {
+                        vcan_copy_msg(&corrupted, msg);
+                        out = &corrupted;
+                    }
+                    vcan_fault_flip(fault, &corrupted, rule->bits);
+                    break;
+                case VCAN_FAULT_DELAY:
+                    err = vcan_fault_delay(fault, out, src_node,
+                                           rule->duration);
+                    deliver = false;
+                    break;
+                case VCAN_FAULT_ERROR_FRAME:
+                {
+                    const vcan_msg_t error = {.id = VCAN_FAULT_ERROR_ID};
+                    vcan_tx_direct(fault->bus, &error, src_node);
+                    err = VCAN_ERROR_FRAME;
+                    deliver = false;
+                    break;
+                }
+                case VCAN_FAULT_DROP:
+                case VCAN_FAULT_BUS_OFF:
+                default:
+                    deliver = false;
+                    break;
+            }
+        }
+    }
+    if (deliver)
+    {
+        err = vcan_tx_direct(fault->bus, out, src_node);
+    }
+    return err;
+}
+
+/** Transmit hook: injects the frame-level faults. */
+static vcan_err_t vcan_fault_tx(void* const ctx,
+                                const vcan_msg_t* const msg,
+                                const vcan_node_t* const src_node)
+{
+    vcan_fault_t* const fault = ctx;
+    vcan_err_t err;
+    vcan_fault_catch_up(fault);
+    if (vcan_fault_is_bus_off(fault, src_node))
+    {
+        err = VCAN_BUS_OFF;
+    }
+    else if (!vcan_fault_marked(fault->frame_ids, msg->id))
+    {
+        err = vcan_tx_direct(fault->bus, msg, src_node);
+    }
+    else
+    {
+        err = vcan_fault_frame(fault, msg, src_node);
+    }
+    return err;
+}
+
+/** Delivers the message to the node, evaluating its node-level rules. */
+static void vcan_fault_deliver(vcan_fault_t* const fault,
+                               vcan_node_t* const node,
+                               const vcan_msg_t* const msg)
+{
+    vcan_msg_t corrupted;
+    const vcan_msg_t* out = msg;
+    bool deliver = !vcan_fault_is_bus_off(fault, node);
+    for (size_t i = vcan_fault_first(fault, msg->id);
+         i < fault->rules_len && deliver;
+         i = vcan_fault_skip(fault, i + 1U, msg->id))
+    {
+        vcan_fault_rule_t* const rule = &fault->rules[i];
+        if (rule->node == node && vcan_fault_triggers(fault, rule))
+        {
+            rule->hits++;
+            switch (rule->kind)
+            {
+                case VCAN_FAULT_BIT_FLIP:
+                    if (out == msg)
+                    {
+                        vcan_copy_msg(&corrupted, msg);
+                        out = &corrupted;
+                    }
+                    vcan_fault_flip(fault, &corrupted, rule->bits);
+                    break;
+                case VCAN_FAULT_BUS_OFF:
+                    rule->off = true;
+                    rule->off_until = vcan_fault_now(fault)
+                                      + rule->duration;
+                    fault->offs++;
+                    deliver = false;
+                    break;
+                case VCAN_FAULT_DROP:
+                case VCAN_FAULT_DELAY:
+                case VCAN_FAULT_ERROR_FRAME:
+                default:
+                    deliver = false;
+                    break;
+            }
+        }
+    }
+    if (deliver)
+    {
+        vcan_tx_to(fault->bus, node, out);
+    }
+}
+
+/** Fan-out hook: injects the node-level faults. */
+static void vcan_fault_fanout(void* const ctx,
+                              vcan_bus_t* const bus,
+                              vcan_node_t* const* const nodes,
+                              const size_t count,
+                              const vcan_msg_t* const msg,
+                              const vcan_node_t* const src_node)
+{
+    vcan_fault_t* const fault = ctx;
+    const bool ruled = fault->offs > 0
+                       || vcan_fault_marked(fault->node_ids, msg->id);
+    // The callbacks may disconnect nodes: the count is re-read each time
+    (void) count;
+    for (size_t i = 0; i < bus->connected; i++)
+    {
+        if (nodes[i] != src_node && ruled)
+        {
+            vcan_fault_deliver(fault, nodes[i], msg);
+        }
+        else if (nodes[i] != src_node)
+        {
+            vcan_tx_to(bus, nodes[i], msg);
+        }
+    }
+}
+
+/** Whether the rule is consistent, see vcan_fault_init(). */
+static bool vcan_fault_rule_valid(const vcan_fault_rule_t* const rule)
+{
+    bool valid;
+    switch (rule->kind)
+    {
+        case VCAN_FAULT_DROP:
+        case VCAN_FAULT_BIT_FLIP:
+            valid = true;
+            break;
+        case VCAN_FAULT_DELAY:
+        case VCAN_FAULT_ERROR_FRAME:
+            valid = rule->node == NULL;
+            break;
+        case VCAN_FAULT_BUS_OFF:
+            valid = rule->node != NULL;
+            break;
+        default:
+            valid = false;
+            break;
+    }
+    return valid && rule->ppm <= VCAN_FAULT_ALWAYS;
+}
+
+/** True if the rules are sorted by ID, with repetitions. */
+static bool vcan_fault_rules_sorted(const vcan_fault_rule_t* const rules,
+                                    const size_t rules_len)
+{
+    bool sorted = true;
+    for (size_t i = 1; i < rules_len && sorted; i++)
+    {
+        sorted = rules[i - 1U].id <= rules[i].id;
+    }
+    return sorted;
+}
+
+/** True if all rules are valid. */
+static bool vcan_fault_rules_valid(const vcan_fault_rule_t* const rules,
+                                   const size_t rules_len)
+{
+    bool valid = true;
+    for (size_t i = 0; i < rules_len && valid; i++)
+    {
+        valid = vcan_fault_rule_valid(&rules[i]);
+    }
+    return valid;
+}
+
+/** True if any rule delays messages. */
+static bool vcan_fault_delays(const vcan_fault_rule_t* const rules,
+                              const size_t rules_len)
+{
+    bool delays = false;
+    for (size_t i = 0; i < rules_len && !delays; i++)
+    {
+        delays = rules[i].kind == VCAN_FAULT_DELAY;
+    }
+    return delays;
+}
+
+/**
+ * Resets the state of the rules and compiles their summary bitmaps.
+ *
+ * @return true if any rule is node-level
+ */
+static bool vcan_fault_compile(vcan_fault_t* const fault)
+{
+    bool node_level = false;
+    fault->any_first = fault->rules_len;
+    for (size_t i = 0; i < fault->rules_len; i++)
+    {
+        vcan_fault_rule_t* const rule = &fault->rules[i];
+        uint64_t* const summary = rule->node == NULL
+                                  ? fault->frame_ids : fault->node_ids;
+        rule->hits = 0;
+        rule->off = false;
+        rule->off_until = 0;
+        node_level = node_level || rule->node != NULL;
+        if (rule->id == VCAN_FAULT_ANY_ID)
+        {
+            fault->any_first = i < fault->any_first ? i : fault->any_first;
+            memset(summary, 0xFF, sizeof(fault->frame_ids));
+        }
+        else
+        {
+            vcan_fault_mark(summary, rule->id);
+        }
+    }
+    return node_level;
+}
+
+vcan_err_t vcan_fault_init(vcan_fault_t* const fault,
+                           vcan_bus_t* const bus,
+                           vcan_fault_rule_t* const rules,
+                           const size_t rules_len,
+                           vcan_fault_delayed_t* const delayed,
+                           const size_t delayed_capacity,
+                           const uint64_t seed)
+{
+    vcan_err_t err;
+    if (fault == NULL || rules == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (!vcan_fault_rules_sorted(rules, rules_len))
+    {
+        err = VCAN_UNSORTED_FILTER;
+    }
+    else if (!vcan_fault_rules_valid(rules, rules_len))
+    {
+        err = VCAN_INVALID_FAULT;
+    }
+    else if (delayed == NULL && vcan_fault_delays(rules, rules_len))
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (delayed_capacity == 0 && vcan_fault_delays(rules, rules_len))
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        memset(fault, 0, sizeof(vcan_fault_t));
+        fault->bus = bus;
+        fault->rules = rules;
+        fault->rules_len = rules_len;
+        fault->delayed = delayed;
+        fault->delayed_capacity = delayed != NULL ? delayed_capacity : 0U;
+        fault->random = seed;
+        const bool node_level = vcan_fault_compile(fault);
+        err = vcan_set_tx_hook(bus, vcan_fault_tx, fault);
+        if (err == VCAN_OK && node_level)
+        {
+            err = vcan_set_fanout(bus, vcan_fault_fanout, fault);
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_fault_deinit(vcan_fault_t* const fault)
+{
+    vcan_err_t err;
+    if (fault == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        err = vcan_set_tx_hook(fault->bus, NULL, NULL);
+        if (fault->bus->fanout_hook == vcan_fault_fanout)
+        {
+            err = vcan_set_fanout(fault->bus, NULL, NULL);
+        }
+        for (size_t i = 0; i < fault->rules_len; i++)
+        {
+            fault->rules[i].off = false;
+        }
+        fault->offs = 0;
+        fault->delayed_len = 0;
+    }
+    return err;
+}
+
+vcan_err_t vcan_fault_release(vcan_fault_t* const fault)
+{
+    vcan_err_t err;
+    if (fault == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        vcan_fault_catch_up(fault);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+vcan_err_t vcan_fault_recover(vcan_fault_t* const fault,
+                              const vcan_node_t* const node)
+{
+    vcan_err_t err;
+    if (fault == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (node == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else
+    {
+        for (size_t i = 0; i < fault->rules_len; i++)
+        {
+            vcan_fault_rule_t* const rule = &fault->rules[i];
+            if (rule->off && rule->node == node)
+            {
+                rule->off = false;
+                fault->offs--;
+            }
+        }
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+bool vcan_fault_is_bus_off(const vcan_fault_t* const fault,
+                           const vcan_node_t* const node)
+{
+    bool off = false;
+    if (fault != NULL && node != NULL && fault->offs > 0)
+    {
+        for (size_t i = 0; i < fault->rules_len && !off; i++)
+        {
+            off = fault->rules[i].off && fault->rules[i].node == node;
+        }
+    }
+    return off;
+}
@@ -0,0 +1,244 @@
+/**
+ * @file
+ *
+ * VCAN gateway implementation.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#include "vcan_gw.h"
+
+/** True if the route sorts before the source bus and CAN ID. */
+static inline bool vcan_gw_route_before(const vcan_gw_route_t* const a,
+                                        const uint32_t src_bus,
+                                        const uint32_t id)
+{
+    return a->src_bus < src_bus || (a->src_bus == src_bus && a->id < id);
+}
+
+/** Binary search of the route of the message, NULL if none. */
+static const vcan_gw_route_t* vcan_gw_find(const vcan_gw_t* const gw,
+                                           const uint32_t src_bus,
+                                           const uint32_t id)
+{
+    size_t low = 0;
+    size_t high = gw->routes_len;
+    while (low < high)
+    {
+        const size_t mid = low + (high - low) / 2;
+        if (vcan_gw_route_before(&gw->routes[mid], src_bus, id))
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    const vcan_gw_route_t* found = NULL;
+    if (low < gw->routes_len && gw->routes[low].src_bus == src_bus
+        && gw->routes[low].id == id)
+    {
+        found = &gw->routes[low];
+    }
+    return found;
+}
+
+/** Transmits every enqueued message, including the ones enqueued meanwhile. */
+static void vcan_gw_drain(vcan_gw_t* const gw)
+{
+    gw->draining = true;
+    while (gw->len > 0)
+    {
+        // Forwarded in place: the slot stays taken until done
+        const vcan_gw_pending_t* const pending = &gw->fifo[gw->head];
+        gw->hops = pending->hops;
+        for (uint32_t i = 0; i < gw->bus_count; i++)
+        {
+            if ((pending->dst_mask >> i) & 1U)
+            {
+                vcan_tx_stamped(gw->buses[i], &pending->msg,
+                                &gw->ports[i].node, pending->tx_time);
+            }
+        }
+        gw->head = (gw->head + 1) % gw->capacity;
+        gw->len--;
+    }
+    gw->hops = 0;
+    gw->draining = false;
+}
+
+/** Enqueues the forwarded copy of the message, if routed. */
+static void vcan_gw_route(vcan_gw_port_t* const port,
+                          const vcan_msg_t* const msg)
+{
+    vcan_gw_t* const gw = port->gw;
+    const vcan_gw_route_t* const route = vcan_gw_find(gw, port->bus_index,
+                                                      msg->id);
+    const uint32_t valid = gw->bus_count < 32U
+                           ? (1U << gw->bus_count) - 1U : UINT32_MAX;
+    const uint32_t dst_mask = route != NULL
+                              ? route->dst_mask & valid
+                                & ~(1U << port->bus_index)
+                              : 0U;
+    if (dst_mask == 0)
+    {
+        // Not routed
+    }
+    else if (gw->len >= gw->capacity || gw->hops >= VCAN_GW_MAX_HOPS)
+    {
+        gw->dropped++;
+    }
+    else
+    {
+        vcan_gw_pending_t* const pending =
+                &gw->fifo[(gw->head + gw->len) % gw->capacity];
+        vcan_copy_msg(&pending->msg, msg);
+        if (route->new_id != VCAN_GW_SAME_ID)
+        {
+            pending->msg.id = route->new_id;
+        }
+        pending->dst_mask = dst_mask;
+        pending->hops = gw->hops + 1U;
+        // Latency measured from the first transmission, across the hops
+        pending->tx_time = port->node.rx_meta.tx_time;
+        gw->len++;
+    }
+}
+
+static void vcan_gw_on_rx(vcan_node_t* const node,
+                          const vcan_msg_t* const msg)
+{
+    vcan_gw_port_t* const port = node->other_custom_data;
+    vcan_gw_route(port, msg);
+    if (!port->gw->draining)
+    {
+        vcan_gw_drain(port->gw);
+    }
+}
+
+static void vcan_gw_on_rx_burst(vcan_node_t* const node,
+                                const vcan_msg_t* const msgs,
+                                const size_t count)
+{
+    vcan_gw_port_t* const port = node->other_custom_data;
+    for (size_t i = 0; i < count; i++)
+    {
+        vcan_gw_route(port, &msgs[i]);
+    }
+    if (!port->gw->draining)
+    {
+        vcan_gw_drain(port->gw);
+    }
+}
+
+/** True if the routes are strictly ascending by source bus and CAN ID. */
+static bool vcan_gw_routes_sorted(const vcan_gw_route_t* const routes,
+                                  const size_t routes_len)
+{
+    bool sorted = true;
+    for (size_t i = 1; i < routes_len && sorted; i++)
+    {
+        sorted = vcan_gw_route_before(&routes[i - 1], routes[i].src_bus,
+                                      routes[i].id);
+    }
+    return sorted;
+}
+
+/** True if any of the buses is NULL. */
+static bool vcan_gw_any_null(vcan_bus_t** const buses, const size_t count)
+{
+    bool found = false;
+    for (size_t i = 0; i < count && !found; i++)
+    {
+        found = buses[i] == NULL;
+    }
+    return found;
+}
+
+vcan_err_t vcan_gw_init(vcan_gw_t* const gw,
+                        vcan_bus_t** const buses,
+                        const size_t bus_count,
+                        const vcan_gw_route_t* const routes,
+                        const size_t routes_len,
+                        vcan_gw_pending_t* const fifo,
+                        const size_t capacity)
+{
+    vcan_err_t err;
+    if (gw == NULL || buses == NULL || fifo == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (routes == NULL && routes_len > 0)
+    {
+        err = VCAN_NULL_FILTER;
+    }
+    else if (bus_count == 0 || bus_count > VCAN_GW_MAX_BUSES || capacity == 0)
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else if (vcan_gw_any_null(buses, bus_count))
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (!vcan_gw_routes_sorted(routes, routes_len))
+    {
+        err = VCAN_UNSORTED_FILTER;
+    }
+    else
+    {
+        memset(gw, 0, sizeof(vcan_gw_t));
+        gw->buses = buses;
+        gw->routes = routes;
+        gw->routes_len = routes_len;
+        gw->fifo = fifo;
+        gw->capacity = capacity;
+        err = VCAN_OK;
+        for (uint32_t i = 0; i < bus_count && err == VCAN_OK; i++)
+        {
+            vcan_gw_port_t* const port = &gw->ports[i];
+            port->gw = gw;
+            port->bus_index = i;
+            port->node.callback_on_rx = vcan_gw_on_rx;
+            port->node.callback_on_rx_burst = vcan_gw_on_rx_burst;
+            port->node.other_custom_data = port;
+            err = vcan_connect(buses[i], &port->node);
+            if (err == VCAN_OK)
+            {
+                gw->bus_count++;
+            }
+        }
+        if (err != VCAN_OK)
+        {
+            vcan_gw_deinit(gw);
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_gw_deinit(vcan_gw_t* const gw)
+{
+    vcan_err_t err;
+    if (gw == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        for (uint32_t i = 0; i < gw->bus_count; i++)
+        {
+            vcan_disconnect(gw->buses[i], &gw->ports[i].node);
+        }
+        gw->bus_count = 0;
+        gw->len = 0;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+uint64_t vcan_gw_dropped(const vcan_gw_t* const gw)
+{
+    return gw->dropped;
+}
@@ -0,0 +1,554 @@
+/**
+ * @file
+ *
+ * VCAN multi-threaded bus implementation.
+ *
+ * The queue is a bounded multi-producer queue where every slot carries a
+ * sequence number telling whether it is free for the transmitter at a given
+ * position or full for the dispatcher, so transmitters only contend on a
+ * compare-and-swap of the tail position.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#include "vcan_mt.h"
+#include <stdbool.h>
+#include <sched.h>
+
+/** Amount of empty polls of the queue before the dispatcher sleeps. */
+#define VCAN_MT_IDLE_POLLS 64U
+
+/** Kinds of queue entries. */
+enum
+{
+    VCAN_MT_MSG = 0,
+    VCAN_MT_CONNECT = 1,
+    VCAN_MT_DISCONNECT = 2,
+    /** Request refused by a stopping dispatcher, skipped. */
+    VCAN_MT_CANCELLED = 3,
+};
+
+/** Connection or disconnection waiting for the dispatcher. */
+struct vcan_mt_request
+{
+    /** Set by the dispatcher once \p err is available. */
+    atomic_bool done;
+
+    /** Result of the connection or disconnection. */
+    vcan_err_t err;
+};
+
+/**
+ * Reserves the next free slot of the queue.
+ *
+ * @return the slot, to be published with vcan_mt_publish(), or NULL when
+ * the queue is full
+ */
+static vcan_mt_slot_t* vcan_mt_claim(vcan_bus_mt_t* const bus,
+                                     size_t* const pos)
+{
+    vcan_mt_slot_t* claimed = NULL;
+    size_t tail = atomic_load_explicit(&bus->tail, memory_order_relaxed);
+    bool full = false;
+    while (claimed == NULL && !full)
+    {
+        vcan_mt_slot_t* const slot = &bus->slots[tail
+                                                 & (VCAN_MT_QUEUE_LEN - 1)];
+        const size_t seq = atomic_load_explicit(&slot->seq,
+                                                memory_order_acquire);
+        if (seq == tail)
+        {
+            if (atomic_compare_exchange_weak_explicit(
+                    &bus->tail, &tail, tail + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+            {
+                claimed = slot;
+            }
+        }
+        else if (seq < tail)
+        {
+            // The dispatcher did not release this slot from the previous lap
+            full = true;
+        }
+        else
+        {
+            // Another transmitter claimed it first
+            tail = atomic_load_explicit(&bus->tail, memory_order_relaxed);
+        }
+    }
+    *pos = tail;
+    return claimed;
+}
+
+/** Hands a filled slot over to the dispatcher, waking it up if needed. */
+static void vcan_mt_publish(vcan_bus_mt_t* const bus,
+                            vcan_mt_slot_t* const slot,
+                            const size_t pos)
+{
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    // Pairs with the fence of the sleeping dispatcher: either it sees the
+    // new entry or we see it sleeping.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&bus->sleeping, memory_order_relaxed))
+    {
+        pthread_mutex_lock(&bus->lock);
+        pthread_cond_signal(&bus->wakeup);
+        pthread_mutex_unlock(&bus->lock);
+    }
+    // Same pairing with the fence of vcan_mt_dispatch()
+    if (bus->notify != NULL
+        && atomic_load_explicit(&bus->armed, memory_order_relaxed)
+        && atomic_exchange_explicit(&bus->armed, false, memory_order_relaxed))
+    {
+        bus->notify(bus->notify_ctx);
+    }
+}
+
+/** The slot at the head of the queue, if it has been published. */
+static vcan_mt_slot_t* vcan_mt_peek(vcan_bus_mt_t* const bus)
+{
+    vcan_mt_slot_t* const slot = &bus->slots[bus->head
+                                             & (VCAN_MT_QUEUE_LEN - 1)];
+    const size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    return seq == bus->head + 1 ? slot : NULL;
+}
+
+static void vcan_mt_complete(vcan_bus_mt_t* const bus,
+                             struct vcan_mt_request* const request,
+                             const vcan_err_t err)
+{
+    pthread_mutex_lock(&bus->lock);
+    request->err = err;
+    atomic_store(&request->done, true);
+    pthread_cond_broadcast(&bus->completed);
+    pthread_mutex_unlock(&bus->lock);
+}
+
+/**
+ * Processes the entry at the head of the queue, if any.
+ *
+ * @return true if an entry was processed
+ */
+static bool vcan_mt_process_one(vcan_bus_mt_t* const bus)
+{
+    vcan_mt_slot_t* const slot = vcan_mt_peek(bus);
+    if (slot != NULL)
+    {
+        if (slot->kind == VCAN_MT_MSG)
+        {
+            vcan_tx_stamped(&bus->bus, &slot->msg, slot->src_node,
+                            slot->tx_time);
+        }
+        else if (slot->kind == VCAN_MT_CONNECT)
+        {
+            vcan_mt_complete(bus, slot->request,
+                             vcan_connect(&bus->bus, slot->node));
+        }
+        else if (slot->kind == VCAN_MT_DISCONNECT)
+        {
+            vcan_mt_complete(bus, slot->request,
+                             vcan_disconnect(&bus->bus, slot->node));
+        }
+        atomic_store_explicit(&slot->seq, bus->head + VCAN_MT_QUEUE_LEN,
+                              memory_order_release);
+        bus->head++;
+        atomic_store(&bus->processed, bus->head);
+        if (atomic_load(&bus->flushers) > 0)
+        {
+            pthread_mutex_lock(&bus->lock);
+            pthread_cond_broadcast(&bus->completed);
+            pthread_mutex_unlock(&bus->lock);
+        }
+    }
+    return slot != NULL;
+}
+
+/** Sleeps until a transmitter publishes an entry or the bus is stopped. */
+static void vcan_mt_sleep(vcan_bus_mt_t* const bus)
+{
+    pthread_mutex_lock(&bus->lock);
+    atomic_store_explicit(&bus->sleeping, true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (vcan_mt_peek(bus) == NULL && atomic_load(&bus->running))
+    {
+        pthread_cond_wait(&bus->wakeup, &bus->lock);
+    }
+    atomic_store_explicit(&bus->sleeping, false, memory_order_relaxed);
+    pthread_mutex_unlock(&bus->lock);
+}
+
+/**
+ * True when no entry is left, checked under the lock the requests are
+ * published with: a stopping dispatcher serves all the accepted ones.
+ */
+static bool vcan_mt_drained(vcan_bus_mt_t* const bus)
+{
+    pthread_mutex_lock(&bus->lock);
+    const bool drained = vcan_mt_peek(bus) == NULL;
+    pthread_mutex_unlock(&bus->lock);
+    return drained;
+}
+
+static void* vcan_mt_dispatcher(void* const arg)
+{
+    vcan_bus_mt_t* const bus = arg;
+    unsigned int idle_polls = 0;
+    for (;;)
+    {
+        if (vcan_mt_process_one(bus))
+        {
+            idle_polls = 0;
+        }
+        else if (!atomic_load(&bus->running))
+        {
+            if (vcan_mt_drained(bus))
+            {
+                break;
+            }
+        }
+        else if (idle_polls < VCAN_MT_IDLE_POLLS)
+        {
+            idle_polls++;
+        }
+        else
+        {
+            idle_polls = 0;
+            vcan_mt_sleep(bus);
+        }
+    }
+    return NULL;
+}
+
+/** True when the caller must apply changes directly instead of enqueueing. */
+static bool vcan_mt_is_direct(vcan_bus_mt_t* const bus)
+{
+    return !atomic_load(&bus->started)
+           || pthread_equal(pthread_self(), bus->dispatcher);
+}
+
+/**
+ * Enqueues a connection or disconnection and waits for its result.
+ *
+ * The entry is published under the lock, after checking that the
+ * dispatcher is still running, so it is either served before the
+ * dispatcher exits or refused.
+ */
+static vcan_err_t vcan_mt_request(vcan_bus_mt_t* const bus,
+                                  const uint32_t kind,
+                                  vcan_node_t* const node)
+{
+    vcan_err_t err;
+    struct vcan_mt_request request = {.err = VCAN_OK};
+    atomic_init(&request.done, false);
+    size_t pos;
+    vcan_mt_slot_t* slot;
+    while ((slot = vcan_mt_claim(bus, &pos)) == NULL)
+    {
+        sched_yield();
+    }
+    slot->node = node;
+    slot->src_node = NULL;
+    slot->request = &request;
+    pthread_mutex_lock(&bus->lock);
+    const bool running = atomic_load(&bus->running);
+    // The claimed slot is published anyway, to keep the queue going
+    slot->kind = running ? kind : VCAN_MT_CANCELLED;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    pthread_cond_signal(&bus->wakeup);
+    if (running)
+    {
+        while (!atomic_load(&request.done))
+        {
+            pthread_cond_wait(&bus->completed, &bus->lock);
+        }
+        err = request.err;
+    }
+    else
+    {
+        err = VCAN_QUEUE_FULL;
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return err;
+}
+
+/** Initialises everything but the inner bus. */
+static vcan_err_t vcan_mt_init_queue(vcan_bus_mt_t* const bus)
+{
+    vcan_err_t err = VCAN_OK;
+    for (size_t i = 0; i < VCAN_MT_QUEUE_LEN; i++)
+    {
+        atomic_init(&bus->slots[i].seq, i);
+    }
+    atomic_init(&bus->tail, 0);
+    atomic_init(&bus->processed, 0);
+    atomic_init(&bus->sleeping, false);
+    atomic_init(&bus->running, false);
+    atomic_init(&bus->started, false);
+    atomic_init(&bus->flushers, 0);
+    atomic_init(&bus->armed, true);
+    if (pthread_mutex_init(&bus->lock, NULL) != 0)
+    {
+        err = VCAN_THREAD_FAILED;
+    }
+    else if (pthread_cond_init(&bus->wakeup, NULL) != 0)
+    {
+        pthread_mutex_destroy(&bus->lock);
+        err = VCAN_THREAD_FAILED;
+    }
+    else if (pthread_cond_init(&bus->completed, NULL) != 0)
+    {
+        pthread_cond_destroy(&bus->wakeup);
+        pthread_mutex_destroy(&bus->lock);
+        err = VCAN_THREAD_FAILED;
+    }
+    return err;
+}
+
+vcan_err_t vcan_mt_init(vcan_bus_mt_t* const bus)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        memset(bus, 0, sizeof(vcan_bus_mt_t));
+        vcan_init(&bus->bus);
+        err = vcan_mt_init_queue(bus);
+    }
+    return err;
+}
+
+vcan_err_t vcan_mt_init_ex(vcan_bus_mt_t* const bus,
+                           vcan_node_t** const nodes,
+                           const size_t capacity)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        memset(bus, 0, sizeof(vcan_bus_mt_t));
+        err = vcan_init_ex(&bus->bus, nodes, capacity);
+        if (err == VCAN_OK)
+        {
+            err = vcan_mt_init_queue(bus);
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_mt_start(vcan_bus_mt_t* const bus)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        atomic_store(&bus->running, true);
+        if (pthread_create(&bus->dispatcher, NULL,
+                           vcan_mt_dispatcher, bus) != 0)
+        {
+            atomic_store(&bus->running, false);
+            err = VCAN_THREAD_FAILED;
+        }
+        else
+        {
+            atomic_store(&bus->started, true);
+            err = VCAN_OK;
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_mt_stop(vcan_bus_mt_t* const bus)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        if (atomic_load(&bus->started))
+        {
+            pthread_mutex_lock(&bus->lock);
+            atomic_store(&bus->running, false);
+            pthread_cond_signal(&bus->wakeup);
+            pthread_cond_broadcast(&bus->completed);
+            pthread_mutex_unlock(&bus->lock);
+            pthread_join(bus->dispatcher, NULL);
+            atomic_store(&bus->started, false);
+        }
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+vcan_err_t vcan_mt_deinit(vcan_bus_mt_t* const bus)
+{
+    vcan_err_t err = vcan_mt_stop(bus);
+    if (err == VCAN_OK)
+    {
+        pthread_cond_destroy(&bus->completed);
+        pthread_cond_destroy(&bus->wakeup);
+        pthread_mutex_destroy(&bus->lock);
+    }
+    return err;
+}
+
+vcan_err_t vcan_mt_connect(vcan_bus_mt_t* const bus,
+                           vcan_node_t* const node)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (vcan_mt_is_direct(bus))
+    {
+        err = vcan_connect(&bus->bus, node);
+    }
+    else
+    {
+        err = vcan_mt_request(bus, VCAN_MT_CONNECT, node);
+    }
+    return err;
+}
+
+vcan_err_t vcan_mt_disconnect(vcan_bus_mt_t* const bus,
+                              vcan_node_t* const node)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (vcan_mt_is_direct(bus))
+    {
+        err = vcan_disconnect(&bus->bus, node);
+    }
+    else
+    {
+        err = vcan_mt_request(bus, VCAN_MT_DISCONNECT, node);
+    }
+    return err;
+}
+
+vcan_err_t vcan_mt_tx(vcan_bus_mt_t* const bus,
+                      const vcan_msg_t* const msg,
+                      const vcan_node_t* const src_node)
+{
+    vcan_err_t err;
+    size_t pos;
+    vcan_mt_slot_t* slot;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (msg == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else if ((slot = vcan_mt_claim(bus, &pos)) == NULL)
+    {
+#ifdef VCAN_STATS
+        atomic_fetch_add_explicit(&bus->bus.stats.dropped, 1U,
+                                  memory_order_relaxed);
+#endif
+        err = VCAN_QUEUE_FULL;
+    }
+    else
+    {
+        slot->kind = VCAN_MT_MSG;
+        slot->src_node = src_node;
+        slot->tx_time = vcan_timestamp(&bus->bus);
+        vcan_copy_msg(&slot->msg, msg);
+        vcan_mt_publish(bus, slot, pos);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+vcan_err_t vcan_mt_flush(vcan_bus_mt_t* const bus)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        if (atomic_load(&bus->started))
+        {
+            const size_t target = atomic_load(&bus->tail);
+            pthread_mutex_lock(&bus->lock);
+            atomic_fetch_add(&bus->flushers, 1);
+            while (atomic_load(&bus->processed) < target)
+            {
+                pthread_cond_wait(&bus->completed, &bus->lock);
+            }
+            atomic_fetch_sub(&bus->flushers, 1);
+            pthread_mutex_unlock(&bus->lock);
+        }
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+bool vcan_mt_has_next(const vcan_bus_mt_t* const bus)
+{
+    // The entry being delivered is still at the head
+    const size_t next = bus->head + 1U;
+    const vcan_mt_slot_t* const slot = &bus->slots[next
+                                                   & (VCAN_MT_QUEUE_LEN - 1)];
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == next + 1U;
+}
+
+vcan_err_t vcan_mt_set_notify(vcan_bus_mt_t* const bus,
+                              void (* const notify)(void* ctx),
+                              void* const ctx)
+{
+    vcan_err_t err;
+    if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        bus->notify = notify;
+        bus->notify_ctx = ctx;
+        atomic_store(&bus->armed, true);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+size_t vcan_mt_dispatch(vcan_bus_mt_t* const bus)
+{
+    size_t dispatched = 0;
+    if (bus != NULL && !atomic_load(&bus->started))
+    {
+        bool empty = false;
+        while (!empty)
+        {
+            while (vcan_mt_process_one(bus))
+            {
+                dispatched++;
+            }
+            atomic_store_explicit(&bus->armed, true, memory_order_relaxed);
+            // Pairs with the fence of vcan_mt_publish(): either we see the
+            // new entry or the transmitter sees us armed.
+            atomic_thread_fence(memory_order_seq_cst);
+            empty = vcan_mt_peek(bus) == NULL;
+        }
+    }
+    return dispatched;
+}
@@ -0,0 +1,559 @@
+/**
+ * @file
+ *
+ * VCAN bus spanning processes and hosts implementation.
+ *
+ * The shared-memory ring is a broadcast ring: every writer claims the next
+ * position with one atomic increment, and every reader follows the ring at
+ * its own pace with a private cursor, checking the sequence of each slot
+ * before and after copying it out, like a sequence lock. Readers never
+ * block the writers, which overwrite the oldest datagrams.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "vcan_net.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Nanoseconds the shared-memory receiver sleeps when the ring is empty. */
+#define VCAN_NET_SHM_POLL_NS 50000
+
+/** Sequence of a shared-memory slot being written. */
+#define VCAN_NET_SHM_WRITING UINT64_MAX
+
+/** First bytes of every datagram. */
+static const uint8_t vcan_net_magic[4] = {'V', 'C', 'N', '1'};
+
+/** Writes the value as \p len little-endian bytes. */
+static void vcan_net_store(uint8_t* const buf,
+                           const uint32_t value,
+                           const size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        buf[i] = (uint8_t) (value >> (8U * i));
+    }
+}
+
+/** Reads a value of \p len little-endian bytes. */
+static uint32_t vcan_net_load(const uint8_t* const buf, const size_t len)
+{
+    uint32_t value = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        value |= (uint32_t) buf[i] << (8U * i);
+    }
+    return value;
+}
+
+/** Writes the datagram into the next slot of the shared-memory ring. */
+static void vcan_net_shm_publish(vcan_net_t* const net)
+{
+    vcan_net_shm_ring_t* const ring = net->ring;
+    const uint64_t pos = atomic_fetch_add(&ring->tail, 1U);
+    vcan_net_shm_slot_t* const slot = &ring->slots[pos % VCAN_NET_SHM_SLOTS];
+    atomic_store_explicit(&slot->seq, VCAN_NET_SHM_WRITING,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->len = (uint32_t) net->datagram_len;
+    memcpy(slot->data, net->datagram, net->datagram_len);
+    atomic_store_explicit(&slot->seq, pos + 1U, memory_order_release);
+}
+
+/** Sends the datagram to the multicast group. */
+static bool vcan_net_udp_publish(const vcan_net_t* const net)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = net->group;
+    addr.sin_port = net->port;
+    ssize_t result;
+    do
+    {
+        result = sendto(net->fd, net->datagram, net->datagram_len, 0,
+                        (const struct sockaddr*) &addr, sizeof(addr));
+    } while (result < 0 && errno == EINTR);
+    return result == (ssize_t) net->datagram_len;
+}
+
+/** Completes the header of the coalesced datagram and publishes it. */
+static void vcan_net_flush(vcan_net_t* const net)
+{
+    memcpy(net->datagram, vcan_net_magic, sizeof(vcan_net_magic));
+    vcan_net_store(&net->datagram[4], net->sender, 4U);
+    vcan_net_store(&net->datagram[8], net->next_seq++, 4U);
+    vcan_net_store(&net->datagram[12], net->datagram_frames, 2U);
+    bool published = true;
+    if (net->shm)
+    {
+        vcan_net_shm_publish(net);
+    }
+    else
+    {
+        published = vcan_net_udp_publish(net);
+    }
+    if (published)
+    {
+        atomic_fetch_add(&net->tx_datagrams, 1U);
+    }
+    else
+    {
+        atomic_fetch_add(&net->dropped, net->datagram_frames);
+    }
+    net->datagram_len = 0;
+    net->datagram_frames = 0;
+}
+
+/** Packs the message into the coalesced datagram, if it fits. */
+static bool vcan_net_append(vcan_net_t* const net, const vcan_msg_t* const msg)
+{
+    if (net->datagram_len == 0)
+    {
+        net->datagram_len = VCAN_NET_HEADER_LEN;
+    }
+    const size_t packed = vcan_pack(&net->datagram[net->datagram_len],
+                                    VCAN_NET_DATAGRAM_LEN - net->datagram_len,
+                                    msg);
+    if (packed > 0)
+    {
+        net->datagram_len += packed;
+        net->datagram_frames++;
+    }
+    return packed > 0;
+}
+
+/** Coalesces the message, publishing the datagram when no more are coming. */
+static void vcan_net_on_rx(vcan_node_t* const node, const vcan_msg_t* const msg)
+{
+    vcan_net_t* const net = node->other_custom_data;
+    if (vcan_net_append(net, msg))
+    {
+        // Fits
+    }
+    else if (net->datagram_frames > 0)
+    {
+        vcan_net_flush(net);
+        if (!vcan_net_append(net, msg))
+        {
+            atomic_fetch_add(&net->dropped, 1U);
+        }
+    }
+    else
+    {
+        atomic_fetch_add(&net->dropped, 1U);
+    }
+    if (net->datagram_frames > 0 && !vcan_mt_has_next(net->bus))
+    {
+        vcan_net_flush(net);
+    }
+}
+
+/**
+ * Tracks the sequence number of the sender, counting the gaps as lost.
+ *
+ * @return false for a datagram older than one already received
+ */
+static bool vcan_net_in_sequence(vcan_net_t* const net,
+                                 const uint32_t sender,
+                                 const uint32_t seq)
+{
+    size_t i = 0;
+    while (i < net->peer_count && net->peers[i].sender != sender)
+    {
+        i++;
+    }
+    bool fresh = true;
+    if (i < net->peer_count)
+    {
+        const uint32_t gap = seq - net->peers[i].next_seq;
+        // Wrapping distance: the upper half means behind
+        fresh = gap < 0x80000000U;
+        if (fresh)
+        {
+            atomic_fetch_add(&net->lost, gap);
+            net->peers[i].next_seq = seq + 1U;
+        }
+    }
+    else if (net->peer_count < VCAN_NET_MAX_PEERS)
+    {
+        net->peers[net->peer_count].sender = sender;
+        net->peers[net->peer_count].next_seq = seq + 1U;
+        net->peer_count++;
+    }
+    return fresh;
+}
+
+/** Transmits the frames of a datagram of another link on the local bus. */
+static void vcan_net_rx_datagram(vcan_net_t* const net,
+                                 const uint8_t* const data,
+                                 const size_t len)
+{
+    if (len >= VCAN_NET_HEADER_LEN
+        && memcmp(data, vcan_net_magic, sizeof(vcan_net_magic)) == 0
+        && vcan_net_load(&data[4], 4U) != net->sender
+        && vcan_net_in_sequence(net, vcan_net_load(&data[4], 4U),
+                                vcan_net_load(&data[8], 4U)))
+    {
+        const uint32_t frames = vcan_net_load(&data[12], 2U);
+        size_t offset = VCAN_NET_HEADER_LEN;
+        size_t read = 1;
+        for (uint32_t i = 0; i < frames && read > 0; i++)
+        {
+            vcan_msg_t msg;
+            read = vcan_unpack(&msg, &data[offset], len - offset);
+            offset += read;
+            if (read > 0
+                && vcan_mt_tx(net->bus, &msg, &net->node) != VCAN_OK)
+            {
+                atomic_fetch_add(&net->dropped, 1U);
+            }
+        }
+        // Counted once its messages are queued on the bus
+        atomic_fetch_add(&net->rx_datagrams, 1U);
+    }
+}
+
+/**
+ * Receives the datagrams published in the ring since the last call.
+ *
+ * @return amount of datagrams read
+ */
+static size_t vcan_net_shm_poll(vcan_net_t* const net)
+{
+    vcan_net_shm_ring_t* const ring = net->ring;
+    uint8_t datagram[VCAN_NET_DATAGRAM_LEN];
+    size_t read = 0;
+    bool more = true;
+    while (more)
+    {
+        vcan_net_shm_slot_t* const slot =
+                &ring->slots[net->cursor % VCAN_NET_SHM_SLOTS];
+        const uint64_t seq = atomic_load_explicit(&slot->seq,
+                                                  memory_order_acquire);
+        if (seq == net->cursor + 1U)
+        {
+            const size_t len = slot->len <= VCAN_NET_DATAGRAM_LEN
+                               ? slot->len : 0U;
+            memcpy(datagram, slot->data, len);
+            atomic_thread_fence(memory_order_acquire);
+            // Overwritten while copying: lost, as the sequence numbers tell
+            if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq)
+            {
+                vcan_net_rx_datagram(net, datagram, len);
+            }
+            net->cursor++;
+            read++;
+        }
+        else if (seq != VCAN_NET_SHM_WRITING && seq > net->cursor + 1U)
+        {
+            // Lapped by the writers: resume from the oldest slot left
+            net->cursor = atomic_load(&ring->tail) - VCAN_NET_SHM_SLOTS;
+        }
+        else
+        {
+            more = false;
+        }
+    }
+    return read;
+}
+
+/** Receives the datagrams waiting in the UDP socket. */
+static void vcan_net_udp_poll(vcan_net_t* const net)
+{
+    uint8_t datagram[VCAN_NET_DATAGRAM_LEN];
+    ssize_t len;
+    do
+    {
+        len = recv(net->fd, datagram, sizeof(datagram), MSG_DONTWAIT);
+        if (len > 0)
+        {
+            vcan_net_rx_datagram(net, datagram, (size_t) len);
+        }
+    } while (len > 0 || (len < 0 && errno == EINTR));
+}
+
+/** Receives the datagrams of the transport until stopped. */
+static void* vcan_net_receiver(void* const arg)
+{
+    vcan_net_t* const net = arg;
+    struct pollfd fds[2] = {
+            {.fd = net->fd, .events = POLLIN},
+            {.fd = net->stop_pipe[0], .events = POLLIN},
+    };
+    while (atomic_load(&net->running))
+    {
+        if (net->shm)
+        {
+            if (vcan_net_shm_poll(net) == 0)
+            {
+                const struct timespec interval = {
+                        .tv_sec = 0, .tv_nsec = VCAN_NET_SHM_POLL_NS,
+                };
+                nanosleep(&interval, NULL);
+            }
+        }
+        else if (poll(fds, 2, -1) > 0 && fds[1].revents == 0)
+        {
+            vcan_net_udp_poll(net);
+        }
+    }
+    return NULL;
+}
+
+/** Resets the link and its proxy node before opening a transport. */
+static void vcan_net_reset(vcan_net_t* const net, vcan_bus_mt_t* const bus)
+{
+    memset(net, 0, sizeof(vcan_net_t));
+    net->bus = bus;
+    net->fd = -1;
+    net->node.callback_on_rx = vcan_net_on_rx;
+    net->node.other_custom_data = net;
+    // Unique among the links with high probability, also across hosts
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    net->sender = (uint32_t) now.tv_nsec ^ ((uint32_t) now.tv_sec << 20U)
+                  ^ ((uint32_t) getpid() << 8U)
+                  ^ (uint32_t) (uintptr_t) net;
+    atomic_init(&net->tx_datagrams, 0U);
+    atomic_init(&net->rx_datagrams, 0U);
+    atomic_init(&net->lost, 0U);
+    atomic_init(&net->dropped, 0U);
+    atomic_init(&net->running, true);
+}
+
+/** Connects the proxy node and starts the receiver, given the transport. */
+static vcan_err_t vcan_net_start(vcan_net_t* const net)
+{
+    vcan_err_t err;
+    if (pipe(net->stop_pipe) != 0)
+    {
+        err = VCAN_IO_FAILED;
+    }
+    else
+    {
+        err = vcan_mt_connect(net->bus, &net->node);
+        if (err == VCAN_OK && pthread_create(&net->receiver, NULL,
+                                             vcan_net_receiver, net) != 0)
+        {
+            vcan_mt_disconnect(net->bus, &net->node);
+            err = VCAN_THREAD_FAILED;
+        }
+        if (err != VCAN_OK)
+        {
+            close(net->stop_pipe[0]);
+            close(net->stop_pipe[1]);
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_net_shm_open(vcan_net_t* const net,
+                             vcan_bus_mt_t* const bus,
+                             const char* const name)
+{
+    vcan_err_t err;
+    if (net == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (name == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        vcan_net_reset(net, bus);
+        net->shm = true;
+        // A newly created object is all zeros: an empty ring
+        const int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+        void* ring = MAP_FAILED;
+        if (fd >= 0 && ftruncate(fd, sizeof(vcan_net_shm_ring_t)) == 0)
+        {
+            ring = mmap(NULL, sizeof(vcan_net_shm_ring_t),
+                        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        if (ring == MAP_FAILED)
+        {
+            err = VCAN_IO_FAILED;
+        }
+        else
+        {
+            net->ring = ring;
+            net->cursor = atomic_load(&net->ring->tail);
+            err = vcan_net_start(net);
+            if (err != VCAN_OK)
+            {
+                munmap(ring, sizeof(vcan_net_shm_ring_t));
+            }
+        }
+    }
+    return err;
+}
+
+/** Creates the UDP socket joined to the multicast group. */
+static vcan_err_t vcan_net_udp_bind(vcan_net_t* const net,
+                                    const char* const group)
+{
+    vcan_err_t err;
+    struct in_addr group_addr;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = net->port;
+    const int enable = 1;
+    if (inet_pton(AF_INET, group, &group_addr) != 1)
+    {
+        err = VCAN_IO_FAILED;
+    }
+    else if ((net->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        err = VCAN_IO_FAILED;
+    }
+    else
+    {
+        // Shared by the processes of the same host
+        struct ip_mreq membership;
+        membership.imr_multiaddr = group_addr;
+        membership.imr_interface.s_addr = htonl(INADDR_ANY);
+        const unsigned char loop = 1;
+        net->group = group_addr.s_addr;
+        if (setsockopt(net->fd, SOL_SOCKET, SO_REUSEADDR, &enable,
+                       sizeof(enable)) != 0
+            || bind(net->fd, (const struct sockaddr*) &addr,
+                    sizeof(addr)) != 0
+            || setsockopt(net->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                          &membership, sizeof(membership)) != 0
+            || setsockopt(net->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                          sizeof(loop)) != 0)
+        {
+            close(net->fd);
+            err = VCAN_IO_FAILED;
+        }
+        else
+        {
+            err = VCAN_OK;
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_net_udp_open(vcan_net_t* const net,
+                             vcan_bus_mt_t* const bus,
+                             const char* const group,
+                             const uint16_t port)
+{
+    vcan_err_t err;
+    if (net == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (group == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (port == 0)
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        vcan_net_reset(net, bus);
+        net->port = htons(port);
+        err = vcan_net_udp_bind(net, group);
+        if (err == VCAN_OK)
+        {
+            err = vcan_net_start(net);
+            if (err != VCAN_OK)
+            {
+                close(net->fd);
+            }
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_net_close(vcan_net_t* const net)
+{
+    vcan_err_t err;
+    if (net == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else
+    {
+        const uint8_t stop = 1;
+        atomic_store(&net->running, false);
+        while (write(net->stop_pipe[1], &stop, 1) < 0 && errno == EINTR)
+        {
+            // Retry
+        }
+        pthread_join(net->receiver, NULL);
+        // Once disconnected, the dispatcher does not touch the datagram
+        vcan_mt_disconnect(net->bus, &net->node);
+        if (net->datagram_frames > 0)
+        {
+            vcan_net_flush(net);
+        }
+        close(net->stop_pipe[0]);
+        close(net->stop_pipe[1]);
+        if (net->shm)
+        {
+            munmap(net->ring, sizeof(vcan_net_shm_ring_t));
+        }
+        else
+        {
+            close(net->fd);
+        }
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+vcan_err_t vcan_net_get_stats(const vcan_net_t* const net,
+                              vcan_net_stats_t* const stats)
+{
+    vcan_err_t err;
+    if (net == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else if (stats == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        stats->tx_datagrams = atomic_load(&net->tx_datagrams);
+        stats->rx_datagrams = atomic_load(&net->rx_datagrams);
+        stats->lost = atomic_load(&net->lost);
+        stats->dropped = atomic_load(&net->dropped);
+        err = VCAN_OK;
+    }
+    return err;
+}
@@ -0,0 +1,120 @@
+/**
+ * @file
+ *
+ * VCAN readiness notifications for event loops implementation.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "vcan_notify.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/** Opens a non-blocking pipe closed on `exec()`. */
+static vcan_err_t vcan_notify_pipe(vcan_notify_t* const notify)
+{
+    int fds[2];
+    vcan_err_t err = VCAN_OK;
+    if (pipe(fds) != 0)
+    {
+        err = VCAN_IO_FAILED;
+    }
+    else
+    {
+        for (size_t i = 0; i < 2; i++)
+        {
+            if (fcntl(fds[i], F_SETFL, O_NONBLOCK) != 0
+                || fcntl(fds[i], F_SETFD, FD_CLOEXEC) != 0)
+            {
+                err = VCAN_IO_FAILED;
+            }
+        }
+        if (err != VCAN_OK)
+        {
+            close(fds[0]);
+            close(fds[1]);
+        }
+        else
+        {
+            notify->read_fd = fds[0];
+            notify->write_fd = fds[1];
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_notify_init(vcan_notify_t* const notify)
+{
+    vcan_err_t err;
+    if (notify == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+#ifdef __linux__
+        notify->read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        notify->write_fd = notify->read_fd;
+        err = notify->read_fd >= 0 ? VCAN_OK : vcan_notify_pipe(notify);
+#else
+        err = vcan_notify_pipe(notify);
+#endif
+    }
+    return err;
+}
+
+vcan_err_t vcan_notify_deinit(vcan_notify_t* const notify)
+{
+    vcan_err_t err;
+    if (notify == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        if (notify->write_fd != notify->read_fd)
+        {
+            close(notify->write_fd);
+        }
+        close(notify->read_fd);
+        notify->read_fd = -1;
+        notify->write_fd = -1;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+int vcan_notify_fd(const vcan_notify_t* const notify)
+{
+    return notify != NULL ? notify->read_fd : -1;
+}
+
+void vcan_notify_signal(void* const notify)
+{
+    const vcan_notify_t* const self = notify;
+    // 8 bytes for an eventfd, any for a pipe. A full pipe or a saturated
+    // eventfd is readable anyway, so the result does not matter.
+    const uint64_t one = 1;
+    const ssize_t written = write(self->write_fd, &one, sizeof(one));
+    (void) written;
+}
+
+bool vcan_notify_clear(vcan_notify_t* const notify)
+{
+    uint64_t drained[8];
+    bool notified = false;
+    // An eventfd is reset by a single read, a pipe is read until empty
+    while (read(notify->read_fd, drained, sizeof(drained)) > 0)
+    {
+        notified = true;
+    }
+    return notified;
+}
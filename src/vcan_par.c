@@ -0,0 +1,369 @@
+/**
+ * @file
+ *
+ * VCAN parallel delivery implementation.
+ *
+ * Each share is a double-ended range packed into one atomic word, so the
+ * owner taking from the front and the thieves taking from the back agree
+ * on the last node with a single compare-and-swap.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#define _GNU_SOURCE
+
+#include "vcan_par.h"
+#include <sched.h>
+
+/** Amount of empty polls of the generation before a worker sleeps. */
+#define VCAN_PAR_IDLE_POLLS 64U
+
+/** Packs the front and the end of a share. */
+static inline uint64_t vcan_par_range(const uint32_t front, const uint32_t back)
+{
+    return (uint64_t) front | ((uint64_t) back << 32U);
+}
+
+/** Takes the next position from the front of the own share. */
+static bool vcan_par_take(vcan_par_worker_t* const worker, uint32_t* const pos)
+{
+    uint64_t range = atomic_load_explicit(&worker->range, memory_order_relaxed);
+    bool taken = false;
+    bool done = false;
+    while (!done)
+    {
+        const uint32_t front = (uint32_t) range;
+        const uint32_t back = (uint32_t) (range >> 32U);
+        if (front >= back)
+        {
+            done = true;
+        }
+        else if (atomic_compare_exchange_weak(
+                &worker->range, &range, vcan_par_range(front + 1U, back)))
+        {
+            *pos = front;
+            taken = true;
+            done = true;
+        }
+    }
+    return taken;
+}
+
+/** Steals the last position of the share of another worker, if not bound. */
+static bool vcan_par_steal(vcan_par_worker_t* const victim,
+                           uint32_t* const pos)
+{
+    uint64_t range = atomic_load_explicit(&victim->range, memory_order_relaxed);
+    bool stolen = false;
+    bool done = false;
+    while (!done)
+    {
+        const uint32_t front = (uint32_t) range;
+        const uint32_t back = (uint32_t) (range >> 32U);
+        if (back <= front || back <= victim->bound_end)
+        {
+            done = true;
+        }
+        else if (atomic_compare_exchange_weak(
+                &victim->range, &range, vcan_par_range(front, back - 1U)))
+        {
+            *pos = back - 1U;
+            stolen = true;
+            done = true;
+        }
+    }
+    return stolen;
+}
+
+/** Delivers the own share, then helps the others, then checks out. */
+static void vcan_par_work(vcan_par_worker_t* const worker)
+{
+    vcan_par_t* const pool = worker->pool;
+    uint32_t pos = 0;
+    while (vcan_par_take(worker, &pos))
+    {
+        vcan_tx_to(pool->bus, pool->order[pos], pool->msg);
+    }
+    for (uint32_t i = 1; i < pool->worker_count; i++)
+    {
+        vcan_par_worker_t* const victim =
+                &pool->workers[(worker->index + i) % pool->worker_count];
+        while (vcan_par_steal(victim, &pos))
+        {
+            vcan_tx_to(pool->bus, pool->order[pos], pool->msg);
+        }
+    }
+    atomic_fetch_sub_explicit(&pool->pending, 1U, memory_order_release);
+}
+
+static void* vcan_par_worker(void* const arg)
+{
+    vcan_par_worker_t* const worker = arg;
+    vcan_par_t* const pool = worker->pool;
+    size_t seen = 0;
+    unsigned int idle_polls = 0;
+    while (atomic_load(&pool->running))
+    {
+        const size_t generation = atomic_load_explicit(&pool->generation,
+                                                       memory_order_acquire);
+        if (generation != seen)
+        {
+            seen = generation;
+            idle_polls = 0;
+            vcan_par_work(worker);
+        }
+        else if (idle_polls < VCAN_PAR_IDLE_POLLS)
+        {
+            idle_polls++;
+        }
+        else
+        {
+            idle_polls = 0;
+            pthread_mutex_lock(&pool->lock);
+            // Either the transmitter sees the sleeper or we see the delivery
+            atomic_fetch_add(&pool->sleepers, 1U);
+            if (atomic_load(&pool->generation) == seen
+                && atomic_load(&pool->running))
+            {
+                pthread_cond_wait(&pool->wakeup, &pool->lock);
+            }
+            atomic_fetch_sub(&pool->sleepers, 1U);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+/** Share of the worker the node at index \p i belongs to. */
+static inline uint32_t vcan_par_share(const vcan_par_t* const pool,
+                                      const vcan_node_t* const node,
+                                      const size_t i,
+                                      const size_t count)
+{
+    return node->affinity > 0
+           ? (node->affinity - 1U) % pool->worker_count
+           : (uint32_t) (i * pool->worker_count / count);
+}
+
+/** Fills the order with the bound nodes, then the other ones, per share. */
+static void vcan_par_split(vcan_par_t* const pool,
+                           vcan_node_t* const* const nodes,
+                           const size_t count,
+                           const vcan_node_t* const src_node)
+{
+    uint32_t bound[VCAN_PAR_MAX_WORKERS] = {0};
+    uint32_t stealable[VCAN_PAR_MAX_WORKERS] = {0};
+    for (size_t i = 0; i < count; i++)
+    {
+        if (nodes[i] != src_node)
+        {
+            const uint32_t share = vcan_par_share(pool, nodes[i], i, count);
+            if (nodes[i]->affinity > 0)
+            {
+                bound[share]++;
+            }
+            else
+            {
+                stealable[share]++;
+            }
+        }
+    }
+    uint32_t start = 0;
+    for (uint32_t w = 0; w < pool->worker_count; w++)
+    {
+        vcan_par_worker_t* const worker = &pool->workers[w];
+        const uint32_t end = start + bound[w] + stealable[w];
+        worker->bound_end = start + bound[w];
+        atomic_store_explicit(&worker->range, vcan_par_range(start, end),
+                              memory_order_relaxed);
+        // From now on, the next free position of each kind
+        stealable[w] = worker->bound_end;
+        bound[w] = start;
+        start = end;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (nodes[i] != src_node)
+        {
+            const uint32_t share = vcan_par_share(pool, nodes[i], i, count);
+            uint32_t* const next = nodes[i]->affinity > 0
+                                   ? &bound[share] : &stealable[share];
+            pool->order[*next] = nodes[i];
+            (*next)++;
+        }
+    }
+}
+
+/** Fan-out hook: delivers the message with all workers. */
+static void vcan_par_fanout(void* const ctx,
+                            vcan_bus_t* const bus,
+                            vcan_node_t* const* const nodes,
+                            const size_t count,
+                            const vcan_msg_t* const msg,
+                            const vcan_node_t* const src_node)
+{
+    vcan_par_t* const pool = ctx;
+    if (count > pool->capacity)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (nodes[i] != src_node)
+            {
+                vcan_tx_to(bus, nodes[i], msg);
+            }
+        }
+    }
+    else if (count > 0)
+    {
+        vcan_par_split(pool, nodes, count, src_node);
+        pool->msg = msg;
+        atomic_store_explicit(&pool->pending, pool->worker_count,
+                              memory_order_relaxed);
+        atomic_fetch_add(&pool->generation, 1U);
+        if (atomic_load(&pool->sleepers) > 0)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->wakeup);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        vcan_par_work(&pool->workers[0]);
+        while (atomic_load_explicit(&pool->pending, memory_order_acquire) > 0)
+        {
+            sched_yield();
+        }
+    }
+}
+
+/** Stops and joins the first \p started worker threads. */
+static void vcan_par_stop(vcan_par_t* const pool, const uint32_t started)
+{
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->running, false);
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t w = 1; w < started; w++)
+    {
+        pthread_join(pool->workers[w].thread, NULL);
+    }
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/** Starts the worker thread, pinned to the CPU if any. */
+static bool vcan_par_start(vcan_par_worker_t* const worker, const int* const cpu)
+{
+    pthread_attr_t attr;
+    bool started = pthread_attr_init(&attr) == 0;
+    if (started)
+    {
+#ifdef __linux__
+        if (cpu != NULL)
+        {
+            // Pinned before running, so a thread either starts pinned or not
+            started = *cpu >= 0 && *cpu < CPU_SETSIZE;
+            if (started)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET((size_t) *cpu, &set);
+                started = pthread_attr_setaffinity_np(&attr, sizeof(set),
+                                                      &set) == 0;
+            }
+        }
+#else
+        (void) cpu;
+#endif
+        started = started && pthread_create(&worker->thread, &attr,
+                                            vcan_par_worker, worker) == 0;
+        pthread_attr_destroy(&attr);
+    }
+    return started;
+}
+
+vcan_err_t vcan_par_init(vcan_par_t* const pool,
+                         vcan_bus_t* const bus,
+                         vcan_node_t** const order,
+                         const size_t capacity,
+                         const uint32_t worker_count,
+                         const int* const cpus)
+{
+    vcan_err_t err;
+    if (pool == NULL || order == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (capacity == 0 || capacity > UINT32_MAX || worker_count == 0
+             || worker_count > VCAN_PAR_MAX_WORKERS)
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        memset(pool, 0, sizeof(vcan_par_t));
+        pool->bus = bus;
+        pool->order = order;
+        pool->capacity = capacity;
+        pool->worker_count = worker_count;
+        atomic_init(&pool->generation, 0U);
+        atomic_init(&pool->pending, 0U);
+        atomic_init(&pool->sleepers, 0U);
+        atomic_init(&pool->running, true);
+        for (uint32_t w = 0; w < worker_count; w++)
+        {
+            pool->workers[w].pool = pool;
+            pool->workers[w].index = w;
+            atomic_init(&pool->workers[w].range, 0U);
+        }
+        if (pthread_mutex_init(&pool->lock, NULL) != 0)
+        {
+            err = VCAN_THREAD_FAILED;
+        }
+        else if (pthread_cond_init(&pool->wakeup, NULL) != 0)
+        {
+            pthread_mutex_destroy(&pool->lock);
+            err = VCAN_THREAD_FAILED;
+        }
+        else
+        {
+            uint32_t started = 1;
+            bool ok = true;
+            while (started < worker_count && ok)
+            {
+                ok = vcan_par_start(&pool->workers[started],
+                                    cpus != NULL ? &cpus[started - 1U] : NULL);
+                started += ok ? 1U : 0U;
+            }
+            if (ok)
+            {
+                err = vcan_set_fanout(bus, vcan_par_fanout, pool);
+            }
+            else
+            {
+                vcan_par_stop(pool, started);
+                err = VCAN_THREAD_FAILED;
+            }
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_par_deinit(vcan_par_t* const pool)
+{
+    vcan_err_t err;
+    if (pool == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        err = vcan_set_fanout(pool->bus, NULL, NULL);
+        vcan_par_stop(pool, pool->worker_count);
+    }
+    return err;
+}
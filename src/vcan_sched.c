@@ -0,0 +1,470 @@
+/**
+ * @file
+ *
+ * VCAN simulated-time scheduler implementation.
+ *
+ * The heap stores pointers to the entries and every entry knows its own
+ * position in it, so rescheduling and cancelling are O(log N) without any
+ * search.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#include "vcan_sched.h"
+#include <stdbool.h>
+
+/** Value of #vcan_sched_entry_t.heap_index of entries not scheduled. */
+#define VCAN_SCHED_IDLE SIZE_MAX
+
+/** True if entry \p a is to be transmitted before entry \p b. */
+static inline bool vcan_sched_before(const vcan_sched_entry_t* const a,
+                                     const vcan_sched_entry_t* const b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+/** Stores the entry in the heap at the given position. */
+static inline void vcan_sched_place(vcan_sched_t* const sched,
+                                    vcan_sched_entry_t* const entry,
+                                    const size_t index)
+{
+    sched->heap[index] = entry;
+    entry->heap_index = index;
+}
+
+/** Moves the entry at \p index towards the root while it is due earlier. */
+static void vcan_sched_sift_up(vcan_sched_t* const sched, size_t index)
+{
+    vcan_sched_entry_t* const entry = sched->heap[index];
+    while (index > 0 && vcan_sched_before(entry,
+                                          sched->heap[(index - 1) / 2]))
+    {
+        vcan_sched_place(sched, sched->heap[(index - 1) / 2], index);
+        index = (index - 1) / 2;
+    }
+    vcan_sched_place(sched, entry, index);
+}
+
+/** Moves the entry at \p index towards the leaves while it is due later. */
+static void vcan_sched_sift_down(vcan_sched_t* const sched, size_t index)
+{
+    vcan_sched_entry_t* const entry = sched->heap[index];
+    bool placed = false;
+    while (!placed)
+    {
+        size_t child = 2 * index + 1;
+        if (child + 1 < sched->len
+            && vcan_sched_before(sched->heap[child + 1], sched->heap[child]))
+        {
+            child++;
+        }
+        if (child < sched->len && vcan_sched_before(sched->heap[child], entry))
+        {
+            vcan_sched_place(sched, sched->heap[child], index);
+            index = child;
+        }
+        else
+        {
+            placed = true;
+        }
+    }
+    vcan_sched_place(sched, entry, index);
+}
+
+/** Removes the scheduled entry from the heap. */
+static void vcan_sched_remove(vcan_sched_t* const sched,
+                              vcan_sched_entry_t* const entry)
+{
+    const size_t index = entry->heap_index;
+    sched->len--;
+    if (index < sched->len)
+    {
+        // Fill the hole with the last entry, which may go either way
+        vcan_sched_entry_t* const last = sched->heap[sched->len];
+        vcan_sched_place(sched, last, index);
+        vcan_sched_sift_up(sched, index);
+        vcan_sched_sift_down(sched, last->heap_index);
+    }
+    entry->heap_index = VCAN_SCHED_IDLE;
+}
+
+/** True if the entry is in the heap of this scheduler. */
+static inline bool vcan_sched_contains(const vcan_sched_t* const sched,
+                                       const vcan_sched_entry_t* const entry)
+{
+    return entry->heap_index < sched->len
+           && sched->heap[entry->heap_index] == entry;
+}
+
+/** Inserts the entry, which must not be in the heap, at its due time. */
+static void vcan_sched_insert(vcan_sched_t* const sched,
+                              vcan_sched_entry_t* const entry)
+{
+    entry->seq = sched->next_seq++;
+    sched->heap[sched->len] = entry;
+    sched->len++;
+    vcan_sched_sift_up(sched, sched->len - 1);
+}
+
+vcan_err_t vcan_sched_init(vcan_sched_t* const sched,
+                           vcan_bus_t* const bus,
+                           vcan_sched_entry_t** const heap,
+                           const size_t capacity)
+{
+    vcan_err_t err;
+    if (sched == NULL || heap == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (capacity == 0)
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        memset(sched, 0, sizeof(vcan_sched_t));
+        sched->bus = bus;
+        sched->heap = heap;
+        sched->capacity = capacity;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+vcan_err_t vcan_sched_add(vcan_sched_t* const sched,
+                          vcan_sched_entry_t* const entry,
+                          const uint64_t delay,
+                          const uint64_t period)
+{
+    vcan_err_t err;
+    if (sched == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (entry == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else
+    {
+        const bool scheduled = vcan_sched_contains(sched, entry);
+        if (!scheduled && sched->len >= sched->capacity)
+        {
+            err = VCAN_QUEUE_FULL;
+        }
+        else
+        {
+            if (scheduled)
+            {
+                vcan_sched_remove(sched, entry);
+            }
+            entry->due = sched->now + delay;
+            entry->period = period;
+            vcan_sched_insert(sched, entry);
+            err = VCAN_OK;
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_sched_cancel(vcan_sched_t* const sched,
+                             vcan_sched_entry_t* const entry)
+{
+    vcan_err_t err;
+    if (sched == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (entry == NULL)
+    {
+        err = VCAN_NULL_MSG;
+    }
+    else
+    {
+        if (vcan_sched_contains(sched, entry))
+        {
+            vcan_sched_remove(sched, entry);
+        }
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+/**
+ * Dequeues the entries due at the same time as the first one and sent by
+ * the same node, copying their messages into the batch. Periodic entries
+ * are rescheduled right away, so the callbacks may cancel them.
+ *
+ * @return the amount of messages in the batch
+ */
+static size_t vcan_sched_next_batch(vcan_sched_t* const sched,
+                                    vcan_msg_t* const batch,
+                                    const vcan_node_t** const src_node)
+{
+    const uint64_t due = sched->heap[0]->due;
+    size_t count = 0;
+    *src_node = sched->heap[0]->src_node;
+    while (count < VCAN_SCHED_BATCH_LEN && sched->len > 0
+           && sched->heap[0]->due == due
+           && sched->heap[0]->src_node == *src_node)
+    {
+        vcan_sched_entry_t* const entry = sched->heap[0];
+        vcan_copy_msg(&batch[count], &entry->msg);
+        count++;
+        vcan_sched_remove(sched, entry);
+        if (entry->period > 0)
+        {
+            entry->due += entry->period;
+            vcan_sched_insert(sched, entry);
+        }
+    }
+    return count;
+}
+
+vcan_err_t vcan_advance_time(vcan_sched_t* const sched, const uint64_t dt)
+{
+    vcan_err_t err;
+    if (sched == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        const uint64_t target = sched->now + dt;
+        vcan_msg_t batch[VCAN_SCHED_BATCH_LEN];
+        const vcan_node_t* src_node;
+        err = VCAN_OK;
+        while (sched->len > 0 && sched->heap[0]->due <= target)
+        {
+            sched->now = sched->heap[0]->due;
+            const size_t count = vcan_sched_next_batch(sched, batch,
+                                                       &src_node);
+            const vcan_err_t tx_err = vcan_tx_burst(sched->bus, batch, count,
+                                                    src_node);
+            // The schedule goes on, the first failure is reported
+            if (err == VCAN_OK)
+            {
+                err = tx_err;
+            }
+        }
+        sched->now = target;
+    }
+    return err;
+}
+
+uint64_t vcan_sched_clock(void* const ctx)
+{
+    return ((const vcan_sched_t*) ctx)->now;
+}
+
+/** Start of a scheduler snapshot. */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t len;
+    uint64_t now;
+    uint64_t next_seq;
+} vcan_sched_snap_header_t;
+
+/** Scheduled entry in a scheduler snapshot, following the header. */
+typedef struct
+{
+    /** Position in the table of the entries. */
+    uint32_t index;
+
+    /** 1 if the message has a transmitting node, 0 otherwise. */
+    uint32_t has_src;
+
+    /** ID of the transmitting node. */
+    uint32_t src_id;
+
+    uint32_t reserved;
+    uint64_t period;
+    uint64_t due;
+    uint64_t seq;
+    vcan_msg_t msg;
+} vcan_sched_snap_entry_t;
+
+vcan_err_t vcan_sched_snapshot(const vcan_sched_t* const sched,
+                               const vcan_sched_entry_t* const entries,
+                               const size_t entries_len,
+                               void* const buf,
+                               const size_t buf_len,
+                               size_t* const len)
+{
+    vcan_err_t err;
+    if (sched == NULL || len == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        const size_t size = sizeof(vcan_sched_snap_header_t)
+                            + sched->len * sizeof(vcan_sched_snap_entry_t);
+        const bool fits = buf != NULL && size <= buf_len;
+        uint8_t* const out = buf;
+        err = VCAN_OK;
+        for (size_t i = 0; i < sched->len && err == VCAN_OK; i++)
+        {
+            const vcan_sched_entry_t* const entry = sched->heap[i];
+            // Pointer comparison only within the table
+            const uintptr_t offset = (uintptr_t) entry - (uintptr_t) entries;
+            if (entries == NULL || (uintptr_t) entry < (uintptr_t) entries
+                || offset % sizeof(vcan_sched_entry_t) != 0
+                || offset / sizeof(vcan_sched_entry_t) >= entries_len)
+            {
+                err = VCAN_INVALID_SNAPSHOT;
+            }
+            else if (fits)
+            {
+                const vcan_sched_snap_entry_t record = {
+                        .index = (uint32_t) (offset
+                                             / sizeof(vcan_sched_entry_t)),
+                        .has_src = entry->src_node != NULL,
+                        .src_id = entry->src_node != NULL
+                                  ? entry->src_node->id : 0,
+                        .period = entry->period,
+                        .due = entry->due,
+                        .seq = entry->seq,
+                        .msg = entry->msg,
+                };
+                memcpy(&out[sizeof(vcan_sched_snap_header_t)
+                            + i * sizeof(record)], &record, sizeof(record));
+            }
+        }
+        if (err == VCAN_OK && fits)
+        {
+            const vcan_sched_snap_header_t header = {
+                    .magic = (uint32_t) VCAN_SCHED_SNAPSHOT_MAGIC,
+                    .len = (uint32_t) sched->len,
+                    .now = sched->now,
+                    .next_seq = sched->next_seq,
+            };
+            memcpy(out, &header, sizeof(header));
+        }
+        *len = size;
+        err = err == VCAN_OK && !fits ? VCAN_TOO_LONG : err;
+    }
+    return err;
+}
+
+/** The node connected to the bus with the given ID, NULL if none. */
+static const vcan_node_t* vcan_sched_node(const vcan_bus_t* const bus,
+                                          const uint32_t id)
+{
+    vcan_node_t* const* const nodes = bus->table != NULL
+                                      ? bus->table : bus->nodes;
+    const vcan_node_t* node = NULL;
+    for (size_t i = 0; i < bus->connected && node == NULL; i++)
+    {
+        node = nodes[i]->id == id ? nodes[i] : NULL;
+    }
+    return node;
+}
+
+/** Whether one of the first \p count records of the snapshot has \p index. */
+static bool vcan_sched_index_taken(const uint8_t* const in,
+                                   const size_t count,
+                                   const uint32_t index)
+{
+    bool taken = false;
+    for (size_t i = 0; i < count && !taken; i++)
+    {
+        vcan_sched_snap_entry_t record;
+        memcpy(&record, &in[sizeof(vcan_sched_snap_header_t)
+                            + i * sizeof(record)], sizeof(record));
+        taken = record.index == index;
+    }
+    return taken;
+}
+
+vcan_err_t vcan_sched_restore(vcan_sched_t* const sched,
+                              vcan_sched_entry_t* const entries,
+                              const size_t entries_len,
+                              const void* const buf,
+                              const size_t buf_len)
+{
+    vcan_err_t err;
+    const uint8_t* const in = buf;
+    vcan_sched_snap_header_t header;
+    if (sched == NULL || buf == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (buf_len < sizeof(header))
+    {
+        err = VCAN_INVALID_SNAPSHOT;
+    }
+    else
+    {
+        memcpy(&header, in, sizeof(header));
+        vcan_sched_snap_entry_t record;
+        if (header.magic != VCAN_SCHED_SNAPSHOT_MAGIC
+            || (buf_len - sizeof(header)) / sizeof(record) != header.len
+            || (buf_len - sizeof(header)) % sizeof(record) != 0)
+        {
+            err = VCAN_INVALID_SNAPSHOT;
+        }
+        else if (header.len > sched->capacity)
+        {
+            err = VCAN_INVALID_CAPACITY;
+        }
+        else
+        {
+            err = VCAN_OK;
+        }
+        // First pass checks, second one applies
+        for (size_t pass = 0; pass < 2 && err == VCAN_OK; pass++)
+        {
+            if (pass == 1)
+            {
+                while (sched->len > 0)
+                {
+                    vcan_sched_remove(sched, sched->heap[sched->len - 1]);
+                }
+                sched->now = header.now;
+                sched->next_seq = header.next_seq;
+            }
+            for (size_t i = 0; i < header.len && err == VCAN_OK; i++)
+            {
+                memcpy(&record, &in[sizeof(header) + i * sizeof(record)],
+                       sizeof(record));
+                const vcan_node_t* const src_node =
+                        record.has_src
+                        ? vcan_sched_node(sched->bus, record.src_id) : NULL;
+                // An entry scheduled twice would corrupt the heap,
+                // checked in the first pass only
+                if (record.index >= entries_len
+                    || record.msg.len > VCAN_DATA_MAX_LEN
+                    || (pass == 0
+                        && vcan_sched_index_taken(in, i, record.index)))
+                {
+                    err = VCAN_INVALID_SNAPSHOT;
+                }
+                else if (record.has_src && src_node == NULL)
+                {
+                    err = VCAN_NODE_NOT_FOUND;
+                }
+                else if (pass == 1)
+                {
+                    vcan_sched_entry_t* const entry = &entries[record.index];
+                    entry->msg = record.msg;
+                    entry->src_node = src_node;
+                    entry->period = record.period;
+                    entry->due = record.due;
+                    entry->seq = record.seq;
+                    sched->heap[sched->len] = entry;
+                    sched->len++;
+                    vcan_sched_sift_up(sched, sched->len - 1);
+                }
+            }
+        }
+    }
+    return err;
+}
@@ -0,0 +1,407 @@
+/**
+ * @file
+ *
+ * VCAN signal decoding implementation.
+ *
+ * Both byte orders are reduced to the same extraction: the bytes of the
+ * signal are visited from the one holding its least significant bit,
+ * upwards for little-endian signals and downwards for big-endian ones.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#include "vcan_sig.h"
+#include <math.h>
+#include <stdlib.h>
+
+/** CAN IDs above it are extended in DBC files, flagged by the top bit. */
+#define VCAN_SIG_DBC_EXTENDED (1UL << 31U)
+
+/** Pseudo-message of the DBC files holding the signals of no message. */
+#define VCAN_SIG_DBC_INDEPENDENT 0xC0000000UL
+
+/** Computes the extraction table entry, false if it does not fit. */
+static bool vcan_sig_compile(const vcan_sig_t* const sig,
+                             vcan_sig_layout_t* const layout)
+{
+    bool fits = sig->length > 0 && sig->length <= 64U
+                && sig->start_bit < VCAN_DATA_MAX_LEN * 8U;
+    if (fits && (sig->flags & VCAN_SIG_LITTLE_ENDIAN) != 0U)
+    {
+        const uint32_t shift = sig->start_bit % 8U;
+        const uint32_t byte_count = (shift + sig->length + 7U) / 8U;
+        const uint32_t end = sig->start_bit / 8U + byte_count;
+        fits = end <= VCAN_DATA_MAX_LEN;
+        layout->lsb_byte = (uint8_t) (sig->start_bit / 8U);
+        layout->byte_count = (uint8_t) byte_count;
+        layout->shift = (uint8_t) shift;
+        layout->min_len = (uint8_t) end;
+    }
+    else if (fits)
+    {
+        // Bit position counting from the most significant bit of byte 0
+        const uint32_t msb = sig->start_bit / 8U * 8U + 7U - sig->start_bit % 8U;
+        const uint32_t end = msb + sig->length;
+        const uint32_t last = (end - 1U) / 8U;
+        fits = end <= VCAN_DATA_MAX_LEN * 8U;
+        layout->lsb_byte = (uint8_t) last;
+        layout->byte_count = (uint8_t) (last - msb / 8U + 1U);
+        layout->shift = (uint8_t) ((last + 1U) * 8U - end);
+        layout->min_len = (uint8_t) (last + 1U);
+    }
+    layout->mask = sig->length >= 64U
+                   ? UINT64_MAX : (UINT64_C(1) << sig->length) - 1U;
+    return fits;
+}
+
+/** Physical value of the signal in the payload. */
+static double vcan_sig_extract(const vcan_sig_t* const sig,
+                               const vcan_sig_layout_t* const layout,
+                               const uint8_t* const data)
+{
+    const bool little_endian = (sig->flags & VCAN_SIG_LITTLE_ENDIAN) != 0U;
+    uint64_t raw = (uint64_t) data[layout->lsb_byte] >> layout->shift;
+    for (uint32_t i = 1; i < layout->byte_count; i++)
+    {
+        const uint32_t byte = little_endian
+                              ? layout->lsb_byte + i : layout->lsb_byte - i;
+        raw |= (uint64_t) data[byte] << (8U * i - layout->shift);
+    }
+    raw &= layout->mask;
+    double value;
+    if ((sig->flags & VCAN_SIG_SIGNED) != 0U
+        && (raw >> (sig->length - 1U)) != 0U)
+    {
+        // Two's complement without the implementation-defined conversion
+        value = -(double) (~raw & layout->mask) - 1.0;
+    }
+    else
+    {
+        value = (double) raw;
+    }
+    return value * sig->factor + sig->offset;
+}
+
+/** Checks the order of the description and counts its CAN IDs. */
+static bool vcan_sig_sorted(const vcan_sig_t* const signals,
+                            const size_t signal_count,
+                            size_t* const msg_count)
+{
+    bool sorted = true;
+    *msg_count = signal_count > 0 ? 1U : 0U;
+    for (size_t i = 1; i < signal_count && sorted; i++)
+    {
+        sorted = signals[i - 1U].msg_id <= signals[i].msg_id;
+        *msg_count += signals[i - 1U].msg_id != signals[i].msg_id ? 1U : 0U;
+    }
+    return sorted;
+}
+
+vcan_err_t vcan_sig_init(vcan_sig_db_t* const db,
+                         const vcan_sig_t* const signals,
+                         const size_t signal_count,
+                         vcan_sig_layout_t* const layouts,
+                         double* const values,
+                         vcan_sig_msg_t* const msgs,
+                         const size_t msg_capacity)
+{
+    vcan_err_t err;
+    size_t msg_count = 0;
+    bool fits = true;
+    if (db == NULL || layouts == NULL || values == NULL || msgs == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (signals == NULL && signal_count > 0)
+    {
+        err = VCAN_NULL_FILTER;
+    }
+    else if (!vcan_sig_sorted(signals, signal_count, &msg_count))
+    {
+        err = VCAN_UNSORTED_FILTER;
+    }
+    else if (msg_count > msg_capacity)
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        for (size_t i = 0; i < signal_count && fits; i++)
+        {
+            fits = vcan_sig_compile(&signals[i], &layouts[i]);
+            values[i] = (double) NAN;
+        }
+        err = fits ? VCAN_OK : VCAN_INVALID_SIGNAL;
+    }
+    if (err == VCAN_OK)
+    {
+        memset(db, 0, sizeof(vcan_sig_db_t));
+        db->signals = signals;
+        db->signal_count = signal_count;
+        db->layouts = layouts;
+        db->values = values;
+        db->msgs = msgs;
+        for (size_t i = 0; i < signal_count; i++)
+        {
+            if (i == 0 || signals[i - 1U].msg_id != signals[i].msg_id)
+            {
+                vcan_sig_msg_t* const entry = &msgs[db->msg_count];
+                memset(entry, 0, sizeof(vcan_sig_msg_t));
+                entry->id = signals[i].msg_id;
+                entry->first = i;
+                entry->values = &values[i];
+                db->msg_count++;
+            }
+            msgs[db->msg_count - 1U].count++;
+        }
+    }
+    return err;
+}
+
+/** Binary search of the cache of the CAN ID, NULL if it has no signals. */
+static vcan_sig_msg_t* vcan_sig_lookup(const vcan_sig_db_t* const db,
+                                       const uint32_t id)
+{
+    size_t low = 0;
+    size_t high = db->msg_count;
+    while (low < high)
+    {
+        const size_t mid = low + (high - low) / 2U;
+        if (db->msgs[mid].id < id)
+        {
+            low = mid + 1U;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low < db->msg_count && db->msgs[low].id == id
+           ? &db->msgs[low] : NULL;
+}
+
+const vcan_sig_msg_t* vcan_sig_decode(vcan_sig_db_t* const db,
+                                      const vcan_msg_t* const msg)
+{
+    vcan_sig_msg_t* const entry = vcan_sig_lookup(db, msg->id);
+    const uint8_t len = msg->len < VCAN_DATA_MAX_LEN
+                        ? (uint8_t) msg->len : VCAN_DATA_MAX_LEN;
+    if (entry != NULL && !(entry->valid && entry->len == len
+                           && memcmp(entry->data, msg->data, len) == 0))
+    {
+        memcpy(entry->data, msg->data, len);
+        entry->len = len;
+        entry->valid = true;
+        for (size_t i = entry->first; i < entry->first + entry->count; i++)
+        {
+            db->values[i] = len >= db->layouts[i].min_len
+                            ? vcan_sig_extract(&db->signals[i],
+                                               &db->layouts[i], msg->data)
+                            : (double) NAN;
+        }
+        db->decodes++;
+    }
+    return entry;
+}
+
+const double* vcan_sig_find(const vcan_sig_db_t* const db,
+                            const char* const name)
+{
+    const size_t name_len = strlen(name);
+    const double* value = NULL;
+    for (size_t i = 0; i < db->signal_count && value == NULL; i++)
+    {
+        const vcan_sig_t* const sig = &db->signals[i];
+        if (sig->name != NULL && sig->name_len == name_len
+            && memcmp(sig->name, name, name_len) == 0)
+        {
+            value = &db->values[i];
+        }
+    }
+    return value;
+}
+
+/** Skips spaces and tabs. */
+static const char* vcan_sig_skip_blank(const char* pos)
+{
+    while (*pos == ' ' || *pos == '\t')
+    {
+        pos++;
+    }
+    return pos;
+}
+
+/** Consumes the character after the blanks, false if not found. */
+static bool vcan_sig_expect(const char** const pos, const char expected)
+{
+    const char* const next = vcan_sig_skip_blank(*pos);
+    const bool found = *next == expected;
+    *pos = found ? next + 1 : next;
+    return found;
+}
+
+/** Consumes an unsigned integer after the blanks, false if none. */
+static bool vcan_sig_parse_ulong(const char** const pos,
+                                 unsigned long* const value)
+{
+    const char* const start = vcan_sig_skip_blank(*pos);
+    char* end;
+    *value = strtoul(start, &end, 10);
+    *pos = end;
+    return end != start && *start != '-';
+}
+
+/** Consumes a floating point number after the blanks, false if none. */
+static bool vcan_sig_parse_double(const char** const pos, double* const value)
+{
+    const char* const start = vcan_sig_skip_blank(*pos);
+    char* end;
+    *value = strtod(start, &end);
+    *pos = end;
+    return end != start;
+}
+
+/** Consumes a name after the blanks, up to a blank or a colon. */
+static const char* vcan_sig_parse_name(const char** const pos,
+                                       size_t* const len)
+{
+    const char* const start = vcan_sig_skip_blank(*pos);
+    const char* end = start;
+    while (*end != '\0' && *end != ' ' && *end != '\t' && *end != ':'
+           && *end != '\r' && *end != '\n')
+    {
+        end++;
+    }
+    *len = (size_t) (end - start);
+    *pos = end;
+    return start;
+}
+
+/** True if the line starts with the DBC keyword followed by a blank. */
+static bool vcan_sig_keyword(const char** const pos, const char* const keyword)
+{
+    const size_t len = strlen(keyword);
+    const bool found = strncmp(*pos, keyword, len) == 0
+                       && ((*pos)[len] == ' ' || (*pos)[len] == '\t');
+    *pos += found ? len : 0U;
+    return found;
+}
+
+/**
+ * Parses the rest of an `SG_` line, e.g.
+ * `EngineSpeed : 0|16@1+ (0.25,0) [0|16383] "rpm" Dashboard`.
+ * \p skipped is set for multiplexed signals.
+ */
+static bool vcan_sig_parse_sg(const char* pos,
+                              vcan_sig_t* const sig,
+                              bool* const skipped)
+{
+    unsigned long start_bit = 0;
+    unsigned long length = 0;
+    sig->name = vcan_sig_parse_name(&pos, &sig->name_len);
+    size_t mux_len = 0;
+    const char* const mux = vcan_sig_parse_name(&pos, &mux_len);
+    *skipped = mux_len > 0 && mux[0] == 'm';
+    bool ok = sig->name_len > 0 && (mux_len == 0 || *skipped
+                                    || (mux_len == 1 && mux[0] == 'M'))
+              && vcan_sig_expect(&pos, ':')
+              && vcan_sig_parse_ulong(&pos, &start_bit)
+              && vcan_sig_expect(&pos, '|')
+              && vcan_sig_parse_ulong(&pos, &length)
+              && vcan_sig_expect(&pos, '@');
+    if (ok)
+    {
+        sig->start_bit = start_bit > UINT32_MAX ? UINT32_MAX
+                                                : (uint32_t) start_bit;
+        sig->length = length > UINT32_MAX ? UINT32_MAX : (uint32_t) length;
+        sig->flags = 0;
+        if (*pos == '1')
+        {
+            sig->flags |= VCAN_SIG_LITTLE_ENDIAN;
+        }
+        ok = (*pos == '0' || *pos == '1')
+             && (pos[1] == '+' || pos[1] == '-');
+        sig->flags |= ok && pos[1] == '-' ? VCAN_SIG_SIGNED : 0U;
+        pos += ok ? 2 : 0;
+    }
+    return ok && vcan_sig_expect(&pos, '(')
+           && vcan_sig_parse_double(&pos, &sig->factor)
+           && vcan_sig_expect(&pos, ',')
+           && vcan_sig_parse_double(&pos, &sig->offset)
+           && vcan_sig_expect(&pos, ')');
+}
+
+/** Inserts the signal after the ones with lower or equal CAN ID. */
+static void vcan_sig_insert(vcan_sig_t* const signals,
+                            const size_t count,
+                            const vcan_sig_t* const sig)
+{
+    size_t pos = count;
+    while (pos > 0 && signals[pos - 1U].msg_id > sig->msg_id)
+    {
+        pos--;
+    }
+    memmove(&signals[pos + 1U], &signals[pos],
+            (count - pos) * sizeof(vcan_sig_t));
+    signals[pos] = *sig;
+}
+
+vcan_err_t vcan_sig_parse_dbc(const char* const text,
+                              vcan_sig_t* const signals,
+                              const size_t capacity,
+                              size_t* const count)
+{
+    vcan_err_t err;
+    if (text == NULL || signals == NULL || count == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        unsigned long msg_id = 0;
+        bool in_msg = false;
+        const char* line = text;
+        err = VCAN_OK;
+        *count = 0;
+        while (*line != '\0' && err == VCAN_OK)
+        {
+            const char* pos = vcan_sig_skip_blank(line);
+            if (vcan_sig_keyword(&pos, "BO_"))
+            {
+                in_msg = vcan_sig_parse_ulong(&pos, &msg_id);
+                err = in_msg ? VCAN_OK : VCAN_INVALID_SIGNAL;
+            }
+            else if (vcan_sig_keyword(&pos, "SG_"))
+            {
+                vcan_sig_t sig;
+                bool skipped;
+                if (!in_msg || !vcan_sig_parse_sg(pos, &sig, &skipped))
+                {
+                    err = VCAN_INVALID_SIGNAL;
+                }
+                else if (skipped || msg_id == VCAN_SIG_DBC_INDEPENDENT)
+                {
+                    // Not decodable on their own
+                }
+                else if (*count == capacity)
+                {
+                    err = VCAN_INVALID_CAPACITY;
+                }
+                else
+                {
+                    sig.msg_id = (uint32_t) (msg_id & ~VCAN_SIG_DBC_EXTENDED);
+                    vcan_sig_insert(signals, *count, &sig);
+                    (*count)++;
+                }
+            }
+            while (*line != '\0' && *line != '\n')
+            {
+                line++;
+            }
+            line += *line == '\n' ? 1 : 0;
+        }
+    }
+    return err;
+}
@@ -0,0 +1,293 @@
+/**
+ * @file
+ *
+ * VCAN bridge to a Linux SocketCAN interface implementation.
+ *
+ * The message headers of `sendmmsg()` and `recvmmsg()` are built on the
+ * stack of each call, so the public header does not depend on the GNU
+ * extensions declaring them.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#define _GNU_SOURCE
+
+#include "vcan_socketcan.h"
+#include <errno.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/can/raw.h>
+
+/** Fills the headers of each frame for `sendmmsg()` or `recvmmsg()`. */
+static void vcan_socketcan_headers(struct mmsghdr* const headers,
+                                   struct iovec* const iov,
+                                   struct canfd_frame* const frames,
+                                   const size_t count)
+{
+    memset(headers, 0, sizeof(struct mmsghdr) * count);
+    for (size_t i = 0; i < count; i++)
+    {
+        iov[i].iov_base = &frames[i];
+        iov[i].iov_len = frames[i].len > CAN_MAX_DLEN ? CANFD_MTU : CAN_MTU;
+        headers[i].msg_hdr.msg_iov = &iov[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+/** Sends the batched frames with as few `sendmmsg()` calls as possible. */
+static void vcan_socketcan_flush(vcan_socketcan_t* const bridge)
+{
+    struct mmsghdr headers[VCAN_SOCKETCAN_BATCH_LEN];
+    struct iovec iov[VCAN_SOCKETCAN_BATCH_LEN];
+    vcan_socketcan_headers(headers, iov, bridge->tx_frames, bridge->tx_len);
+    size_t sent = 0;
+    while (sent < bridge->tx_len)
+    {
+        const int result = sendmmsg(bridge->fd, &headers[sent],
+                                    (unsigned int) (bridge->tx_len - sent), 0);
+        if (result > 0)
+        {
+            sent += (size_t) result;
+        }
+        else if (result < 0 && errno == EINTR)
+        {
+            // Retry
+        }
+        else
+        {
+            atomic_fetch_add(&bridge->tx_dropped, bridge->tx_len - sent);
+            sent = bridge->tx_len;
+        }
+    }
+    bridge->tx_len = 0;
+}
+
+/** Batches the message, sending the batch when no more are coming. */
+static void vcan_socketcan_on_rx(vcan_node_t* const node,
+                                 const vcan_msg_t* const msg)
+{
+    vcan_socketcan_t* const bridge = node->other_custom_data;
+    if (msg->len > CANFD_MAX_DLEN
+        || (msg->len > CAN_MAX_DLEN && !bridge->fd_frames))
+    {
+        atomic_fetch_add(&bridge->tx_dropped, 1U);
+    }
+    else
+    {
+        struct canfd_frame* const frame = &bridge->tx_frames[bridge->tx_len];
+        memset(frame, 0, sizeof(struct canfd_frame));
+        frame->can_id = msg->id > CAN_SFF_MASK
+                        ? (msg->id & CAN_EFF_MASK) | CAN_EFF_FLAG : msg->id;
+        frame->len = (uint8_t) vcan_fd_len(msg->len);
+        memcpy(frame->data, msg->data, msg->len);
+        bridge->tx_len++;
+    }
+    if (bridge->tx_len > 0 && (bridge->tx_len == VCAN_SOCKETCAN_BATCH_LEN
+                               || !vcan_mt_has_next(bridge->bus)))
+    {
+        vcan_socketcan_flush(bridge);
+    }
+}
+
+/** Transmits the received frame on the bus, unless it carries no data. */
+static void vcan_socketcan_rx_frame(vcan_socketcan_t* const bridge,
+                                    const struct canfd_frame* const frame,
+                                    const unsigned int frame_len)
+{
+    if ((frame_len == CAN_MTU || frame_len == CANFD_MTU)
+        && (frame->can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG)) == 0)
+    {
+        vcan_msg_t msg;
+        msg.id = frame->can_id & ((frame->can_id & CAN_EFF_FLAG) != 0U
+                                  ? CAN_EFF_MASK : CAN_SFF_MASK);
+        msg.len = frame->len > CANFD_MAX_DLEN ? CANFD_MAX_DLEN : frame->len;
+        memcpy(msg.data, frame->data, msg.len);
+        if (vcan_mt_tx(bridge->bus, &msg, &bridge->node) != VCAN_OK)
+        {
+            atomic_fetch_add(&bridge->rx_dropped, 1U);
+        }
+    }
+}
+
+/** Receives the frames of the interface in batches until stopped. */
+static void* vcan_socketcan_receiver(void* const arg)
+{
+    vcan_socketcan_t* const bridge = arg;
+    struct canfd_frame frames[VCAN_SOCKETCAN_BATCH_LEN];
+    struct mmsghdr headers[VCAN_SOCKETCAN_BATCH_LEN];
+    struct iovec iov[VCAN_SOCKETCAN_BATCH_LEN];
+    struct pollfd fds[2] = {
+            {.fd = bridge->fd, .events = POLLIN},
+            {.fd = bridge->stop_pipe[0], .events = POLLIN},
+    };
+    bool running = true;
+    while (running)
+    {
+        const int ready = poll(fds, 2, -1);
+        if (ready < 0)
+        {
+            running = errno == EINTR;
+        }
+        else if (fds[1].revents != 0 || (fds[0].revents & POLLIN) == 0)
+        {
+            // Stopped or the socket failed
+            running = false;
+        }
+        else
+        {
+            for (size_t i = 0; i < VCAN_SOCKETCAN_BATCH_LEN; i++)
+            {
+                frames[i].len = CANFD_MAX_DLEN;  // Room for CAN FD frames
+            }
+            vcan_socketcan_headers(headers, iov, frames,
+                                   VCAN_SOCKETCAN_BATCH_LEN);
+            const int received = recvmmsg(bridge->fd, headers,
+                                          VCAN_SOCKETCAN_BATCH_LEN,
+                                          MSG_DONTWAIT, NULL);
+            for (int i = 0; i < received; i++)
+            {
+                vcan_socketcan_rx_frame(bridge, &frames[i],
+                                        headers[i].msg_len);
+            }
+        }
+    }
+    return NULL;
+}
+
+/** Creates the raw CAN socket bound to the interface. */
+static vcan_err_t vcan_socketcan_bind(vcan_socketcan_t* const bridge,
+                                      const char* const ifname)
+{
+    vcan_err_t err;
+    struct sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = (int) if_nametoindex(ifname);
+    bridge->fd = addr.can_ifindex != 0
+                 ? socket(PF_CAN, SOCK_RAW, CAN_RAW) : -1;
+    if (bridge->fd < 0)
+    {
+        err = VCAN_IO_FAILED;
+    }
+    else if (bind(bridge->fd, (const struct sockaddr*) &addr,
+                  sizeof(addr)) != 0)
+    {
+        close(bridge->fd);
+        err = VCAN_IO_FAILED;
+    }
+    else
+    {
+        // Fails on kernels or interfaces without CAN FD: classic only
+        const int enable = 1;
+        bridge->fd_frames = setsockopt(bridge->fd, SOL_CAN_RAW,
+                                       CAN_RAW_FD_FRAMES, &enable,
+                                       sizeof(enable)) == 0;
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+/** Connects the node and starts the receiver, given the bound socket. */
+static vcan_err_t vcan_socketcan_start(vcan_socketcan_t* const bridge)
+{
+    vcan_err_t err;
+    if (pipe(bridge->stop_pipe) != 0)
+    {
+        err = VCAN_IO_FAILED;
+    }
+    else
+    {
+        err = vcan_mt_connect(bridge->bus, &bridge->node);
+        if (err == VCAN_OK && pthread_create(&bridge->receiver, NULL,
+                                             vcan_socketcan_receiver,
+                                             bridge) != 0)
+        {
+            vcan_mt_disconnect(bridge->bus, &bridge->node);
+            err = VCAN_THREAD_FAILED;
+        }
+        if (err != VCAN_OK)
+        {
+            close(bridge->stop_pipe[0]);
+            close(bridge->stop_pipe[1]);
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_socketcan_open(vcan_socketcan_t* const bridge,
+                               vcan_bus_mt_t* const bus,
+                               const char* const ifname)
+{
+    vcan_err_t err;
+    if (bridge == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else if (ifname == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        memset(bridge, 0, sizeof(vcan_socketcan_t));
+        bridge->bus = bus;
+        bridge->node.callback_on_rx = vcan_socketcan_on_rx;
+        bridge->node.other_custom_data = bridge;
+        atomic_init(&bridge->tx_dropped, 0U);
+        atomic_init(&bridge->rx_dropped, 0U);
+        err = vcan_socketcan_bind(bridge, ifname);
+        if (err == VCAN_OK)
+        {
+            err = vcan_socketcan_start(bridge);
+            if (err != VCAN_OK)
+            {
+                close(bridge->fd);
+            }
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_socketcan_close(vcan_socketcan_t* const bridge)
+{
+    vcan_err_t err;
+    if (bridge == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else
+    {
+        const uint8_t stop = 1;
+        while (write(bridge->stop_pipe[1], &stop, 1) < 0 && errno == EINTR)
+        {
+            // Retry
+        }
+        pthread_join(bridge->receiver, NULL);
+        // Once disconnected, the dispatcher does not touch the batch anymore
+        vcan_mt_disconnect(bridge->bus, &bridge->node);
+        vcan_socketcan_flush(bridge);
+        close(bridge->stop_pipe[0]);
+        close(bridge->stop_pipe[1]);
+        close(bridge->fd);
+        err = VCAN_OK;
+    }
+    return err;
+}
+
+uint64_t vcan_socketcan_tx_dropped(const vcan_socketcan_t* const bridge)
+{
+    return atomic_load(&bridge->tx_dropped);
+}
+
+uint64_t vcan_socketcan_rx_dropped(const vcan_socketcan_t* const bridge)
+{
+    return atomic_load(&bridge->rx_dropped);
+}
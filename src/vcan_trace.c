@@ -0,0 +1,470 @@
+/**
+ * @file
+ *
+ * VCAN trace recording and replay implementation.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "vcan_trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Current time of the monotonic clock in nanoseconds. */
+static uint64_t vcan_trace_monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000U + (uint64_t) now.tv_nsec;
+}
+
+/** Writes the whole buffer, retrying on partial writes and interruptions. */
+static bool vcan_trace_write_all(const int fd,
+                                 const uint8_t* const buf,
+                                 const size_t len)
+{
+    size_t written = 0;
+    bool ok = true;
+    while (written < len && ok)
+    {
+        const ssize_t result = write(fd, &buf[written], len - written);
+        if (result > 0)
+        {
+            written += (size_t) result;
+        }
+        else if (result < 0 && errno == EINTR)
+        {
+            // Retry
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/** Writes the buffers handed over by the recording until stopped. */
+static void* vcan_trace_flusher(void* const arg)
+{
+    vcan_trace_recorder_t* const recorder = arg;
+    pthread_mutex_lock(&recorder->lock);
+    while (recorder->running || recorder->pending_len > 0)
+    {
+        if (recorder->pending_len == 0)
+        {
+            pthread_cond_wait(&recorder->filled, &recorder->lock);
+        }
+        else
+        {
+            // The pending half is the one not being recorded into
+            const uint8_t* const buf = recorder->buffers[recorder->active ^ 1U];
+            const size_t len = recorder->pending_len;
+            pthread_mutex_unlock(&recorder->lock);
+            const bool ok = vcan_trace_write_all(recorder->fd, buf, len);
+            pthread_mutex_lock(&recorder->lock);
+            recorder->io_failed = recorder->io_failed || !ok;
+            recorder->pending_len = 0;
+            pthread_cond_broadcast(&recorder->flushed);
+        }
+    }
+    pthread_mutex_unlock(&recorder->lock);
+    return NULL;
+}
+
+/**
+ * Hands the recorded half over to the flusher and switches to the other
+ * one, waiting for the flusher first if it is still busy with it.
+ */
+static void vcan_trace_swap(vcan_trace_recorder_t* const recorder)
+{
+    pthread_mutex_lock(&recorder->lock);
+    while (recorder->pending_len > 0)
+    {
+        pthread_cond_wait(&recorder->flushed, &recorder->lock);
+    }
+    recorder->active ^= 1U;
+    recorder->pending_len = recorder->used;
+    recorder->used = 0;
+    pthread_cond_signal(&recorder->filled);
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+/**
+ * Appends one timestamped message to the active half. Messages with an
+ * invalid length are not recorded.
+ */
+static void vcan_trace_append(vcan_trace_recorder_t* const recorder,
+                              const uint64_t timestamp,
+                              const vcan_msg_t* const msg)
+{
+    if (recorder->buffer_len - recorder->used < VCAN_TRACE_RECORD_MAX_LEN)
+    {
+        vcan_trace_swap(recorder);
+    }
+    uint8_t* const record = &recorder->buffers[recorder->active][recorder->used];
+    const size_t packed = vcan_pack(&record[VCAN_TRACE_TIMESTAMP_LEN],
+                                    VCAN_PACKED_SIZE(VCAN_DATA_MAX_LEN), msg);
+    if (packed > 0)
+    {
+        for (size_t i = 0; i < VCAN_TRACE_TIMESTAMP_LEN; i++)
+        {
+            record[i] = (uint8_t) (timestamp >> (8U * i));
+        }
+        recorder->used += VCAN_TRACE_TIMESTAMP_LEN + packed;
+    }
+}
+
+/** Current timestamp of the recorder. */
+static uint64_t vcan_trace_now(const vcan_trace_recorder_t* const recorder)
+{
+    return recorder->now != NULL
+           ? recorder->now(recorder->now_ctx)
+           : vcan_trace_monotonic_ns();
+}
+
+static void vcan_trace_on_rx(vcan_node_t* const node,
+                             const vcan_msg_t* const msg)
+{
+    vcan_trace_recorder_t* const recorder = node->other_custom_data;
+    vcan_trace_append(recorder, vcan_trace_now(recorder), msg);
+}
+
+static void vcan_trace_on_rx_burst(vcan_node_t* const node,
+                                   const vcan_msg_t* const msgs,
+                                   const size_t count)
+{
+    vcan_trace_recorder_t* const recorder = node->other_custom_data;
+    // The burst is transmitted at once: a single timestamp for all of it
+    const uint64_t timestamp = vcan_trace_now(recorder);
+    for (size_t i = 0; i < count; i++)
+    {
+        vcan_trace_append(recorder, timestamp, &msgs[i]);
+    }
+}
+
+/** Initialises the synchronisation primitives and starts the flusher. */
+static vcan_err_t vcan_trace_start(vcan_trace_recorder_t* const recorder)
+{
+    vcan_err_t err = VCAN_THREAD_FAILED;
+    if (pthread_mutex_init(&recorder->lock, NULL) == 0)
+    {
+        if (pthread_cond_init(&recorder->filled, NULL) == 0)
+        {
+            if (pthread_cond_init(&recorder->flushed, NULL) == 0)
+            {
+                recorder->running = true;
+                if (pthread_create(&recorder->flusher, NULL,
+                                   vcan_trace_flusher, recorder) == 0)
+                {
+                    err = VCAN_OK;
+                }
+                else
+                {
+                    pthread_cond_destroy(&recorder->flushed);
+                }
+            }
+            if (err != VCAN_OK)
+            {
+                pthread_cond_destroy(&recorder->filled);
+            }
+        }
+        if (err != VCAN_OK)
+        {
+            pthread_mutex_destroy(&recorder->lock);
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_trace_recorder_open(vcan_trace_recorder_t* const recorder,
+                                    const char* const path,
+                                    uint8_t* const arena,
+                                    const size_t arena_len,
+                                    uint64_t (* const now)(void* ctx),
+                                    void* const now_ctx)
+{
+    vcan_err_t err;
+    if (recorder == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else if (path == NULL || arena == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (arena_len / 2U < VCAN_TRACE_RECORD_MAX_LEN)
+    {
+        err = VCAN_INVALID_CAPACITY;
+    }
+    else
+    {
+        memset(recorder, 0, sizeof(vcan_trace_recorder_t));
+        recorder->node.callback_on_rx = vcan_trace_on_rx;
+        recorder->node.callback_on_rx_burst = vcan_trace_on_rx_burst;
+        recorder->node.other_custom_data = recorder;
+        recorder->buffer_len = arena_len / 2U;
+        recorder->buffers[0] = arena;
+        recorder->buffers[1] = &arena[recorder->buffer_len];
+        recorder->now = now;
+        recorder->now_ctx = now_ctx;
+        recorder->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (recorder->fd < 0)
+        {
+            err = VCAN_IO_FAILED;
+        }
+        else if (!vcan_trace_write_all(recorder->fd,
+                                       (const uint8_t*) VCAN_TRACE_MAGIC,
+                                       VCAN_TRACE_MAGIC_LEN))
+        {
+            close(recorder->fd);
+            err = VCAN_IO_FAILED;
+        }
+        else
+        {
+            err = vcan_trace_start(recorder);
+            if (err != VCAN_OK)
+            {
+                close(recorder->fd);
+            }
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_trace_recorder_close(vcan_trace_recorder_t* const recorder)
+{
+    vcan_err_t err;
+    if (recorder == NULL)
+    {
+        err = VCAN_NULL_NODE;
+    }
+    else
+    {
+        if (recorder->used > 0)
+        {
+            vcan_trace_swap(recorder);
+        }
+        pthread_mutex_lock(&recorder->lock);
+        recorder->running = false;
+        pthread_cond_signal(&recorder->filled);
+        pthread_mutex_unlock(&recorder->lock);
+        pthread_join(recorder->flusher, NULL);
+        pthread_cond_destroy(&recorder->flushed);
+        pthread_cond_destroy(&recorder->filled);
+        pthread_mutex_destroy(&recorder->lock);
+        const bool closed = close(recorder->fd) == 0;
+        err = (recorder->io_failed || !closed) ? VCAN_IO_FAILED : VCAN_OK;
+    }
+    return err;
+}
+
+vcan_err_t vcan_trace_replay_open(vcan_trace_replay_t* const replay,
+                                  const char* const path)
+{
+    vcan_err_t err;
+    int fd = -1;
+    struct stat info;
+    if (replay == NULL || path == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if ((fd = open(path, O_RDONLY)) < 0)
+    {
+        err = VCAN_IO_FAILED;
+    }
+    else if (fstat(fd, &info) != 0)
+    {
+        err = VCAN_IO_FAILED;
+    }
+    else if ((size_t) info.st_size < VCAN_TRACE_MAGIC_LEN)
+    {
+        err = VCAN_INVALID_PACKED;
+    }
+    else
+    {
+        memset(replay, 0, sizeof(vcan_trace_replay_t));
+        replay->len = (size_t) info.st_size;
+        void* const data = mmap(NULL, replay->len, PROT_READ, MAP_PRIVATE,
+                                fd, 0);
+        if (data == MAP_FAILED)
+        {
+            err = VCAN_IO_FAILED;
+        }
+        else if (memcmp(data, VCAN_TRACE_MAGIC, VCAN_TRACE_MAGIC_LEN) != 0)
+        {
+            munmap(data, replay->len);
+            err = VCAN_INVALID_PACKED;
+        }
+        else
+        {
+            // Read once front to back: let the kernel read ahead
+            posix_madvise(data, replay->len, POSIX_MADV_SEQUENTIAL);
+            replay->data = data;
+            replay->offset = VCAN_TRACE_MAGIC_LEN;
+            err = VCAN_OK;
+        }
+    }
+    if (fd >= 0)
+    {
+        // The mapping stays valid without the descriptor
+        close(fd);
+    }
+    return err;
+}
+
+/**
+ * Reads the timestamp of the record at the replay position.
+ *
+ * @return false if the record is truncated
+ */
+static bool vcan_trace_peek_timestamp(const vcan_trace_replay_t* const replay,
+                                      uint64_t* const timestamp)
+{
+    const bool available = replay->len - replay->offset
+                           >= VCAN_TRACE_TIMESTAMP_LEN;
+    if (available)
+    {
+        const uint8_t* const record = &replay->data[replay->offset];
+        *timestamp = 0;
+        for (size_t i = 0; i < VCAN_TRACE_TIMESTAMP_LEN; i++)
+        {
+            *timestamp |= (uint64_t) record[i] << (8U * i);
+        }
+    }
+    return available;
+}
+
+/** Sleeps until the monotonic clock reaches the given nanoseconds. */
+static void vcan_trace_sleep_until(const uint64_t deadline)
+{
+    struct timespec until = {
+            .tv_sec = (time_t) (deadline / 1000000000U),
+            .tv_nsec = (long) (deadline % 1000000000U),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL)
+           == EINTR)
+    {
+        // Keep sleeping after signals
+    }
+}
+
+/**
+ * Unpacks the next batch of records. In real-time mode, stops at the first
+ * record not yet due, after waiting for at least one to be.
+ *
+ * @return false on a truncated or corrupted record
+ */
+static bool vcan_trace_next_batch(vcan_trace_replay_t* const replay,
+                                  vcan_msg_t* const batch,
+                                  size_t* const count,
+                                  const uint32_t mode)
+{
+    bool valid = true;
+    bool due = true;
+    uint64_t timestamp;
+    *count = 0;
+    while (valid && due && *count < VCAN_TRACE_BATCH_LEN
+           && replay->offset < replay->len)
+    {
+        valid = vcan_trace_peek_timestamp(replay, &timestamp);
+        if (valid && mode == VCAN_TRACE_REAL_TIME)
+        {
+            if (replay->offset == VCAN_TRACE_MAGIC_LEN)
+            {
+                replay->start_time = vcan_trace_monotonic_ns();
+                replay->start_timestamp = timestamp;
+            }
+            const uint64_t deadline = replay->start_time
+                                      + (timestamp - replay->start_timestamp);
+            if (*count == 0)
+            {
+                vcan_trace_sleep_until(deadline);
+            }
+            else
+            {
+                due = vcan_trace_monotonic_ns() >= deadline;
+            }
+        }
+        if (valid && due)
+        {
+            const size_t offset = replay->offset + VCAN_TRACE_TIMESTAMP_LEN;
+            const size_t read = vcan_unpack(&batch[*count],
+                                            &replay->data[offset],
+                                            replay->len - offset);
+            valid = read > 0;
+            if (valid)
+            {
+                replay->offset = offset + read;
+                (*count)++;
+            }
+        }
+    }
+    return valid;
+}
+
+vcan_err_t vcan_trace_replay(vcan_trace_replay_t* const replay,
+                             vcan_bus_t* const bus,
+                             const uint32_t mode,
+                             const vcan_node_t* const src_node)
+{
+    vcan_err_t err;
+    if (replay == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else if (bus == NULL)
+    {
+        err = VCAN_NULL_BUS;
+    }
+    else
+    {
+        vcan_msg_t batch[VCAN_TRACE_BATCH_LEN];
+        size_t count = 0;
+        bool valid = true;
+        err = VCAN_OK;
+        while (valid && replay->offset < replay->len)
+        {
+            valid = vcan_trace_next_batch(replay, batch, &count, mode);
+            const vcan_err_t tx_err = vcan_tx_burst(bus, batch, count,
+                                                    src_node);
+            // The replay goes on, the first failure is reported
+            if (err == VCAN_OK)
+            {
+                err = tx_err;
+            }
+        }
+        if (!valid && err == VCAN_OK)
+        {
+            err = VCAN_INVALID_PACKED;
+        }
+    }
+    return err;
+}
+
+vcan_err_t vcan_trace_replay_close(vcan_trace_replay_t* const replay)
+{
+    vcan_err_t err;
+    if (replay == NULL)
+    {
+        err = VCAN_NULL_STORAGE;
+    }
+    else
+    {
+        if (replay->data != NULL)
+        {
+            munmap((void*) replay->data, replay->len);
+        }
+        memset(replay, 0, sizeof(vcan_trace_replay_t));
+        err = VCAN_OK;
+    }
+    return err;
+}
@@ -0,0 +1,241 @@
+/**
+ * @file
+ *
+ * Microbenchmarks of the VCAN transmission.
+ *
+ * Measures vcan_tx() for every combination of connected nodes, payload
+ * length and source node exclusion, reporting throughput, time and cycles
+ * per frame and the per-call latency percentiles. The results are printed
+ * as CSV (default) or JSON on stdout, one row per combination.
+ *
+ * Usage: `benchvcan [--json] [--iterations N]`
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "vcan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_CYCLES 1
+#else
+#define BENCH_HAS_CYCLES 0
+#endif
+
+#define BENCH_MAX_NODES 128U
+#define BENCH_DEFAULT_ITERATIONS 100000U
+
+static const size_t bench_nodes[] = {1, 2, 4, 8, 16, 32, 64, 128};
+static const uint32_t bench_lens[] = {0, 8, 16, 32, 64};
+
+typedef struct
+{
+    size_t nodes;
+    uint32_t len;
+    int excludes_src;
+    double frames_per_sec;
+    double ns_per_frame;
+    double cycles_per_frame;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+} bench_result_t;
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000U + (uint64_t) now.tv_nsec;
+}
+
+static uint64_t bench_cycles(void)
+{
+#if BENCH_HAS_CYCLES
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/** Touches the payload, so the delivery cannot be optimised away. */
+static void bench_on_rx(vcan_node_t* const node, const vcan_msg_t* const msg)
+{
+    node->other_custom_data = (void*) (uintptr_t) (
+            (uintptr_t) node->other_custom_data + msg->data[0] + msg->len);
+}
+
+static int bench_compare(const void* const a, const void* const b)
+{
+    const uint64_t x = *(const uint64_t*) a;
+    const uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t bench_percentile(const uint64_t* const sorted,
+                                 const size_t count,
+                                 const double percentile)
+{
+    size_t index = (size_t) (percentile * (double) count);
+    if (index >= count)
+    {
+        index = count - 1;
+    }
+    return sorted[index];
+}
+
+static void bench_run(bench_result_t* const result,
+                      uint64_t* const samples,
+                      const size_t iterations)
+{
+    static vcan_node_t nodes[BENCH_MAX_NODES];
+    static vcan_node_t* table[BENCH_MAX_NODES];
+    vcan_bus_t bus;
+    vcan_init_ex(&bus, table, BENCH_MAX_NODES);
+    for (size_t i = 0; i < result->nodes; i++)
+    {
+        memset(&nodes[i], 0, sizeof(nodes[i]));
+        nodes[i].callback_on_rx = bench_on_rx;
+        nodes[i].id = (uint32_t) i;
+        vcan_connect(&bus, &nodes[i]);
+    }
+    const vcan_node_t* const src = result->excludes_src ? &nodes[0] : NULL;
+    vcan_msg_t msg = {.id = 0x123, .len = result->len};
+    memset(msg.data, 0xA5, sizeof(msg.data));
+
+    // Warm up the caches and the branch predictors
+    for (size_t i = 0; i < iterations / 10U; i++)
+    {
+        vcan_tx(&bus, &msg, src);
+    }
+    // Throughput: one timing around the whole loop
+    const uint64_t start_cycles = bench_cycles();
+    const uint64_t start_ns = bench_now_ns();
+    for (size_t i = 0; i < iterations; i++)
+    {
+        msg.data[0] = (uint8_t) i;
+        vcan_tx(&bus, &msg, src);
+    }
+    const uint64_t elapsed_ns = bench_now_ns() - start_ns;
+    const uint64_t elapsed_cycles = bench_cycles() - start_cycles;
+    // Latency: one timing around each call, including the clock overhead
+    for (size_t i = 0; i < iterations; i++)
+    {
+        msg.data[0] = (uint8_t) i;
+        const uint64_t before = bench_now_ns();
+        vcan_tx(&bus, &msg, src);
+        samples[i] = bench_now_ns() - before;
+    }
+    qsort(samples, iterations, sizeof(samples[0]), bench_compare);
+
+    result->ns_per_frame = (double) elapsed_ns / (double) iterations;
+    result->frames_per_sec = result->ns_per_frame > 0
+                             ? 1e9 / result->ns_per_frame : 0;
+    result->cycles_per_frame = (double) elapsed_cycles / (double) iterations;
+    result->p50_ns = bench_percentile(samples, iterations, 0.50);
+    result->p99_ns = bench_percentile(samples, iterations, 0.99);
+    result->p999_ns = bench_percentile(samples, iterations, 0.999);
+}
+
+static void bench_print(const bench_result_t* const result,
+                        const int json,
+                        const int first)
+{
+    if (json)
+    {
+        printf("%s\n  {\"nodes\": %zu, \"len\": %u, \"excludes_src\": %s, "
+               "\"frames_per_sec\": %.0f, \"ns_per_frame\": %.2f, "
+               "\"cycles_per_frame\": %.2f, \"p50_ns\": %llu, "
+               "\"p99_ns\": %llu, \"p999_ns\": %llu}",
+               first ? "" : ",",
+               result->nodes, result->len,
+               result->excludes_src ? "true" : "false",
+               result->frames_per_sec, result->ns_per_frame,
+               result->cycles_per_frame,
+               (unsigned long long) result->p50_ns,
+               (unsigned long long) result->p99_ns,
+               (unsigned long long) result->p999_ns);
+    }
+    else
+    {
+        printf("%zu,%u,%d,%.0f,%.2f,%.2f,%llu,%llu,%llu\n",
+               result->nodes, result->len, result->excludes_src,
+               result->frames_per_sec, result->ns_per_frame,
+               result->cycles_per_frame,
+               (unsigned long long) result->p50_ns,
+               (unsigned long long) result->p99_ns,
+               (unsigned long long) result->p999_ns);
+    }
+}
+
+int main(const int argc, const char* const argv[])
+{
+    int json = 0;
+    size_t iterations = BENCH_DEFAULT_ITERATIONS;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+        {
+            json = 1;
+        }
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+        {
+            iterations = strtoul(argv[++i], NULL, 10);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--json] [--iterations N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations == 0)
+    {
+        iterations = 1;
+    }
+    uint64_t* const samples = malloc(iterations * sizeof(uint64_t));
+    if (samples == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (json)
+    {
+        printf("[");
+    }
+    else
+    {
+        printf("nodes,len,excludes_src,frames_per_sec,ns_per_frame,"
+               "cycles_per_frame,p50_ns,p99_ns,p999_ns\n");
+    }
+    int first = 1;
+    for (size_t n = 0; n < sizeof(bench_nodes) / sizeof(bench_nodes[0]); n++)
+    {
+        for (size_t l = 0; l < sizeof(bench_lens) / sizeof(bench_lens[0]); l++)
+        {
+            for (int excludes_src = 0; excludes_src <= 1; excludes_src++)
+            {
+                bench_result_t result = {
+                        .nodes = bench_nodes[n],
+                        .len = bench_lens[l],
+                        .excludes_src = excludes_src,
+                };
+                bench_run(&result, samples, iterations);
+                bench_print(&result, json, first);
+                first = 0;
+            }
+        }
+    }
+    if (json)
+    {
+        printf("\n]\n");
+    }
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,519 @@
+/**
+ * @file
+ *
+ * Stress and soak scenarios of the concurrent VCAN modes.
+ *
+ * Each scenario runs with 1 up to N threads against #STRESS_NODES nodes,
+ * checking on every delivery the ordering and loss invariants from the
+ * sequence numbers of the bus and a per-producer counter in the payload:
+ *
+ * - `mt_producers`: many producers transmitting with vcan_mt_tx(), every
+ *   node receives every message, in the order of each producer, with
+ *   contiguous bus sequence numbers.
+ * - `mt_churn`: the same while one more thread keeps disconnecting and
+ *   reconnecting every #STRESS_CHURN_STRIDE-th node: those may miss
+ *   messages but never receive them out of order, the others miss none.
+ * - `rx_overflow`: one transmitter filling small receive queues, half
+ *   dropping the newest and half the oldest message, drained by consumer
+ *   threads: the messages received and the overflows add up to the ones
+ *   transmitted, in order.
+ * - `par_fanout`: parallel delivery with vcan_par.h across the workers,
+ *   every node receives every message exactly once, in order.
+ *
+ * The results are printed as CSV (default) or JSON on stdout, one row per
+ * scenario and thread count, giving the throughput scaling across cores.
+ * The exit code is 1 when any invariant is violated. CMake builds it with
+ * ThreadSanitizer as well, as `stressvcan_tsan`, covering every scenario.
+ *
+ * Usage: `stressvcan [--json] [--messages N] [--max-threads N]
+ * [--rounds N]`
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "vcan.h"
+#include "vcan_mt.h"
+#include "vcan_par.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STRESS_NODES 128U
+#define STRESS_MAX_THREADS 64U
+#define STRESS_DEFAULT_MESSAGES 20000U
+#define STRESS_QUEUE_LEN 64U
+#define STRESS_CHURN_STRIDE 4U
+#define STRESS_BASE_ID 0x100U
+
+/** Node with the invariants checked on its deliveries. */
+typedef struct
+{
+    /** First member: the callbacks obtain a pointer to it. */
+    vcan_node_t node;
+
+    /** Counter expected next from each producer. */
+    uint32_t next[STRESS_MAX_THREADS];
+
+    /** Bus sequence number of the last delivery. */
+    uint64_t last_seq;
+
+    uint64_t received;
+    uint64_t violations;
+
+    /** True if the node may miss messages, never receive them twice or
+     * out of order. */
+    bool gaps;
+
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[STRESS_QUEUE_LEN];
+    vcan_meta_t metas[STRESS_QUEUE_LEN];
+} stress_node_t;
+
+typedef struct
+{
+    const char* scenario;
+    uint32_t threads;
+    size_t messages;
+    double seconds;
+    uint64_t deliveries;
+    uint64_t lost;
+    uint64_t violations;
+} stress_result_t;
+
+static stress_node_t stress_nodes[STRESS_NODES];
+static vcan_node_t* stress_table[STRESS_NODES];
+static vcan_node_t* stress_order[STRESS_NODES];
+static vcan_bus_mt_t stress_mt;
+static vcan_par_t stress_par;
+
+static uint64_t stress_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000U + (uint64_t) now.tv_nsec;
+}
+
+/** The message of a producer with its counter in the payload. */
+static void stress_msg(vcan_msg_t* const msg,
+                       const uint32_t producer,
+                       const uint32_t counter)
+{
+    msg->id = STRESS_BASE_ID + producer;
+    msg->len = 8;
+    memcpy(msg->data, &counter, sizeof(counter));
+    memset(&msg->data[sizeof(counter)], (int) producer, 4);
+}
+
+/** Checks the ordering invariants of one delivery. */
+static void stress_check(stress_node_t* const node,
+                         const vcan_msg_t* const msg,
+                         const uint64_t seq)
+{
+    const uint32_t producer = msg->id - STRESS_BASE_ID;
+    uint32_t counter;
+    memcpy(&counter, msg->data, sizeof(counter));
+    if (producer >= STRESS_MAX_THREADS || msg->len != 8)
+    {
+        node->violations++;
+    }
+    else if (node->gaps ? counter < node->next[producer]
+                          || seq <= node->last_seq
+                        : counter != node->next[producer]
+                          || seq != node->last_seq + 1U)
+    {
+        node->violations++;
+    }
+    else
+    {
+        node->next[producer] = counter + 1U;
+    }
+    node->last_seq = seq;
+    node->received++;
+}
+
+static void stress_on_rx(vcan_node_t* const node, const vcan_msg_t* const msg)
+{
+    stress_check((stress_node_t*) node, msg, node->rx_meta.seq);
+}
+
+/** Resets the first \p count nodes, queued or with the callback. */
+static void stress_reset_nodes(const size_t count, const bool queued)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        stress_node_t* const node = &stress_nodes[i];
+        memset(node, 0, sizeof(stress_node_t));
+        node->node.callback_on_rx = stress_on_rx;
+        node->node.id = (uint32_t) i;
+        if (queued)
+        {
+            vcan_rx_queue_init(&node->queue, node->storage, STRESS_QUEUE_LEN);
+            vcan_rx_queue_set_meta(&node->queue, node->metas);
+            vcan_rx_queue_set_policy(&node->queue, i % 2U == 0
+                                     ? VCAN_RX_DROP_NEWEST
+                                     : VCAN_RX_DROP_OLDEST, 0, NULL);
+            node->node.rx_queue = &node->queue;
+            node->gaps = true;
+        }
+    }
+}
+
+/** Sums the deliveries and violations of the first \p count nodes. */
+static void stress_collect(stress_result_t* const result, const size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        result->deliveries += stress_nodes[i].received;
+        result->violations += stress_nodes[i].violations;
+    }
+}
+
+typedef struct
+{
+    pthread_t thread;
+    uint32_t producer;
+    size_t messages;
+    atomic_bool* done;
+    size_t first_node;
+    size_t stride;
+} stress_worker_t;
+
+static void* stress_produce_mt(void* const arg)
+{
+    const stress_worker_t* const worker = arg;
+    vcan_msg_t msg;
+    for (uint32_t i = 0; i < worker->messages; i++)
+    {
+        stress_msg(&msg, worker->producer, i);
+        while (vcan_mt_tx(&stress_mt, &msg, NULL) == VCAN_QUEUE_FULL)
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void* stress_churn(void* const arg)
+{
+    const stress_worker_t* const worker = arg;
+    while (!atomic_load(worker->done))
+    {
+        for (size_t i = 0; i < STRESS_NODES; i += STRESS_CHURN_STRIDE)
+        {
+            vcan_mt_disconnect(&stress_mt, &stress_nodes[i].node);
+            vcan_mt_connect(&stress_mt, &stress_nodes[i].node);
+        }
+    }
+    return NULL;
+}
+
+/** Many producers on the multi-threaded bus, optionally with churn. */
+static void stress_mt_run(stress_result_t* const result, const bool churn)
+{
+    static stress_worker_t workers[STRESS_MAX_THREADS + 1U];
+    atomic_bool done = false;
+    stress_reset_nodes(STRESS_NODES, false);
+    vcan_mt_init_ex(&stress_mt, stress_table, STRESS_NODES);
+    for (size_t i = 0; i < STRESS_NODES; i++)
+    {
+        stress_nodes[i].gaps = churn && i % STRESS_CHURN_STRIDE == 0;
+        vcan_mt_connect(&stress_mt, &stress_nodes[i].node);
+    }
+    vcan_mt_start(&stress_mt);
+    const uint64_t start = stress_now_ns();
+    for (uint32_t p = 0; p < result->threads; p++)
+    {
+        workers[p].producer = p;
+        workers[p].messages = result->messages;
+        pthread_create(&workers[p].thread, NULL, stress_produce_mt,
+                       &workers[p]);
+    }
+    if (churn)
+    {
+        workers[STRESS_MAX_THREADS].done = &done;
+        pthread_create(&workers[STRESS_MAX_THREADS].thread, NULL,
+                       stress_churn, &workers[STRESS_MAX_THREADS]);
+    }
+    for (uint32_t p = 0; p < result->threads; p++)
+    {
+        pthread_join(workers[p].thread, NULL);
+    }
+    atomic_store(&done, true);
+    if (churn)
+    {
+        pthread_join(workers[STRESS_MAX_THREADS].thread, NULL);
+    }
+    vcan_mt_flush(&stress_mt);
+    result->seconds = (double) (stress_now_ns() - start) / 1e9;
+    vcan_mt_deinit(&stress_mt);
+    const uint64_t expected = (uint64_t) result->messages * result->threads;
+    for (size_t i = 0; i < STRESS_NODES; i++)
+    {
+        if (stress_nodes[i].received > expected)
+        {
+            stress_nodes[i].violations++;
+        }
+        else if (!stress_nodes[i].gaps)
+        {
+            result->lost += expected - stress_nodes[i].received;
+        }
+    }
+    result->messages = (size_t) expected;
+    stress_collect(result, STRESS_NODES);
+}
+
+static void* stress_consume(void* const arg)
+{
+    const stress_worker_t* const worker = arg;
+    vcan_msg_t msgs[8];
+    vcan_meta_t metas[8];
+    bool drained = false;
+    while (!drained)
+    {
+        // Read before polling: once done, an empty poll means drained
+        const bool done = atomic_load(worker->done);
+        size_t polled = 0;
+        for (size_t i = worker->first_node; i < STRESS_NODES;
+             i += worker->stride)
+        {
+            stress_node_t* const node = &stress_nodes[i];
+            const size_t count = vcan_rx_poll_meta(&node->node, msgs, metas,
+                                                   8);
+            for (size_t m = 0; m < count; m++)
+            {
+                stress_check(node, &msgs[m], metas[m].seq);
+            }
+            polled += count;
+        }
+        drained = done && polled == 0;
+    }
+    return NULL;
+}
+
+/** One transmitter filling the receive queues, drained by consumers. */
+static void stress_rx_run(stress_result_t* const result)
+{
+    static stress_worker_t workers[STRESS_MAX_THREADS];
+    atomic_bool done = false;
+    vcan_bus_t bus;
+    stress_reset_nodes(STRESS_NODES, true);
+    vcan_init_ex(&bus, stress_table, STRESS_NODES);
+    for (size_t i = 0; i < STRESS_NODES; i++)
+    {
+        vcan_connect(&bus, &stress_nodes[i].node);
+    }
+    for (uint32_t c = 0; c < result->threads; c++)
+    {
+        workers[c].done = &done;
+        workers[c].first_node = c;
+        workers[c].stride = result->threads;
+        pthread_create(&workers[c].thread, NULL, stress_consume, &workers[c]);
+    }
+    const uint64_t start = stress_now_ns();
+    vcan_msg_t msg;
+    for (uint32_t i = 0; i < result->messages; i++)
+    {
+        stress_msg(&msg, 0, i);
+        vcan_tx(&bus, &msg, NULL);
+    }
+    atomic_store(&done, true);
+    for (uint32_t c = 0; c < result->threads; c++)
+    {
+        pthread_join(workers[c].thread, NULL);
+    }
+    result->seconds = (double) (stress_now_ns() - start) / 1e9;
+    for (size_t i = 0; i < STRESS_NODES; i++)
+    {
+        // Nothing vanishes: each message is received or counted as overflow
+        const uint64_t overflows = vcan_rx_overflows(&stress_nodes[i].node);
+        if (stress_nodes[i].received + overflows != result->messages)
+        {
+            stress_nodes[i].violations++;
+        }
+        result->lost += overflows;
+    }
+    stress_collect(result, STRESS_NODES);
+}
+
+/** Parallel delivery to the nodes by the workers of vcan_par.h. */
+static void stress_par_run(stress_result_t* const result)
+{
+    vcan_bus_t bus;
+    stress_reset_nodes(STRESS_NODES, false);
+    vcan_init_ex(&bus, stress_table, STRESS_NODES);
+    for (size_t i = 0; i < STRESS_NODES; i++)
+    {
+        vcan_connect(&bus, &stress_nodes[i].node);
+    }
+    if (vcan_par_init(&stress_par, &bus, stress_order, STRESS_NODES,
+                      result->threads, NULL) != VCAN_OK)
+    {
+        result->violations++;
+    }
+    else
+    {
+        const uint64_t start = stress_now_ns();
+        vcan_msg_t msg;
+        for (uint32_t i = 0; i < result->messages; i++)
+        {
+            stress_msg(&msg, 0, i);
+            vcan_tx(&bus, &msg, NULL);
+        }
+        result->seconds = (double) (stress_now_ns() - start) / 1e9;
+        vcan_par_deinit(&stress_par);
+        for (size_t i = 0; i < STRESS_NODES; i++)
+        {
+            result->lost += result->messages - stress_nodes[i].received;
+        }
+        stress_collect(result, STRESS_NODES);
+    }
+}
+
+static void stress_print(const stress_result_t* const result,
+                         const int json,
+                         const int first)
+{
+    const double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+    if (json)
+    {
+        printf("%s\n  {\"scenario\": \"%s\", \"threads\": %u, "
+               "\"nodes\": %u, \"messages\": %zu, \"seconds\": %.3f, "
+               "\"msgs_per_sec\": %.0f, \"deliveries_per_sec\": %.0f, "
+               "\"lost\": %llu, \"violations\": %llu}",
+               first ? "" : ",",
+               result->scenario, result->threads, STRESS_NODES,
+               result->messages, result->seconds,
+               (double) result->messages / seconds,
+               (double) result->deliveries / seconds,
+               (unsigned long long) result->lost,
+               (unsigned long long) result->violations);
+    }
+    else
+    {
+        printf("%s,%u,%u,%zu,%.3f,%.0f,%.0f,%llu,%llu\n",
+               result->scenario, result->threads, STRESS_NODES,
+               result->messages, result->seconds,
+               (double) result->messages / seconds,
+               (double) result->deliveries / seconds,
+               (unsigned long long) result->lost,
+               (unsigned long long) result->violations);
+    }
+    fflush(stdout);
+}
+
+/** Next thread count of the scaling curve: powers of 2, then the max. */
+static uint32_t stress_next_threads(const uint32_t threads,
+                                    const uint32_t max_threads)
+{
+    return threads < max_threads && threads * 2U > max_threads
+           ? max_threads : threads * 2U;
+}
+
+int main(const int argc, const char* const argv[])
+{
+    int json = 0;
+    size_t messages = STRESS_DEFAULT_MESSAGES;
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long max_threads = cpus > 0 ? (unsigned long) cpus : 1U;
+    unsigned long rounds = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+        {
+            json = 1;
+        }
+        else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc)
+        {
+            messages = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--max-threads") == 0 && i + 1 < argc)
+        {
+            max_threads = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc)
+        {
+            rounds = strtoul(argv[++i], NULL, 10);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--json] [--messages N] "
+                            "[--max-threads N] [--rounds N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (messages == 0 || messages > UINT32_MAX)
+    {
+        messages = STRESS_DEFAULT_MESSAGES;
+    }
+    if (max_threads == 0 || max_threads > STRESS_MAX_THREADS)
+    {
+        max_threads = STRESS_MAX_THREADS;
+    }
+    if (json)
+    {
+        printf("[");
+    }
+    else
+    {
+        printf("scenario,threads,nodes,messages,seconds,msgs_per_sec,"
+               "deliveries_per_sec,lost,violations\n");
+    }
+    int first = 1;
+    uint64_t violations = 0;
+    static const char* const scenarios[] = {
+            "mt_producers", "mt_churn", "rx_overflow", "par_fanout"
+    };
+    for (unsigned long round = 0; round < rounds; round++)
+    {
+        for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+        {
+            for (uint32_t threads = 1; threads <= max_threads;
+                 threads = stress_next_threads(threads,
+                                               (uint32_t) max_threads))
+            {
+                stress_result_t result = {
+                        .scenario = scenarios[s],
+                        .threads = threads,
+                        .messages = messages,
+                };
+                switch (s)
+                {
+                    case 0:
+                        stress_mt_run(&result, false);
+                        break;
+                    case 1:
+                        stress_mt_run(&result, true);
+                        break;
+                    case 2:
+                        stress_rx_run(&result);
+                        break;
+                    default:
+                        stress_par_run(&result);
+                        break;
+                }
+                // Lossless scenarios must not lose anything either
+                if (s != 2)
+                {
+                    result.violations += result.lost;
+                }
+                stress_print(&result, json, first);
+                violations += result.violations;
+                first = 0;
+            }
+        }
+    }
+    if (json)
+    {
+        printf("\n]\n");
+    }
+    return violations > 0 ? 1 : 0;
+}
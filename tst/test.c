@@ -8,10 +8,32 @@
  * @license BSD 3-clause license.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "atto.h"
 #include "vcan.h"
+#include "vcan_mt.h"
+#include "vcan_trace.h"
+#include "vcan_sched.h"
+#include "vcan_arb.h"
+#include "vcan_gw.h"
+#include "vcan_net.h"
+#include "vcan_par.h"
+#include "vcan_sig.h"
+#include "vcan_notify.h"
+#include "vcan_static.h"
+#include "vcan_fault.h"
+#ifdef __linux__
+#include "vcan_socketcan.h"
+#include <net/if.h>
+#endif
 #include <assert.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 static void test_init_null(void)
 {
@@ -124,6 +146,16 @@ static void test_connect_max_reached(void)
 }
 
 
+static void test_init_ex_invalid(void)
+{
+    vcan_bus_t bus;
+    vcan_node_t* table[4];
+
+    atto_eq(vcan_init_ex(NULL, table, 4), VCAN_NULL_BUS);
+    atto_eq(vcan_init_ex(&bus, NULL, 4), VCAN_NULL_STORAGE);
+    atto_eq(vcan_init_ex(&bus, table, 0), VCAN_INVALID_CAPACITY);
+}
+
 static void test_disconnect_null_bus(void)
 {
     vcan_err_t err = vcan_disconnect(NULL, NULL);
@@ -201,6 +233,149 @@ static void test_disconnect_not_found(void)
     atto_eq(bus.nodes[0], &node_1);
 }
 
+static void test_connect_sets_handle(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node_1 = {
+            .callback_on_rx = does_nothing,
+    };
+    vcan_node_t node_2 = {
+            .callback_on_rx = does_nothing,
+    };
+
+    err = vcan_connect(&bus, &node_1);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_2);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(node_1.bus, &bus);
+    atto_eq(node_1.slot, 0);
+    atto_eq(node_1.connections, 1);
+    atto_eq(node_2.bus, &bus);
+    atto_eq(node_2.slot, 1);
+    err = vcan_disconnect(&bus, &node_1);
+    atto_eq(err, VCAN_OK);
+    atto_eq(node_1.bus, NULL);
+    atto_eq(node_1.connections, 0);
+    atto_eq(node_2.slot, 0);
+}
+
+static void test_disconnect_const_node(void)
+{
+    vcan_bus_t bus;
+    atto_eq(vcan_init(&bus), VCAN_OK);
+    vcan_node_t node = {
+            .callback_on_rx = does_nothing,
+    };
+    atto_eq(vcan_connect(&bus, &node), VCAN_OK);
+    const vcan_node_t* const connected = &node;
+
+    vcan_err_t err = vcan_disconnect(&bus, connected);
+
+    atto_eq(err, VCAN_OK);
+    atto_eq(bus.connected, 0);
+    // The handle is reset anyway
+    atto_eq(node.bus, NULL);
+    atto_eq(node.connections, 0);
+}
+
+static void connect_5_nodes(vcan_bus_t* bus, vcan_node_t nodes[5])
+{
+    for (size_t i = 0; i < 5; i++)
+    {
+        nodes[i].callback_on_rx = does_nothing;
+        nodes[i].id = (uint32_t) i;
+        atto_eq(vcan_connect(bus, &nodes[i]), VCAN_OK);
+    }
+}
+
+static void test_disconnect_swaps_last(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t nodes[5] = {{0}};
+    connect_5_nodes(&bus, nodes);
+
+    err = vcan_disconnect(&bus, &nodes[1]);
+
+    atto_eq(err, VCAN_OK);
+    atto_eq(bus.connected, 4);
+    atto_eq(bus.nodes[0], &nodes[0]);
+    atto_eq(bus.nodes[1], &nodes[4]);
+    atto_eq(bus.nodes[2], &nodes[2]);
+    atto_eq(bus.nodes[3], &nodes[3]);
+    atto_eq(nodes[4].slot, 1);
+    // Disconnecting the last one moves nothing
+    err = vcan_disconnect(&bus, &nodes[3]);
+    atto_eq(err, VCAN_OK);
+    atto_eq(bus.connected, 3);
+    atto_eq(bus.nodes[2], &nodes[2]);
+    atto_eq(nodes[2].slot, 2);
+}
+
+static void test_disconnect_ordered(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    bus.flags |= VCAN_BUS_ORDERED;
+    vcan_node_t nodes[5] = {{0}};
+    connect_5_nodes(&bus, nodes);
+
+    err = vcan_disconnect(&bus, &nodes[1]);
+
+    atto_eq(err, VCAN_OK);
+    atto_eq(bus.connected, 4);
+    for (size_t i = 0; i < 4; i++)
+    {
+        const size_t expected = i == 0 ? 0 : i + 1;
+        atto_eq(bus.nodes[i], &nodes[expected]);
+        atto_eq(nodes[expected].slot, i);
+    }
+}
+
+static void test_connect_to_multiple_buses(void)
+{
+    vcan_bus_t bus_a;
+    vcan_bus_t bus_b;
+    vcan_err_t err = vcan_init(&bus_a);
+    atto_eq(err, VCAN_OK);
+    err = vcan_init(&bus_b);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t other = {
+            .callback_on_rx = does_nothing,
+    };
+    vcan_node_t node = {
+            .callback_on_rx = does_nothing,
+    };
+    err = vcan_connect(&bus_b, &other);
+    atto_eq(err, VCAN_OK);
+
+    err = vcan_connect(&bus_a, &node);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus_b, &node);
+    atto_eq(err, VCAN_OK);
+    atto_eq(node.bus, &bus_a);
+    atto_eq(node.connections, 2);
+    atto_eq(vcan_connect(&bus_a, &node), VCAN_ALREADY_CONNECTED);
+    atto_eq(vcan_connect(&bus_b, &node), VCAN_ALREADY_CONNECTED);
+    // Losing the handle bus, the other one is still found by scanning
+    err = vcan_disconnect(&bus_a, &node);
+    atto_eq(err, VCAN_OK);
+    atto_eq(node.bus, NULL);
+    atto_eq(vcan_connect(&bus_b, &node), VCAN_ALREADY_CONNECTED);
+    atto_eq(vcan_disconnect(&bus_a, &node), VCAN_NODE_NOT_FOUND);
+    err = vcan_disconnect(&bus_b, &node);
+    atto_eq(err, VCAN_OK);
+    atto_eq(node.connections, 0);
+    atto_eq(vcan_disconnect(&bus_b, &node), VCAN_NODE_NOT_FOUND);
+    atto_eq(bus_b.connected, 1);
+    atto_eq(bus_b.nodes[0], &other);
+}
+
 static void test_tx_null_bus(void)
 {
     vcan_err_t err = vcan_tx(NULL, NULL, NULL);
@@ -282,8 +457,8 @@ static void test_tx_to_all_nodes(void)
     // Message was copied
     atto_memeq(&msg, &bus.received_msg, sizeof(vcan_msg_t));
     // Callbacks were called
-    atto_eq((int) node_1.other_custom_data, 1);
-    atto_eq((int) node_2.other_custom_data, 2);
+    atto_eq((intptr_t) node_1.other_custom_data, 1);
+    atto_eq((intptr_t) node_2.other_custom_data, 2);
 }
 
 
@@ -320,9 +495,4109 @@ static void test_tx_to_all_nodes_except_source(void)
     // Message was copied
     atto_memeq(&msg, &bus.received_msg, sizeof(vcan_msg_t));
     // Callback was called
-    atto_eq((int) node_1.other_custom_data, 1);
+    atto_eq((intptr_t) node_1.other_custom_data, 1);
+    // Source node untouched
+    atto_eq(node_2.other_custom_data, NULL);
+}
+
+static void test_tx_copies_only_used_payload(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    memset(bus.received_msg.data, 0xFF, VCAN_DATA_MAX_LEN);
+    vcan_msg_t msg = {
+            .id = 20,
+            .len = 3,
+            .data = {1, 2, 3}
+    };
+
+    err = vcan_tx(&bus, &msg, NULL);
+
+    atto_eq(err, VCAN_OK);
+    atto_eq(bus.received_msg.id, 20);
+    atto_eq(bus.received_msg.len, 3);
+    atto_memeq(bus.received_msg.data, msg.data, 3);
+    // Bytes past len are not copied
+    for (size_t i = 3; i < VCAN_DATA_MAX_LEN; i++)
+    {
+        atto_eq(bus.received_msg.data[i], 0xFF);
+    }
+}
+
+static void test_tx_len_too_long_is_clamped(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_msg_t msg = {
+            .id = 20,
+            .len = 1000,
+    };
+    memset(msg.data, 0xAB, VCAN_DATA_MAX_LEN);
+
+    err = vcan_tx(&bus, &msg, NULL);
+
+    atto_eq(err, VCAN_OK);
+    atto_memeq(&msg, &bus.received_msg, sizeof(vcan_msg_t));
+}
+
+static void stores_msg_address(vcan_node_t* node, const vcan_msg_t* msg)
+{
+    node->other_custom_data = (void*) msg;
+}
+
+static void test_tx_ref_null_bus(void)
+{
+    vcan_err_t err = vcan_tx_ref(NULL, NULL, NULL);
+
+    atto_eq(err, VCAN_NULL_BUS);
+}
+
+static void test_tx_ref_null_msg(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+
+    err = vcan_tx_ref(&bus, NULL, NULL);
+
+    atto_eq(err, VCAN_NULL_MSG);
+}
+
+static void test_tx_ref_passes_caller_msg(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node_1 = {
+            .callback_on_rx = stores_msg_address,
+            .other_custom_data = NULL,
+            .id = 1
+    };
+    vcan_node_t node_2 = {
+            .callback_on_rx = stores_msg_address,
+            .other_custom_data = NULL,
+            .id = 2
+    };
+    err = vcan_connect(&bus, &node_1);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_2);
+    atto_eq(err, VCAN_OK);
+    vcan_msg_t msg = {
+            .id = 20,
+            .len = 3,
+            .data = {1, 2, 3}
+    };
+
+    err = vcan_tx_ref(&bus, &msg, &node_2);
+
+    atto_eq(err, VCAN_OK);
+    // Callback obtained the caller's message, not a copy
+    atto_eq(node_1.other_custom_data, &msg);
     // Source node untouched
     atto_eq(node_2.other_custom_data, NULL);
+    // Bus copy untouched
+    atto_zeros((uint8_t*) &bus.received_msg, sizeof(vcan_msg_t));
+}
+
+static void counts_msgs(vcan_node_t* node, const vcan_msg_t* msg)
+{
+    (void) msg;
+    node->other_custom_data = (void*) ((intptr_t) node->other_custom_data + 1);
+}
+
+static void counts_bursts(vcan_node_t* node,
+                          const vcan_msg_t* msgs,
+                          size_t count)
+{
+    (void) msgs;
+    node->other_custom_data = (void*) ((intptr_t) node->other_custom_data
+                                       + 100 * (intptr_t) count);
+}
+
+static void test_tx_burst_null_bus(void)
+{
+    vcan_err_t err = vcan_tx_burst(NULL, NULL, 0, NULL);
+
+    atto_eq(err, VCAN_NULL_BUS);
+}
+
+static void test_tx_burst_null_msgs(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+
+    err = vcan_tx_burst(&bus, NULL, 3, NULL);
+
+    atto_eq(err, VCAN_NULL_MSG);
+}
+
+static void test_tx_burst_empty(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+    };
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+
+    err = vcan_tx_burst(&bus, NULL, 0, NULL);
+
+    atto_eq(err, VCAN_OK);
+    atto_eq(node.other_custom_data, NULL);
+}
+
+static void test_tx_burst_to_all_nodes_except_source(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node_1 = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+            .id = 1
+    };
+    vcan_node_t node_2 = {
+            .callback_on_rx = counts_msgs,
+            .callback_on_rx_burst = counts_bursts,
+            .other_custom_data = NULL,
+            .id = 2
+    };
+    vcan_node_t node_3 = {
+            .callback_on_rx = counts_msgs,
+            .callback_on_rx_burst = counts_bursts,
+            .other_custom_data = NULL,
+            .id = 3
+    };
+    err = vcan_connect(&bus, &node_1);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_2);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_3);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t msgs[3] = {
+            {.id = 1, .len = 1, .data = {1}},
+            {.id = 2, .len = 2, .data = {1, 2}},
+            {.id = 3, .len = 3, .data = {1, 2, 3}},
+    };
+
+    err = vcan_tx_burst(&bus, msgs, 3, &node_3);
+
+    atto_eq(err, VCAN_OK);
+    // Fallback to one callback per message
+    atto_eq((intptr_t) node_1.other_custom_data, 3);
+    // One burst callback with all messages
+    atto_eq((intptr_t) node_2.other_custom_data, 300);
+    // Source node untouched
+    atto_eq(node_3.other_custom_data, NULL);
+    // Last message was copied
+    atto_memeq(&msgs[2], &bus.received_msg, sizeof(vcan_msg_t));
+}
+
+#define LARGE_BUS_NODES 120
+
+static void test_init_ex_large_bus(void)
+{
+    vcan_bus_t bus;
+    static vcan_node_t* table[LARGE_BUS_NODES];
+    static vcan_node_t nodes[LARGE_BUS_NODES + 1];
+    vcan_err_t err = vcan_init_ex(&bus, table, LARGE_BUS_NODES);
+    atto_eq(err, VCAN_OK);
+    atto_eq(bus.table, table);
+    atto_eq(bus.capacity, LARGE_BUS_NODES);
+    for (size_t i = 0; i <= LARGE_BUS_NODES; i++)
+    {
+        nodes[i].callback_on_rx = counts_msgs;
+        nodes[i].other_custom_data = NULL;
+        nodes[i].id = (uint32_t) i;
+    }
+
+    for (size_t i = 0; i < LARGE_BUS_NODES; i++)
+    {
+        err = vcan_connect(&bus, &nodes[i]);
+        atto_eq(err, VCAN_OK);
+    }
+    err = vcan_connect(&bus, &nodes[LARGE_BUS_NODES]);
+    atto_eq(err, VCAN_TOO_MANY_CONNECTED);
+    err = vcan_disconnect(&bus, &nodes[50]);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &nodes[LARGE_BUS_NODES - 1]);
+    atto_eq(err, VCAN_ALREADY_CONNECTED);
+    const vcan_msg_t msg = {.id = 1, .len = 0};
+    err = vcan_tx(&bus, &msg, &nodes[0]);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(bus.connected, LARGE_BUS_NODES - 1);
+    atto_eq(nodes[0].other_custom_data, NULL);
+    atto_eq(nodes[50].other_custom_data, NULL);
+    for (size_t i = 1; i < LARGE_BUS_NODES; i++)
+    {
+        if (i != 50)
+        {
+            atto_eq((intptr_t) nodes[i].other_custom_data, 1);
+        }
+    }
+    // The embedded table is untouched
+    atto_zeros((uint8_t*) bus.nodes, sizeof(bus.nodes));
+}
+
+static void test_set_filter_null_node(void)
+{
+    vcan_err_t err = vcan_set_filter(NULL, NULL, 0, NULL, 0);
+
+    atto_eq(err, VCAN_NULL_NODE);
+}
+
+static void test_set_filter_null_arrays(void)
+{
+    vcan_node_t node = {
+            .callback_on_rx = does_nothing,
+    };
+    const uint32_t ids[] = {1};
+    const vcan_filter_t filters[] = {{.id = 1, .mask = 1}};
+
+    vcan_err_t err = vcan_set_filter(&node, NULL, 1, ids, 1);
+    atto_eq(err, VCAN_NULL_FILTER);
+    err = vcan_set_filter(&node, filters, 1, NULL, 1);
+    atto_eq(err, VCAN_NULL_FILTER);
+}
+
+static void test_set_filter_unsorted(void)
+{
+    vcan_node_t node = {
+            .callback_on_rx = does_nothing,
+    };
+    const uint32_t ids[] = {0x100, 0x300, 0x200};
+
+    vcan_err_t err = vcan_set_filter(&node, NULL, 0, ids, 3);
+
+    atto_eq(err, VCAN_UNSORTED_FILTER);
+    // Previous state kept: accepts all
+    atto_eq(node.acceptance.ids, NULL);
+    atto_eq(node.acceptance.summary.mask, 0);
+}
+
+static void test_set_filter_stale_handle(void)
+{
+    vcan_bus_t bus;
+    vcan_node_t* table[2];
+    vcan_node_t nodes[5] = {{0}};
+    const uint32_t ids[] = {0x100};
+    atto_eq(vcan_init(&bus), VCAN_OK);
+    connect_5_nodes(&bus, nodes);
+
+    // Initialised again, smaller, under the connected nodes
+    atto_eq(vcan_init_ex(&bus, table, 2), VCAN_OK);
+    vcan_err_t err = vcan_set_filter(&nodes[4], NULL, 0, ids, 1);
+    atto_eq(err, VCAN_NODE_NOT_FOUND);
+    atto_eq(nodes[4].bus, NULL);
+    atto_eq(nodes[4].acceptance.ids, NULL);
+    // Initialised again, same size, another node in the slot
+    atto_eq(vcan_init(&bus), VCAN_OK);
+    atto_eq(vcan_connect(&bus, &nodes[0]), VCAN_OK);
+    atto_eq(vcan_connect(&bus, &nodes[2]), VCAN_OK);
+    atto_eq(nodes[1].slot, 1);
+    err = vcan_set_filter(&nodes[1], NULL, 0, ids, 1);
+    atto_eq(err, VCAN_NODE_NOT_FOUND);
+    atto_eq(nodes[1].bus, NULL);
+    atto_eq(bus.nodes[1], &nodes[2]);
+    // Valid handles still update the summary of their slot
+    err = vcan_set_filter(&nodes[0], NULL, 0, ids, 1);
+    atto_eq(err, VCAN_OK);
+    atto_eq(nodes[0].bus, &bus);
+}
+
+static void test_tx_filtered(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node_ids = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+            .id = 1
+    };
+    vcan_node_t node_masks = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+            .id = 2
+    };
+    vcan_node_t node_all = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+            .id = 3
+    };
+    const uint32_t ids[] = {0x100, 0x123, 0x7FF};
+    // Accepts 0x200..0x20F and 0x310
+    const vcan_filter_t filters[] = {
+            {.id = 0x200, .mask = 0x7F0},
+            {.id = 0x310, .mask = 0x7FF},
+    };
+    err = vcan_set_filter(&node_ids, NULL, 0, ids, 3);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_ids);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_masks);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_all);
+    atto_eq(err, VCAN_OK);
+    // Setting filters after connecting.
+    err = vcan_set_filter(&node_masks, filters, 2, NULL, 0);
+    atto_eq(err, VCAN_OK);
+    const uint32_t tx_ids[] = {0x100, 0x101, 0x123, 0x7FF, 0x200, 0x20F,
+                               0x210, 0x310, 0x311, 0x000};
+
+    for (size_t i = 0; i < sizeof(tx_ids) / sizeof(tx_ids[0]); i++)
+    {
+        const vcan_msg_t msg = {.id = tx_ids[i], .len = 0};
+        err = vcan_tx(&bus, &msg, NULL);
+        atto_eq(err, VCAN_OK);
+    }
+
+    atto_eq((intptr_t) node_ids.other_custom_data, 3);
+    atto_eq((intptr_t) node_masks.other_custom_data, 3);
+    atto_eq((intptr_t) node_all.other_custom_data, 10);
+}
+
+static void test_tx_burst_filtered(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node_per_msg = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+            .id = 1
+    };
+    vcan_node_t node_burst = {
+            .callback_on_rx = counts_msgs,
+            .callback_on_rx_burst = counts_bursts,
+            .other_custom_data = NULL,
+            .id = 2
+    };
+    const uint32_t ids[] = {0x10, 0x20};
+    err = vcan_set_filter(&node_per_msg, NULL, 0, ids, 2);
+    atto_eq(err, VCAN_OK);
+    err = vcan_set_filter(&node_burst, NULL, 0, ids, 2);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_per_msg);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_burst);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t msgs[6] = {
+            {.id = 0x10}, {.id = 0x20}, {.id = 0x30},
+            {.id = 0x10}, {.id = 0x40}, {.id = 0x20},
+    };
+
+    err = vcan_tx_burst(&bus, msgs, 6, NULL);
+
+    atto_eq(err, VCAN_OK);
+    atto_eq((intptr_t) node_per_msg.other_custom_data, 4);
+    // 3 runs of accepted messages: 2 + 1 + 1, counted as 100 per message
+    atto_eq((intptr_t) node_burst.other_custom_data, 400);
+}
+
+#define MT_PRODUCERS 4
+#define MT_MSGS_PER_PRODUCER 5000
+
+static vcan_bus_mt_t mt_bus;
+
+typedef struct
+{
+    uint32_t next_seq[MT_PRODUCERS];
+    size_t received;
+    size_t out_of_order;
+} mt_rx_state_t;
+
+static void mt_checks_order(vcan_node_t* node, const vcan_msg_t* msg)
+{
+    mt_rx_state_t* const state = node->other_custom_data;
+    const uint8_t producer = msg->data[0];
+    uint32_t seq;
+    memcpy(&seq, &msg->data[1], sizeof(seq));
+    if (producer >= MT_PRODUCERS || seq != state->next_seq[producer])
+    {
+        state->out_of_order++;
+    }
+    else
+    {
+        state->next_seq[producer]++;
+    }
+    state->received++;
+}
+
+static void* mt_producer(void* arg)
+{
+    const uint8_t producer = (uint8_t) (intptr_t) arg;
+    vcan_msg_t msg = {.id = producer, .len = 5, .data = {producer}};
+    for (uint32_t seq = 0; seq < MT_MSGS_PER_PRODUCER; seq++)
+    {
+        memcpy(&msg.data[1], &seq, sizeof(seq));
+        while (vcan_mt_tx(&mt_bus, &msg, NULL) == VCAN_QUEUE_FULL)
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void test_mt_null_args(void)
+{
+    const vcan_msg_t msg = {.id = 1};
+
+    atto_eq(vcan_mt_init(NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_mt_start(NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_mt_stop(NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_mt_deinit(NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_mt_connect(NULL, NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_mt_disconnect(NULL, NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_mt_tx(NULL, &msg, NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_mt_flush(NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_mt_init(&mt_bus), VCAN_OK);
+    atto_eq(vcan_mt_tx(&mt_bus, NULL, NULL), VCAN_NULL_MSG);
+    atto_eq(vcan_mt_connect(&mt_bus, NULL), VCAN_NULL_NODE);
+    atto_eq(vcan_mt_deinit(&mt_bus), VCAN_OK);
+}
+
+static void test_mt_queue_full(void)
+{
+    vcan_err_t err = vcan_mt_init(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+    };
+    err = vcan_mt_connect(&mt_bus, &node);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t msg = {.id = 1, .len = 1};
+
+    // Dispatcher not started: nothing is dequeued
+    for (size_t i = 0; i < VCAN_MT_QUEUE_LEN; i++)
+    {
+        err = vcan_mt_tx(&mt_bus, &msg, NULL);
+        atto_eq(err, VCAN_OK);
+    }
+    err = vcan_mt_tx(&mt_bus, &msg, NULL);
+    atto_eq(err, VCAN_QUEUE_FULL);
+    atto_eq(node.other_custom_data, NULL);
+#ifdef VCAN_STATS
+    vcan_bus_stats_t stats;
+    atto_eq(vcan_get_stats(&mt_bus.bus, &stats), VCAN_OK);
+    atto_eq(stats.dropped, 1);
+#endif
+
+    // Stopping delivers all queued messages
+    err = vcan_mt_start(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_stop(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    atto_eq((intptr_t) node.other_custom_data, VCAN_MT_QUEUE_LEN);
+    err = vcan_mt_deinit(&mt_bus);
+    atto_eq(err, VCAN_OK);
+}
+
+static void test_mt_global_order(void)
+{
+    vcan_err_t err = vcan_mt_init(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    mt_rx_state_t state_1 = {.received = 0};
+    mt_rx_state_t state_2 = {.received = 0};
+    vcan_node_t node_1 = {
+            .callback_on_rx = mt_checks_order,
+            .other_custom_data = &state_1,
+            .id = 1,
+    };
+    vcan_node_t node_2 = {
+            .callback_on_rx = mt_checks_order,
+            .other_custom_data = &state_2,
+            .id = 2,
+    };
+    err = vcan_mt_connect(&mt_bus, &node_1);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_start(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    // Connecting while running
+    err = vcan_mt_connect(&mt_bus, &node_2);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_connect(&mt_bus, &node_2);
+    atto_eq(err, VCAN_ALREADY_CONNECTED);
+    pthread_t producers[MT_PRODUCERS];
+
+    for (intptr_t i = 0; i < MT_PRODUCERS; i++)
+    {
+        atto_eq(pthread_create(&producers[i], NULL, mt_producer, (void*) i),
+                0);
+    }
+    for (size_t i = 0; i < MT_PRODUCERS; i++)
+    {
+        pthread_join(producers[i], NULL);
+    }
+    err = vcan_mt_flush(&mt_bus);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(state_1.received, MT_PRODUCERS * MT_MSGS_PER_PRODUCER);
+    atto_eq(state_1.out_of_order, 0);
+    atto_eq(state_2.received, MT_PRODUCERS * MT_MSGS_PER_PRODUCER);
+    atto_eq(state_2.out_of_order, 0);
+    err = vcan_mt_disconnect(&mt_bus, &node_2);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_disconnect(&mt_bus, &node_2);
+    atto_eq(err, VCAN_NODE_NOT_FOUND);
+    const vcan_msg_t msg = {.id = 0, .len = 5};
+    err = vcan_mt_tx(&mt_bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_flush(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    atto_eq(state_1.received, MT_PRODUCERS * MT_MSGS_PER_PRODUCER + 1);
+    atto_eq(state_2.received, MT_PRODUCERS * MT_MSGS_PER_PRODUCER);
+    err = vcan_mt_deinit(&mt_bus);
+    atto_eq(err, VCAN_OK);
+}
+
+static void test_mt_init_ex(void)
+{
+    static vcan_node_t* table[LARGE_BUS_NODES];
+    static vcan_node_t nodes[LARGE_BUS_NODES];
+    vcan_err_t err = vcan_mt_init_ex(&mt_bus, table, 0);
+    atto_eq(err, VCAN_INVALID_CAPACITY);
+    err = vcan_mt_init_ex(&mt_bus, table, LARGE_BUS_NODES);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_start(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    for (size_t i = 0; i < LARGE_BUS_NODES; i++)
+    {
+        nodes[i].callback_on_rx = counts_msgs;
+        nodes[i].other_custom_data = NULL;
+        err = vcan_mt_connect(&mt_bus, &nodes[i]);
+        atto_eq(err, VCAN_OK);
+    }
+    const vcan_msg_t msg = {.id = 1, .len = 0};
+
+    err = vcan_mt_tx(&mt_bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_flush(&mt_bus);
+    atto_eq(err, VCAN_OK);
+
+    for (size_t i = 0; i < LARGE_BUS_NODES; i++)
+    {
+        atto_eq((intptr_t) nodes[i].other_custom_data, 1);
+    }
+    err = vcan_mt_deinit(&mt_bus);
+    atto_eq(err, VCAN_OK);
+}
+
+static void test_mt_connect_while_stopping(void)
+{
+    vcan_err_t err = vcan_mt_init(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {
+            .callback_on_rx = counts_msgs,
+    };
+    err = vcan_mt_start(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    // What vcan_mt_stop() does first: the dispatcher drains and exits
+    pthread_mutex_lock(&mt_bus.lock);
+    atomic_store(&mt_bus.running, false);
+    pthread_cond_signal(&mt_bus.wakeup);
+    pthread_mutex_unlock(&mt_bus.lock);
+    pthread_join(mt_bus.dispatcher, NULL);
+
+    // Refused instead of waiting for the gone dispatcher
+    err = vcan_mt_connect(&mt_bus, &node);
+    atto_eq(err, VCAN_QUEUE_FULL);
+    err = vcan_mt_disconnect(&mt_bus, &node);
+    atto_eq(err, VCAN_QUEUE_FULL);
+    atto_eq(mt_bus.bus.connected, 0);
+    atomic_store(&mt_bus.started, false);
+    // The refused entries are skipped on the next start
+    err = vcan_mt_start(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_connect(&mt_bus, &node);
+    atto_eq(err, VCAN_OK);
+    atto_eq(mt_bus.bus.connected, 1);
+    err = vcan_mt_deinit(&mt_bus);
+    atto_eq(err, VCAN_OK);
+}
+
+static vcan_node_t mt_late_node;
+
+static void mt_connects_late_node(vcan_node_t* node, const vcan_msg_t* msg)
+{
+    (void) msg;
+    node->other_custom_data = (void*) 1;
+    vcan_mt_connect(&mt_bus, &mt_late_node);
+}
+
+static void test_mt_connect_from_callback(void)
+{
+    vcan_err_t err = vcan_mt_init(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {
+            .callback_on_rx = mt_connects_late_node,
+            .other_custom_data = NULL,
+    };
+    mt_late_node.callback_on_rx = counts_msgs;
+    mt_late_node.other_custom_data = NULL;
+    err = vcan_mt_connect(&mt_bus, &node);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_start(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t msg = {.id = 0, .len = 0};
+
+    err = vcan_mt_tx(&mt_bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_tx(&mt_bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_flush(&mt_bus);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(node.other_custom_data, (void*) 1);
+    // Connected while processing the first message: received at least the
+    // second one
+    atto_ge((intptr_t) mt_late_node.other_custom_data, 1);
+    err = vcan_mt_deinit(&mt_bus);
+    atto_eq(err, VCAN_OK);
+}
+
+static void test_rx_queue_init_invalid(void)
+{
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[4];
+
+    atto_eq(vcan_rx_queue_init(NULL, storage, 4), VCAN_NULL_STORAGE);
+    atto_eq(vcan_rx_queue_init(&queue, NULL, 4), VCAN_NULL_STORAGE);
+    atto_eq(vcan_rx_queue_init(&queue, storage, 0), VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_rx_queue_init(&queue, storage, 3), VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_rx_queue_init(&queue, storage, 4), VCAN_OK);
+}
+
+static void test_rx_poll_invalid(void)
+{
+    vcan_msg_t msgs[1];
+    vcan_node_t node = {
+            .callback_on_rx = does_nothing,
+    };
+
+    atto_eq(vcan_rx_poll(NULL, msgs, 1), 0);
+    atto_eq(vcan_rx_poll(&node, msgs, 1), 0);
+    atto_eq(vcan_rx_overflows(NULL), 0);
+    atto_eq(vcan_rx_overflows(&node), 0);
+}
+
+static void test_rx_queue_instead_of_callback(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[4];
+    err = vcan_rx_queue_init(&queue, storage, 4);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node_queued = {
+            .callback_on_rx = NULL,
+            .rx_queue = &queue,
+            .id = 1,
+    };
+    vcan_node_t node_callback = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+            .id = 2,
+    };
+    err = vcan_connect(&bus, &node_queued);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_callback);
+    atto_eq(err, VCAN_OK);
+    vcan_msg_t msgs[3];
+    vcan_msg_t msg = {.id = 0, .len = 1};
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        msg.id = 0x100U + i;
+        msg.data[0] = i;
+        err = vcan_tx(&bus, &msg, NULL);
+        atto_eq(err, VCAN_OK);
+    }
+
+    atto_eq((intptr_t) node_callback.other_custom_data, 3);
+    atto_eq(vcan_rx_poll(&node_queued, msgs, 2), 2);
+    atto_eq(msgs[0].id, 0x100);
+    atto_eq(msgs[0].data[0], 0);
+    atto_eq(msgs[1].id, 0x101);
+    atto_eq(msgs[1].data[0], 1);
+    atto_eq(vcan_rx_poll(&node_queued, msgs, 3), 1);
+    atto_eq(msgs[0].id, 0x102);
+    atto_eq(msgs[0].len, 1);
+    atto_eq(msgs[0].data[0], 2);
+    atto_eq(vcan_rx_poll(&node_queued, msgs, 3), 0);
+    atto_eq(vcan_rx_overflows(&node_queued), 0);
+}
+
+static void test_rx_queue_overflow(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[4];
+    err = vcan_rx_queue_init(&queue, storage, 4);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {
+            .rx_queue = &queue,
+    };
+    const uint32_t ids[] = {0x10, 0x20};
+    err = vcan_set_filter(&node, NULL, 0, ids, 2);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t burst[8] = {
+            {.id = 0x10}, {.id = 0x30}, {.id = 0x20}, {.id = 0x10},
+            {.id = 0x20}, {.id = 0x40}, {.id = 0x10}, {.id = 0x20},
+    };
+    vcan_msg_t msgs[8];
+
+    err = vcan_tx_burst(&bus, burst, 8, NULL);
+
+    atto_eq(err, VCAN_OK);
+    // 6 accepted, 4 fit
+    atto_eq(vcan_rx_overflows(&node), 2);
+    atto_eq(vcan_rx_poll(&node, msgs, 8), 4);
+    atto_eq(msgs[0].id, 0x10);
+    atto_eq(msgs[1].id, 0x20);
+    atto_eq(msgs[2].id, 0x10);
+    atto_eq(msgs[3].id, 0x20);
+    // Room again after polling
+    err = vcan_tx(&bus, &burst[0], NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_rx_poll(&node, msgs, 8), 1);
+    atto_eq(vcan_rx_overflows(&node), 2);
+}
+
+#define SPSC_MSGS 200000U
+
+typedef struct
+{
+    vcan_node_t* node;
+    uint32_t received;
+    uint32_t out_of_order;
+} spsc_consumer_t;
+
+static void* spsc_consumer(void* arg)
+{
+    spsc_consumer_t* const consumer = arg;
+    vcan_msg_t msgs[16];
+    uint32_t last = 0;
+    while (consumer->received + vcan_rx_overflows(consumer->node) < SPSC_MSGS)
+    {
+        const size_t polled = vcan_rx_poll(consumer->node, msgs, 16);
+        for (size_t i = 0; i < polled; i++)
+        {
+            uint32_t seq;
+            memcpy(&seq, msgs[i].data, sizeof(seq));
+            if (consumer->received > 0 && seq <= last)
+            {
+                consumer->out_of_order++;
+            }
+            last = seq;
+            consumer->received++;
+        }
+        if (polled == 0)
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void test_rx_queue_other_thread(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    static vcan_rx_queue_t queue;
+    static vcan_msg_t storage[64];
+    err = vcan_rx_queue_init(&queue, storage, 64);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {
+            .rx_queue = &queue,
+    };
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    spsc_consumer_t consumer = {.node = &node};
+    pthread_t thread;
+    atto_eq(pthread_create(&thread, NULL, spsc_consumer, &consumer), 0);
+    vcan_msg_t msg = {.id = 1, .len = 4};
+
+    for (uint32_t seq = 0; seq < SPSC_MSGS; seq++)
+    {
+        memcpy(msg.data, &seq, sizeof(seq));
+        vcan_tx(&bus, &msg, NULL);
+    }
+    pthread_join(thread, NULL);
+
+    // Nothing lost without being counted, nothing reordered
+    atto_eq(consumer.received + vcan_rx_overflows(&node), SPSC_MSGS);
+    atto_eq(consumer.out_of_order, 0);
+}
+
+static void test_frame8_conversion(void)
+{
+    const vcan_msg_t msg = {.id = 0x123, .len = 3, .data = {1, 2, 3}};
+    vcan_frame8_t frame;
+    vcan_msg_t back;
+
+    atto_eq(vcan_frame8_from_msg(NULL, &msg), VCAN_NULL_MSG);
+    atto_eq(vcan_frame8_from_msg(&frame, NULL), VCAN_NULL_MSG);
+    atto_eq(vcan_frame8_from_msg(&frame, &msg), VCAN_OK);
+    atto_eq(frame.id, 0x123);
+    atto_eq(frame.len, 3);
+    atto_eq(frame.data[2], 3);
+    atto_eq(vcan_frame8_to_msg(&back, &frame), VCAN_OK);
+    atto_eq(back.id, 0x123);
+    atto_eq(back.len, 3);
+    atto_memeq(back.data, msg.data, 3);
+
+    const vcan_msg_t fd = {.id = 1, .len = 9};
+    atto_eq(vcan_frame8_from_msg(&frame, &fd), VCAN_TOO_LONG);
+    atto_eq(frame.id, 0x123);
+    frame.len = 9;
+    atto_eq(vcan_frame8_to_msg(&back, &frame), VCAN_TOO_LONG);
+}
+
+static void test_pack_unpack(void)
+{
+    vcan_msg_t msg = {.id = 0x18DAF110, .len = 8,
+                      .data = {1, 2, 3, 4, 5, 6, 7, 8}};
+    uint8_t buf[VCAN_PACKED_SIZE(VCAN_DATA_MAX_LEN)];
+    vcan_msg_t back;
+
+    atto_eq(vcan_pack(buf, sizeof(buf), &msg), 13);
+    atto_eq(buf[0], 0x10);
+    atto_eq(buf[3], 0x18);
+    atto_eq(buf[4], 8);
+    atto_eq(vcan_unpack(&back, buf, 13), 13);
+    atto_eq(back.id, msg.id);
+    atto_eq(back.len, 8);
+    atto_memeq(back.data, msg.data, 8);
+    // Truncated buffers
+    atto_eq(vcan_pack(buf, 12, &msg), 0);
+    atto_eq(vcan_unpack(&back, buf, 12), 0);
+    atto_eq(vcan_unpack(&back, buf, 4), 0);
+    // Invalid length
+    msg.len = VCAN_DATA_MAX_LEN + 1;
+    atto_eq(vcan_pack(buf, sizeof(buf), &msg), 0);
+    buf[4] = VCAN_DATA_MAX_LEN + 1;
+    atto_eq(vcan_unpack(&back, buf, sizeof(buf)), 0);
+    atto_eq(vcan_pack(NULL, sizeof(buf), &msg), 0);
+    atto_eq(vcan_unpack(NULL, buf, sizeof(buf)), 0);
+}
+
+static void test_fd_len(void)
+{
+    atto_eq(vcan_fd_len(0), 0);
+    atto_eq(vcan_fd_len(8), 8);
+    atto_eq(vcan_fd_len(9), 12);
+    atto_eq(vcan_fd_len(12), 12);
+    atto_eq(vcan_fd_len(13), 16);
+    atto_eq(vcan_fd_len(33), 48);
+    atto_eq(vcan_fd_len(VCAN_DATA_MAX_LEN), VCAN_DATA_MAX_LEN);
+    atto_eq(vcan_fd_len(VCAN_DATA_MAX_LEN + 1), 0);
+}
+
+static void test_tx_frame8_and_packed(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+    };
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    const vcan_frame8_t frame = {.id = 7, .len = 2, .data = {0xAA, 0xBB}};
+
+    atto_eq(vcan_tx_frame8(NULL, &frame, NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_tx_frame8(&bus, NULL, NULL), VCAN_NULL_MSG);
+    atto_eq(vcan_tx_frame8(&bus, &frame, NULL), VCAN_OK);
+    atto_eq((intptr_t) node.other_custom_data, 1);
+    atto_eq(bus.received_msg.id, 7);
+    atto_eq(bus.received_msg.len, 2);
+    atto_eq(bus.received_msg.data[1], 0xBB);
+
+    uint8_t buf[64];
+    const vcan_msg_t msgs[2] = {
+            {.id = 1, .len = 0},
+            {.id = 2, .len = 3, .data = {9, 8, 7}},
+    };
+    size_t len = vcan_pack(buf, sizeof(buf), &msgs[0]);
+    len += vcan_pack(&buf[len], sizeof(buf) - len, &msgs[1]);
+    atto_eq(len, 13);
+    atto_eq(vcan_tx_packed(NULL, buf, len, NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_tx_packed(&bus, NULL, len, NULL), VCAN_NULL_MSG);
+    atto_eq(vcan_tx_packed(&bus, NULL, 0, NULL), VCAN_OK);
+    atto_eq(vcan_tx_packed(&bus, buf, len, NULL), VCAN_OK);
+    atto_eq((intptr_t) node.other_custom_data, 3);
+    atto_eq(bus.received_msg.id, 2);
+    atto_eq(bus.received_msg.data[2], 7);
+    // The frames before a truncated one are still transmitted
+    atto_eq(vcan_tx_packed(&bus, buf, len - 1, NULL), VCAN_INVALID_PACKED);
+    atto_eq((intptr_t) node.other_custom_data, 4);
+}
+
+static void test_rx_poll_compact(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[8];
+    err = vcan_rx_queue_init(&queue, storage, 8);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {
+            .rx_queue = &queue,
+    };
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t burst[4] = {
+            {.id = 1, .len = 8, .data = {1}},
+            {.id = 2, .len = 1, .data = {2}},
+            {.id = 3, .len = 12, .data = {3}},
+            {.id = 4, .len = 2, .data = {4}},
+    };
+    err = vcan_tx_burst(&bus, burst, 4, NULL);
+    atto_eq(err, VCAN_OK);
+    vcan_frame8_t frames[4];
+    uint8_t buf[VCAN_PACKED_SIZE(12) + 3];
+    vcan_msg_t msg;
+
+    atto_eq(vcan_rx_poll_frame8(NULL, frames, 4), 0);
+    atto_eq(vcan_rx_poll_frame8(&node, frames, 1), 1);
+    atto_eq(frames[0].id, 1);
+    atto_eq(frames[0].len, 8);
+    // Stops before the frame not fitting into 8 bytes
+    atto_eq(vcan_rx_poll_frame8(&node, frames, 4), 1);
+    atto_eq(frames[0].id, 2);
+    atto_eq(frames[0].data[0], 2);
+    atto_eq(vcan_rx_poll_frame8(&node, frames, 4), 0);
+    // Only as many frames as fit into the buffer
+    atto_eq(vcan_rx_poll_packed(&node, buf, sizeof(buf)),
+            VCAN_PACKED_SIZE(12));
+    atto_eq(vcan_unpack(&msg, buf, sizeof(buf)), VCAN_PACKED_SIZE(12));
+    atto_eq(msg.id, 3);
+    atto_eq(msg.data[0], 3);
+    atto_eq(vcan_rx_poll_packed(&node, buf, sizeof(buf)), VCAN_PACKED_SIZE(2));
+    atto_eq(vcan_unpack(&msg, buf, sizeof(buf)), VCAN_PACKED_SIZE(2));
+    atto_eq(msg.id, 4);
+    atto_eq(vcan_rx_poll_packed(&node, buf, sizeof(buf)), 0);
+}
+
+static uint64_t ticks_by_10(void* ctx)
+{
+    uint64_t* const ticks = ctx;
+    *ticks += 10;
+    return *ticks;
+}
+
+static void test_stats_null_args(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {.callback_on_rx = does_nothing};
+    vcan_bus_stats_t bus_stats;
+    vcan_node_stats_t node_stats;
+
+    atto_eq(vcan_set_clock(NULL, ticks_by_10, NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_get_stats(NULL, &bus_stats), VCAN_NULL_BUS);
+    atto_eq(vcan_get_stats(&bus, NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_get_node_stats(NULL, &node_stats), VCAN_NULL_NODE);
+    atto_eq(vcan_get_node_stats(&node, NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_get_stats(&bus, &bus_stats), VCAN_OK);
+    atto_eq(bus_stats.tx_frames, 0);
+    atto_eq(vcan_get_node_stats(&node, &node_stats), VCAN_OK);
+    atto_eq(node_stats.rx_frames, 0);
+}
+
+static void test_stats_counters(void)
+{
+#ifdef VCAN_STATS
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    uint64_t ticks = 0;
+    err = vcan_set_clock(&bus, ticks_by_10, &ticks);
+    atto_eq(err, VCAN_OK);
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[2];
+    err = vcan_rx_queue_init(&queue, storage, 2);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node_callback = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+    };
+    vcan_node_t node_burst = {
+            .callback_on_rx = counts_msgs,
+            .callback_on_rx_burst = counts_bursts,
+            .other_custom_data = NULL,
+    };
+    vcan_node_t node_queued = {
+            .rx_queue = &queue,
+    };
+    err = vcan_connect(&bus, &node_callback);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_burst);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_queued);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t msgs[3] = {
+            {.id = 1, .len = 8}, {.id = 2, .len = 2}, {.id = 3, .len = 0},
+    };
+    vcan_bus_stats_t bus_stats;
+    vcan_node_stats_t node_stats;
+
+    err = vcan_tx(&bus, &msgs[0], &node_burst);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx_burst(&bus, msgs, 3, NULL);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(vcan_get_stats(&bus, &bus_stats), VCAN_OK);
+    atto_eq(bus_stats.tx_frames, 4);
+    atto_eq(bus_stats.tx_bytes, 18);
+    // The queue of 2 already had a message
+    atto_eq(bus_stats.dropped, 2);
+    atto_eq(vcan_get_node_stats(&node_callback, &node_stats), VCAN_OK);
+    atto_eq(node_stats.rx_frames, 4);
+    atto_eq(node_stats.rx_bytes, 18);
+    // Each callback takes one clock tick
+    atto_eq(node_stats.callback_time, 4 * 10);
+    atto_eq(vcan_get_node_stats(&node_burst, &node_stats), VCAN_OK);
+    atto_eq(node_stats.rx_frames, 3);
+    atto_eq(node_stats.rx_bytes, 10);
+    atto_eq(node_stats.callback_time, 10);
+    atto_eq(vcan_get_node_stats(&node_queued, &node_stats), VCAN_OK);
+    atto_eq(node_stats.rx_frames, 2);
+    atto_eq(node_stats.rx_bytes, 16);
+    atto_eq(node_stats.callback_time, 0);
+    atto_eq(vcan_rx_overflows(&node_queued), 2);
+#endif
+}
+
+#define TRACE_PATH "testvcan_trace.bin"
+
+typedef struct
+{
+    vcan_msg_t msgs[8];
+    size_t count;
+} captured_msgs_t;
+
+static void captures_msgs(vcan_node_t* node, const vcan_msg_t* msg)
+{
+    captured_msgs_t* const captured = node->other_custom_data;
+    if (captured->count < 8)
+    {
+        captured->msgs[captured->count] = *msg;
+    }
+    captured->count++;
+}
+
+/** Transmit hook rejecting the messages with odd IDs. */
+static vcan_err_t rejects_odd_ids(void* const ctx,
+                                  const vcan_msg_t* const msg,
+                                  const vcan_node_t* const src_node)
+{
+    vcan_err_t err = VCAN_QUEUE_FULL;
+    if (msg->id % 2U == 0)
+    {
+        err = vcan_tx_direct((vcan_bus_t*) ctx, msg, src_node);
+    }
+    return err;
+}
+
+static void test_trace_invalid(void)
+{
+    vcan_trace_recorder_t recorder;
+    vcan_trace_replay_t replay;
+    uint8_t arena[2 * VCAN_TRACE_RECORD_MAX_LEN];
+
+    atto_eq(vcan_trace_recorder_open(NULL, TRACE_PATH, arena, sizeof(arena),
+                                     NULL, NULL), VCAN_NULL_NODE);
+    atto_eq(vcan_trace_recorder_open(&recorder, NULL, arena, sizeof(arena),
+                                     NULL, NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_trace_recorder_open(&recorder, TRACE_PATH, arena,
+                                     sizeof(arena) - 1, NULL, NULL),
+            VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_trace_recorder_open(&recorder, "no/such/dir/trace.bin",
+                                     arena, sizeof(arena), NULL, NULL),
+            VCAN_IO_FAILED);
+    atto_eq(vcan_trace_replay_open(NULL, TRACE_PATH), VCAN_NULL_STORAGE);
+    atto_eq(vcan_trace_replay_open(&replay, "no/such/trace.bin"),
+            VCAN_IO_FAILED);
+    FILE* const file = fopen(TRACE_PATH, "wb");
+    atto_neq(file, NULL);
+    fputs("NOTATRACE", file);
+    fclose(file);
+    atto_eq(vcan_trace_replay_open(&replay, TRACE_PATH), VCAN_INVALID_PACKED);
+    remove(TRACE_PATH);
+}
+
+static uint64_t ticks_by_1ms(void* ctx)
+{
+    uint64_t* const ticks = ctx;
+    *ticks += 1000000U;
+    return *ticks;
+}
+
+static void test_trace_record_and_replay(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_trace_recorder_t recorder;
+    // Small arena: forces several handovers to the flusher
+    uint8_t arena[2 * VCAN_TRACE_RECORD_MAX_LEN];
+    uint64_t ticks = 0;
+    err = vcan_trace_recorder_open(&recorder, TRACE_PATH, arena,
+                                   sizeof(arena), ticks_by_1ms, &ticks);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &recorder.node);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t msgs[4] = {
+            {.id = 1, .len = 64, .data = {1}},
+            {.id = 2, .len = 0},
+            {.id = 3, .len = 3, .data = {3, 3, 3}},
+            {.id = 4, .len = 8, .data = {4}},
+    };
+    err = vcan_tx(&bus, &msgs[0], NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx(&bus, &msgs[1], NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx_burst(&bus, &msgs[2], 2, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_disconnect(&bus, &recorder.node);
+    atto_eq(err, VCAN_OK);
+    err = vcan_trace_recorder_close(&recorder);
+    atto_eq(err, VCAN_OK);
+
+    captured_msgs_t captured = {.count = 0};
+    vcan_node_t node = {
+            .callback_on_rx = captures_msgs,
+            .other_custom_data = &captured,
+    };
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    vcan_trace_replay_t replay;
+    err = vcan_trace_replay_open(&replay, TRACE_PATH);
+    atto_eq(err, VCAN_OK);
+    err = vcan_trace_replay(&replay, &bus, VCAN_TRACE_FULL_SPEED, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(captured.count, 4);
+    for (size_t i = 0; i < 4; i++)
+    {
+        atto_eq(captured.msgs[i].id, msgs[i].id);
+        atto_eq(captured.msgs[i].len, msgs[i].len);
+        atto_memeq(captured.msgs[i].data, msgs[i].data, msgs[i].len);
+    }
+    // Nothing left to replay
+    err = vcan_trace_replay(&replay, &bus, VCAN_TRACE_FULL_SPEED, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(captured.count, 4);
+    err = vcan_trace_replay_close(&replay);
+    atto_eq(err, VCAN_OK);
+
+    // Recorded at 1, 2, 3, 3 ms: at least 2 ms of replay
+    captured.count = 0;
+    err = vcan_trace_replay_open(&replay, TRACE_PATH);
+    atto_eq(err, VCAN_OK);
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = vcan_trace_replay(&replay, &bus, VCAN_TRACE_REAL_TIME, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    atto_eq(err, VCAN_OK);
+    atto_eq(captured.count, 4);
+    const int64_t elapsed_ns = (int64_t) (end.tv_sec - start.tv_sec)
+                               * 1000000000 + (end.tv_nsec - start.tv_nsec);
+    atto_ge(elapsed_ns, 2000000);
+    err = vcan_trace_replay_close(&replay);
+    atto_eq(err, VCAN_OK);
+
+    // Rejected transmissions are reported, the replay goes on: batches at
+    // 1 ms {1}, 2 ms {2} and 3 ms {3, 4}, only the even one gets through
+    captured.count = 0;
+    err = vcan_set_tx_hook(&bus, rejects_odd_ids, &bus);
+    atto_eq(err, VCAN_OK);
+    err = vcan_trace_replay_open(&replay, TRACE_PATH);
+    atto_eq(err, VCAN_OK);
+    err = vcan_trace_replay(&replay, &bus, VCAN_TRACE_REAL_TIME, NULL);
+    atto_eq(err, VCAN_QUEUE_FULL);
+    atto_eq(captured.count, 1);
+    atto_eq(captured.msgs[0].id, 2);
+    atto_eq(replay.offset, replay.len);
+    err = vcan_trace_replay_close(&replay);
+    atto_eq(err, VCAN_OK);
+    remove(TRACE_PATH);
+}
+
+static void test_sched_invalid(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_sched_t sched;
+    vcan_sched_entry_t* heap[1];
+    vcan_sched_entry_t entries[2] = {{.msg = {.id = 1}}, {.msg = {.id = 2}}};
+
+    atto_eq(vcan_sched_init(NULL, &bus, heap, 1), VCAN_NULL_STORAGE);
+    atto_eq(vcan_sched_init(&sched, &bus, NULL, 1), VCAN_NULL_STORAGE);
+    atto_eq(vcan_sched_init(&sched, NULL, heap, 1), VCAN_NULL_BUS);
+    atto_eq(vcan_sched_init(&sched, &bus, heap, 0), VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_sched_init(&sched, &bus, heap, 1), VCAN_OK);
+    atto_eq(vcan_sched_add(NULL, &entries[0], 0, 0), VCAN_NULL_STORAGE);
+    atto_eq(vcan_sched_add(&sched, NULL, 0, 0), VCAN_NULL_MSG);
+    atto_eq(vcan_sched_add(&sched, &entries[0], 0, 0), VCAN_OK);
+    // Rescheduling takes no room, another entry does
+    atto_eq(vcan_sched_add(&sched, &entries[0], 5, 0), VCAN_OK);
+    atto_eq(vcan_sched_add(&sched, &entries[1], 0, 0), VCAN_QUEUE_FULL);
+    atto_eq(vcan_sched_cancel(NULL, &entries[0]), VCAN_NULL_STORAGE);
+    atto_eq(vcan_sched_cancel(&sched, NULL), VCAN_NULL_MSG);
+    atto_eq(vcan_sched_cancel(&sched, &entries[1]), VCAN_OK);
+    atto_eq(vcan_advance_time(NULL, 1), VCAN_NULL_STORAGE);
+}
+
+static void test_sched_periodic(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node_bursts = {
+            .callback_on_rx = counts_msgs,
+            .callback_on_rx_burst = counts_bursts,
+            .other_custom_data = NULL,
+    };
+    vcan_node_t node_msgs = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+    };
+    err = vcan_connect(&bus, &node_bursts);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &node_msgs);
+    atto_eq(err, VCAN_OK);
+    vcan_sched_t sched;
+    vcan_sched_entry_t* heap[4];
+    err = vcan_sched_init(&sched, &bus, heap, 4);
+    atto_eq(err, VCAN_OK);
+    vcan_sched_entry_t entries[4] = {
+            {.msg = {.id = 0x10}}, {.msg = {.id = 0x11}},
+            {.msg = {.id = 0x20}}, {.msg = {.id = 0x30}},
+    };
+    // Two 10 ms messages, one 20 ms message, one one-shot at 35 ms
+    atto_eq(vcan_sched_add(&sched, &entries[0], 10, 10), VCAN_OK);
+    atto_eq(vcan_sched_add(&sched, &entries[1], 10, 10), VCAN_OK);
+    atto_eq(vcan_sched_add(&sched, &entries[2], 20, 20), VCAN_OK);
+    atto_eq(vcan_sched_add(&sched, &entries[3], 35, 0), VCAN_OK);
+
+    atto_eq(vcan_advance_time(&sched, 9), VCAN_OK);
+    atto_eq(node_msgs.other_custom_data, NULL);
+    atto_eq(vcan_advance_time(&sched, 1), VCAN_OK);
+    // Both 10 ms messages in one burst
+    atto_eq((intptr_t) node_msgs.other_custom_data, 2);
+    atto_eq((intptr_t) node_bursts.other_custom_data, 200);
+    atto_eq(bus.received_msg.id, 0x11);
+    atto_eq(vcan_advance_time(&sched, 90), VCAN_OK);
+    // 10 x 2 + 5 x 1 + 1
+    atto_eq((intptr_t) node_msgs.other_custom_data, 26);
+    atto_eq(sched.now, 100);
+    atto_eq(sched.len, 3);
+    atto_eq(vcan_sched_cancel(&sched, &entries[0]), VCAN_OK);
+    atto_eq(vcan_sched_cancel(&sched, &entries[2]), VCAN_OK);
+    atto_eq(vcan_advance_time(&sched, 30), VCAN_OK);
+    atto_eq((intptr_t) node_msgs.other_custom_data, 29);
+    atto_eq(bus.received_msg.id, 0x11);
+}
+
+static void test_sched_tx_errors(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+    };
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    err = vcan_set_tx_hook(&bus, rejects_odd_ids, &bus);
+    atto_eq(err, VCAN_OK);
+    vcan_sched_t sched;
+    vcan_sched_entry_t* heap[2];
+    err = vcan_sched_init(&sched, &bus, heap, 2);
+    atto_eq(err, VCAN_OK);
+    vcan_sched_entry_t entries[2] = {{.msg = {.id = 1}}, {.msg = {.id = 2}}};
+    atto_eq(vcan_sched_add(&sched, &entries[0], 1, 10), VCAN_OK);
+    atto_eq(vcan_sched_add(&sched, &entries[1], 2, 10), VCAN_OK);
+
+    // The failure is reported, the later transmission still happens
+    atto_eq(vcan_advance_time(&sched, 5), VCAN_QUEUE_FULL);
+    atto_eq((intptr_t) node.other_custom_data, 1);
+    atto_eq(sched.now, 5);
+    atto_eq(sched.len, 2);
+    atto_eq(vcan_advance_time(&sched, 1), VCAN_OK);
+    err = vcan_set_tx_hook(&bus, NULL, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_advance_time(&sched, 10), VCAN_OK);
+    atto_eq((intptr_t) node.other_custom_data, 3);
+}
+
+static uint64_t last_rx_time;
+static uint32_t rx_time_regressions;
+
+static void checks_sched_time(vcan_node_t* node, const vcan_msg_t* msg)
+{
+    const uint64_t now = node->bus->clock_now(node->bus->clock_ctx);
+    // The message ID is its period: must arrive at a multiple of it
+    if (now < last_rx_time || now % msg->id != 0)
+    {
+        rx_time_regressions++;
+    }
+    last_rx_time = now;
+}
+
+static void test_sched_many_in_time_order(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    static vcan_sched_t sched;
+    static vcan_sched_entry_t* heap[500];
+    static vcan_sched_entry_t entries[500];
+    err = vcan_sched_init(&sched, &bus, heap, 500);
+    atto_eq(err, VCAN_OK);
+    err = vcan_set_clock(&bus, vcan_sched_clock, &sched);
+    atto_eq(err, VCAN_OK);
+    last_rx_time = 0;
+    rx_time_regressions = 0;
+    vcan_node_t node = {.callback_on_rx = checks_sched_time};
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    for (uint32_t i = 0; i < 500; i++)
+    {
+        entries[i].msg.id = 1U + (i * 7U) % 97U;
+        err = vcan_sched_add(&sched, &entries[i], entries[i].msg.id,
+                             entries[i].msg.id);
+        atto_eq(err, VCAN_OK);
+    }
+
+    for (uint32_t step = 0; step < 100; step++)
+    {
+        err = vcan_advance_time(&sched, 7);
+        atto_eq(err, VCAN_OK);
+    }
+
+    atto_eq(rx_time_regressions, 0);
+    atto_eq(vcan_sched_clock(&sched), 700);
+    atto_eq(sched.len, 500);
+}
+
+static void test_arb_wire_time(void)
+{
+    const vcan_msg_t empty = {.id = 0x100, .len = 0};
+    const vcan_msg_t classic = {.id = 0x100, .len = 8};
+    const vcan_msg_t extended = {.id = 0x18DAF110, .len = 8};
+    const vcan_msg_t fd = {.id = 0x100, .len = 64};
+    const vcan_msg_t padded = {.id = 0x100, .len = 33};
+
+    // Worst-case classic frames: 55 and 135 bits, 160 bits extended
+    atto_eq(vcan_arb_wire_time(500000, 0, &empty), 110000);
+    atto_eq(vcan_arb_wire_time(500000, 0, &classic), 270000);
+    atto_eq(vcan_arb_wire_time(500000, 0, &extended), 320000);
+    // CAN FD: faster data phase, padding to the next valid length
+    atto_lt(vcan_arb_wire_time(500000, 2000000, &fd),
+            vcan_arb_wire_time(500000, 0, &fd));
+    atto_eq(vcan_arb_wire_time(500000, 2000000, &padded),
+            vcan_arb_wire_time(500000, 2000000, &(vcan_msg_t) {.len = 48}));
+    atto_eq(vcan_arb_wire_time(0, 0, &classic), 0);
+    atto_eq(vcan_arb_wire_time(500000, 0, NULL), 0);
+}
+
+static void test_arb_invalid(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_arb_t arb;
+    vcan_arb_slot_t slots[1];
+
+    atto_eq(vcan_arb_init(NULL, &bus, slots, 1, 500000, 0), VCAN_NULL_STORAGE);
+    atto_eq(vcan_arb_init(&arb, &bus, NULL, 1, 500000, 0), VCAN_NULL_STORAGE);
+    atto_eq(vcan_arb_init(&arb, NULL, slots, 1, 500000, 0), VCAN_NULL_BUS);
+    atto_eq(vcan_arb_init(&arb, &bus, slots, 0, 500000, 0),
+            VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_arb_init(&arb, &bus, slots, 1, 0, 0), VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_arb_advance(NULL, 1), VCAN_NULL_STORAGE);
+    atto_eq(vcan_arb_deinit(NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_set_tx_hook(NULL, NULL, NULL), VCAN_NULL_BUS);
+}
+
+static void test_arb_priority_order(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    captured_msgs_t captured = {.count = 0};
+    vcan_node_t node = {
+            .callback_on_rx = captures_msgs,
+            .other_custom_data = &captured,
+    };
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    vcan_arb_t arb;
+    vcan_arb_slot_t slots[4];
+    err = vcan_arb_init(&arb, &bus, slots, 4, 500000, 0);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t msgs[4] = {
+            {.id = 0x300, .len = 0}, {.id = 0x100, .len = 0},
+            {.id = 0x200, .len = 0}, {.id = 0x100, .len = 1, .data = {1}},
+    };
+    vcan_msg_t late = {.id = 0x050, .len = 0};
+
+    err = vcan_tx_burst(&bus, msgs, 4, NULL);
+    atto_eq(err, VCAN_OK);
+    // Only queued, the pool is full
+    atto_eq(captured.count, 0);
+    atto_eq(vcan_arb_pending(&arb), 4);
+    atto_eq(vcan_tx(&bus, &late, NULL), VCAN_QUEUE_FULL);
+
+    // The first 0x100 is on the wire for 110 us
+    atto_eq(vcan_arb_advance(&arb, 109999), VCAN_OK);
+    atto_eq(captured.count, 0);
+    atto_eq(vcan_tx(&bus, &late, NULL), VCAN_QUEUE_FULL);
+    atto_eq(vcan_arb_advance(&arb, 1), VCAN_OK);
+    atto_eq(captured.count, 1);
+    atto_eq(captured.msgs[0].id, 0x100);
+    atto_eq(captured.msgs[0].len, 0);
+    // The second 0x100 is on the wire, a higher priority cannot preempt it
+    atto_eq(vcan_tx(&bus, &late, NULL), VCAN_OK);
+    atto_eq(vcan_arb_advance(&arb, 1000000), VCAN_OK);
+    atto_eq(captured.count, 5);
+    atto_eq(captured.msgs[1].id, 0x100);
+    atto_eq(captured.msgs[1].len, 1);
+    atto_eq(captured.msgs[2].id, 0x050);
+    atto_eq(captured.msgs[3].id, 0x200);
+    atto_eq(captured.msgs[4].id, 0x300);
+    atto_eq(vcan_arb_pending(&arb), 0);
+    atto_eq(vcan_arb_busy_time(&arb), 110000 * 4 + 130000);
+    atto_eq(vcan_arb_clock(&arb), 1110000);
+
+    err = vcan_arb_deinit(&arb);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx(&bus, &late, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(captured.count, 6);
+}
+
+static void test_gw_invalid(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_bus_t* buses[2] = {&bus, NULL};
+    vcan_gw_t gw;
+    vcan_gw_pending_t fifo[1];
+    const vcan_gw_route_t unsorted[2] = {
+            {.src_bus = 0, .id = 2}, {.src_bus = 0, .id = 1},
+    };
+
+    atto_eq(vcan_gw_init(NULL, buses, 1, NULL, 0, fifo, 1), VCAN_NULL_STORAGE);
+    atto_eq(vcan_gw_init(&gw, NULL, 1, NULL, 0, fifo, 1), VCAN_NULL_STORAGE);
+    atto_eq(vcan_gw_init(&gw, buses, 1, NULL, 0, NULL, 1), VCAN_NULL_STORAGE);
+    atto_eq(vcan_gw_init(&gw, buses, 1, NULL, 1, fifo, 1), VCAN_NULL_FILTER);
+    atto_eq(vcan_gw_init(&gw, buses, 0, NULL, 0, fifo, 1),
+            VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_gw_init(&gw, buses, 33, NULL, 0, fifo, 1),
+            VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_gw_init(&gw, buses, 1, NULL, 0, fifo, 0),
+            VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_gw_init(&gw, buses, 2, NULL, 0, fifo, 1), VCAN_NULL_BUS);
+    atto_eq(vcan_gw_init(&gw, buses, 1, unsorted, 2, fifo, 1),
+            VCAN_UNSORTED_FILTER);
+    atto_eq(vcan_gw_deinit(NULL), VCAN_NULL_STORAGE);
+    // The same bus twice: the port of the failed connection is not left over
+    buses[1] = &bus;
+    atto_eq(vcan_gw_init(&gw, buses, 2, NULL, 0, fifo, 1), VCAN_OK);
+    atto_eq(bus.connected, 2);
+    atto_eq(vcan_gw_deinit(&gw), VCAN_OK);
+    atto_eq(bus.connected, 0);
+}
+
+static void test_gw_routing(void)
+{
+    vcan_bus_t bus[3];
+    vcan_bus_t* buses[3] = {&bus[0], &bus[1], &bus[2]};
+    captured_msgs_t captured[3] = {{.count = 0}, {.count = 0}, {.count = 0}};
+    vcan_node_t nodes[3];
+    memset(nodes, 0, sizeof(nodes));
+    for (size_t i = 0; i < 3; i++)
+    {
+        atto_eq(vcan_init(&bus[i]), VCAN_OK);
+        nodes[i].callback_on_rx = captures_msgs;
+        nodes[i].other_custom_data = &captured[i];
+        atto_eq(vcan_connect(&bus[i], &nodes[i]), VCAN_OK);
+    }
+    const vcan_gw_route_t routes[3] = {
+            // Back to the source bus is ignored
+            {.src_bus = 0, .id = 0x100, .dst_mask = 0x7, .new_id = 0x500},
+            {.src_bus = 0, .id = 0x101, .dst_mask = 0x2,
+                    .new_id = VCAN_GW_SAME_ID},
+            {.src_bus = 1, .id = 0x200, .dst_mask = 0x1,
+                    .new_id = VCAN_GW_SAME_ID},
+    };
+    vcan_gw_t gw;
+    vcan_gw_pending_t fifo[1];
+    vcan_err_t err = vcan_gw_init(&gw, buses, 3, routes, 3, fifo, 1);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t msg_routed = {.id = 0x100, .len = 2, .data = {1, 2}};
+    const vcan_msg_t msg_not_routed = {.id = 0x200, .len = 0};
+    const vcan_msg_t msg_back = {.id = 0x200, .len = 1, .data = {9}};
+
+    err = vcan_tx(&bus[0], &msg_routed, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(captured[0].count, 1);
+    atto_eq(captured[0].msgs[0].id, 0x100);
+    atto_eq(captured[1].count, 1);
+    atto_eq(captured[1].msgs[0].id, 0x500);
+    atto_eq(captured[1].msgs[0].len, 2);
+    atto_eq(captured[1].msgs[0].data[1], 2);
+    atto_eq(captured[2].count, 1);
+    atto_eq(captured[2].msgs[0].id, 0x500);
+    err = vcan_tx(&bus[0], &msg_not_routed, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(captured[1].count, 1);
+    err = vcan_tx(&bus[1], &msg_back, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(captured[0].count, 3);
+    atto_eq(captured[0].msgs[2].id, 0x200);
+    atto_eq(captured[0].msgs[2].data[0], 9);
+    atto_eq(captured[1].count, 2);
+    atto_eq(captured[2].count, 1);
+
+    // A burst of 2 routed messages does not fit into a FIFO of 1
+    const vcan_msg_t burst[2] = {{.id = 0x100}, {.id = 0x101}};
+    err = vcan_tx_burst(&bus[0], burst, 2, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(captured[1].count, 3);
+    atto_eq(captured[1].msgs[2].id, 0x500);
+    atto_eq(vcan_gw_dropped(&gw), 1);
+    atto_eq(vcan_gw_deinit(&gw), VCAN_OK);
+}
+
+static void test_gw_loop_guard(void)
+{
+    vcan_bus_t bus[2];
+    vcan_bus_t* buses_a[2] = {&bus[0], &bus[1]};
+    vcan_bus_t* buses_b[2] = {&bus[1], &bus[0]};
+    vcan_node_t nodes[2] = {
+            {.callback_on_rx = counts_msgs, .other_custom_data = NULL},
+            {.callback_on_rx = counts_msgs, .other_custom_data = NULL},
+    };
+    for (size_t i = 0; i < 2; i++)
+    {
+        atto_eq(vcan_init(&bus[i]), VCAN_OK);
+        atto_eq(vcan_connect(&bus[i], &nodes[i]), VCAN_OK);
+    }
+    // Both gateways forward from their bus 0 to their bus 1: a loop
+    const vcan_gw_route_t route = {
+            .src_bus = 0, .id = 0x10, .dst_mask = 0x2,
+            .new_id = VCAN_GW_SAME_ID,
+    };
+    vcan_gw_t gw_a;
+    vcan_gw_t gw_b;
+    vcan_gw_pending_t fifo_a[4];
+    vcan_gw_pending_t fifo_b[4];
+    vcan_err_t err = vcan_gw_init(&gw_a, buses_a, 2, &route, 1, fifo_a, 4);
+    atto_eq(err, VCAN_OK);
+    err = vcan_gw_init(&gw_b, buses_b, 2, &route, 1, fifo_b, 4);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t msg = {.id = 0x10};
+
+    err = vcan_tx(&bus[0], &msg, NULL);
+
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_gw_dropped(&gw_a) + vcan_gw_dropped(&gw_b), 1);
+    atto_eq((intptr_t) nodes[1].other_custom_data, VCAN_GW_MAX_HOPS);
+    atto_eq((intptr_t) nodes[0].other_custom_data, VCAN_GW_MAX_HOPS + 1);
+    atto_eq(vcan_gw_deinit(&gw_a), VCAN_OK);
+    atto_eq(vcan_gw_deinit(&gw_b), VCAN_OK);
+}
+
+static void test_deferred_invalid(void)
+{
+    vcan_bus_t bus;
+    vcan_deferred_t fifo[1];
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(vcan_set_deferred(NULL, fifo, 1), VCAN_NULL_BUS);
+    atto_eq(vcan_set_deferred(&bus, fifo, 0), VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_set_deferred(&bus, fifo, 1), VCAN_OK);
+    atto_eq(vcan_set_deferred(&bus, NULL, 0), VCAN_OK);
+    atto_eq(bus.deferred, NULL);
+}
+
+/** State of the node answering each message with the next CAN ID. */
+typedef struct
+{
+    vcan_bus_t* bus;
+    uint32_t last_id;
+    size_t depth;
+    size_t max_depth;
+    size_t burst_len;
+    vcan_err_t last_err;
+} responder_t;
+
+static void responds_with_next_id(vcan_node_t* node, const vcan_msg_t* msg)
+{
+    responder_t* const responder = node->other_custom_data;
+    responder->depth++;
+    if (responder->depth > responder->max_depth)
+    {
+        responder->max_depth = responder->depth;
+    }
+    if (msg->id < responder->last_id)
+    {
+        const vcan_msg_t answers[2] = {
+                {.id = msg->id + 1U, .len = 1, .data = {(uint8_t) msg->id}},
+                {.id = msg->id + 1U},
+        };
+        // Without source node, so the answer is answered to as well
+        responder->last_err = responder->burst_len > 1
+                              ? vcan_tx_burst(responder->bus, answers,
+                                              responder->burst_len, NULL)
+                              : vcan_tx(responder->bus, answers, NULL);
+    }
+    responder->depth--;
+}
+
+static void test_deferred_response_chain(void)
+{
+    vcan_bus_t bus;
+    vcan_deferred_t fifo[2];
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    err = vcan_set_deferred(&bus, fifo, 2);
+    atto_eq(err, VCAN_OK);
+    responder_t responder = {.bus = &bus, .last_id = 100, .burst_len = 1};
+    vcan_node_t responding = {
+            .callback_on_rx = responds_with_next_id,
+            .other_custom_data = &responder,
+    };
+    captured_msgs_t captured = {.count = 0};
+    vcan_node_t observer = {
+            .callback_on_rx = captures_msgs,
+            .other_custom_data = &captured,
+    };
+    atto_eq(vcan_connect(&bus, &responding), VCAN_OK);
+    atto_eq(vcan_connect(&bus, &observer), VCAN_OK);
+    const vcan_msg_t request = {.id = 0, .len = 0};
+
+    err = vcan_tx(&bus, &request, NULL);
+
+    // Delivered in order, one at a time, without recursion
+    atto_eq(err, VCAN_OK);
+    atto_eq(responder.last_err, VCAN_OK);
+    atto_eq(responder.max_depth, 1);
+    atto_eq(captured.count, 101);
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        atto_eq(captured.msgs[i].id, i);
+    }
+    atto_eq(captured.msgs[2].data[0], 1);
+    atto_eq(bus.received_msg.id, 100);
+    atto_eq(bus.deferred_len, 0);
+    atto_false(bus.delivering);
+}
+
+static void test_deferred_full(void)
+{
+    vcan_bus_t bus;
+    vcan_deferred_t fifo[1];
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    err = vcan_set_deferred(&bus, fifo, 1);
+    atto_eq(err, VCAN_OK);
+    responder_t responder = {.bus = &bus, .last_id = 5, .burst_len = 2};
+    vcan_node_t responding = {
+            .callback_on_rx = responds_with_next_id,
+            .other_custom_data = &responder,
+    };
+    vcan_node_t counting = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+    };
+    atto_eq(vcan_connect(&bus, &responding), VCAN_OK);
+    atto_eq(vcan_connect(&bus, &counting), VCAN_OK);
+    const vcan_msg_t request = {.id = 0, .len = 0};
+
+    // A burst of 2 does not fit at all
+    err = vcan_tx(&bus, &request, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(responder.last_err, VCAN_QUEUE_FULL);
+    atto_eq((intptr_t) counting.other_custom_data, 1);
+
+    // The same FIFO fits the chain of single messages
+    responder.burst_len = 1;
+    err = vcan_tx(&bus, &request, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(responder.last_err, VCAN_OK);
+    atto_eq((intptr_t) counting.other_custom_data, 1 + 6);
+}
+
+static void records_has_next(vcan_node_t* node, const vcan_msg_t* msg)
+{
+    bool* const has_next = node->other_custom_data;
+    has_next[msg->id] = vcan_mt_has_next(&mt_bus);
+}
+
+static void test_mt_has_next(void)
+{
+    vcan_err_t err = vcan_mt_init(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    bool has_next[3] = {false, false, true};
+    vcan_node_t node = {
+            .callback_on_rx = records_has_next,
+            .other_custom_data = has_next,
+    };
+    err = vcan_mt_connect(&mt_bus, &node);
+    atto_eq(err, VCAN_OK);
+    for (uint32_t id = 0; id < 3; id++)
+    {
+        const vcan_msg_t msg = {.id = id, .len = 0};
+        err = vcan_mt_tx(&mt_bus, &msg, NULL);
+        atto_eq(err, VCAN_OK);
+    }
+
+    // All queued before starting: only the last one has nothing behind
+    err = vcan_mt_start(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    err = vcan_mt_stop(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    atto_assert(has_next[0]);
+    atto_assert(has_next[1]);
+    atto_false(has_next[2]);
+    err = vcan_mt_deinit(&mt_bus);
+    atto_eq(err, VCAN_OK);
+}
+
+#ifdef __linux__
+static void test_socketcan_invalid(void)
+{
+    vcan_socketcan_t bridge;
+    vcan_err_t err = vcan_mt_init(&mt_bus);
+    atto_eq(err, VCAN_OK);
+
+    err = vcan_socketcan_open(NULL, &mt_bus, "vcan0");
+    atto_eq(err, VCAN_NULL_NODE);
+    err = vcan_socketcan_open(&bridge, NULL, "vcan0");
+    atto_eq(err, VCAN_NULL_BUS);
+    err = vcan_socketcan_open(&bridge, &mt_bus, NULL);
+    atto_eq(err, VCAN_NULL_STORAGE);
+    err = vcan_socketcan_open(&bridge, &mt_bus, "vcannotexisting");
+    atto_eq(err, VCAN_IO_FAILED);
+    atto_eq(mt_bus.bus.connected, 0);
+    atto_eq(vcan_socketcan_close(NULL), VCAN_NULL_NODE);
+    err = vcan_mt_deinit(&mt_bus);
+    atto_eq(err, VCAN_OK);
+}
+
+static vcan_bus_mt_t mt_bus_remote;
+
+/** Runs only where the `vcan0` interface exists, e.g. after
+ * `ip link add dev vcan0 type vcan && ip link set up vcan0`. */
+static void test_socketcan_bridge(void)
+{
+    if (if_nametoindex("vcan0") == 0)
+    {
+        return;
+    }
+    vcan_socketcan_t bridge;
+    vcan_socketcan_t bridge_remote;
+    vcan_node_t counting = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+    };
+    atto_eq(vcan_mt_init(&mt_bus), VCAN_OK);
+    atto_eq(vcan_mt_init(&mt_bus_remote), VCAN_OK);
+    atto_eq(vcan_mt_connect(&mt_bus_remote, &counting), VCAN_OK);
+    atto_eq(vcan_mt_start(&mt_bus), VCAN_OK);
+    atto_eq(vcan_mt_start(&mt_bus_remote), VCAN_OK);
+    // Both bridges on the same interface: one sees the frames of the other
+    atto_eq(vcan_socketcan_open(&bridge, &mt_bus, "vcan0"), VCAN_OK);
+    atto_eq(vcan_socketcan_open(&bridge_remote, &mt_bus_remote, "vcan0"),
+            VCAN_OK);
+    const vcan_msg_t msgs[3] = {
+            {.id = 0x123, .len = 2, .data = {1, 2}},
+            {.id = 0x1ABCDEF, .len = 8},
+            {.id = 0x7FF, .len = 0},
+    };
+
+    for (size_t i = 0; i < 3; i++)
+    {
+        atto_eq(vcan_mt_tx(&mt_bus, &msgs[i], NULL), VCAN_OK);
+    }
+    for (size_t wait = 0; wait < 1000
+                          && (intptr_t) counting.other_custom_data < 3; wait++)
+    {
+        const struct timespec interval = {.tv_sec = 0, .tv_nsec = 1000000};
+        nanosleep(&interval, NULL);
+    }
+
+    atto_eq(vcan_socketcan_close(&bridge), VCAN_OK);
+    atto_eq(vcan_socketcan_close(&bridge_remote), VCAN_OK);
+    atto_eq(vcan_mt_deinit(&mt_bus), VCAN_OK);
+    atto_eq(vcan_mt_deinit(&mt_bus_remote), VCAN_OK);
+    atto_eq((intptr_t) counting.other_custom_data, 3);
+    atto_eq(vcan_socketcan_tx_dropped(&bridge), 0);
+    atto_eq(vcan_socketcan_rx_dropped(&bridge_remote), 0);
+}
+#endif
+
+static void test_net_invalid(void)
+{
+    vcan_net_t net;
+    vcan_net_stats_t stats;
+    vcan_err_t err = vcan_mt_init(&mt_bus);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(vcan_net_shm_open(NULL, &mt_bus, "/x"), VCAN_NULL_NODE);
+    atto_eq(vcan_net_shm_open(&net, NULL, "/x"), VCAN_NULL_BUS);
+    atto_eq(vcan_net_shm_open(&net, &mt_bus, NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_net_shm_open(&net, &mt_bus, "/in/valid"), VCAN_IO_FAILED);
+    atto_eq(vcan_net_udp_open(NULL, &mt_bus, "239.0.0.1", 1), VCAN_NULL_NODE);
+    atto_eq(vcan_net_udp_open(&net, NULL, "239.0.0.1", 1), VCAN_NULL_BUS);
+    atto_eq(vcan_net_udp_open(&net, &mt_bus, NULL, 1), VCAN_NULL_STORAGE);
+    atto_eq(vcan_net_udp_open(&net, &mt_bus, "239.0.0.1", 0),
+            VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_net_udp_open(&net, &mt_bus, "not an address", 1),
+            VCAN_IO_FAILED);
+    atto_eq(mt_bus.bus.connected, 0);
+    atto_eq(vcan_net_close(NULL), VCAN_NULL_NODE);
+    atto_eq(vcan_net_get_stats(NULL, &stats), VCAN_NULL_NODE);
+    atto_eq(vcan_net_get_stats(&net, NULL), VCAN_NULL_STORAGE);
+    err = vcan_mt_deinit(&mt_bus);
+    atto_eq(err, VCAN_OK);
+}
+
+static vcan_bus_mt_t mt_bus_net;
+
+/** Sends messages over the link pair, as if they were two processes. */
+static void checks_net_link_pair(vcan_net_t* const net,
+                                 vcan_net_t* const net_remote)
+{
+    captured_msgs_t captured = {.count = 0};
+    vcan_node_t local = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+    };
+    vcan_node_t remote = {
+            .callback_on_rx = captures_msgs,
+            .other_custom_data = &captured,
+    };
+    atto_eq(vcan_mt_connect(&mt_bus, &local), VCAN_OK);
+    atto_eq(vcan_mt_connect(&mt_bus_net, &remote), VCAN_OK);
+    const vcan_msg_t msgs[3] = {
+            {.id = 0x10, .len = 2, .data = {1, 2}},
+            {.id = 0x11, .len = 64, .data = {3}},
+            {.id = 0x12, .len = 0},
+    };
+
+    for (size_t i = 0; i < 3; i++)
+    {
+        atto_eq(vcan_mt_tx(&mt_bus, &msgs[i], NULL), VCAN_OK);
+    }
+    atto_eq(vcan_mt_flush(&mt_bus), VCAN_OK);
+    vcan_net_stats_t stats;
+    vcan_net_stats_t stats_remote = {.rx_datagrams = 0};
+    atto_eq(vcan_net_get_stats(net, &stats), VCAN_OK);
+    for (size_t wait = 0; wait < 2000
+                          && stats_remote.rx_datagrams < stats.tx_datagrams;
+         wait++)
+    {
+        const struct timespec interval = {.tv_sec = 0, .tv_nsec = 1000000};
+        nanosleep(&interval, NULL);
+        atto_eq(vcan_net_get_stats(net_remote, &stats_remote), VCAN_OK);
+    }
+    atto_eq(vcan_mt_flush(&mt_bus_net), VCAN_OK);
+
+    atto_eq(captured.count, 3);
+    atto_eq(captured.msgs[0].id, 0x10);
+    atto_eq(captured.msgs[0].data[1], 2);
+    atto_eq(captured.msgs[1].len, 64);
+    atto_eq(captured.msgs[1].data[0], 3);
+    atto_eq(captured.msgs[2].id, 0x12);
+    // Not echoed back to the transmitting process
+    atto_eq((intptr_t) local.other_custom_data, 3);
+    atto_eq(vcan_net_get_stats(net_remote, &stats), VCAN_OK);
+    atto_ge(stats.rx_datagrams, 1);
+    atto_eq(stats.lost, 0);
+    atto_eq(stats.dropped, 0);
+    atto_eq(vcan_net_get_stats(net, &stats), VCAN_OK);
+    atto_eq(stats.rx_datagrams, 0);
+    atto_ge(stats.tx_datagrams, 1);
+    atto_le(stats.tx_datagrams, 3);
+    atto_eq(vcan_net_close(net), VCAN_OK);
+    atto_eq(vcan_net_close(net_remote), VCAN_OK);
+}
+
+static void starts_net_buses(void)
+{
+    atto_eq(vcan_mt_init(&mt_bus), VCAN_OK);
+    atto_eq(vcan_mt_init(&mt_bus_net), VCAN_OK);
+    atto_eq(vcan_mt_start(&mt_bus), VCAN_OK);
+    atto_eq(vcan_mt_start(&mt_bus_net), VCAN_OK);
+}
+
+static void stops_net_buses(void)
+{
+    atto_eq(vcan_mt_deinit(&mt_bus), VCAN_OK);
+    atto_eq(vcan_mt_deinit(&mt_bus_net), VCAN_OK);
+}
+
+static void test_net_shm(void)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/vcan-test-%ld", (long) getpid());
+    vcan_net_t net;
+    vcan_net_t net_remote;
+    starts_net_buses();
+    atto_eq(vcan_net_shm_open(&net, &mt_bus, name), VCAN_OK);
+    atto_eq(vcan_net_shm_open(&net_remote, &mt_bus_net, name), VCAN_OK);
+
+    checks_net_link_pair(&net, &net_remote);
+
+    stops_net_buses();
+    atto_eq(shm_unlink(name), 0);
+}
+
+/** Skipped where the host has no multicast route. */
+static void test_net_udp(void)
+{
+    vcan_net_t net;
+    vcan_net_t net_remote;
+    starts_net_buses();
+    vcan_err_t err = vcan_net_udp_open(&net, &mt_bus, "239.255.0.42", 47000);
+    if (err == VCAN_OK)
+    {
+        atto_eq(vcan_net_udp_open(&net_remote, &mt_bus_net, "239.255.0.42",
+                                  47000), VCAN_OK);
+        checks_net_link_pair(&net, &net_remote);
+    }
+    stops_net_buses();
+}
+
+static void test_par_invalid(void)
+{
+    static vcan_par_t pool;
+    vcan_bus_t bus;
+    vcan_node_t* order[4];
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(vcan_par_init(NULL, &bus, order, 4, 2, NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_par_init(&pool, NULL, order, 4, 2, NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_par_init(&pool, &bus, NULL, 4, 2, NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_par_init(&pool, &bus, order, 0, 2, NULL),
+            VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_par_init(&pool, &bus, order, 4, 0, NULL),
+            VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_par_init(&pool, &bus, order, 4, VCAN_PAR_MAX_WORKERS + 1U,
+                          NULL), VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_par_deinit(NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_set_fanout(NULL, NULL, NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_tx_to(NULL, NULL, NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_tx_to(&bus, NULL, NULL), VCAN_NULL_NODE);
+    atto_eq(vcan_tx_to(&bus, (vcan_node_t*) order, NULL), VCAN_NULL_MSG);
+}
+
+/** Amount of nodes of the parallel delivery tests. */
+#define PAR_NODES 40U
+
+static vcan_node_t* par_table[PAR_NODES];
+
+typedef struct
+{
+    atomic_uint_least32_t received;
+    pthread_t last_thread;
+    atomic_bool moved;
+} par_record_t;
+
+static void records_par_delivery(vcan_node_t* const node,
+                                 const vcan_msg_t* const msg)
+{
+    par_record_t* const record = node->other_custom_data;
+    const pthread_t self = pthread_self();
+    if (atomic_fetch_add(&record->received, 1U) > 0
+        && !pthread_equal(record->last_thread, self))
+    {
+        atomic_store(&record->moved, true);
+    }
+    record->last_thread = self;
+    (void) msg;
+}
+
+static void connects_par_nodes(vcan_bus_t* const bus,
+                               vcan_node_t* const nodes,
+                               par_record_t* const records,
+                               const uint32_t workers)
+{
+    vcan_err_t err = vcan_init_ex(bus, par_table, PAR_NODES);
+    atto_eq(err, VCAN_OK);
+    for (uint32_t i = 0; i < PAR_NODES; i++)
+    {
+        memset(&nodes[i], 0, sizeof(vcan_node_t));
+        atomic_init(&records[i].received, 0U);
+        atomic_init(&records[i].moved, false);
+        nodes[i].callback_on_rx = records_par_delivery;
+        nodes[i].other_custom_data = &records[i];
+        // Every other node bound to a worker
+        nodes[i].affinity = i % 2U == 0U ? i / 2U % workers + 1U : 0U;
+        err = vcan_connect(bus, &nodes[i]);
+        atto_eq(err, VCAN_OK);
+    }
+}
+
+static void test_par_delivers_all_once(void)
+{
+    static vcan_par_t pool;
+    static vcan_node_t* order[PAR_NODES];
+    static vcan_node_t nodes[PAR_NODES];
+    static par_record_t records[PAR_NODES];
+    vcan_bus_t bus;
+    connects_par_nodes(&bus, nodes, records, 4);
+    vcan_err_t err = vcan_par_init(&pool, &bus, order, PAR_NODES, 4, NULL);
+    atto_eq(err, VCAN_OK);
+
+    const vcan_msg_t msg = {.id = 0x10, .len = 1, .data = {0xAB}};
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        err = vcan_tx(&bus, &msg, &nodes[3]);
+        atto_eq(err, VCAN_OK);
+    }
+    const vcan_msg_t burst[2] = {{.id = 0x11}, {.id = 0x12}};
+    err = vcan_tx_burst(&bus, burst, 2, &nodes[3]);
+    atto_eq(err, VCAN_OK);
+    err = vcan_par_deinit(&pool);
+    atto_eq(err, VCAN_OK);
+
+    for (uint32_t i = 0; i < PAR_NODES; i++)
+    {
+        atto_eq(atomic_load(&records[i].received), i == 3 ? 0U : 102U);
+        // Bound nodes never leave their worker
+        if (nodes[i].affinity > 0)
+        {
+            atto_false(atomic_load(&records[i].moved));
+        }
+    }
+    atto_eq(bus.received_msg.id, 0x12);
+    // Serial again once deinitialised
+    err = vcan_tx(&bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(atomic_load(&records[3].received), 1U);
+}
+
+static void test_par_serial_when_over_capacity(void)
+{
+    static vcan_par_t pool;
+    static vcan_node_t* order[PAR_NODES / 2U];
+    static vcan_node_t nodes[PAR_NODES];
+    static par_record_t records[PAR_NODES];
+    vcan_bus_t bus;
+    connects_par_nodes(&bus, nodes, records, 2);
+    vcan_err_t err = vcan_par_init(&pool, &bus, order, PAR_NODES / 2U, 2,
+                                   NULL);
+    atto_eq(err, VCAN_OK);
+
+    const vcan_msg_t msg = {.id = 0x20, .len = 0};
+    err = vcan_tx(&bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    for (uint32_t i = 0; i < PAR_NODES; i++)
+    {
+        atto_eq(atomic_load(&records[i].received), 1U);
+        atto_false(atomic_load(&records[i].moved));
+    }
+    err = vcan_par_deinit(&pool);
+    atto_eq(err, VCAN_OK);
+}
+
+static const vcan_sig_t sig_table[] = {
+        VCAN_SIG("EngineSpeed", 0x100, 0, 16, VCAN_SIG_LITTLE_ENDIAN, 0.25, 0),
+        VCAN_SIG("Torque", 0x100, 16, 8,
+                 VCAN_SIG_LITTLE_ENDIAN | VCAN_SIG_SIGNED, 2, 0),
+        VCAN_SIG("Pressure", 0x200, 7, 16, 0, 1, 0),
+        VCAN_SIG("Level", 0x200, 13, 12, 0, 1, -100),
+        VCAN_SIG("Counter", 0x300, 4, 64,
+                 VCAN_SIG_LITTLE_ENDIAN | VCAN_SIG_SIGNED, 1, 0),
+};
+
+#define SIG_COUNT (sizeof(sig_table) / sizeof(sig_table[0]))
+
+static void test_sig_invalid(void)
+{
+    vcan_sig_db_t db;
+    vcan_sig_layout_t layouts[SIG_COUNT];
+    double values[SIG_COUNT];
+    vcan_sig_msg_t msgs[3];
+
+    atto_eq(vcan_sig_init(NULL, sig_table, SIG_COUNT, layouts, values, msgs, 3),
+            VCAN_NULL_STORAGE);
+    atto_eq(vcan_sig_init(&db, sig_table, SIG_COUNT, NULL, values, msgs, 3),
+            VCAN_NULL_STORAGE);
+    atto_eq(vcan_sig_init(&db, sig_table, SIG_COUNT, layouts, NULL, msgs, 3),
+            VCAN_NULL_STORAGE);
+    atto_eq(vcan_sig_init(&db, sig_table, SIG_COUNT, layouts, values, NULL,
+                          3),
+            VCAN_NULL_STORAGE);
+    atto_eq(vcan_sig_init(&db, NULL, SIG_COUNT, layouts, values, msgs, 3),
+            VCAN_NULL_FILTER);
+    atto_eq(vcan_sig_init(&db, sig_table, SIG_COUNT, layouts, values, msgs, 2),
+            VCAN_INVALID_CAPACITY);
+    const vcan_sig_t unsorted[2] = {
+            VCAN_SIG("B", 0x200, 0, 8, 0, 1, 0),
+            VCAN_SIG("A", 0x100, 0, 8, 0, 1, 0),
+    };
+    atto_eq(vcan_sig_init(&db, unsorted, 2, layouts, values, msgs, 3),
+            VCAN_UNSORTED_FILTER);
+    const vcan_sig_t too_wide[3] = {
+            VCAN_SIG("Empty", 0x100, 0, 0, 0, 1, 0),
+            VCAN_SIG("Wide", 0x100, 0, 65, VCAN_SIG_LITTLE_ENDIAN, 1, 0),
+            VCAN_SIG("Past", 0x100, 500, 16, VCAN_SIG_LITTLE_ENDIAN, 1, 0),
+    };
+    atto_eq(vcan_sig_init(&db, &too_wide[0], 1, layouts, values, msgs, 3),
+            VCAN_INVALID_SIGNAL);
+    atto_eq(vcan_sig_init(&db, &too_wide[1], 1, layouts, values, msgs, 3),
+            VCAN_INVALID_SIGNAL);
+    atto_eq(vcan_sig_init(&db, &too_wide[2], 1, layouts, values, msgs, 3),
+            VCAN_INVALID_SIGNAL);
+    size_t count;
+    vcan_sig_t parsed[2];
+    atto_eq(vcan_sig_parse_dbc(NULL, parsed, 2, &count), VCAN_NULL_STORAGE);
+    atto_eq(vcan_sig_parse_dbc("", NULL, 2, &count), VCAN_NULL_STORAGE);
+    atto_eq(vcan_sig_parse_dbc("", parsed, 2, NULL), VCAN_NULL_STORAGE);
+}
+
+static void test_sig_decode_both_byte_orders(void)
+{
+    vcan_sig_db_t db;
+    vcan_sig_layout_t layouts[SIG_COUNT];
+    double values[SIG_COUNT];
+    vcan_sig_msg_t msgs[3];
+    vcan_err_t err = vcan_sig_init(&db, sig_table, SIG_COUNT, layouts, values, msgs, 3);
+    atto_eq(err, VCAN_OK);
+
+    const vcan_msg_t little = {.id = 0x100, .len = 3,
+            .data = {0x40, 0x1F, 0xFE}};
+    const vcan_sig_msg_t* decoded = vcan_sig_decode(&db, &little);
+    atto_neq(decoded, NULL);
+    atto_eq(decoded->count, 2);
+    atto_dapprox(decoded->values[0], 2000.0);
+    atto_dapprox(decoded->values[1], -4.0);
+    const vcan_msg_t big = {.id = 0x200, .len = 3,
+            .data = {0x12, 0x2A, 0xCC}};
+    decoded = vcan_sig_decode(&db, &big);
+    atto_neq(decoded, NULL);
+    atto_dapprox(decoded->values[0], 0x122A);
+    atto_dapprox(decoded->values[1], 0xAB3 - 100);
+    // 64 bits not aligned to a byte: spanning 9 bytes
+    vcan_msg_t wide = {.id = 0x300, .len = 12};
+    wide.data[0] = 0x0F;
+    wide.data[8] = 0xF0;
+    decoded = vcan_sig_decode(&db, &wide);
+    atto_neq(decoded, NULL);
+    atto_dapprox(decoded->values[0], 0.0);
+    memset(wide.data, 0xFF, sizeof(wide.data));
+    decoded = vcan_sig_decode(&db, &wide);
+    atto_dapprox(decoded->values[0], -1.0);
+    // Signals past the payload are missing
+    const vcan_msg_t short_msg = {.id = 0x100, .len = 2, .data = {0x40, 0x1F}};
+    decoded = vcan_sig_decode(&db, &short_msg);
+    atto_dapprox(decoded->values[0], 2000.0);
+    atto_nan(decoded->values[1]);
+    const vcan_msg_t unknown = {.id = 0x101, .len = 8};
+    atto_eq(vcan_sig_decode(&db, &unknown), NULL);
+}
+
+typedef struct
+{
+    vcan_sig_db_t* db;
+    const double* speed;
+    double seen;
+} sig_reader_t;
+
+static void reads_engine_speed(vcan_node_t* const node,
+                               const vcan_msg_t* const msg)
+{
+    sig_reader_t* const reader = node->other_custom_data;
+    if (vcan_sig_decode(reader->db, msg) != NULL)
+    {
+        reader->seen = *reader->speed;
+    }
+}
+
+static void test_sig_decoded_once_per_tx(void)
+{
+    vcan_sig_db_t db;
+    vcan_sig_layout_t layouts[SIG_COUNT];
+    double values[SIG_COUNT];
+    vcan_sig_msg_t msgs[3];
+    vcan_err_t err = vcan_sig_init(&db, sig_table, SIG_COUNT, layouts, values, msgs, 3);
+    atto_eq(err, VCAN_OK);
+    const double* const speed = vcan_sig_find(&db, "EngineSpeed");
+    atto_neq(speed, NULL);
+    atto_nan(*speed);
+    atto_eq(vcan_sig_find(&db, "Engine"), NULL);
+    vcan_bus_t bus;
+    err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    sig_reader_t readers[3];
+    vcan_node_t nodes[3];
+    for (size_t i = 0; i < 3; i++)
+    {
+        readers[i].db = &db;
+        readers[i].speed = speed;
+        readers[i].seen = 0;
+        memset(&nodes[i], 0, sizeof(vcan_node_t));
+        nodes[i].callback_on_rx = reads_engine_speed;
+        nodes[i].other_custom_data = &readers[i];
+        err = vcan_connect(&bus, &nodes[i]);
+        atto_eq(err, VCAN_OK);
+    }
+
+    vcan_msg_t msg = {.id = 0x100, .len = 3, .data = {0x40, 0x1F, 0}};
+    err = vcan_tx(&bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(db.decodes, 1);
+    for (size_t i = 0; i < 3; i++)
+    {
+        atto_dapprox(readers[i].seen, 2000.0);
+    }
+    msg.data[0] = 0x44;
+    err = vcan_tx(&bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(db.decodes, 2);
+    atto_dapprox(readers[2].seen, 2001.0);
+    atto_dapprox(*speed, 2001.0);
+}
+
+static void test_sig_parse_dbc(void)
+{
+    static const char dbc[] =
+            "VERSION \"\"\n"
+            "BU_: Engine Dashboard\n"
+            "\n"
+            "BO_ 512 Brakes: 8 Engine\n"
+            " SG_ Pressure : 7|16@0+ (1,0) [0|65535] \"kPa\" Dashboard\n"
+            "\n"
+            "BO_ 256 EngineData: 8 Engine\r\n"
+            " SG_ Mode M : 24|2@1+ (1,0) [0|3] \"\" Dashboard\r\n"
+            " SG_ EngineSpeed : 0|16@1+ (0.25,0) [0|16383] \"rpm\" Dashboard\n"
+            "\tSG_ Torque : 16|8@1- (2,0) [-256|254] \"Nm\" Dashboard\n"
+            " SG_ Boost m1 : 32|8@1+ (1,0) [0|255] \"\" Dashboard\n"
+            "BO_ 2147484416 Extended: 8 Engine\n"
+            " SG_ Flag : 0|1@1+ (1,0) [0|1] \"\" Dashboard\n"
+            "BO_TX_BU_ 256 : Engine;\n"
+            "BO_ 3221225472 VECTOR__INDEPENDENT_SIG_MSG: 0 Vector__XXX\n"
+            " SG_ Orphan : 0|8@1+ (1,0) [0|0] \"\" Vector__XXX\n"
+            "CM_ SG_ 256 EngineSpeed \"Crankshaft speed\";\n";
+    vcan_sig_t signals[8];
+    size_t count = 0;
+    vcan_err_t err = vcan_sig_parse_dbc(dbc, signals, 8, &count);
+    atto_eq(err, VCAN_OK);
+    atto_eq(count, 5);
+    // Sorted by CAN ID, keeping the order of the file within one ID
+    atto_eq(signals[0].msg_id, 256);
+    atto_eq(signals[0].name_len, 4);
+    atto_memeq(signals[0].name, "Mode", 4);
+    atto_memeq(signals[1].name, "EngineSpeed", 11);
+    atto_eq(signals[2].flags, VCAN_SIG_LITTLE_ENDIAN | VCAN_SIG_SIGNED);
+    atto_dapprox(signals[2].factor, 2.0);
+    atto_eq(signals[3].msg_id, 512);
+    atto_eq(signals[3].start_bit, 7);
+    atto_eq(signals[3].length, 16);
+    atto_eq(signals[3].flags, 0);
+    atto_eq(signals[4].msg_id, 0x300);
+
+    vcan_sig_db_t db;
+    vcan_sig_layout_t layouts[8];
+    double values[8];
+    vcan_sig_msg_t msgs[3];
+    err = vcan_sig_init(&db, signals, count, layouts, values, msgs, 3);
+    atto_eq(err, VCAN_OK);
+    const vcan_msg_t msg = {.id = 256, .len = 4, .data = {0x40, 0x1F, 0xFE, 2}};
+    const vcan_sig_msg_t* const decoded = vcan_sig_decode(&db, &msg);
+    atto_neq(decoded, NULL);
+    atto_dapprox(decoded->values[0], 2.0);
+    atto_dapprox(*vcan_sig_find(&db, "EngineSpeed"), 2000.0);
+    atto_dapprox(*vcan_sig_find(&db, "Torque"), -4.0);
+
+    err = vcan_sig_parse_dbc(dbc, signals, 4, &count);
+    atto_eq(err, VCAN_INVALID_CAPACITY);
+    err = vcan_sig_parse_dbc(" SG_ Early : 0|8@1+ (1,0) [0|0] \"\" X\n",
+                             signals, 8, &count);
+    atto_eq(err, VCAN_INVALID_SIGNAL);
+    err = vcan_sig_parse_dbc("BO_ 1 A: 8 X\n SG_ Bad : 0|8@2+ (1,0)\n",
+                             signals, 8, &count);
+    atto_eq(err, VCAN_INVALID_SIGNAL);
+    err = vcan_sig_parse_dbc("BO_ x A: 8 X\n", signals, 8, &count);
+    atto_eq(err, VCAN_INVALID_SIGNAL);
+}
+
+static void test_pool_invalid(void)
+{
+    vcan_bus_t bus;
+    vcan_frame_t frames[2];
+    vcan_frame_t* refs[4];
+    vcan_rx_queue_t queue;
+    vcan_pool_stats_t stats;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(vcan_set_pool(NULL, frames, 2), VCAN_NULL_BUS);
+    atto_eq(vcan_set_pool(&bus, NULL, 2), VCAN_NULL_STORAGE);
+    atto_eq(vcan_set_pool(&bus, frames, 0), VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_frame_alloc(NULL), NULL);
+    atto_eq(vcan_frame_alloc(&bus), NULL);
+    vcan_frame_retain(NULL);
+    vcan_frame_release(NULL);
+    atto_eq(vcan_tx_shared(NULL, NULL, NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_tx_shared(&bus, NULL, NULL), VCAN_NULL_MSG);
+    atto_eq(vcan_get_pool_stats(NULL, &stats), VCAN_NULL_BUS);
+    atto_eq(vcan_get_pool_stats(&bus, NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_get_pool_stats(&bus, &stats), VCAN_OK);
+    atto_eq(stats.capacity, 0);
+    atto_eq(stats.high_water, 0);
+    atto_eq(vcan_rx_queue_init_shared(NULL, refs, 4), VCAN_NULL_STORAGE);
+    atto_eq(vcan_rx_queue_init_shared(&queue, NULL, 4), VCAN_NULL_STORAGE);
+    atto_eq(vcan_rx_queue_init_shared(&queue, refs, 3),
+            VCAN_INVALID_CAPACITY);
+    atto_eq(vcan_rx_poll_shared(NULL, refs, 4), 0);
+    // A queue of copies has no frames to hand over
+    vcan_msg_t msgs[4];
+    err = vcan_rx_queue_init(&queue, msgs, 4);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {.rx_queue = &queue};
+    atto_eq(vcan_rx_poll_shared(&node, refs, 4), 0);
+}
+
+/** Amount of nodes with a receive queue in shared mode. */
+#define POOL_NODES 8U
+
+static void test_pool_one_frame_for_all_queues(void)
+{
+    vcan_bus_t bus;
+    vcan_frame_t frames[4];
+    static vcan_frame_t* refs[POOL_NODES][4];
+    static vcan_rx_queue_t queues[POOL_NODES];
+    static vcan_node_t nodes[POOL_NODES];
+    vcan_pool_stats_t stats;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    err = vcan_set_pool(&bus, frames, 4);
+    atto_eq(err, VCAN_OK);
+    for (size_t i = 0; i < POOL_NODES; i++)
+    {
+        err = vcan_rx_queue_init_shared(&queues[i], refs[i], 4);
+        atto_eq(err, VCAN_OK);
+        memset(&nodes[i], 0, sizeof(vcan_node_t));
+        nodes[i].rx_queue = &queues[i];
+        err = vcan_connect(&bus, &nodes[i]);
+        atto_eq(err, VCAN_OK);
+    }
+
+    const vcan_msg_t msg = {.id = 0x42, .len = 2, .data = {0xCA, 0xFE}};
+    err = vcan_tx(&bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_get_pool_stats(&bus, &stats);
+    atto_eq(err, VCAN_OK);
+    atto_eq(stats.capacity, 4);
+    atto_eq(stats.in_use, 1);
+    atto_eq(stats.high_water, 1);
+    // The same frame in every queue
+    vcan_frame_t* first = NULL;
+    vcan_frame_t* other = NULL;
+    atto_eq(vcan_rx_poll_shared(&nodes[0], &first, 1), 1);
+    atto_eq(vcan_rx_poll_shared(&nodes[1], &other, 1), 1);
+    atto_eq(first, other);
+    atto_eq(first->msg.id, 0x42);
+    atto_memeq(first->msg.data, msg.data, 2);
+    vcan_frame_release(first);
+    vcan_frame_release(other);
+    for (size_t i = 2; i < POOL_NODES; i++)
+    {
+        vcan_msg_t copy;
+        atto_eq(vcan_rx_poll(&nodes[i], &copy, 1), 1);
+        atto_eq(copy.id, 0x42);
+        atto_eq(stats.in_use, 1);
+    }
+    err = vcan_get_pool_stats(&bus, &stats);
+    atto_eq(err, VCAN_OK);
+    atto_eq(stats.in_use, 0);
+    atto_eq(stats.high_water, 1);
+}
+
+static void records_shared_msg(vcan_node_t* const node,
+                               const vcan_msg_t* const msg)
+{
+    node->other_custom_data = (void*) msg;
+}
+
+static void test_pool_tx_shared_and_exhausted(void)
+{
+    vcan_bus_t bus;
+    vcan_frame_t frames[2];
+    vcan_frame_t* refs[8];
+    vcan_rx_queue_t queue;
+    vcan_pool_stats_t stats;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    err = vcan_set_pool(&bus, frames, 2);
+    atto_eq(err, VCAN_OK);
+    err = vcan_rx_queue_init_shared(&queue, refs, 8);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t queued = {.rx_queue = &queue};
+    vcan_node_t direct = {.callback_on_rx = records_shared_msg};
+    err = vcan_connect(&bus, &queued);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &direct);
+    atto_eq(err, VCAN_OK);
+
+    // Transmitted from a frame: no copy at all
+    vcan_frame_t* const frame = vcan_frame_alloc(&bus);
+    atto_neq(frame, NULL);
+    frame->msg.id = 0x7;
+    frame->msg.len = 0;
+    err = vcan_tx_shared(&bus, frame, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(direct.other_custom_data, &frame->msg);
+    atto_eq(bus.frame, NULL);
+    vcan_frame_release(frame);
+    err = vcan_get_pool_stats(&bus, &stats);
+    atto_eq(err, VCAN_OK);
+    atto_eq(stats.in_use, 1);
+
+    // One frame left for two messages kept by the queue
+    const vcan_msg_t msg = {.id = 0x8, .len = 0};
+    err = vcan_tx(&bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx(&bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_rx_overflows(&queued), 1);
+    err = vcan_get_pool_stats(&bus, &stats);
+    atto_eq(err, VCAN_OK);
+    atto_eq(stats.in_use, 2);
+    atto_eq(stats.high_water, 2);
+    atto_gt(stats.exhausted, 0);
+    // The callbacks are not affected by the exhaustion
+    atto_eq(((const vcan_msg_t*) direct.other_custom_data)->id, 0x8);
+    vcan_frame_t* polled[8];
+    atto_eq(vcan_rx_poll_shared(&queued, polled, 8), 2);
+    atto_eq(polled[0], frame);
+    atto_eq(polled[1]->msg.id, 0x8);
+    vcan_frame_release(polled[0]);
+    vcan_frame_release(polled[1]);
+    err = vcan_get_pool_stats(&bus, &stats);
+    atto_eq(err, VCAN_OK);
+    atto_eq(stats.in_use, 0);
+    atto_neq(vcan_frame_alloc(&bus), NULL);
+    atto_neq(vcan_frame_alloc(&bus), NULL);
+    atto_eq(vcan_frame_alloc(&bus), NULL);
+}
+
+#define POOL_THREAD_MSGS 20000U
+
+static void* pool_consumer(void* const arg)
+{
+    spsc_consumer_t* const consumer = arg;
+    vcan_frame_t* frames[16];
+    uint32_t last = 0;
+    while (consumer->received + vcan_rx_overflows(consumer->node)
+           < POOL_THREAD_MSGS)
+    {
+        const size_t polled = vcan_rx_poll_shared(consumer->node, frames, 16);
+        for (size_t i = 0; i < polled; i++)
+        {
+            uint32_t seq;
+            memcpy(&seq, frames[i]->msg.data, sizeof(seq));
+            if (consumer->received > 0 && seq <= last)
+            {
+                consumer->out_of_order++;
+            }
+            last = seq;
+            consumer->received++;
+            vcan_frame_release(frames[i]);
+        }
+        if (polled == 0)
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void test_pool_released_on_other_threads(void)
+{
+    vcan_bus_t bus;
+    static vcan_frame_t frames[32];
+    static vcan_frame_t* refs[2][16];
+    static vcan_rx_queue_t queues[2];
+    vcan_node_t nodes[2];
+    spsc_consumer_t consumers[2];
+    pthread_t threads[2];
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    err = vcan_set_pool(&bus, frames, 32);
+    atto_eq(err, VCAN_OK);
+    for (size_t i = 0; i < 2; i++)
+    {
+        err = vcan_rx_queue_init_shared(&queues[i], refs[i], 16);
+        atto_eq(err, VCAN_OK);
+        memset(&nodes[i], 0, sizeof(vcan_node_t));
+        nodes[i].rx_queue = &queues[i];
+        err = vcan_connect(&bus, &nodes[i]);
+        atto_eq(err, VCAN_OK);
+        consumers[i] = (spsc_consumer_t) {.node = &nodes[i]};
+        atto_eq(pthread_create(&threads[i], NULL, pool_consumer,
+                               &consumers[i]), 0);
+    }
+
+    vcan_msg_t msg = {.id = 1, .len = 4};
+    for (uint32_t seq = 0; seq < POOL_THREAD_MSGS; seq++)
+    {
+        memcpy(msg.data, &seq, sizeof(seq));
+        vcan_tx(&bus, &msg, NULL);
+    }
+    vcan_pool_stats_t stats;
+    for (size_t i = 0; i < 2; i++)
+    {
+        pthread_join(threads[i], NULL);
+        atto_eq(consumers[i].received + vcan_rx_overflows(&nodes[i]),
+                POOL_THREAD_MSGS);
+        atto_eq(consumers[i].out_of_order, 0);
+    }
+    err = vcan_get_pool_stats(&bus, &stats);
+    atto_eq(err, VCAN_OK);
+    atto_eq(stats.in_use, 0);
+    atto_le(stats.high_water, 32);
+}
+
+static void test_match_table_invalid(void)
+{
+    vcan_bus_t bus;
+    uint32_t codes[4];
+    uint32_t masks[4];
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(vcan_set_match_table(NULL, codes, masks), VCAN_NULL_BUS);
+    atto_eq(vcan_set_match_table(&bus, NULL, masks), VCAN_NULL_STORAGE);
+    atto_eq(vcan_set_match_table(&bus, codes, NULL), VCAN_NULL_STORAGE);
+    // The embedded node table keeps its own summaries
+    atto_eq(vcan_set_match_table(&bus, codes, masks), VCAN_OK);
+    atto_eq(bus.table_codes, NULL);
+    atto_eq(bus.table_masks, NULL);
+}
+
+/** Amount of nodes of each kind of filter on the large filtered bus. */
+#define MATCH_MASKED_NODES 60U
+#define MATCH_LISTED_NODES 30U
+#define MATCH_OPEN_NODES 10U
+#define MATCH_NODES (MATCH_MASKED_NODES + MATCH_LISTED_NODES + MATCH_OPEN_NODES)
+#define MATCH_IDS 0x800U
+
+static void test_tx_filtered_many_nodes(void)
+{
+    vcan_bus_t bus;
+    static vcan_node_t* table[MATCH_NODES];
+    static uint32_t codes[MATCH_NODES];
+    static uint32_t masks[MATCH_NODES];
+    static vcan_node_t nodes[MATCH_NODES];
+    static vcan_filter_t filters[MATCH_MASKED_NODES];
+    static uint32_t ids[MATCH_LISTED_NODES][2];
+    vcan_err_t err = vcan_init_ex(&bus, table, MATCH_NODES);
+    atto_eq(err, VCAN_OK);
+    for (uint32_t i = 0; i < MATCH_NODES; i++)
+    {
+        memset(&nodes[i], 0, sizeof(vcan_node_t));
+        nodes[i].callback_on_rx = counts_msgs;
+        nodes[i].id = i;
+        if (i < MATCH_MASKED_NODES)
+        {
+            filters[i] = (vcan_filter_t) {.id = i, .mask = 0x7F};
+            err = vcan_set_filter(&nodes[i], &filters[i], 1, NULL, 0);
+            atto_eq(err, VCAN_OK);
+        }
+        else if (i < MATCH_MASKED_NODES + MATCH_LISTED_NODES)
+        {
+            ids[i - MATCH_MASKED_NODES][0] = i;
+            ids[i - MATCH_MASKED_NODES][1] = 0x400U + i;
+            err = vcan_set_filter(&nodes[i], NULL, 0,
+                                  ids[i - MATCH_MASKED_NODES], 2);
+            atto_eq(err, VCAN_OK);
+        }
+        err = vcan_connect(&bus, &nodes[i]);
+        atto_eq(err, VCAN_OK);
+        // Half of the nodes connected before the summaries have storage
+        if (i == MATCH_NODES / 2U)
+        {
+            err = vcan_set_match_table(&bus, codes, masks);
+            atto_eq(err, VCAN_OK);
+        }
+    }
+    atto_eq(masks[0], 0x7F);
+    atto_eq(codes[MATCH_MASKED_NODES], MATCH_MASKED_NODES);
+    atto_eq(masks[MATCH_NODES - 1U], 0);
+    // Moves the last node into slot 3, with its summary
+    err = vcan_disconnect(&bus, &nodes[3]);
+    atto_eq(err, VCAN_OK);
+    atto_eq(masks[3], 0);
+    // Opens up a node while connected
+    const uint32_t single_id[] = {0x7FF};
+    err = vcan_set_filter(&nodes[1], NULL, 0, single_id, 1);
+    atto_eq(err, VCAN_OK);
+    atto_eq(codes[1], 0x7FF);
+
+    for (uint32_t id = 0; id < MATCH_IDS; id++)
+    {
+        const vcan_msg_t msg = {.id = id, .len = 0};
+        err = vcan_tx(&bus, &msg, &nodes[0]);
+        atto_eq(err, VCAN_OK);
+    }
+
+    atto_eq((intptr_t) nodes[0].other_custom_data, 0);
+    atto_eq((intptr_t) nodes[1].other_custom_data, 1);
+    atto_eq((intptr_t) nodes[3].other_custom_data, 0);
+    for (uint32_t i = 4; i < MATCH_NODES; i++)
+    {
+        intptr_t expected = MATCH_IDS;
+        if (i < MATCH_MASKED_NODES)
+        {
+            expected = MATCH_IDS / 0x80U;
+        }
+        else if (i < MATCH_MASKED_NODES + MATCH_LISTED_NODES)
+        {
+            expected = 2;
+        }
+        atto_eq((intptr_t) nodes[i].other_custom_data, expected);
+    }
+}
+
+static void test_tx_filtered_node_on_two_buses(void)
+{
+    vcan_bus_t first;
+    vcan_bus_t second;
+    vcan_err_t err = vcan_init(&first);
+    atto_eq(err, VCAN_OK);
+    err = vcan_init(&second);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {.callback_on_rx = counts_msgs};
+    err = vcan_connect(&first, &node);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&second, &node);
+    atto_eq(err, VCAN_OK);
+    atto_eq(node.bus, &first);
+    const uint32_t ids[] = {0x10};
+    err = vcan_set_filter(&node, NULL, 0, ids, 1);
+    atto_eq(err, VCAN_OK);
+    // Only the bus of the handle has the summary, the other one asks the node
+    atto_eq(first.masks[0], UINT32_MAX);
+    atto_eq(second.masks[0], 0);
+    const vcan_msg_t accepted = {.id = 0x10};
+    const vcan_msg_t rejected = {.id = 0x11};
+
+    err = vcan_tx(&first, &accepted, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx(&first, &rejected, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx(&second, &accepted, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx(&second, &rejected, NULL);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq((intptr_t) node.other_custom_data, 2);
+}
+
+static void test_meta_invalid(void)
+{
+    vcan_rx_queue_t queue;
+    vcan_meta_t metas[4];
+    vcan_msg_t msgs[4];
+    atto_eq(vcan_rx_queue_set_meta(NULL, metas), VCAN_NULL_STORAGE);
+    atto_eq(vcan_rx_queue_set_meta(&queue, NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_timestamp(NULL), 0);
+    atto_eq(vcan_tx_stamped(NULL, msgs, NULL, 0), VCAN_NULL_BUS);
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_tx_stamped(&bus, NULL, NULL, 0), VCAN_NULL_MSG);
+    err = vcan_rx_queue_init(&queue, msgs, 4);
+    atto_eq(err, VCAN_OK);
+    atto_eq(queue.metas, NULL);
+    vcan_node_t node = {.rx_queue = &queue};
+    atto_eq(vcan_rx_poll_meta(NULL, msgs, metas, 4), 0);
+    atto_eq(vcan_rx_poll_meta(&node, NULL, metas, 4), 0);
+    atto_eq(vcan_rx_poll_meta(&node, msgs, NULL, 4), 0);
+    // Timestamps need both the flag and a clock
+    uint64_t ticks = 0;
+    atto_eq(vcan_timestamp(&bus), 0);
+    bus.flags |= VCAN_BUS_TIMESTAMPS;
+    atto_eq(vcan_timestamp(&bus), 0);
+    err = vcan_set_clock(&bus, ticks_by_10, &ticks);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_timestamp(&bus), 10);
+}
+
+/** Metadata seen by the callback of records_meta(). */
+static vcan_meta_t recorded_metas[8];
+static size_t recorded_metas_len;
+
+static void records_meta(vcan_node_t* const node, const vcan_msg_t* const msg)
+{
+    (void) msg;
+    if (recorded_metas_len < 8U)
+    {
+        recorded_metas[recorded_metas_len++] = node->rx_meta;
+    }
+}
+
+static void test_meta_seq_and_timestamps(void)
+{
+    vcan_bus_t bus;
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[8];
+    vcan_meta_t queue_metas[8];
+    uint64_t ticks = 0;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    err = vcan_rx_queue_init(&queue, storage, 8);
+    atto_eq(err, VCAN_OK);
+    err = vcan_rx_queue_set_meta(&queue, queue_metas);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t queued = {.rx_queue = &queue};
+    vcan_node_t direct = {.callback_on_rx = records_meta};
+    err = vcan_connect(&bus, &queued);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &direct);
+    atto_eq(err, VCAN_OK);
+    recorded_metas_len = 0;
+    const vcan_msg_t msg = {.id = 1, .len = 0};
+
+    // Sequence numbers without timestamps
+    err = vcan_tx(&bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    bus.flags |= VCAN_BUS_TIMESTAMPS;
+    err = vcan_set_clock(&bus, ticks_by_10, &ticks);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx(&bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx_stamped(&bus, &msg, NULL, 5);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(recorded_metas_len, 3);
+    atto_eq(recorded_metas[0].seq, 1);
+    atto_eq(recorded_metas[0].tx_time, 0);
+    atto_eq(recorded_metas[0].rx_time, 0);
+    atto_eq(recorded_metas[1].seq, 2);
+    // Transmitted at 10, queued at 20, called back at 30
+    atto_eq(recorded_metas[1].tx_time, 10);
+    atto_eq(recorded_metas[1].rx_time, 30);
+    atto_eq(recorded_metas[2].seq, 3);
+    atto_eq(recorded_metas[2].tx_time, 5);
+    vcan_msg_t msgs[8];
+    vcan_meta_t metas[8];
+    atto_eq(vcan_rx_poll_meta(&queued, msgs, metas, 8), 3);
+    atto_eq(metas[0].seq, 1);
+    atto_eq(metas[0].rx_time, 0);
+    atto_eq(metas[1].seq, 2);
+    atto_eq(metas[1].tx_time, 10);
+    atto_eq(metas[1].rx_time, 20);
+    atto_eq(metas[2].seq, 3);
+    atto_eq(metas[2].tx_time, 5);
+    // VCAN_STATS reads the clock around the callbacks too
+    atto_gt(metas[2].rx_time, recorded_metas[1].rx_time);
+    atto_gt(recorded_metas[2].rx_time, metas[2].rx_time);
+}
+
+static void records_burst_meta(vcan_node_t* const node,
+                               const vcan_msg_t* const msgs,
+                               const size_t count)
+{
+    (void) msgs;
+    (void) count;
+    records_meta(node, msgs);
+}
+
+static void transmits_deferred_once(vcan_node_t* const node,
+                                    const vcan_msg_t* const msg)
+{
+    records_meta(node, msg);
+    if (msg->id == 1)
+    {
+        const vcan_msg_t reply = {.id = 2, .len = 0};
+        vcan_tx(node->bus, &reply, node);
+    }
+}
+
+static void test_meta_burst_and_deferred(void)
+{
+    vcan_bus_t bus;
+    vcan_deferred_t fifo[4];
+    uint64_t ticks = 0;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    err = vcan_set_deferred(&bus, fifo, 4);
+    atto_eq(err, VCAN_OK);
+    bus.flags |= VCAN_BUS_TIMESTAMPS;
+    err = vcan_set_clock(&bus, ticks_by_10, &ticks);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t burst = {
+            .callback_on_rx = records_meta,
+            .callback_on_rx_burst = records_burst_meta,
+    };
+    const uint32_t ids[] = {0x10, 0x12};
+    err = vcan_set_filter(&burst, NULL, 0, ids, 2);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &burst);
+    atto_eq(err, VCAN_OK);
+    recorded_metas_len = 0;
+    const vcan_msg_t msgs[3] = {{.id = 0x10}, {.id = 0x11}, {.id = 0x12}};
+
+    // Two runs of accepted messages: seq 1 and seq 3
+    err = vcan_tx_burst(&bus, msgs, 3, NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(recorded_metas_len, 2);
+    atto_eq(recorded_metas[0].seq, 1);
+    atto_eq(recorded_metas[0].tx_time, 10);
+    atto_eq(recorded_metas[1].seq, 3);
+    atto_eq(recorded_metas[1].tx_time, 10);
+    atto_gt(recorded_metas[1].rx_time, recorded_metas[0].rx_time);
+
+    err = vcan_disconnect(&bus, &burst);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t replier = {.callback_on_rx = transmits_deferred_once};
+    vcan_node_t listener = {.callback_on_rx = records_meta};
+    err = vcan_connect(&bus, &replier);
+    atto_eq(err, VCAN_OK);
+    err = vcan_connect(&bus, &listener);
+    atto_eq(err, VCAN_OK);
+    recorded_metas_len = 0;
+    const vcan_msg_t msg = {.id = 1, .len = 0};
+    err = vcan_tx(&bus, &msg, NULL);
+    atto_eq(err, VCAN_OK);
+
+    // The reply is deferred, stamped when transmitted by the callback
+    atto_eq(recorded_metas_len, 3);
+    atto_eq(recorded_metas[0].seq, 4);
+    atto_eq(recorded_metas[1].seq, 4);
+    atto_eq(recorded_metas[2].seq, 5);
+    atto_gt(recorded_metas[2].tx_time, recorded_metas[0].rx_time);
+    atto_gt(recorded_metas[2].rx_time, recorded_metas[1].rx_time);
+}
+
+static void test_meta_across_gateway(void)
+{
+    vcan_bus_t bus[2];
+    vcan_bus_t* buses[2] = {&bus[0], &bus[1]};
+    uint64_t ticks = 0;
+    for (size_t i = 0; i < 2; i++)
+    {
+        atto_eq(vcan_init(&bus[i]), VCAN_OK);
+        bus[i].flags |= VCAN_BUS_TIMESTAMPS;
+        // One shared clock, so the latency spans the buses
+        atto_eq(vcan_set_clock(&bus[i], ticks_by_10, &ticks), VCAN_OK);
+    }
+    vcan_node_t listener = {.callback_on_rx = records_meta};
+    atto_eq(vcan_connect(&bus[1], &listener), VCAN_OK);
+    const vcan_gw_route_t routes[1] = {
+            {.src_bus = 0, .id = 0x100, .dst_mask = 0x2,
+                    .new_id = VCAN_GW_SAME_ID},
+    };
+    vcan_gw_t gw;
+    vcan_gw_pending_t fifo[2];
+    vcan_err_t err = vcan_gw_init(&gw, buses, 2, routes, 1, fifo, 2);
+    atto_eq(err, VCAN_OK);
+    recorded_metas_len = 0;
+    const vcan_msg_t msg = {.id = 0x100, .len = 0};
+
+    err = vcan_tx(&bus[0], &msg, NULL);
+    atto_eq(err, VCAN_OK);
+
+    atto_eq(recorded_metas_len, 1);
+    // Sequence numbers are per bus, the transmission time is the original
+    atto_eq(recorded_metas[0].seq, 1);
+    atto_eq(recorded_metas[0].tx_time, 10);
+    atto_gt(recorded_metas[0].rx_time, 20);
+    atto_eq(vcan_gw_deinit(&gw), VCAN_OK);
+}
+
+static void test_hist_buckets(void)
+{
+    static vcan_hist_t hist;
+    char text[256];
+    atto_eq(vcan_hist_init(NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_hist_init(&hist), VCAN_OK);
+    atto_eq(vcan_hist_quantile(&hist, 0.5), 0);
+    atto_eq(vcan_hist_dump(&hist, text, sizeof(text)), 33);
+    atto_eq(strcmp(text, "count 0 max 0 p50 0 p99 0 p999 0\n"), 0);
+
+    // Exact up to 15, then 8 sub-buckets per power of 2
+    for (uint64_t value = 1; value <= 100; value++)
+    {
+        vcan_hist_record(&hist, value);
+    }
+    vcan_hist_record(&hist, UINT64_MAX);
+    atto_eq(vcan_hist_quantile(&hist, 0), 1);
+    atto_eq(vcan_hist_quantile(&hist, 0.1), 11);
+    // 50th value: bucket 48..51
+    atto_eq(vcan_hist_quantile(&hist, 0.5), 51);
+    // 100th value: bucket 96..103, capped at the largest value recorded
+    atto_eq(vcan_hist_quantile(&hist, 0.99), 103);
+    atto_eq(vcan_hist_quantile(&hist, 1), UINT64_MAX);
+    const size_t written = vcan_hist_dump(&hist, text, sizeof(text));
+    atto_eq(written, strlen(text));
+    atto_eq(strncmp(text, "count 101 max 18446744073709551615 p50 51 ", 42),
+            0);
+    atto_neq(strstr(text, "\n1 1 1\n2 2 1\n"), NULL);
+    atto_neq(strstr(text, "\n16 17 2\n"), NULL);
+    // Whole lines only
+    atto_eq(text[written - 1], '\n');
+    atto_lt(written, sizeof(text) - 1);
+}
+
+static size_t probe_calls[3];
+
+static void probe_tx_entry(void* const ctx,
+                           const vcan_bus_t* const bus,
+                           const vcan_msg_t* const msgs,
+                           const size_t count)
+{
+    (void) ctx;
+    (void) msgs;
+    atto_neq(bus, NULL);
+    probe_calls[0] += count;
+}
+
+static void probe_dispatch(void* const ctx,
+                           const vcan_bus_t* const bus,
+                           const vcan_node_t* const node,
+                           const vcan_msg_t* const msg)
+{
+    (void) ctx;
+    (void) bus;
+    (void) msg;
+    atto_neq(node, NULL);
+    probe_calls[1]++;
+}
+
+static void probe_tx_exit(void* const ctx,
+                          const vcan_bus_t* const bus,
+                          const vcan_msg_t* const msgs,
+                          const size_t count)
+{
+    (void) ctx;
+    (void) bus;
+    (void) msgs;
+    probe_calls[2] += count;
+}
+
+static void test_probes_and_histogram(void)
+{
+    vcan_bus_t bus;
+    static vcan_hist_t hist;
+    uint64_t ticks = 0;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_set_probes(NULL, NULL), VCAN_NULL_BUS);
+    atto_eq(vcan_set_histogram(NULL, NULL), VCAN_NULL_BUS);
+    const vcan_probes_t probes = {
+            .tx_entry = probe_tx_entry,
+            .dispatch = probe_dispatch,
+            .tx_exit = probe_tx_exit,
+    };
+    err = vcan_set_probes(&bus, &probes);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_hist_init(&hist), VCAN_OK);
+    err = vcan_set_histogram(&bus, &hist);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t nodes[3];
+    memset(nodes, 0, sizeof(nodes));
+    for (size_t i = 0; i < 3; i++)
+    {
+        nodes[i].callback_on_rx = counts_msgs;
+        err = vcan_connect(&bus, &nodes[i]);
+        atto_eq(err, VCAN_OK);
+    }
+    memset(probe_calls, 0, sizeof(probe_calls));
+    const vcan_msg_t msgs[2] = {{.id = 1}, {.id = 2}};
+
+    // Nothing recorded without a clock
+    err = vcan_tx(&bus, &msgs[0], NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(atomic_load(&hist.total), 0);
+    err = vcan_set_clock(&bus, ticks_by_10, &ticks);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx(&bus, &msgs[0], &nodes[0]);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx_burst(&bus, msgs, 2, NULL);
+    atto_eq(err, VCAN_OK);
+
+#ifdef VCAN_PROBES
+    atto_eq(probe_calls[0], 4);
+    atto_eq(probe_calls[1], 3 + 2 + 6);
+    atto_eq(probe_calls[2], 4);
+#else
+    atto_eq(probe_calls[0], 0);
+    atto_eq(probe_calls[1], 0);
+    atto_eq(probe_calls[2], 0);
+#endif
+    // One duration per fan-out, a burst counting as one
+    atto_eq(atomic_load(&hist.total), 2);
+    atto_gt(vcan_hist_quantile(&hist, 0.5), 0);
+    err = vcan_set_histogram(&bus, NULL);
+    atto_eq(err, VCAN_OK);
+    err = vcan_tx(&bus, &msgs[0], NULL);
+    atto_eq(err, VCAN_OK);
+    atto_eq(atomic_load(&hist.total), 2);
+}
+
+static void test_rx_policy_invalid(void)
+{
+    vcan_rx_queue_t queue;
+    vcan_rx_queue_t spill;
+    vcan_msg_t msgs[4];
+    vcan_frame_t* refs[4];
+    atto_eq(vcan_rx_queue_init(&queue, msgs, 4), VCAN_OK);
+    atto_eq(vcan_rx_queue_init_shared(&spill, refs, 4), VCAN_OK);
+
+    atto_eq(vcan_rx_queue_set_policy(NULL, VCAN_RX_DROP_OLDEST, 0, NULL),
+            VCAN_NULL_STORAGE);
+    atto_eq(vcan_rx_queue_set_policy(&queue, VCAN_RX_SPILL, 0, NULL),
+            VCAN_NULL_STORAGE);
+    atto_eq(vcan_rx_queue_set_policy(&queue, (vcan_rx_policy_t) 4, 0, NULL),
+            VCAN_INVALID_POLICY);
+    atto_eq(vcan_rx_queue_set_policy(&queue, VCAN_RX_SPILL, 0, &queue),
+            VCAN_INVALID_POLICY);
+    atto_eq(vcan_rx_queue_set_policy(&queue, VCAN_RX_SPILL, 0, &spill),
+            VCAN_INVALID_POLICY);
+    atto_eq(vcan_rx_queue_set_policy(&queue, VCAN_RX_DROP_NEWEST, 0, &spill),
+            VCAN_OK);
+    atto_eq(queue.spill, NULL);
+
+    vcan_node_t node = {0};
+    atto_eq(vcan_rx_last_overflow(NULL), VCAN_OK);
+    atto_eq(vcan_rx_last_overflow(&node), VCAN_OK);
+    node.rx_queue = &queue;
+    atto_eq(vcan_rx_last_overflow(&node), VCAN_OK);
+    atto_eq(vcan_bus_pressure(NULL), 0);
+}
+
+/** Transmits messages with the IDs from \p first to \p last, included. */
+static void tx_ids(vcan_bus_t* const bus,
+                   const uint32_t first,
+                   const uint32_t last)
+{
+    for (uint32_t id = first; id <= last; id++)
+    {
+        const vcan_msg_t msg = {.id = id, .len = 1, .data = {(uint8_t) id}};
+        atto_eq(vcan_tx(bus, &msg, NULL), VCAN_OK);
+    }
+}
+
+static void test_rx_policy_drop_oldest(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[4];
+    err = vcan_rx_queue_init(&queue, storage, 4);
+    atto_eq(err, VCAN_OK);
+    err = vcan_rx_queue_set_policy(&queue, VCAN_RX_DROP_OLDEST, 0, NULL);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {.rx_queue = &queue};
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    vcan_msg_t msgs[8];
+    atto_eq(vcan_bus_pressure(&bus), 0);
+
+    tx_ids(&bus, 1, 3);
+    atto_eq(vcan_bus_pressure(&bus), 75);
+    tx_ids(&bus, 4, 6);
+
+    atto_eq(vcan_bus_pressure(&bus), 100);
+    atto_eq(vcan_rx_overflows(&node), 2);
+    atto_eq(vcan_rx_last_overflow(&node), VCAN_DROPPED_OLDEST);
+    // The latest traffic is kept
+    atto_eq(vcan_rx_poll(&node, msgs, 8), 4);
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        atto_eq(msgs[i].id, 3 + i);
+        atto_eq(msgs[i].data[0], 3 + i);
+    }
+    atto_eq(vcan_bus_pressure(&bus), 0);
+    tx_ids(&bus, 7, 7);
+    atto_eq(vcan_rx_poll(&node, msgs, 8), 1);
+    atto_eq(msgs[0].id, 7);
+    atto_eq(vcan_rx_overflows(&node), 2);
+
+    // Messages left queued by a partial poll can be dropped again
+    const vcan_msg_t fd = {.id = 8, .len = 12};
+    tx_ids(&bus, 7, 7);
+    atto_eq(vcan_tx(&bus, &fd, NULL), VCAN_OK);
+    vcan_frame8_t frames[4];
+    atto_eq(vcan_rx_poll_frame8(&node, frames, 4), 1);
+    atto_eq(frames[0].id, 7);
+    tx_ids(&bus, 9, 12);
+    atto_eq(vcan_rx_overflows(&node), 3);
+    atto_eq(vcan_rx_poll(&node, msgs, 8), 4);
+    atto_eq(msgs[0].id, 9);
+    atto_eq(msgs[3].id, 12);
+}
+
+static void test_rx_policy_drop_oldest_other_thread(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    static vcan_rx_queue_t queue;
+    static vcan_msg_t storage[16];
+    err = vcan_rx_queue_init(&queue, storage, 16);
+    atto_eq(err, VCAN_OK);
+    err = vcan_rx_queue_set_policy(&queue, VCAN_RX_DROP_OLDEST, 0, NULL);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {.rx_queue = &queue};
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    spsc_consumer_t consumer = {.node = &node};
+    pthread_t thread;
+    atto_eq(pthread_create(&thread, NULL, spsc_consumer, &consumer), 0);
+    vcan_msg_t msg = {.id = 1, .len = 4};
+
+    for (uint32_t seq = 0; seq < SPSC_MSGS; seq++)
+    {
+        memcpy(msg.data, &seq, sizeof(seq));
+        vcan_tx(&bus, &msg, NULL);
+    }
+    pthread_join(thread, NULL);
+
+    // Messages dropped under the consumer's feet are never handed over
+    atto_eq(consumer.received + vcan_rx_overflows(&node), SPSC_MSGS);
+    atto_eq(consumer.out_of_order, 0);
+}
+
+typedef struct
+{
+    vcan_node_t* node;
+    uint64_t ticks;
+    /** Clock reads before polling one message, 0 for never. */
+    uint32_t drain_after;
+    uint32_t drained;
+} draining_clock_t;
+
+/** Clock of one tick per read, also consuming like a slow node would. */
+static uint64_t draining_clock(void* const ctx)
+{
+    draining_clock_t* const clock = ctx;
+    if (clock->drain_after > 0 && --clock->drain_after == 0)
+    {
+        vcan_msg_t msg;
+        clock->drained += (uint32_t) vcan_rx_poll(clock->node, &msg, 1);
+    }
+    return clock->ticks++;
+}
+
+static void test_rx_policy_block(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[2];
+    err = vcan_rx_queue_init(&queue, storage, 2);
+    atto_eq(err, VCAN_OK);
+    err = vcan_rx_queue_set_policy(&queue, VCAN_RX_BLOCK, 100, NULL);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {.rx_queue = &queue};
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    draining_clock_t clock = {.node = &node};
+    err = vcan_set_clock(&bus, draining_clock, &clock);
+    atto_eq(err, VCAN_OK);
+    vcan_msg_t msgs[4];
+    tx_ids(&bus, 1, 2);
+
+    // The consumer frees a slot while the transmitter waits
+    clock.drain_after = 3;
+    tx_ids(&bus, 3, 3);
+
+    atto_eq(clock.drained, 1);
+    atto_eq(vcan_rx_overflows(&node), 0);
+    atto_eq(vcan_rx_last_overflow(&node), VCAN_OK);
+
+    // It does not
+    const uint64_t start = clock.ticks;
+    tx_ids(&bus, 4, 4);
+
+    atto_ge(clock.ticks - start, 100);
+    atto_eq(vcan_rx_overflows(&node), 1);
+    atto_eq(vcan_rx_last_overflow(&node), VCAN_TX_TIMEOUT);
+    atto_eq(vcan_rx_poll(&node, msgs, 4), 2);
+    atto_eq(msgs[0].id, 2);
+    atto_eq(msgs[1].id, 3);
+
+    // Without a clock it does not wait at all
+    err = vcan_set_clock(&bus, NULL, NULL);
+    atto_eq(err, VCAN_OK);
+    tx_ids(&bus, 5, 7);
+    atto_eq(vcan_rx_overflows(&node), 2);
+    atto_eq(vcan_rx_poll(&node, msgs, 4), 2);
+    atto_eq(msgs[0].id, 5);
+    atto_eq(msgs[1].id, 6);
+}
+
+static void test_rx_policy_spill(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[2];
+    err = vcan_rx_queue_init(&queue, storage, 2);
+    atto_eq(err, VCAN_OK);
+    vcan_rx_queue_t arena;
+    vcan_msg_t arena_storage[4];
+    err = vcan_rx_queue_init(&arena, arena_storage, 4);
+    atto_eq(err, VCAN_OK);
+    err = vcan_rx_queue_set_policy(&queue, VCAN_RX_SPILL, 0, &arena);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {.rx_queue = &queue};
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    vcan_msg_t msgs[8];
+
+    tx_ids(&bus, 1, 3);
+
+    atto_eq(vcan_rx_last_overflow(&node), VCAN_SPILLED);
+    atto_eq(vcan_rx_overflows(&node), 0);
+    atto_eq(vcan_bus_pressure(&bus), 50);
+
+    tx_ids(&bus, 4, 7);
+
+    atto_eq(vcan_rx_last_overflow(&node), VCAN_DROPPED_NEWEST);
+    atto_eq(vcan_rx_overflows(&node), 1);
+    atto_eq(vcan_bus_pressure(&bus), 100);
+    atto_eq(vcan_rx_poll(&node, msgs, 8), 2);
+    atto_eq(msgs[0].id, 1);
+    atto_eq(msgs[1].id, 2);
+    // Still spilling while the arena holds messages, even with room in the
+    // queue: 8 is dropped, 9 is queued behind the arena
+    tx_ids(&bus, 8, 8);
+    atto_eq(vcan_rx_overflows(&node), 2);
+    atto_eq(vcan_rx_poll(&node, msgs, 1), 1);
+    atto_eq(msgs[0].id, 3);
+    tx_ids(&bus, 9, 9);
+    atto_eq(vcan_rx_poll(&node, msgs, 8), 4);
+    atto_eq(msgs[0].id, 4);
+    atto_eq(msgs[1].id, 5);
+    atto_eq(msgs[2].id, 6);
+    atto_eq(msgs[3].id, 9);
+    // Back to the queue once the arena drained
+    tx_ids(&bus, 10, 10);
+    atto_eq(vcan_rx_poll(&node, msgs, 8), 1);
+    atto_eq(msgs[0].id, 10);
+    atto_eq(vcan_bus_pressure(&bus), 0);
+}
+
+static void counts_notifications(void* const ctx)
+{
+    (*(uint32_t*) ctx)++;
+}
+
+static uint32_t drained_ids[8];
+static uint32_t drained_amount;
+
+static void records_drained(vcan_node_t* const node,
+                            const vcan_msg_t* const msg)
+{
+    (void) node;
+    drained_ids[drained_amount++ % 8] = msg->id;
+}
+
+static void test_rx_notify_once_per_batch(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[8];
+    err = vcan_rx_queue_init(&queue, storage, 8);
+    atto_eq(err, VCAN_OK);
+    uint32_t notifications = 0;
+    atto_eq(vcan_rx_queue_set_notify(NULL, counts_notifications, NULL),
+            VCAN_NULL_STORAGE);
+    err = vcan_rx_queue_set_notify(&queue, counts_notifications,
+                                   &notifications);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {.rx_queue = &queue};
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_rx_drain(NULL, records_drained), 0);
+    atto_eq(vcan_rx_drain(&node, NULL), 0);
+    drained_amount = 0;
+
+    tx_ids(&bus, 1, 3);
+
+    atto_eq(notifications, 1);
+    atto_eq(vcan_rx_drain(&node, records_drained), 3);
+    atto_eq(drained_amount, 3);
+    atto_eq(drained_ids[0], 1);
+    atto_eq(drained_ids[2], 3);
+    // Re-armed by draining
+    tx_ids(&bus, 4, 4);
+    atto_eq(notifications, 2);
+    // Not by polling
+    atto_eq(vcan_rx_poll(&node, storage, 8), 1);
+    tx_ids(&bus, 5, 5);
+    atto_eq(notifications, 2);
+    atto_eq(vcan_rx_drain(&node, records_drained), 1);
+    atto_eq(drained_ids[3], 5);
+    atto_eq(vcan_rx_drain(&node, records_drained), 0);
+    atto_eq(notifications, 2);
+    // Dropped messages do not notify
+    tx_ids(&bus, 1, 9);
+    atto_eq(notifications, 3);
+    atto_eq(vcan_rx_overflows(&node), 1);
+}
+
+static bool notify_readable(const vcan_notify_t* const notify)
+{
+    struct pollfd fd = {.fd = vcan_notify_fd(notify), .events = POLLIN};
+    return poll(&fd, 1, 0) == 1 && (fd.revents & POLLIN);
+}
+
+static void test_notify_fd(void)
+{
+    vcan_notify_t notify;
+    atto_eq(vcan_notify_init(NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_notify_deinit(NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_notify_fd(NULL), -1);
+    atto_eq(vcan_notify_init(&notify), VCAN_OK);
+    atto_ge(vcan_notify_fd(&notify), 0);
+    atto_false(notify_readable(&notify));
+
+    vcan_notify_signal(&notify);
+    vcan_notify_signal(&notify);
+
+    atto_assert(notify_readable(&notify));
+    atto_assert(vcan_notify_clear(&notify));
+    atto_false(notify_readable(&notify));
+    atto_false(vcan_notify_clear(&notify));
+
+    // Through a receive queue
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[4];
+    err = vcan_rx_queue_init(&queue, storage, 4);
+    atto_eq(err, VCAN_OK);
+    err = vcan_rx_queue_set_notify(&queue, vcan_notify_signal, &notify);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {.rx_queue = &queue};
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    tx_ids(&bus, 1, 2);
+    atto_assert(notify_readable(&notify));
+    atto_assert(vcan_notify_clear(&notify));
+    atto_eq(vcan_rx_drain(&node, records_drained), 2);
+    atto_false(notify_readable(&notify));
+    atto_eq(vcan_notify_deinit(&notify), VCAN_OK);
+}
+
+#define EVENT_LOOP_MSGS 20000U
+
+static void* transmits_event_loop_msgs(void* const arg)
+{
+    vcan_bus_mt_t* const bus = arg;
+    const vcan_msg_t msg = {.id = 1, .len = 1};
+    for (uint32_t i = 0; i < EVENT_LOOP_MSGS; i++)
+    {
+        while (vcan_mt_tx(bus, &msg, NULL) == VCAN_QUEUE_FULL)
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void test_mt_dispatch_from_event_loop(void)
+{
+    vcan_err_t err = vcan_mt_init(&mt_bus);
+    atto_eq(err, VCAN_OK);
+    vcan_notify_t notify;
+    atto_eq(vcan_notify_init(&notify), VCAN_OK);
+    atto_eq(vcan_mt_set_notify(NULL, vcan_notify_signal, &notify),
+            VCAN_NULL_BUS);
+    err = vcan_mt_set_notify(&mt_bus, vcan_notify_signal, &notify);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {
+            .callback_on_rx = counts_msgs,
+            .other_custom_data = NULL,
+    };
+    err = vcan_mt_connect(&mt_bus, &node);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_mt_dispatch(NULL), 0);
+    atto_eq(vcan_mt_dispatch(&mt_bus), 0);
+    pthread_t thread;
+    atto_eq(pthread_create(&thread, NULL, transmits_event_loop_msgs,
+                           &mt_bus), 0);
+    size_t dispatched = 0;
+    uint32_t wakeups = 0;
+
+    while (dispatched < EVENT_LOOP_MSGS)
+    {
+        struct pollfd fd = {.fd = vcan_notify_fd(&notify), .events = POLLIN};
+        atto_eq(poll(&fd, 1, 5000), 1);
+        vcan_notify_clear(&notify);
+        dispatched += vcan_mt_dispatch(&mt_bus);
+        wakeups++;
+    }
+    pthread_join(thread, NULL);
+
+    atto_eq(dispatched, EVENT_LOOP_MSGS);
+    atto_eq((intptr_t) node.other_custom_data, EVENT_LOOP_MSGS);
+    atto_le(wakeups, EVENT_LOOP_MSGS);
+    atto_false(notify_readable(&notify));
+    atto_eq(vcan_notify_deinit(&notify), VCAN_OK);
+    atto_eq(vcan_mt_deinit(&mt_bus), VCAN_OK);
+}
+
+static void test_snapshot_invalid(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    vcan_node_t node = {.callback_on_rx = records_drained, .id = 7};
+    err = vcan_connect(&bus, &node);
+    atto_eq(err, VCAN_OK);
+    uint8_t buf[256];
+    size_t len = 0;
+
+    atto_eq(vcan_snapshot(NULL, buf, sizeof(buf), &len), VCAN_NULL_BUS);
+    atto_eq(vcan_snapshot(&bus, buf, sizeof(buf), NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_snapshot(&bus, NULL, 0, &len), VCAN_TOO_LONG);
+    atto_gt(len, 0);
+    atto_eq(vcan_snapshot(&bus, buf, len - 1, &len), VCAN_TOO_LONG);
+    atto_eq(vcan_snapshot(&bus, buf, sizeof(buf), &len), VCAN_OK);
+    atto_eq(vcan_restore(NULL, buf, len, NULL, 0), VCAN_NULL_BUS);
+    atto_eq(vcan_restore(&bus, NULL, len, NULL, 0), VCAN_NULL_STORAGE);
+    vcan_node_t* const self[] = {&node};
+    atto_eq(vcan_restore(&bus, buf, len - 1, self, 1), VCAN_INVALID_SNAPSHOT);
+    buf[len] = 0;
+    atto_eq(vcan_restore(&bus, buf, len + 1, self, 1), VCAN_INVALID_SNAPSHOT);
+    atto_eq(vcan_restore(&bus, buf, len, self, 1), VCAN_OK);
+    // Node 7 is not a candidate: nothing changes
+    vcan_node_t other = {.callback_on_rx = records_drained, .id = 8};
+    vcan_node_t* const candidates[] = {&other};
+    atto_eq(vcan_restore(&bus, buf, len, candidates, 1), VCAN_NODE_NOT_FOUND);
+    atto_eq(bus.connected, 1);
+    atto_eq(node.bus, &bus);
+    // A queued node needs a queue
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[2];
+    atto_eq(vcan_rx_queue_init(&queue, storage, 2), VCAN_OK);
+    vcan_node_t queued = {.rx_queue = &queue, .id = 9};
+    err = vcan_connect(&bus, &queued);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_snapshot(&bus, buf, sizeof(buf), &len), VCAN_OK);
+    queued.rx_queue = NULL;
+    vcan_node_t* const both[] = {&node, &queued};
+    atto_eq(vcan_restore(&bus, buf, len, both, 2), VCAN_INVALID_SNAPSHOT);
+    queued.rx_queue = &queue;
+    buf[0] ^= 0xFFU;
+    atto_eq(vcan_restore(&bus, buf, len, both, 2), VCAN_INVALID_SNAPSHOT);
+    buf[0] ^= 0xFFU;
+    atto_eq(vcan_restore(&bus, buf, len, both, 2), VCAN_OK);
+}
+
+static void test_snapshot_restore_checked_first(void)
+{
+    vcan_bus_t bus;
+    vcan_err_t err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    uint8_t buf[512];
+    size_t len;
+    // Two entries re-bound to the same candidate: rejected, nothing changes
+    vcan_node_t a = {.callback_on_rx = records_drained, .id = 0};
+    vcan_node_t b = {.callback_on_rx = records_drained, .id = 0};
+    vcan_node_t c = {.callback_on_rx = records_drained, .id = 3};
+    atto_eq(vcan_connect(&bus, &a), VCAN_OK);
+    atto_eq(vcan_connect(&bus, &b), VCAN_OK);
+    atto_eq(vcan_snapshot(&bus, buf, sizeof(buf), &len), VCAN_OK);
+    atto_eq(vcan_connect(&bus, &c), VCAN_OK);
+    vcan_node_t* const twins[] = {&a, &b};
+    atto_eq(vcan_restore(&bus, buf, len, twins, 2), VCAN_INVALID_SNAPSHOT);
+    atto_eq(bus.connected, 3);
+    atto_eq(c.bus, &bus);
+
+    // Messages of a queue in shared mode need a pool on the restored bus
+    vcan_frame_t frames[2];
+    vcan_frame_t* refs[2];
+    vcan_rx_queue_t queue;
+    err = vcan_init(&bus);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_set_pool(&bus, frames, 2), VCAN_OK);
+    atto_eq(vcan_rx_queue_init_shared(&queue, refs, 2), VCAN_OK);
+    vcan_node_t shared = {.rx_queue = &queue, .id = 4};
+    atto_eq(vcan_connect(&bus, &shared), VCAN_OK);
+    tx_ids(&bus, 1, 1);
+    atto_eq(vcan_snapshot(&bus, buf, sizeof(buf), &len), VCAN_OK);
+    vcan_frame_t* polled[2];
+    atto_eq(vcan_rx_poll_shared(&shared, polled, 2), 1);
+    vcan_frame_release(polled[0]);
+    vcan_bus_t poolless;
+    err = vcan_init(&poolless);
+    atto_eq(err, VCAN_OK);
+    atto_eq(vcan_connect(&poolless, &c), VCAN_OK);
+    vcan_node_t* const candidates[] = {&shared};
+    atto_eq(vcan_disconnect(&bus, &shared), VCAN_OK);
+    atto_eq(vcan_restore(&poolless, buf, len, candidates, 1),
+            VCAN_INVALID_CAPACITY);
+    atto_eq(poolless.connected, 1);
+    atto_eq(shared.bus, NULL);
+    atto_eq(vcan_restore(&bus, buf, len, candidates, 1), VCAN_OK);
+    atto_eq(vcan_rx_poll_shared(&shared, polled, 2), 1);
+    atto_eq(polled[0]->msg.id, 1);
+    vcan_frame_release(polled[0]);
+}
+
+/** A warmed-up bus to snapshot and restore. */
+typedef struct
+{
+    vcan_bus_t bus;
+    vcan_node_t nodes[3];
+    vcan_rx_queue_t queue;
+    vcan_msg_t storage[4];
+    vcan_meta_t metas[4];
+    vcan_rx_queue_t spilling;
+    vcan_msg_t spilling_storage[2];
+    vcan_rx_queue_t arena;
+    vcan_msg_t arena_storage[4];
+} snapshot_rig_t;
+
+static void snapshot_rig_init(snapshot_rig_t* const rig)
+{
+    memset(rig, 0, sizeof(*rig));
+    atto_eq(vcan_init(&rig->bus), VCAN_OK);
+    atto_eq(vcan_rx_queue_init(&rig->queue, rig->storage, 4), VCAN_OK);
+    atto_eq(vcan_rx_queue_set_meta(&rig->queue, rig->metas), VCAN_OK);
+    atto_eq(vcan_rx_queue_init(&rig->spilling, rig->spilling_storage, 2),
+            VCAN_OK);
+    atto_eq(vcan_rx_queue_init(&rig->arena, rig->arena_storage, 4), VCAN_OK);
+    atto_eq(vcan_rx_queue_set_policy(&rig->spilling, VCAN_RX_SPILL, 0,
+                                     &rig->arena), VCAN_OK);
+    rig->nodes[0].id = 1;
+    rig->nodes[0].callback_on_rx = records_drained;
+    rig->nodes[1].id = 2;
+    rig->nodes[1].rx_queue = &rig->queue;
+    rig->nodes[2].id = 3;
+    rig->nodes[2].rx_queue = &rig->spilling;
+}
+
+static void test_snapshot_restore_bus(void)
+{
+    static snapshot_rig_t warm;
+    static snapshot_rig_t cold;
+    snapshot_rig_init(&warm);
+    snapshot_rig_init(&cold);
+    for (size_t i = 0; i < 3; i++)
+    {
+        atto_eq(vcan_connect(&warm.bus, &warm.nodes[i]), VCAN_OK);
+    }
+    warm.bus.flags = VCAN_BUS_ORDERED;
+    drained_amount = 0;
+    tx_ids(&warm.bus, 1, 5);
+    // Something already in the queues of the cold bus, to be replaced
+    atto_eq(vcan_connect(&cold.bus, &cold.nodes[2]), VCAN_OK);
+    tx_ids(&cold.bus, 0x70, 0x70);
+    uint8_t taken[2048];
+    size_t len;
+    atto_eq(vcan_snapshot(&warm.bus, taken, sizeof(taken), &len), VCAN_OK);
+    // Relocated
+    static uint8_t moved[2048];
+    memcpy(moved, taken, len);
+    vcan_node_t* const candidates[] = {
+            &cold.nodes[2], &cold.nodes[0], &cold.nodes[1],
+    };
+
+    vcan_err_t err = vcan_restore(&cold.bus, moved, len, candidates, 3);
+
+    atto_eq(err, VCAN_OK);
+    atto_eq(cold.bus.connected, 3);
+    for (size_t i = 0; i < 3; i++)
+    {
+        atto_eq(cold.bus.nodes[i], &cold.nodes[i]);
+        atto_eq(cold.nodes[i].rx_meta.seq, warm.nodes[i].rx_meta.seq);
+    }
+    atto_eq(cold.bus.flags, VCAN_BUS_ORDERED);
+    atto_eq(cold.bus.seq, 5);
+    vcan_msg_t warm_msgs[8];
+    vcan_msg_t cold_msgs[8];
+    vcan_meta_t warm_metas[8];
+    vcan_meta_t cold_metas[8];
+    atto_eq(vcan_rx_poll_meta(&cold.nodes[1], cold_msgs, cold_metas, 8), 4);
+    atto_eq(vcan_rx_poll_meta(&warm.nodes[1], warm_msgs, warm_metas, 8), 4);
+    for (size_t i = 0; i < 4; i++)
+    {
+        atto_eq(cold_msgs[i].id, warm_msgs[i].id);
+        atto_eq(cold_msgs[i].data[0], warm_msgs[i].data[0]);
+        atto_eq(cold_metas[i].seq, warm_metas[i].seq);
+    }
+    atto_eq(vcan_rx_overflows(&cold.nodes[1]), 1);
+    // Queue then arena, in order
+    atto_eq(vcan_rx_poll(&cold.nodes[2], cold_msgs, 8), 2);
+    atto_eq(cold_msgs[0].id, 1);
+    atto_eq(cold_msgs[1].id, 2);
+    atto_eq(vcan_rx_poll(&cold.nodes[2], cold_msgs, 8), 3);
+    atto_eq(cold_msgs[0].id, 3);
+    atto_eq(cold_msgs[2].id, 5);
+    atto_eq(vcan_rx_last_overflow(&cold.nodes[2]), VCAN_SPILLED);
+#ifdef VCAN_STATS
+    vcan_bus_stats_t warm_stats;
+    vcan_bus_stats_t cold_stats;
+    atto_eq(vcan_get_stats(&warm.bus, &warm_stats), VCAN_OK);
+    atto_eq(vcan_get_stats(&cold.bus, &cold_stats), VCAN_OK);
+    atto_eq(cold_stats.tx_frames, warm_stats.tx_frames);
+    atto_eq(cold_stats.dropped, warm_stats.dropped);
+    vcan_node_stats_t node_stats;
+    atto_eq(vcan_get_node_stats(&cold.nodes[0], &node_stats), VCAN_OK);
+    atto_eq(node_stats.rx_frames, 5);
+#endif
+    // Carries on from there
+    tx_ids(&cold.bus, 6, 6);
+    atto_eq(cold.nodes[0].rx_meta.seq, 6);
+    atto_eq(vcan_rx_poll_meta(&cold.nodes[1], cold_msgs, cold_metas, 8), 1);
+    atto_eq(cold_metas[0].seq, 6);
+}
+
+static void test_snapshot_restore_sched(void)
+{
+    vcan_bus_t bus;
+    atto_eq(vcan_init(&bus), VCAN_OK);
+    vcan_node_t sender = {.callback_on_rx = records_drained, .id = 1};
+    vcan_node_t receiver = {.callback_on_rx = records_drained, .id = 2};
+    atto_eq(vcan_connect(&bus, &sender), VCAN_OK);
+    atto_eq(vcan_connect(&bus, &receiver), VCAN_OK);
+    vcan_sched_t sched;
+    vcan_sched_entry_t* heap[4];
+    atto_eq(vcan_sched_init(&sched, &bus, heap, 4), VCAN_OK);
+    vcan_sched_entry_t entries[3] = {
+            {.msg = {.id = 0x10}, .src_node = &sender},
+            {.msg = {.id = 0x20}},
+            {.msg = {.id = 0x30}},
+    };
+    atto_eq(vcan_sched_add(&sched, &entries[0], 10, 10), VCAN_OK);
+    atto_eq(vcan_sched_add(&sched, &entries[2], 15, 0), VCAN_OK);
+    atto_eq(vcan_sched_add(&sched, &entries[1], 20, 20), VCAN_OK);
+    atto_eq(vcan_advance_time(&sched, 12), VCAN_OK);
+    uint8_t buf[512];
+    size_t len;
+    atto_eq(vcan_sched_snapshot(NULL, entries, 3, buf, sizeof(buf), &len),
+            VCAN_NULL_STORAGE);
+    atto_eq(vcan_sched_snapshot(&sched, entries, 3, NULL, 0, &len),
+            VCAN_TOO_LONG);
+    atto_eq(vcan_sched_snapshot(&sched, entries, 2, buf, sizeof(buf), &len),
+            VCAN_INVALID_SNAPSHOT);
+    atto_eq(vcan_sched_snapshot(&sched, entries, 3, buf, sizeof(buf), &len),
+            VCAN_OK);
+    // Continue the original, recording what it transmits
+    drained_amount = 0;
+    atto_eq(vcan_advance_time(&sched, 30), VCAN_OK);
+    const uint32_t expected_amount = drained_amount;
+    uint32_t expected[8];
+    memcpy(expected, drained_ids, sizeof(expected));
+
+    // Restored onto a fresh bus and scheduler
+    vcan_bus_t bus2;
+    atto_eq(vcan_init(&bus2), VCAN_OK);
+    vcan_node_t sender2 = {.callback_on_rx = records_drained, .id = 1};
+    vcan_node_t receiver2 = {.callback_on_rx = records_drained, .id = 2};
+    atto_eq(vcan_connect(&bus2, &receiver2), VCAN_OK);
+    vcan_sched_t sched2;
+    vcan_sched_entry_t* heap2[4];
+    atto_eq(vcan_sched_init(&sched2, &bus2, heap2, 4), VCAN_OK);
+    vcan_sched_entry_t entries2[3] = {{.msg = {.id = 0}}};
+    atto_eq(vcan_sched_restore(&sched2, entries2, 3, buf, len - 1),
+            VCAN_INVALID_SNAPSHOT);
+    atto_eq(vcan_sched_restore(&sched2, entries2, 2, buf, len),
+            VCAN_INVALID_SNAPSHOT);
+    // The same entry twice
+    const size_t header_len = 24;
+    const size_t record_len = (len - header_len) / 3;
+    uint8_t twice[512];
+    memcpy(twice, buf, len);
+    memcpy(&twice[header_len + record_len], &twice[header_len],
+           sizeof(uint32_t));
+    atto_eq(vcan_sched_restore(&sched2, entries2, 3, twice, len),
+            VCAN_INVALID_SNAPSHOT);
+    atto_eq(vcan_sched_restore(&sched2, entries2, 3, buf, len),
+            VCAN_NODE_NOT_FOUND);
+    atto_eq(sched2.len, 0);
+    atto_eq(vcan_connect(&bus2, &sender2), VCAN_OK);
+    atto_eq(vcan_sched_restore(&sched2, entries2, 3, buf, len), VCAN_OK);
+    atto_eq(sched2.now, 12);
+    atto_eq(sched2.len, 3);
+    atto_eq(entries2[0].src_node, &sender2);
+    atto_eq(entries2[1].msg.id, 0x20);
+    drained_amount = 0;
+    atto_eq(vcan_advance_time(&sched2, 30), VCAN_OK);
+
+    atto_eq(drained_amount, expected_amount);
+    atto_memeq(drained_ids, expected, sizeof(expected));
+    atto_eq(entries2[0].due, entries[0].due);
+}
+
+static vcan_node_t static_engine = {.id = 1};
+static vcan_node_t static_brakes = {.id = 2};
+static uint32_t static_engine_ids;
+static uint32_t static_brakes_ids;
+
+static void static_engine_rx(vcan_node_t* const node,
+                             const vcan_msg_t* const msg)
+{
+    (void) node;
+    static_engine_ids += msg->id;
+}
+
+static void static_brakes_rx(vcan_node_t* const node,
+                             const vcan_msg_t* const msg)
+{
+    atto_eq(node, &static_brakes);
+    static_brakes_ids += msg->id;
+}
+
+#define STATIC_ROUTES(ROUTE, TO) \
+    ROUTE(0x100, TO(static_engine, static_engine_rx) \
+                 TO(static_brakes, static_brakes_rx)) \
+    ROUTE(0x200, TO(static_brakes, static_brakes_rx))
+
+VCAN_STATIC_TX(static_tx, STATIC_ROUTES)
+
+static void test_static_tx(void)
+{
+    vcan_msg_t msg = {.id = 0x100, .len = 1};
+    atto_eq(static_tx(NULL, NULL), VCAN_NULL_MSG);
+    atto_eq(static_tx(&msg, NULL), VCAN_OK);
+    atto_eq(static_engine_ids, 0x100);
+    atto_eq(static_brakes_ids, 0x100);
+    // The transmitting node is excluded
+    atto_eq(static_tx(&msg, &static_engine), VCAN_OK);
+    atto_eq(static_engine_ids, 0x100);
+    atto_eq(static_brakes_ids, 0x200);
+    msg.id = 0x200;
+    atto_eq(static_tx(&msg, &static_engine), VCAN_OK);
+    atto_eq(static_engine_ids, 0x100);
+    atto_eq(static_brakes_ids, 0x400);
+    // Not routed to anybody
+    msg.id = 0x300;
+    atto_eq(static_tx(&msg, NULL), VCAN_OK);
+    atto_eq(static_engine_ids, 0x100);
+    atto_eq(static_brakes_ids, 0x400);
+}
+
+static uint32_t fault_received[3];
+static vcan_msg_t fault_last[3];
+
+static void records_fault_rx(vcan_node_t* const node,
+                             const vcan_msg_t* const msg)
+{
+    fault_received[node->id]++;
+    vcan_copy_msg(&fault_last[node->id], msg);
+}
+
+static uint64_t reads_time(void* const ctx)
+{
+    return *(const uint64_t*) ctx;
+}
+
+static uint32_t differing_bits(const uint8_t* const a,
+                               const uint8_t* const b,
+                               const size_t len)
+{
+    uint32_t bits = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        for (uint8_t diff = (uint8_t) (a[i] ^ b[i]); diff != 0;
+             diff &= (uint8_t) (diff - 1U))
+        {
+            bits++;
+        }
+    }
+    return bits;
+}
+
+static void test_fault_invalid(void)
+{
+    vcan_bus_t bus;
+    atto_eq(vcan_init(&bus), VCAN_OK);
+    vcan_node_t node = {.callback_on_rx = records_fault_rx, .id = 1};
+    vcan_fault_t fault;
+    vcan_fault_delayed_t delayed[2];
+    vcan_fault_rule_t rules[2] = {
+            {.id = 0x20, .kind = VCAN_FAULT_DROP, .ppm = VCAN_FAULT_ALWAYS},
+            {.id = 0x10, .kind = VCAN_FAULT_DROP, .ppm = VCAN_FAULT_ALWAYS},
+    };
+    atto_eq(vcan_fault_init(NULL, &bus, rules, 1, NULL, 0, 1),
+            VCAN_NULL_STORAGE);
+    atto_eq(vcan_fault_init(&fault, &bus, NULL, 0, NULL, 0, 1),
+            VCAN_NULL_STORAGE);
+    atto_eq(vcan_fault_init(&fault, NULL, rules, 1, NULL, 0, 1),
+            VCAN_NULL_BUS);
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 2, NULL, 0, 1),
+            VCAN_UNSORTED_FILTER);
+    rules[1].id = 0x30;
+    rules[1].ppm = VCAN_FAULT_ALWAYS + 1U;
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 2, NULL, 0, 1),
+            VCAN_INVALID_FAULT);
+    rules[1].ppm = VCAN_FAULT_ALWAYS;
+    rules[1].kind = VCAN_FAULT_BUS_OFF;
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 2, NULL, 0, 1),
+            VCAN_INVALID_FAULT);
+    rules[1].kind = VCAN_FAULT_ERROR_FRAME;
+    rules[1].node = &node;
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 2, NULL, 0, 1),
+            VCAN_INVALID_FAULT);
+    rules[1].kind = VCAN_FAULT_DELAY;
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 2, NULL, 0, 1),
+            VCAN_INVALID_FAULT);
+    rules[1].node = NULL;
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 2, NULL, 2, 1),
+            VCAN_NULL_STORAGE);
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 2, delayed, 0, 1),
+            VCAN_INVALID_CAPACITY);
+    atto_eq(bus.tx_hook, NULL);
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 2, delayed, 2, 1), VCAN_OK);
+    atto_neq(bus.tx_hook, NULL);
+    atto_eq(bus.fanout_hook, NULL);
+    atto_eq(vcan_fault_release(NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_fault_recover(NULL, &node), VCAN_NULL_STORAGE);
+    atto_eq(vcan_fault_recover(&fault, NULL), VCAN_NULL_NODE);
+    atto_false(vcan_fault_is_bus_off(NULL, &node));
+    atto_false(vcan_fault_is_bus_off(&fault, NULL));
+    atto_eq(vcan_fault_deinit(NULL), VCAN_NULL_STORAGE);
+    atto_eq(vcan_fault_deinit(&fault), VCAN_OK);
+    atto_eq(bus.tx_hook, NULL);
+}
+
+static void test_fault_frame_level(void)
+{
+    vcan_bus_t bus;
+    atto_eq(vcan_init(&bus), VCAN_OK);
+    vcan_node_t sender = {.callback_on_rx = records_fault_rx, .id = 0};
+    vcan_node_t receiver = {.callback_on_rx = records_fault_rx, .id = 1};
+    atto_eq(vcan_connect(&bus, &sender), VCAN_OK);
+    atto_eq(vcan_connect(&bus, &receiver), VCAN_OK);
+    vcan_fault_rule_t rules[] = {
+            {.id = 0x10, .kind = VCAN_FAULT_DROP, .ppm = VCAN_FAULT_ALWAYS},
+            {.id = 0x20, .kind = VCAN_FAULT_BIT_FLIP, .ppm = VCAN_FAULT_ALWAYS,
+                    .bits = 3},
+            {.id = 0x30, .kind = VCAN_FAULT_ERROR_FRAME,
+                    .ppm = VCAN_FAULT_ALWAYS},
+            // Never triggering: the message goes through
+            {.id = 0x40, .kind = VCAN_FAULT_DROP, .ppm = 0},
+    };
+    vcan_fault_t fault;
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 4, NULL, 0, 42), VCAN_OK);
+    memset(fault_received, 0, sizeof(fault_received));
+    vcan_msg_t msg = {.id = 0x10, .len = 8,
+            .data = {1, 2, 3, 4, 5, 6, 7, 8}};
+
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_OK);
+    atto_eq(fault_received[1], 0);
+    msg.id = 0x20;
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_OK);
+    atto_eq(fault_received[1], 1);
+    atto_eq(fault_last[1].id, 0x20);
+    atto_le(differing_bits(fault_last[1].data, msg.data, 8), 3);
+    atto_gt(differing_bits(fault_last[1].data, msg.data, 8), 0);
+    msg.id = 0x30;
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_ERROR_FRAME);
+    atto_eq(fault_received[1], 2);
+    atto_eq(fault_last[1].id, VCAN_FAULT_ERROR_ID);
+    atto_eq(fault_last[1].len, 0);
+    msg.id = 0x40;
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_OK);
+    msg.id = 0x50;
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_OK);
+    atto_eq(fault_received[1], 4);
+    atto_memeq(fault_last[1].data, msg.data, 8);
+    atto_eq(fault_received[0], 0);
+    atto_eq(rules[0].hits, 1);
+    atto_eq(rules[1].hits, 1);
+    atto_eq(rules[2].hits, 1);
+    atto_eq(rules[3].hits, 0);
+
+    atto_eq(vcan_fault_deinit(&fault), VCAN_OK);
+    msg.id = 0x10;
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_OK);
+    atto_eq(fault_received[1], 5);
+}
+
+static void test_fault_node_level(void)
+{
+    vcan_bus_t bus;
+    atto_eq(vcan_init(&bus), VCAN_OK);
+    uint64_t now = 0;
+    atto_eq(vcan_set_clock(&bus, reads_time, &now), VCAN_OK);
+    vcan_node_t sender = {.callback_on_rx = records_fault_rx, .id = 0};
+    vcan_node_t lossy = {.callback_on_rx = records_fault_rx, .id = 1};
+    vcan_node_t fragile = {.callback_on_rx = records_fault_rx, .id = 2};
+    atto_eq(vcan_connect(&bus, &sender), VCAN_OK);
+    atto_eq(vcan_connect(&bus, &lossy), VCAN_OK);
+    atto_eq(vcan_connect(&bus, &fragile), VCAN_OK);
+    vcan_fault_rule_t rules[] = {
+            {.id = 0x10, .kind = VCAN_FAULT_BUS_OFF, .node = &fragile,
+                    .ppm = VCAN_FAULT_ALWAYS, .duration = 100},
+            {.id = 0x20, .kind = VCAN_FAULT_BUS_OFF, .node = &fragile,
+                    .ppm = VCAN_FAULT_ALWAYS},
+            {.id = VCAN_FAULT_ANY_ID, .kind = VCAN_FAULT_DROP, .node = &lossy,
+                    .ppm = VCAN_FAULT_ALWAYS},
+    };
+    vcan_fault_t fault;
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 3, NULL, 0, 7), VCAN_OK);
+    atto_neq(bus.fanout_hook, NULL);
+    memset(fault_received, 0, sizeof(fault_received));
+    vcan_msg_t msg = {.id = 0x5, .len = 1};
+
+    // Only the lossy node misses it
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_OK);
+    atto_eq(fault_received[0], 0);
+    atto_eq(fault_received[1], 0);
+    atto_eq(fault_received[2], 1);
+    // Bus-off for 100 time units
+    msg.id = 0x10;
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_OK);
+    atto_eq(fault_received[2], 1);
+    atto_false(vcan_fault_is_bus_off(&fault, &lossy));
+    atto_assert(vcan_fault_is_bus_off(&fault, &fragile));
+    atto_eq(vcan_tx(&bus, &msg, &fragile), VCAN_BUS_OFF);
+    msg.id = 0x5;
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_OK);
+    atto_eq(fault_received[2], 1);
+    now = 100;
+    atto_eq(vcan_fault_release(&fault), VCAN_OK);
+    atto_false(vcan_fault_is_bus_off(&fault, &fragile));
+    atto_eq(vcan_tx(&bus, &msg, &fragile), VCAN_OK);
+    atto_eq(fault_received[0], 1);
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_OK);
+    atto_eq(fault_received[2], 2);
+    // Bus-off until recovered
+    msg.id = 0x20;
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_OK);
+    now = 1000000;
+    atto_eq(vcan_fault_release(&fault), VCAN_OK);
+    atto_assert(vcan_fault_is_bus_off(&fault, &fragile));
+    atto_eq(vcan_fault_recover(&fault, &fragile), VCAN_OK);
+    atto_false(vcan_fault_is_bus_off(&fault, &fragile));
+    msg.id = 0x5;
+    atto_eq(vcan_tx(&bus, &msg, &sender), VCAN_OK);
+    atto_eq(fault_received[2], 3);
+    atto_eq(fault_received[1], 0);
+    atto_eq(rules[0].hits, 1);
+    atto_eq(rules[1].hits, 1);
+    atto_eq(rules[2].hits, 7);
+
+    atto_eq(vcan_fault_deinit(&fault), VCAN_OK);
+    atto_eq(bus.fanout_hook, NULL);
+}
+
+static void test_fault_delay(void)
+{
+    vcan_bus_t bus;
+    atto_eq(vcan_init(&bus), VCAN_OK);
+    uint64_t now = 0;
+    atto_eq(vcan_set_clock(&bus, reads_time, &now), VCAN_OK);
+    vcan_node_t receiver = {.callback_on_rx = records_drained, .id = 1};
+    atto_eq(vcan_connect(&bus, &receiver), VCAN_OK);
+    vcan_fault_rule_t rules[] = {
+            {.id = 0x10, .kind = VCAN_FAULT_DELAY, .ppm = VCAN_FAULT_ALWAYS,
+                    .duration = 30},
+            {.id = 0x20, .kind = VCAN_FAULT_DELAY, .ppm = VCAN_FAULT_ALWAYS,
+                    .duration = 10},
+    };
+    vcan_fault_delayed_t delayed[2];
+    vcan_fault_t fault;
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 2, delayed, 2, 1), VCAN_OK);
+    drained_amount = 0;
+    vcan_msg_t msg = {.id = 0x10};
+
+    atto_eq(vcan_tx(&bus, &msg, NULL), VCAN_OK);
+    msg.id = 0x20;
+    atto_eq(vcan_tx(&bus, &msg, NULL), VCAN_OK);
+    atto_eq(vcan_tx(&bus, &msg, NULL), VCAN_QUEUE_FULL);
+    atto_eq(drained_amount, 0);
+    now = 9;
+    atto_eq(vcan_fault_release(&fault), VCAN_OK);
+    atto_eq(drained_amount, 0);
+    // Due messages go before the next transmission, earliest first
+    now = 40;
+    msg.id = 0x30;
+    atto_eq(vcan_tx(&bus, &msg, NULL), VCAN_OK);
+    atto_eq(drained_amount, 3);
+    atto_eq(drained_ids[0], 0x20);
+    atto_eq(drained_ids[1], 0x10);
+    atto_eq(drained_ids[2], 0x30);
+    atto_eq(vcan_fault_deinit(&fault), VCAN_OK);
+}
+
+static void fault_pattern(const uint64_t seed, uint32_t* const pattern)
+{
+    vcan_bus_t bus;
+    atto_eq(vcan_init(&bus), VCAN_OK);
+    vcan_node_t receiver = {.callback_on_rx = records_drained, .id = 1};
+    atto_eq(vcan_connect(&bus, &receiver), VCAN_OK);
+    vcan_fault_rule_t rules[] = {
+            {.id = VCAN_FAULT_ANY_ID, .kind = VCAN_FAULT_DROP,
+                    .ppm = VCAN_FAULT_ALWAYS / 2U},
+    };
+    vcan_fault_t fault;
+    atto_eq(vcan_fault_init(&fault, &bus, rules, 1, NULL, 0, seed), VCAN_OK);
+    uint32_t delivered = 0;
+    *pattern = 0;
+    for (uint32_t i = 0; i < 32; i++)
+    {
+        const vcan_msg_t msg = {.id = i};
+        drained_amount = 0;
+        atto_eq(vcan_tx(&bus, &msg, NULL), VCAN_OK);
+        *pattern |= drained_amount << i;
+        delivered += drained_amount;
+    }
+    atto_eq(rules[0].hits, 32U - delivered);
+}
+
+static void test_fault_deterministic(void)
+{
+    uint32_t pattern;
+    uint32_t again;
+    uint32_t other;
+    fault_pattern(1234, &pattern);
+    fault_pattern(1234, &again);
+    fault_pattern(4321, &other);
+    atto_eq(again, pattern);
+    atto_neq(pattern, 0);
+    atto_neq(pattern, UINT32_MAX);
+    atto_neq(other, pattern);
 }
 
 static void callback_print_msg(vcan_node_t* node, const vcan_msg_t* msg)
@@ -431,16 +4706,117 @@ int main(void)
     test_connect_valid();
     test_connect_max_reached();
     test_connect_already_connected();
+    test_init_ex_invalid();
+    test_init_ex_large_bus();
     test_disconnect_null_bus();
     test_disconnect_null_node();
     test_disconnect_empty_bus();
     test_disconnect_not_found();
     test_disconnect_valid();
+    test_connect_sets_handle();
+    test_disconnect_const_node();
+    test_disconnect_swaps_last();
+    test_disconnect_ordered();
+    test_connect_to_multiple_buses();
     test_tx_null_bus();
     test_tx_null_msg();
     test_tx_no_nodes_connected();
     test_tx_to_all_nodes();
     test_tx_to_all_nodes_except_source();
+    test_tx_copies_only_used_payload();
+    test_tx_len_too_long_is_clamped();
+    test_tx_ref_null_bus();
+    test_tx_ref_null_msg();
+    test_tx_ref_passes_caller_msg();
+    test_tx_burst_null_bus();
+    test_tx_burst_null_msgs();
+    test_tx_burst_empty();
+    test_tx_burst_to_all_nodes_except_source();
+    test_set_filter_null_node();
+    test_set_filter_null_arrays();
+    test_set_filter_unsorted();
+    test_set_filter_stale_handle();
+    test_tx_filtered();
+    test_tx_burst_filtered();
+    test_mt_null_args();
+    test_mt_queue_full();
+    test_mt_global_order();
+    test_mt_connect_from_callback();
+    test_mt_connect_while_stopping();
+    test_mt_init_ex();
+    test_rx_queue_init_invalid();
+    test_rx_poll_invalid();
+    test_rx_queue_instead_of_callback();
+    test_rx_queue_overflow();
+    test_rx_queue_other_thread();
+    test_frame8_conversion();
+    test_pack_unpack();
+    test_fd_len();
+    test_tx_frame8_and_packed();
+    test_rx_poll_compact();
+    test_stats_null_args();
+    test_stats_counters();
+    test_trace_invalid();
+    test_trace_record_and_replay();
+    test_sched_invalid();
+    test_sched_periodic();
+    test_sched_tx_errors();
+    test_sched_many_in_time_order();
+    test_arb_wire_time();
+    test_arb_invalid();
+    test_arb_priority_order();
+    test_gw_invalid();
+    test_gw_routing();
+    test_gw_loop_guard();
+    test_deferred_invalid();
+    test_deferred_response_chain();
+    test_deferred_full();
+    test_mt_has_next();
+    test_net_invalid();
+    test_net_shm();
+    test_net_udp();
+    test_par_invalid();
+    test_par_delivers_all_once();
+    test_par_serial_when_over_capacity();
+    test_sig_invalid();
+    test_sig_decode_both_byte_orders();
+    test_sig_decoded_once_per_tx();
+    test_sig_parse_dbc();
+    test_pool_invalid();
+    test_pool_one_frame_for_all_queues();
+    test_pool_tx_shared_and_exhausted();
+    test_pool_released_on_other_threads();
+    test_match_table_invalid();
+    test_tx_filtered_many_nodes();
+    test_tx_filtered_node_on_two_buses();
+    test_meta_invalid();
+    test_meta_seq_and_timestamps();
+    test_meta_burst_and_deferred();
+    test_meta_across_gateway();
+    test_hist_buckets();
+    test_probes_and_histogram();
+    test_rx_policy_invalid();
+    test_rx_policy_drop_oldest();
+    test_rx_policy_drop_oldest_other_thread();
+    test_rx_policy_block();
+    test_rx_policy_spill();
+    test_rx_notify_once_per_batch();
+    test_notify_fd();
+    test_mt_dispatch_from_event_loop();
+    test_snapshot_invalid();
+    test_snapshot_restore_checked_first();
+    test_snapshot_restore_bus();
+    test_snapshot_restore_sched();
+    test_static_tx();
+    test_fault_invalid();
+    test_fault_frame_level();
+    test_fault_node_level();
+    test_fault_delay();
+    test_fault_deterministic();
+#ifdef __linux__
+    test_socketcan_invalid();
+    test_socketcan_bridge();
+#endif
     test_readme_example();
     return atto_at_least_one_fail;
 }
@@ -0,0 +1,63 @@
+/**
+ * @file
+ *
+ * Unit tests of the C++ static topology of VCAN, vcan::static_bus.
+ *
+ * @copyright Copyright © 2020, Matjaž Guštin <dev@matjaz.it>
+ * <https://matjaz.it>. All rights reserved.
+ * @license BSD 3-clause license.
+ */
+
+#include "atto.h"
+#include "vcan_static.h"
+
+vcan_node_t engine = {};
+vcan_node_t brakes = {};
+static uint32_t engine_ids;
+static uint32_t brakes_ids;
+
+static void engine_rx(vcan_node_t* const node, const vcan_msg_t* const msg)
+{
+    atto_eq(node, &engine);
+    engine_ids += msg->id;
+}
+
+static void brakes_rx(vcan_node_t* const node, const vcan_msg_t* const msg)
+{
+    atto_eq(node, &brakes);
+    brakes_ids += msg->id;
+}
+
+using body_bus = vcan::static_bus<
+        vcan::route<0x100, vcan::to<engine, engine_rx>,
+                           vcan::to<brakes, brakes_rx>>,
+        vcan::route<0x200, vcan::to<brakes, brakes_rx>>>;
+
+static void test_static_bus(void)
+{
+    vcan_msg_t msg = {};
+    msg.id = 0x100;
+    atto_eq(body_bus::tx(nullptr), VCAN_NULL_MSG);
+    atto_eq(body_bus::tx(&msg), VCAN_OK);
+    atto_eq(engine_ids, 0x100);
+    atto_eq(brakes_ids, 0x100);
+    // The transmitting node is excluded
+    atto_eq(body_bus::tx(&msg, &engine), VCAN_OK);
+    atto_eq(engine_ids, 0x100);
+    atto_eq(brakes_ids, 0x200);
+    msg.id = 0x200;
+    atto_eq(body_bus::tx(&msg, &engine), VCAN_OK);
+    atto_eq(engine_ids, 0x100);
+    atto_eq(brakes_ids, 0x400);
+    // Not routed to anybody
+    msg.id = 0x300;
+    atto_eq(body_bus::tx(&msg), VCAN_OK);
+    atto_eq(engine_ids, 0x100);
+    atto_eq(brakes_ids, 0x400);
+}
+
+int main(void)
+{
+    test_static_bus();
+    return atto_at_least_one_fail;
+}